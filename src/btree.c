@@ -1,9 +1,11 @@
+#include"os.h"
 #include"mndbInt.h"
 #include"pager.h"
 #include"btree.h"
 #include<assert.h>
+#include<stdint.h>
 
-typedef unsigned int uptr;
+typedef uintptr_t uptr;
 typedef unsigned char u8;
 typedef unsigned short int u16;
 
@@ -27,13 +29,51 @@ typedef struct OverflowPage OverflowPage;
 */
 #define ROUNDUP(X)  ((X+3) & ~3)
 
+/*
+** This is a magic string that appears at the beginning of every
+** database file that was written by this version of the B-Tree.
+*/
+static const char zMagicHeader[] = 
+   "** This file contains an MNDB 2.0 database **";
+#define MAGIC_SIZE (sizeof(zMagicHeader))
+
+/*
+** This is a magic integer also used to test the integrity of the database
+** file.  This integer is used in addition to the string above so that
+** if the file is written on a little-endian architecture and read
+** on a big-endian architectures (or vice versa) we can detect the
+** problem.
+*/
+#define MAGIC 0xdae37528
+
+/*
+** The first page of the database file contains a magic header string
+** to identify the file as a database file, the page size used by the
+** whole file, and a link to the list of free pages.
+**
+** The page size is chosen when the database is created and cannot
+** be changed afterwards.  Files written before the page size was
+** recorded have no magic string and always use 1024-byte pages.
+**
+** The iChange field must sit at MNDB_CHANGE_COUNTER_OFFSET.  The pager
+** writes it on commit and the B-Tree layer never touches it.  The
+** structure must end before MNDB_FORMAT_OFFSET, which the pager owns as
+** well.
+*/
 struct PageOne{
-  char zMagic[MAIC_SIZE];
-  int iMagic;
-  Pgno freeList;
-  int nFree;
+  char zMagic[MAGIC_SIZE];  /* String that identifies the file as a database */
+  int iMagic;               /* Integer to verify correct byte order */
+  Pgno freeList;            /* First free page in a list of all free pages */
+  int nFree;                /* Number of pages on the free list */
+  int szPage;               /* Number of bytes in each page of the file */
+  u32 iChange;              /* Change counter.  Maintained by the pager */
 };
 
+/*
+** The page size of database files that predate PageOne.szPage.
+*/
+#define LEGACY_PAGE_SIZE 1024
+
 /*
 ** Each database page has a header that is an instance of this
 ** structure.
@@ -76,17 +116,23 @@ struct CellHdr {
 };
 
 #define MIN_CELL_SIZE (sizeof(CellHdr)+4)
+
 /*
-** The maximum number of database entries that can be held in a single
-** page of the database. 
+** The page size is a property of each database file, so the sizes
+** below are computed from the page size SZ when the file is opened
+** and are cached in the Btree structure.  Use the fields of Btree,
+** not these macros, in the rest of this file.
+**
+** MX_CELL is the maximum number of database entries that can be held
+** in a single page of the database.
 */
-#define MX_CELL ((MNDB_PAGE_SIZE-sizeof(PageHdr))/MIN_CELL_SIZE)
+#define MX_CELL(SZ) (((SZ)-sizeof(PageHdr))/MIN_CELL_SIZE)
 
 /*
 ** The amount of usable space on a single page of the BTree.  This is the
 ** page size minus the overhead of the page header.
 */
-#define USABLE_SPACE  (MNDB_PAGE_SIZE - sizeof(PageHdr))
+#define USABLE_SPACE(SZ)  ((SZ) - sizeof(PageHdr))
 
 /*
 ** The maximum amount of payload (in bytes) that can be stored locally for
@@ -95,28 +141,32 @@ struct CellHdr {
 **
 ** This number is chosen so that at least 4 cells will fit on every page.
 */
-#define MX_LOCAL_PAYLOAD ((USABLE_SPACE/4-(sizeof(CellHdr)+sizeof(Pgno)))&~3)
+#define MX_LOCAL_PAYLOAD(SZ) \
+    ((USABLE_SPACE(SZ)/4-(sizeof(CellHdr)+sizeof(Pgno)))&~3)
 
 
 /*
 ** Data on a database page is stored as a linked list of Cell structures.
 ** Both the key and the data are stored in aPayload[].  The key always comes
 ** first.  The aPayload[] field grows as necessary to hold the key and data,
-** up to a maximum of MX_LOCAL_PAYLOAD bytes.  If the size of the key and
-** data combined exceeds MX_LOCAL_PAYLOAD bytes, then Cell.ovfl is the
-** page number of the first overflow page.
+** up to a maximum of Btree.mxLocal bytes.  If the size of the key and
+** data combined exceeds Btree.mxLocal bytes, then the page number of the
+** first overflow page is stored right after the local payload.  Use
+** CELL_OVFL() to get at it.
 **
 ** Though this structure is fixed in size, the Cell on the database
 ** page varies in size.  Every cell has a CellHdr and at least 4 bytes
 ** of payload space.  Additional payload bytes (up to the maximum of
-** MX_LOCAL_PAYLOAD) and the Cell.ovfl value are allocated only as
-** needed.
+** Btree.mxLocal) and the overflow page number are allocated only as
+** needed.  The structure itself is big enough for the largest page size
+** so that a Cell can be assembled on the stack.
 */
 struct Cell {
   CellHdr h;                        /* The cell header */
-  char aPayload[MX_LOCAL_PAYLOAD];  /* Key and data */
-  Pgno ovfl;                        /* The first overflow page */
+  char aPayload[MX_LOCAL_PAYLOAD(MNDB_MAX_PAGE_SIZE)+sizeof(Pgno)];
+                                    /* Key and data, then the overflow page */
 };
+#define CELL_OVFL(pBt,pCell) (*(Pgno*)&(pCell)->aPayload[(pBt)->mxLocal])
 
 /*
 ** Free space on a page is remembered using a linked list of the FreeBlk
@@ -133,7 +183,7 @@ struct FreeBlk {
 /*
 ** The number of bytes of payload that will fit on a single overflow page.
 */
-#define OVERFLOW_SIZE (MNDB_PAGE_SIZE-sizeof(Pgno))
+#define OVERFLOW_SIZE(SZ) ((SZ)-sizeof(Pgno))
 
 
 /*
@@ -149,21 +199,23 @@ struct FreeBlk {
 */
 struct OverflowPage {
   Pgno iNext;
-  char aPayload[OVERFLOW_SIZE];
+  char aPayload[OVERFLOW_SIZE(MNDB_MAX_PAGE_SIZE)];  /* Btree.ovflSize used */
 };
 
 /*
 ** For every page in the database file, an instance of the following structure
-** is stored in memory.  The u.aDisk[] array contains the raw bits read from
-** the disk.  The rest is auxiliary information that held in memory only. The
-** auxiliary info is only valid for regular database pages - it is not
-** used for overflow pages and pages on the freelist.
+** is stored in memory, in the extra space that the pager appends to each
+** page.  u.aDisk points to the raw bits read from the disk, which is the
+** page data handed out by the pager.  The rest is auxiliary information that
+** held in memory only. The auxiliary info is only valid for regular database
+** pages - it is not used for overflow pages and pages on the freelist.
 **
 ** Of particular interest in the auxiliary info is the apCell[] entry.  Each
 ** apCell[] entry is a pointer to a Cell structure in u.aDisk[].  The cells are
 ** put in this array so that they can be accessed in constant time, rather
 ** than in linear time which would be needed if we had to walk the linked 
-** list on every access.
+** list on every access.  The array is sized for the page size of the
+** file and immediately follows the MemPage structure in the extra space.
 **
 ** Note that apCell[] contains enough space to hold up to two more Cells
 ** than can possibly fit on one page.  In the steady state, every apCell[]
@@ -181,29 +233,51 @@ struct OverflowPage {
 */
 struct MemPage {
   union {
-    char aDisk[MNDB_PAGE_SIZE];  /* Page data stored on disk */
-    PageHdr hdr;                   /* Overlay page header */
+    char *aDisk;                 /* Page data stored on disk */
+    PageHdr *hdr;                /* Overlay page header */
   } u; 
+  Btree *pBt;                    /* The Btree this page belongs to */
+  Pgno pgno;                     /* Page number of this page */
   int isInit;                    /* True if auxiliary data is initialized */
   MemPage *pParent;              /* The parent of this page.  NULL for root */
   int nFree;                     /* Number of free bytes in u.aDisk[] */
   int nCell;                     /* Number of entries on this page */
   int isOverfull;                /* Some apCell[] points outside u.aDisk[] */
-  Cell *apCell[MX_CELL+2];       /* All data entires in sorted order 插入操作会超出page所以+2*/
+  int latch;                     /* Reader/writer latch, see latchPage() */
+  int nHold;                     /* Times the writer latched it, see latchWrite() */
+  Cell **apCell;                 /* All data entires in sorted order 插入操作会超出page所以+2*/
 };
 
 /*
 ** The in-memory image of a disk page has the auxiliary information appended
 ** to the end.  EXTRA_SIZE is the number of bytes of space needed to hold
-** that extra information.
+** that extra information for pages of SZ bytes.
 */
-#define EXTRA_SIZE (sizeof(MemPage)-MNDB_PAGE_SIZE)
+#define EXTRA_SIZE(SZ) (sizeof(MemPage) + (MX_CELL(SZ)+2)*sizeof(Cell*))
+
+/*
+** When a cursor steps down onto a leaf page, the pager is asked to
+** start reading this many of the leaves to its right.  See
+** prefetchSiblings().
+*/
+#define N_PREFETCH_LEAF 4
 
 struct Btree{
   Pager *pPager;
   BtCursor *pCursor;
   PageOne *page1;
   int inTrans;
+  int pageSize;              /* Number of bytes in each page */
+  int usableSpace;           /* USABLE_SPACE(pageSize) */
+  int mxCell;                /* MX_CELL(pageSize) */
+  int mxLocal;               /* MX_LOCAL_PAYLOAD(pageSize) */
+  int ovflSize;              /* OVERFLOW_SIZE(pageSize) */
+  char *aTmpPage;            /* pageSize bytes of scratch space */
+  OsMutex *pMutex;           /* Held by the thread changing the Btree */
+  MemPage **apHeld;          /* Pages the writer holds, see holdPage() */
+  int nHeld;                 /* Number of entries in apHeld[] */
+  int nHeldAlloc;            /* Number of slots allocated for apHeld[] */
+  PagerSnap *pSnap;          /* Snapshot read, see mndbBtreeSnapshot() */
 };
 
 typedef Btree Bt;
@@ -222,25 +296,120 @@ struct BtCursor {
   int idx;                  /* pPage->apCell[] 里面记录（entry）的索引 */
   u8 bSkipNext;             /* mndbBtreeNext() is no-op if true */
   u8 iMatch;                /* compare result from last mndbBtreeMoveto() */
+  u8 eLatch;                /* Latch held on pPage during a call, or 0 */
 };
 
 /*
-** Compute the total number of bytes that a Cell needs on the main
+** Threads that share a Btree read its pages while one of them changes
+** others.  Each MemPage has a reader/writer latch, held shared while the
+** page is read and exclusive while the page or its MemPage is changed.
+** Latches are only held within a call and for a few pages at a time,
+** so a thread that cannot have one spins until it can.
+**
+** MemPage.latch counts the threads that hold it shared in its low
+** bits.  LATCH_WRITER is set while a thread holds it exclusive, and
+** every thread waiting to do so adds LATCH_WAITER.  No new shared latch
+** is granted while anyone waits, so readers cannot starve the writer.
+**
+** Latches are taken from the root of a tree downwards.  A reader holds
+** the latch of a page and at most that of one child, which it takes
+** before it lets go of the parent.  It lets go of a page before it
+** takes the latch of the parent.  So no two threads wait for each other.
+*/
+#define LATCH_SHARED  1
+#define LATCH_EXCL    2
+
+#define LATCH_READERS 0x0000ffff
+#define LATCH_WAITER  0x00010000
+#define LATCH_WRITER  0x40000000
+
+/*
+** Wait a little for a latch.  A latch is rarely held for long, so spin
+** at first and only then start giving the processor away.
+*/
+static void latchBackoff(int *pnSpin){
+  if( ++*pnSpin>100 ) mndbOsYield();
+}
+
+/*
+** Take the latch of pPage, shared or exclusive as eLatch says.
+*/
+static void latchPage(MemPage *pPage, int eLatch){
+  int nSpin = 0;
+  int v;
+  if( eLatch==LATCH_SHARED ){
+    v = mndbOsAtomicLoad(&pPage->latch);
+    for(;;){
+      if( (v & ~LATCH_READERS)==0 ){
+        if( mndbOsAtomicCas(&pPage->latch, &v, v+1) ) return;
+      }else{
+        latchBackoff(&nSpin);
+        v = mndbOsAtomicLoad(&pPage->latch);
+      }
+    }
+  }
+  v = mndbOsAtomicAdd(&pPage->latch, LATCH_WAITER);
+  for(;;){
+    if( (v & (LATCH_WRITER|LATCH_READERS))==0 ){
+      if( mndbOsAtomicCas(&pPage->latch, &v, v-LATCH_WAITER+LATCH_WRITER) ){
+        return;
+      }
+    }else{
+      latchBackoff(&nSpin);
+      v = mndbOsAtomicLoad(&pPage->latch);
+    }
+  }
+}
+
+/*
+** Let go of a latch taken by latchPage().
+*/
+static void unlatchPage(MemPage *pPage, int eLatch){
+  mndbOsAtomicAdd(&pPage->latch, eLatch==LATCH_SHARED ? -1 : -LATCH_WRITER);
+}
+
+/*
+** Trade an exclusive latch on pPage for a shared one without letting
+** any writer in between.
+*/
+static void downgradeLatch(MemPage *pPage){
+  mndbOsAtomicAdd(&pPage->latch, 1-LATCH_WRITER);
+}
+
+/*
+** Every page the writer changes is latched exclusive, and the writer
+** may come back to a page that it has latched already.  MemPage.nHold
+** counts how many times it did.  Only the thread that holds
+** Btree.pMutex looks at nHold.
+*/
+static void latchWrite(MemPage *pPage){
+  if( pPage->nHold++==0 ) latchPage(pPage, LATCH_EXCL);
+}
+static void unlatchWrite(MemPage *pPage){
+  assert( pPage->nHold>0 );
+  if( --pPage->nHold==0 ) unlatchPage(pPage, LATCH_EXCL);
+}
+
+/*
+** Compute the total number of bytes that a Cell with n bytes of payload,
+** or the Cell pCell, needs on the main
 ** database page.  The number returned includes the Cell header,
 ** local payload storage, and the pointer to overflow pages (if
 ** applicable).  Additional space allocated on overflow pages
 ** is NOT included in the value returned from this routine.
 */
-static int cellSize(Cell *pCell){
-  int n = pCell->h.nKey + pCell->h.nData;
-  if( n>MX_LOCAL_PAYLOAD ){
-    n = MX_LOCAL_PAYLOAD + sizeof(Pgno);//加上溢出页的页号的空间
+static int cellSizeOf(Btree *pBt, int n){
+  if( n>pBt->mxLocal ){
+    n = pBt->mxLocal + sizeof(Pgno);//加上溢出页的页号的空间
   }else{
     n = ROUNDUP(n);
   }
   n += sizeof(CellHdr);
   return n;
 }
+static int cellSize(Btree *pBt, Cell *pCell){
+  return cellSizeOf(pBt, pCell->h.nKey + pCell->h.nData);
+}
 
 /* 所有的Cell移动到页的开头，宾且所有的free space 被分配到一个
 ** 巨大的FreeBlk里面作为page的结尾
@@ -248,33 +417,34 @@ static int cellSize(Cell *pCell){
 static void defragmentPage(MemPage *pPage){
   int pc, i ,n;
   FreeBlk *pFBlk;
-  char newPage[MNDB_PAGE_SIZE];
+  Btree *pBt = pPage->pBt;
+  char *newPage = pBt->aTmpPage;
   pc = sizeof(PageHdr);
-  pPage->u.hdr.firstCell = pc;
-  memcpy(newPage, pPage->u.aDisk,MNDB_PAGE_SIZE);
+  pPage->u.hdr->firstCell = pc;
+  memcpy(newPage, pPage->u.aDisk, pBt->pageSize);
   for(i = 0; i < pPage->nCell; ++i){
     Cell *pCell = pPage->apCell[i];
     /* This routine should never be called on an overfull page.  The
     ** following asserts verify that constraint. */
-    assert( Addr(pCell) > Addr(pPage) );
-    assert( Addr(pCell) < Addr(pPage) + MNDB_PAGE_SIZE );
+    assert( Addr(pCell) > Addr(pPage->u.aDisk) );
+    assert( Addr(pCell) < Addr(pPage->u.aDisk) + pBt->pageSize );
     
-    n = cellSize(pCell);
+    n = cellSize(pBt, pCell);
     pCell->h.iNext = pc + n;
     memcpy(&newPage[pc], pCell, n);
     pPage->apCell[i] = (Cell*)&pPage->u.aDisk[pc];
     pc += n;
   }
-  assert( pPage->nFree==MNDB_PAGE_SIZE-pc );
+  assert( pPage->nFree==pBt->pageSize-pc );
   memcpy(pPage->u.aDisk, newPage, pc);
   if( pPage->nCell>0 ){
     pPage->apCell[pPage->nCell-1]->h.iNext = 0;
   }
   pFBlk = (FreeBlk*)&pPage->u.aDisk[pc];
-  pFBlk->iSize = MNDB_PAGE_SIZE - pc;
+  pFBlk->iSize = pBt->pageSize - pc;
   pFBlk->iNext = 0;
-  pPage->u.hdr.firstFree = pc;
-  memset(&pFBlk[1], 0, MNDB_PAGE_SIZE - pc - sizeof(FreeBlk));
+  pPage->u.hdr->firstFree = pc;
+  memset(&pFBlk[1], 0, pBt->pageSize - pc - sizeof(FreeBlk));
 }
 
 
@@ -298,16 +468,16 @@ static int allocateSpace(MemPage *pPage, int nByte){
   int start;
   int cnt = 0;
 
-  assert( mndbpager_iswriteable(pPage) );
+  assert( mndbpager_iswriteable(pPage->u.aDisk) );
   assert( nByte==ROUNDUP(nByte) );
   if( pPage->nFree<nByte || pPage->isOverfull ) return 0;
-  pIdx = &pPage->u.hdr.firstFree;
+  pIdx = &pPage->u.hdr->firstFree;
   p = (FreeBlk*)&pPage->u.aDisk[*pIdx];
   while( p->iSize<nByte ){
-    assert( cnt++ < MNDB_PAGE_SIZE/4 );
+    assert( cnt++ < pPage->pBt->pageSize/4 );
     if( p->iNext==0 ){
       defragmentPage(pPage);
-      pIdx = &pPage->u.hdr.firstFree;
+      pIdx = &pPage->u.hdr->firstFree;
     }else{
       pIdx = &p->iNext;
     }
@@ -344,10 +514,10 @@ static void freeSpace(MemPage *pPage, int start, int size){
   FreeBlk *pNew;
   FreeBlk *pNext;
 
-  assert( mndbpager_iswriteable(pPage) );
+  assert( mndbpager_iswriteable(pPage->u.aDisk) );
   assert( size == ROUNDUP(size) );
   assert( start == ROUNDUP(start) );
-  pIdx = &pPage->u.hdr.firstFree;
+  pIdx = &pPage->u.hdr->firstFree;
   idx = *pIdx;
   while( idx!=0 && idx<start ){
     pFBlk = (FreeBlk*)&pPage->u.aDisk[idx];
@@ -387,6 +557,10 @@ static void freeSpace(MemPage *pPage, int start, int size){
 ** BTree (usually page 2) has no parent and so for that page, 
 ** pParent==NULL.
 **
+** The pager is told whether the page is a root, an interior page or a
+** leaf, so that it can keep the pages every search goes through in the
+** cache.  See mndbpager_set_priority().
+**
 ** Return MNDB_OK on success.  If we see that the page does
 ** not contained a well-formed database page, then return 
 ** MNDB_CORRUPT.  Note that a return of MNDB_OK does not
@@ -399,35 +573,40 @@ static int initPage(MemPage *pPage, Pgno pgnoThis, MemPage *pParent){
   FreeBlk *pFBlk;    /* A pointer to a free block in pPage->u.aDisk[] */
   int sz;            /* The size of a Cell in bytes */
   int freeSpace;     /* Amount of free space on the page */
+  Btree *pBt = pPage->pBt;
 
+  mndbpager_set_priority(pPage->u.aDisk,
+      pParent==0 ? MNDB_PAGE_ROOT :
+      pPage->u.hdr->rightChild ? MNDB_PAGE_INTERIOR : MNDB_PAGE_LEAF);
   if( pPage->pParent ){
     assert( pPage->pParent==pParent );
     return MNDB_OK;
   }
   if( pParent ){
     pPage->pParent = pParent;
-    mndbpager_ref(pParent);
+    mndbpager_ref(pParent->u.aDisk);
   }
   if( pPage->isInit ) return MNDB_OK;
   pPage->isInit = 1;
   pPage->nCell = 0;
-  freeSpace = USABLE_SPACE;
-  idx = pPage->u.hdr.firstCell;
+  freeSpace = pBt->usableSpace;
+  idx = pPage->u.hdr->firstCell;
   while( idx!=0 ){
-    if( idx>MNDB_PAGE_SIZE-MIN_CELL_SIZE ) goto page_format_error;
+    if( idx>pBt->pageSize-(int)MIN_CELL_SIZE ) goto page_format_error;
     if( idx<sizeof(PageHdr) ) goto page_format_error;
     if( idx!=ROUNDUP(idx) ) goto page_format_error;
+    if( pPage->nCell>pBt->mxCell ) goto page_format_error;
     pCell = (Cell*)&pPage->u.aDisk[idx];
-    sz = cellSize(pCell);
-    if( idx+sz > MNDB_PAGE_SIZE ) goto page_format_error;
+    sz = cellSize(pBt, pCell);
+    if( idx+sz > pBt->pageSize ) goto page_format_error;
     freeSpace -= sz;
     pPage->apCell[pPage->nCell++] = pCell;
     idx = pCell->h.iNext;
   }
   pPage->nFree = 0;
-  idx = pPage->u.hdr.firstFree;
+  idx = pPage->u.hdr->firstFree;
   while( idx!=0 ){
-    if( idx>MNDB_PAGE_SIZE-sizeof(FreeBlk) ) goto page_format_error;
+    if( idx>pBt->pageSize-(int)sizeof(FreeBlk) ) goto page_format_error;
     if( idx<sizeof(PageHdr) ) goto page_format_error;
     pFBlk = (FreeBlk*)&pPage->u.aDisk[idx];
     pPage->nFree += pFBlk->iSize;
@@ -453,14 +632,14 @@ page_format_error:
 static void zeroPage(MemPage *pPage){
   PageHdr *pHdr;
   FreeBlk *pFBlk;
-  assert( mndbpager_iswriteable(pPage) );
-  memset(pPage, 0, MNDB_PAGE_SIZE);
-  pHdr = &pPage->u.hdr;
+  assert( mndbpager_iswriteable(pPage->u.aDisk) );
+  memset(pPage->u.aDisk, 0, pPage->pBt->pageSize);
+  pHdr = pPage->u.hdr;
   pHdr->firstCell = 0;
   pHdr->firstFree = sizeof(*pHdr);
   pFBlk = (FreeBlk*)&pHdr[1];
   pFBlk->iNext = 0;
-  pFBlk->iSize = MNDB_PAGE_SIZE - sizeof(*pHdr);
+  pFBlk->iSize = pPage->pBt->pageSize - sizeof(*pHdr);
   pPage->nFree = pFBlk->iSize;
   pPage->nCell = 0;
   pPage->isOverfull = 0;
@@ -472,12 +651,199 @@ static void zeroPage(MemPage *pPage){
 ** happens.
 */
 static void pageDestructor(void *pData){
-  MemPage *pPage = (MemPage*)pData;
+  MemPage *pPage = (MemPage*)mndbpager_getextra(pData);
   if( pPage->pParent ){
     MemPage *pParent = pPage->pParent;
     pPage->pParent = 0;
-    mndbpager_unref(pParent);
+    mndbpager_unref(pParent->u.aDisk);
+  }
+}
+
+/*
+** Acquire the raw data of a page, as the snapshot sees it if pBt is a
+** snapshot.  Give it back with mndbpager_unref().
+*/
+static int getData(Btree *pBt, Pgno pgno, void **ppData){
+  if( pBt->pSnap ){
+    return mndbpager_snapshot_get(pBt->pSnap, pgno, ppData);
   }
+  return mndbpager_get(pBt->pPager, pgno, ppData);
+}
+
+/*
+** Acquire a page of the database and return a pointer to the MemPage
+** that describes it.  Use releasePage() to give the page back.
+*/
+static int getPage(Btree *pBt, Pgno pgno, MemPage **ppPage){
+  void *pData;
+  MemPage *pPage;
+  int rc;
+  rc = getData(pBt, pgno, &pData);
+  if( rc ) return rc;
+  pPage = (MemPage*)mndbpager_getextra(pData);
+  if( mndbOsAtomicLoad(&pPage->pBt)==0 ){
+    /* The pager zeroed the MemPage when it loaded the page.  Other
+    ** threads may be getting the same page right now.
+    */
+    latchPage(pPage, LATCH_EXCL);
+    if( pPage->pBt==0 ){
+      pPage->u.aDisk = pData;
+      pPage->pgno = pgno;
+      pPage->apCell = (Cell**)&pPage[1];
+      mndbOsAtomicStore(&pPage->pBt, pBt);
+    }
+    unlatchPage(pPage, LATCH_EXCL);
+  }
+  assert( pPage->pgno==pgno );
+  *ppPage = pPage;
+  return MNDB_OK;
+}
+
+/*
+** Release a reference to a page obtained from getPage().
+*/
+static int releasePage(MemPage *pPage){
+  return mndbpager_unref(pPage->u.aDisk);
+}
+
+/*
+** Latch pPage exclusive for the writer and keep it latched, along with
+** a reference to it, until the change being made is finished and
+** releaseHeldPages() is called.
+*/
+static int holdPage(Btree *pBt, MemPage *pPage){
+  if( pBt->nHeld>=pBt->nHeldAlloc ){
+    int n = pBt->nHeldAlloc*2 + 16;
+    MemPage **a = mndbRealloc(pBt->apHeld, n*sizeof(MemPage*));
+    if( a==0 ) return MNDB_NOMEM;
+    pBt->apHeld = a;
+    pBt->nHeldAlloc = n;
+  }
+  mndbpager_ref(pPage->u.aDisk);
+  latchWrite(pPage);
+  pBt->apHeld[pBt->nHeld++] = pPage;
+  return MNDB_OK;
+}
+
+/*
+** Let go of every page held by holdPage().
+*/
+static void releaseHeldPages(Btree *pBt){
+  while( pBt->nHeld>0 ){
+    MemPage *pPage = pBt->apHeld[--pBt->nHeld];
+    unlatchWrite(pPage);
+    releasePage(pPage);
+  }
+}
+
+/*
+** Hold pPage and every page above it, from the root down.
+*/
+static int holdPath(Btree *pBt, MemPage *pPage){
+  MemPage *pParent;
+  int rc;
+  latchPage(pPage, LATCH_SHARED);
+  pParent = pPage->pParent;
+  unlatchPage(pPage, LATCH_SHARED);
+  if( pParent ){
+    rc = holdPath(pBt, pParent);
+    if( rc ) return rc;
+  }
+  return holdPage(pBt, pPage);
+}
+
+/*
+** Latch pPage, which cursor pCur is about to move onto from pParent, in
+** the mode of the cursor, and make sure the page is initialized.
+** initPage() changes the MemPage, so a reader that finds it has not
+** been done yet takes the latch exclusive to do it and then trades that
+** for a shared latch.  *pIsCold is set to true if the page had not been
+** initialized before.  The page is not left latched if there is an
+** error, unless it is held for the writer.
+*/
+static int latchInitPage(
+  BtCursor *pCur,
+  MemPage *pPage,
+  Pgno pgno,
+  MemPage *pParent,
+  int *pIsCold
+){
+  int rc;
+  *pIsCold = 0;
+  if( pCur->eLatch==LATCH_EXCL ){
+    rc = holdPage(pCur->pBt, pPage);
+    if( rc ) return rc;
+    *pIsCold = !pPage->isInit;
+    return initPage(pPage, pgno, pParent);
+  }
+  latchPage(pPage, LATCH_SHARED);
+  if( pPage->isInit && (pParent==0 || pPage->pParent!=0) ){
+    return MNDB_OK;
+  }
+  unlatchPage(pPage, LATCH_SHARED);
+  latchPage(pPage, LATCH_EXCL);
+  *pIsCold = !pPage->isInit;
+  rc = initPage(pPage, pgno, pParent);
+  if( rc ){
+    unlatchPage(pPage, LATCH_EXCL);
+    return rc;
+  }
+  downgradeLatch(pPage);
+  return MNDB_OK;
+}
+
+/*
+** Latch the page of cursor pCur shared for a call that reads through
+** the cursor, and let go of it at the end of the call.  Between calls a
+** cursor holds a reference to its page but no latch.  While a call
+** moves the cursor, it holds the latch of whatever page the cursor is
+** on.
+*/
+static void latchCursor(BtCursor *pCur){
+  pCur->eLatch = LATCH_SHARED;
+  latchPage(pCur->pPage, LATCH_SHARED);
+}
+static void unlatchCursor(BtCursor *pCur){
+  unlatchPage(pCur->pPage, LATCH_SHARED);
+  pCur->eLatch = 0;
+}
+
+/*
+** Move cursor pCur onto pNew, which latchInitPage() has latched for it,
+** and let go of the page it was on.
+*/
+static void setCursorPage(BtCursor *pCur, MemPage *pNew){
+  if( pCur->eLatch==LATCH_SHARED ){
+    unlatchPage(pCur->pPage, LATCH_SHARED);
+  }
+  releasePage(pCur->pPage);
+  pCur->pPage = pNew;
+}
+
+/*
+** Compute the sizes that depend on the page size and allocate the
+** scratch space used by defragmentPage().  Also tell the pager about
+** the page size and the amount of extra space needed for each MemPage.
+**
+** The pager may take the new size and still return an error, if its
+** background writer could not be restarted.  The sizes here follow the
+** pager's all the same.
+*/
+static int setPageSize(Btree *pBt, int pageSize){
+  char *aTmp;
+  int rc;
+  rc = mndbpager_set_pagesize(pBt->pPager, pageSize, EXTRA_SIZE(pageSize));
+  if( mndbpager_pagesize(pBt->pPager)!=pageSize ) return rc;
+  aTmp = mndbMalloc( pageSize );
+  if( aTmp==0 ) return MNDB_NOMEM;
+  mndbFree(pBt->aTmpPage);
+  pBt->aTmpPage = aTmp;
+  pBt->pageSize = pageSize;
+  pBt->usableSpace = USABLE_SPACE(pageSize);
+  pBt->mxCell = MX_CELL(pageSize);
+  pBt->mxLocal = MX_LOCAL_PAYLOAD(pageSize);
+  pBt->ovflSize = OVERFLOW_SIZE(pageSize);
+  return rc;
 }
 
 /*
@@ -486,6 +852,13 @@ static void pageDestructor(void *pData){
 ** Actually, this routine just sets up the internal data structures
 ** for accessing the database.  We do not open the database file 
 ** until the first page is loaded.
+**
+** In a build with THREADSAFE several threads may use the Btree at once,
+** each through cursors of its own.  They read at the same time, and
+** changes are made one at a time while the others go on reading.  See
+** latchPage() and mndbBtreeInsert().  As with several cursors in one
+** thread, a change made through one cursor may move the entry that
+** another cursor was left on.
 */
 int mndbBtreeOpen(
   const char *zFilename,    /* Name of the file containing the BTree database */
@@ -493,21 +866,54 @@ int mndbBtreeOpen(
   Btree **ppBtree           /* Pointer to new Btree object written here */
 ){
   Btree *pBt;
+  PageOne hdr;
+  int pageSize;
   int rc;
 
+  assert( (int)(size_t)&((PageOne*)0)->iChange==MNDB_CHANGE_COUNTER_OFFSET );
+  assert( sizeof(PageOne)<=MNDB_FORMAT_OFFSET );
   pBt = mndbMalloc( sizeof(*pBt) );
   if( pBt==0 ){
     *ppBtree = 0;
     return MNDB_NOMEM;
   }
   if( nCache<10 ) nCache = 10;
-  rc = mndbpager_open(&pBt->pPager, zFilename, nCache, EXTRA_SIZE);
+  rc = mndbpager_open(&pBt->pPager, zFilename, nCache,
+                      EXTRA_SIZE(MNDB_PAGE_SIZE));
+  if( rc==MNDB_OK ){
+    /* Adopt the page size recorded in the file.  A new file gets the
+    ** default page size, which mndbBtreeSetPageSize() can change until
+    ** the first transaction creates the database.
+    */
+    rc = mndbpager_read_fileheader(pBt->pPager, sizeof(hdr),
+                                   (unsigned char*)&hdr);
+  }
+  if( rc==MNDB_OK ){
+    if( memcmp(hdr.zMagic, zMagicHeader, MAGIC_SIZE)==0 ){
+      pageSize = hdr.iMagic==(int)MAGIC ? hdr.szPage : 0;
+    }else if( mndbpager_pagecount(pBt->pPager)>0 ){
+      pageSize = LEGACY_PAGE_SIZE;
+    }else{
+      pageSize = MNDB_PAGE_SIZE;
+    }
+    rc = setPageSize(pBt, pageSize);
+    if( rc==MNDB_ERROR ) rc = MNDB_CORRUPT;
+  }
   if( rc!=MNDB_OK ){
     if( pBt->pPager ) mndbpager_close(pBt->pPager);
+    mndbFree(pBt->aTmpPage);
     mndbFree(pBt);
     *ppBtree = 0;
     return rc;
   }
+  pBt->pMutex = mndbOsMutexAlloc();
+  if( pBt->pMutex==0 ){
+    mndbpager_close(pBt->pPager);
+    mndbFree(pBt->aTmpPage);
+    mndbFree(pBt);
+    *ppBtree = 0;
+    return MNDB_NOMEM;
+  }
   mndbpager_set_destructor(pBt->pPager, pageDestructor);
   pBt->pCursor = 0;
   pBt->page1 = 0;
@@ -515,6 +921,47 @@ int mndbBtreeOpen(
   return MNDB_OK;
 }
 
+/*
+** Open a read-only view of the database pBt as of its last commit.  The
+** view does not change as transactions of pBt commit, and it holds no
+** lock on the database file between calls, so a long scan through
+** cursors of the view does not hold up the writer.  Only cursors can be
+** opened on the view.  Close it with mndbBtreeClose() before pBt.
+**
+** MNDB_BUSY is returned while a transaction of pBt that began with no
+** view open has made changes, and, by a cursor of the view, if another
+** connection has committed to the file since the view was opened.  See
+** mndbpager_snapshot_begin().
+*/
+int mndbBtreeSnapshot(Btree *pBt, Btree **ppSnap){
+  Btree *pSnap;
+  int rc;
+  *ppSnap = 0;
+  pSnap = mndbMalloc( sizeof(*pSnap) );
+  if( pSnap==0 ){
+    return MNDB_NOMEM;
+  }
+  pSnap->pPager = pBt->pPager;
+  pSnap->pageSize = pBt->pageSize;
+  pSnap->usableSpace = pBt->usableSpace;
+  pSnap->mxCell = pBt->mxCell;
+  pSnap->mxLocal = pBt->mxLocal;
+  pSnap->ovflSize = pBt->ovflSize;
+  pSnap->pMutex = mndbOsMutexAlloc();
+  if( pSnap->pMutex==0 ){
+    mndbFree(pSnap);
+    return MNDB_NOMEM;
+  }
+  rc = mndbpager_snapshot_begin(pBt->pPager, &pSnap->pSnap);
+  if( rc!=MNDB_OK ){
+    mndbOsMutexFree(pSnap->pMutex);
+    mndbFree(pSnap);
+    return rc;
+  }
+  *ppSnap = pSnap;
+  return MNDB_OK;
+}
+
 /*
 ** Close an open database and invalidate all cursors.
 */
@@ -522,11 +969,113 @@ int mndbBtreeClose(Btree *pBt){
   while( pBt->pCursor ){
     mndbBtreeCloseCursor(pBt->pCursor);
   }
-  mndbpager_close(pBt->pPager);
+  if( pBt->pSnap ){
+    mndbpager_snapshot_end(pBt->pSnap);
+  }else{
+    mndbpager_close(pBt->pPager);
+  }
+  mndbOsMutexFree(pBt->pMutex);
+  mndbFree(pBt->apHeld);
+  mndbFree(pBt->aTmpPage);
   mndbFree(pBt);
   return MNDB_OK;
 }
 
+/*
+** Change the page size of the database.  This only works before the
+** database has been created, that is while the file is still empty
+** and no transaction has been started.  The page size must be a power
+** of two between MNDB_MIN_PAGE_SIZE and MNDB_MAX_PAGE_SIZE.
+*/
+int mndbBtreeSetPageSize(Btree *pBt, int pageSize){
+  if( pBt->page1 || mndbpager_pagecount(pBt->pPager)>0 ){
+    return MNDB_MISUSE;
+  }
+  return setPageSize(pBt, pageSize);
+}
+
+/*
+** Turn WAL mode on or off.  This can only be done while no cursor or
+** transaction is open.  See mndbpager_set_wal().
+*/
+int mndbBtreeSetWal(Btree *pBt, int useWal){
+  if( pBt->page1 ){
+    return MNDB_MISUSE;
+  }
+  return mndbpager_set_wal(pBt->pPager, useWal);
+}
+
+/*
+** Copy the write-ahead log into the database file, as far as readers
+** allow.  This is a no-op outside of WAL mode.
+*/
+int mndbBtreeCheckpoint(Btree *pBt){
+  return mndbpager_checkpoint(pBt->pPager);
+}
+
+/*
+** Turn the background writer of the page cache on or off.  This can
+** only be done while no cursor or transaction is open.  See
+** mndbpager_set_bgwriter().
+*/
+int mndbBtreeSetBgWriter(Btree *pBt, int pctClean){
+  if( pBt->page1 ){
+    return MNDB_MISUSE;
+  }
+  return mndbpager_set_bgwriter(pBt->pPager, pctClean);
+}
+
+/*
+** Turn direct I/O on the database file on or off.  This can only be
+** done while no cursor or transaction is open.  See
+** mndbpager_set_direct().
+*/
+int mndbBtreeSetDirect(Btree *pBt, int useDirect){
+  if( pBt->page1 ){
+    return MNDB_MISUSE;
+  }
+  return mndbpager_set_direct(pBt->pPager, useDirect);
+}
+
+/*
+** Store the pages of a new database file compressed.  This can only be
+** done while no cursor or transaction is open.  See
+** mndbpager_set_compress().
+*/
+int mndbBtreeSetCompress(Btree *pBt, int useCompress){
+  if( pBt->page1 ){
+    return MNDB_MISUSE;
+  }
+  return mndbpager_set_compress(pBt->pPager, useCompress);
+}
+
+/*
+** Have the database file grow nPage pages at a time.  This can be done
+** at any time.  See mndbpager_set_chunksize().
+*/
+int mndbBtreeSetChunkSize(Btree *pBt, int nPage){
+  return mndbpager_set_chunksize(pBt->pPager, nPage);
+}
+
+/*
+** Turn warm restarts of the page cache on or off.  Turning them on right
+** after mndbBtreeOpen() loads the pages that were cached when the file
+** was last closed with them on.  See mndbpager_set_warm().
+*/
+int mndbBtreeSetWarm(Btree *pBt, int useWarm){
+  if( pBt->page1 ){
+    return MNDB_MISUSE;
+  }
+  return mndbpager_set_warm(pBt->pPager, useWarm);
+}
+
+/*
+** Return the page size of the database.
+*/
+int mndbBtreeGetPageSize(Btree *pBt){
+  return pBt->pageSize;
+}
+
 /*
 ** Change the number of pages in the cache.
 */
@@ -549,7 +1098,7 @@ int mndbBtreeClose(Btree *pBt){
 static int lockBtree(Btree *pBt){
   int rc;
   if( pBt->page1 ) return MNDB_OK;
-  rc = mndbpager_get(pBt->pPager, 1, (void**)&pBt->page1);
+  rc = getData(pBt, 1, (void**)&pBt->page1);
   return rc;
 }
 
@@ -559,40 +1108,31 @@ static int lockBtree(Btree *pBt){
 */
 static int newDatabase(Btree *pBt){
   MemPage *pRoot;
+  PageOne *pP1;
   int rc;
   if( mndbpager_pagecount(pBt->pPager)>1 ) return MNDB_OK;
-  rc = mndbpager_write(pBt->page1);
+  pP1 = pBt->page1;
+  rc = mndbpager_write(pP1);
   if( rc ) return rc;
-  rc = mndbpager_get(pBt->pPager, 2, (void**)&pRoot);
+  rc = getPage(pBt, 2, &pRoot);
   if( rc ) return rc;
-  rc = mndbpager_write(pRoot);
+  rc = holdPage(pBt, pRoot);
+  if( rc==MNDB_OK ){
+    rc = mndbpager_write(pRoot->u.aDisk);
+  }
   if( rc ){
-    mndbpager_unref(pRoot);
+    releasePage(pRoot);
     return rc;
   }
+  memcpy(pP1->zMagic, zMagicHeader, MAGIC_SIZE);
+  pP1->iMagic = MAGIC;
+  pP1->szPage = pBt->pageSize;
   zeroPage(pRoot);
-  mndbpager_unref(pRoot);
+  releasePage(pRoot);
   return MNDB_OK;
 }
 
 
-/*
-** Attempt to start a new transaction./ 
-**
-** A transaction must be started before attempting any changes
-** to the database.  None of the following routines will work
-** unless a transaction is started first:
-**
-**      mndbBtreeCreateTable()
-**      mndbBtreeClearTable()
-**      mndbBtreeDropTable()
-**      mndbBtreeInsert()
-**      mndbBtreeDelete()
-*/
-int mndbBtreeBeginTrans(Btree *pBt){//改
-  return MNDB_OK;
-}
-
 /*
 ** If there are no outstanding cursors and we are not in the middle
 ** of a transaction but there is a read lock on the database, then
@@ -612,6 +1152,45 @@ static void unlockBtreeIfUnused(Btree *pBt){
   }
 }
 
+/*
+** Attempt to start a new transaction./ 
+**
+** A transaction must be started before attempting any changes
+** to the database.  None of the following routines will work
+** unless a transaction is started first:
+**
+**      mndbBtreeCreateTable()
+**      mndbBtreeClearTable()
+**      mndbBtreeDropTable()
+**      mndbBtreeInsert()
+**      mndbBtreeDelete()
+*/
+int mndbBtreeBeginTrans(Btree *pBt){
+  int rc = MNDB_OK;
+  mndbOsMutexEnter(pBt->pMutex);
+  if( pBt->inTrans ){
+    rc = MNDB_ERROR;
+  }else if( pBt->pSnap ){
+    rc = MNDB_READONLY;
+  }else if( pBt->page1==0 ){
+    rc = lockBtree(pBt);
+  }
+  if( rc==MNDB_OK ){
+    rc = mndbpager_begin(pBt->page1);
+    if( rc==MNDB_OK ){
+      rc = newDatabase(pBt);
+    }
+    releaseHeldPages(pBt);
+    if( rc==MNDB_OK ){
+      pBt->inTrans = 1;
+    }else{
+      unlockBtreeIfUnused(pBt);
+    }
+  }
+  mndbOsMutexLeave(pBt->pMutex);
+  return rc;
+}
+
 /*
 ** Commit the transaction currently in progress.
 **
@@ -619,8 +1198,17 @@ static void unlockBtreeIfUnused(Btree *pBt){
 ** are no active cursors, it also releases the read lock.
 */
 int mndbBtreeCommit(Btree *pBt){
-  //改
-  return MNDB_OK;
+  int rc;
+  mndbOsMutexEnter(pBt->pMutex);
+  if( pBt->inTrans==0 ){
+    rc = MNDB_ERROR;
+  }else{
+    rc = mndbpager_commit(pBt->pPager);
+    pBt->inTrans = 0;
+    unlockBtreeIfUnused(pBt);
+  }
+  mndbOsMutexLeave(pBt->pMutex);
+  return rc;
 }
 
 
@@ -632,11 +1220,15 @@ int mndbBtreeCommit(Btree *pBt){
 //新建cursor会给database ,iTable 就是该BTree的rootPageNumber
 int mndbBtreeCursor(Btree *pBt, int iTable, BtCursor **ppCur){
   int rc;
+  int isCold;
   BtCursor *pCur;
+  MemPage *pRoot;
+  mndbOsMutexEnter(pBt->pMutex);
   if( pBt->page1==0 ){
     rc = lockBtree(pBt);
     if( rc!=MNDB_OK ){
       *ppCur = 0;
+      mndbOsMutexLeave(pBt->pMutex);
       return rc;
     }
   }
@@ -645,16 +1237,21 @@ int mndbBtreeCursor(Btree *pBt, int iTable, BtCursor **ppCur){
     rc = MNDB_NOMEM;
     goto create_cursor_exception;
   }
+  pCur->pBt = pBt;
   pCur->pgnoRoot = (Pgno)iTable;
-  rc = mndbpager_get(pBt->pPager, pCur->pgnoRoot, (void**)&pCur->pPage);
+  rc = getPage(pBt, pCur->pgnoRoot, &pRoot);
   if( rc!=MNDB_OK ){
     goto create_cursor_exception;
   }
-  rc = initPage(pCur->pPage, pCur->pgnoRoot, 0);
+  pCur->eLatch = LATCH_SHARED;
+  rc = latchInitPage(pCur, pRoot, pCur->pgnoRoot, 0, &isCold);
+  pCur->eLatch = 0;
   if( rc!=MNDB_OK ){
+    releasePage(pRoot);
     goto create_cursor_exception;
   }
-  pCur->pBt = pBt;
+  unlatchPage(pRoot, LATCH_SHARED);
+  pCur->pPage = pRoot;
   pCur->idx = 0;
   pCur->pNext = pBt->pCursor;
   if( pCur->pNext ){
@@ -663,15 +1260,14 @@ int mndbBtreeCursor(Btree *pBt, int iTable, BtCursor **ppCur){
   pCur->pPrev = 0;
   pBt->pCursor = pCur;
   *ppCur = pCur;
+  mndbOsMutexLeave(pBt->pMutex);
   return MNDB_OK;
 
 create_cursor_exception:
   *ppCur = 0;
-  if( pCur ){
-    if( pCur->pPage ) mndbpager_unref(pCur->pPage);
-    mndbFree(pCur);
-  }
+  mndbFree(pCur);
   unlockBtreeIfUnused(pBt);
+  mndbOsMutexLeave(pBt->pMutex);
   return rc;
 }
 
@@ -681,6 +1277,7 @@ create_cursor_exception:
 */
 int mndbBtreeCloseCursor(BtCursor *pCur){
   Btree *pBt = pCur->pBt;
+  mndbOsMutexEnter(pBt->pMutex);
   if( pCur->pPrev ){
     pCur->pPrev->pNext = pCur->pNext;
   }else{
@@ -689,8 +1286,9 @@ int mndbBtreeCloseCursor(BtCursor *pCur){
   if( pCur->pNext ){
     pCur->pNext->pPrev = pCur->pPrev;
   }
-  mndbpager_unref(pCur->pPage);
+  releasePage(pCur->pPage);
   unlockBtreeIfUnused(pBt);
+  mndbOsMutexLeave(pBt->pMutex);
   mndbFree(pCur);
   return MNDB_OK;
 }
@@ -703,7 +1301,7 @@ static void getTempCursor(BtCursor *pCur, BtCursor *pTempCur){
   memcpy(pTempCur, pCur, sizeof(*pCur));
   pTempCur->pNext = 0;
   pTempCur->pPrev = 0;
-  mndbpager_ref(pTempCur->pPage);
+  mndbpager_ref(pTempCur->pPage->u.aDisk);
 }
 
 /*
@@ -711,7 +1309,7 @@ static void getTempCursor(BtCursor *pCur, BtCursor *pTempCur){
 ** function above.
 */
 static void releaseTempCursor(BtCursor *pCur){
-  mndbpager_unref(pCur->pPage);
+  releasePage(pCur->pPage);
 }
 
 /*
@@ -726,6 +1324,7 @@ int mndbBtreeKeySize(BtCursor *pCur, int *pSize){
   Cell *pCell;
   MemPage *pPage;
 
+  latchCursor(pCur);
   pPage = pCur->pPage;
   assert( pPage!=0 );
   if( pCur->idx >= pPage->nCell ){
@@ -734,6 +1333,7 @@ int mndbBtreeKeySize(BtCursor *pCur, int *pSize){
     pCell = pPage->apCell[pCur->idx];
     *pSize = pCell->h.nKey;
   }
+  unlatchCursor(pCur);
   return MNDB_OK;
 }
 
@@ -749,13 +1349,14 @@ static int getPayload(BtCursor *pCur, int offset, int amt, char *zBuf){
   char *aPayload;
   Pgno nextPage;
   int rc;
+  Btree *pBt = pCur->pBt;
   assert( pCur!=0 && pCur->pPage!=0 );
   assert( pCur->idx>=0 && pCur->idx<pCur->pPage->nCell );
   aPayload = pCur->pPage->apCell[pCur->idx]->aPayload;
-  if( offset<MX_LOCAL_PAYLOAD ){
+  if( offset<pBt->mxLocal ){
     int a = amt;
-    if( a+offset>MX_LOCAL_PAYLOAD ){
-      a = MX_LOCAL_PAYLOAD - offset;
+    if( a+offset>pBt->mxLocal ){
+      a = pBt->mxLocal - offset;
     }
     memcpy(zBuf, &aPayload[offset], a);
     if( a==amt ){
@@ -765,29 +1366,41 @@ static int getPayload(BtCursor *pCur, int offset, int amt, char *zBuf){
     zBuf += a;
     amt -= a;
   }else{
-    offset -= MX_LOCAL_PAYLOAD;
+    offset -= pBt->mxLocal;
   }
   if( amt>0 ){
-    nextPage = pCur->pPage->apCell[pCur->idx]->ovfl;
+    nextPage = CELL_OVFL(pBt, pCur->pPage->apCell[pCur->idx]);
+    mndbpager_prefetch(pBt->pPager, nextPage,
+                       (offset + amt + pBt->ovflSize - 1)/pBt->ovflSize);
   }
   while( amt>0 && nextPage ){
     OverflowPage *pOvfl;
-    rc = mndbpager_get(pCur->pBt->pPager, nextPage, (void**)&pOvfl);
+    rc = getData(pBt, nextPage, (void**)&pOvfl);
     if( rc!=0 ){
       return rc;
     }
+    mndbpager_set_priority(pOvfl, MNDB_PAGE_OVERFLOW);
+
+    /* Overflow pages are usually allocated one after the other, so the
+    ** read-ahead above normally covers the whole chain.  Where the chain
+    ** jumps, start again from the new place.
+    */
+    if( pOvfl->iNext!=nextPage+1 && amt+offset>pBt->ovflSize ){
+      mndbpager_prefetch(pBt->pPager, pOvfl->iNext,
+           (offset + amt - 1)/pBt->ovflSize);
+    }
     nextPage = pOvfl->iNext;
-    if( offset<OVERFLOW_SIZE ){
+    if( offset<pBt->ovflSize ){
       int a = amt;
-      if( a + offset > OVERFLOW_SIZE ){
-        a = OVERFLOW_SIZE - offset;
+      if( a + offset > pBt->ovflSize ){
+        a = pBt->ovflSize - offset;
       }
       memcpy(zBuf, &pOvfl->aPayload[offset], a);
       offset = 0;
       amt -= a;
       zBuf += a;
     }else{
-      offset -= OVERFLOW_SIZE;
+      offset -= pBt->ovflSize;
     }
     mndbpager_unref(pOvfl);
   }
@@ -809,19 +1422,23 @@ int mndbBtreeKey(BtCursor *pCur, int offset, int amt, char *zBuf){
   if( amt<0 ) return 0;
   if( offset<0 ) return 0; 
   if( amt==0 ) return 0;
+  latchCursor(pCur);
   pPage = pCur->pPage;
   assert( pPage!=0 );
   if( pCur->idx >= pPage->nCell ){
-    return 0;
-  }
-  pCell = pPage->apCell[pCur->idx];
-  if( amt+offset > pCell->h.nKey ){
-    amt = pCell->h.nKey - offset;
-    if( amt<=0 ){
-      return 0;
+    amt = 0;
+  }else{
+    pCell = pPage->apCell[pCur->idx];
+    if( amt+offset > pCell->h.nKey ){
+      amt = pCell->h.nKey - offset;
+    }
+    if( amt>0 ){
+      getPayload(pCur, offset, amt, zBuf);
+    }else{
+      amt = 0;
     }
   }
-  getPayload(pCur, offset, amt, zBuf);
+  unlatchCursor(pCur);
   return amt;
 }
 
@@ -836,6 +1453,7 @@ int mndbBtreeDataSize(BtCursor *pCur, int *pSize){
   Cell *pCell;
   MemPage *pPage;
 
+  latchCursor(pCur);
   pPage = pCur->pPage;
   assert( pPage!=0 );
   if( pCur->idx >= pPage->nCell ){
@@ -844,6 +1462,7 @@ int mndbBtreeDataSize(BtCursor *pCur, int *pSize){
     pCell = pPage->apCell[pCur->idx];
     *pSize = pCell->h.nData;
   }
+  unlatchCursor(pCur);
   return MNDB_OK;
 }
 
@@ -862,19 +1481,23 @@ int mndbBtreeData(BtCursor *pCur, int offset, int amt, char *zBuf){
   if( amt<0 ) return 0;
   if( offset<0 ) return 0;
   if( amt==0 ) return 0;
+  latchCursor(pCur);
   pPage = pCur->pPage;
   assert( pPage!=0 );
   if( pCur->idx >= pPage->nCell ){
-    return 0;
-  }
-  pCell = pPage->apCell[pCur->idx];
-  if( amt+offset > pCell->h.nData ){
-    amt = pCell->h.nData - offset;
-    if( amt<=0 ){
-      return 0;
+    amt = 0;
+  }else{
+    pCell = pPage->apCell[pCur->idx];
+    if( amt+offset > (int)pCell->h.nData ){
+      amt = pCell->h.nData - offset;
+    }
+    if( amt>0 ){
+      getPayload(pCur, offset + pCell->h.nKey, amt, zBuf);
+    }else{
+      amt = 0;
     }
   }
-  getPayload(pCur, offset + pCell->h.nKey, amt, zBuf);
+  unlatchCursor(pCur);
   return amt;
 }
 
@@ -896,6 +1519,7 @@ static int compareKey(
   int *pResult         /* Write the comparison results here */
 ){
   Pgno nextPage;
+  Btree *pBt = pCur->pBt;
   int nKey = nKeyOrig;
   int n, c, rc;
   Cell *pCell;
@@ -907,8 +1531,8 @@ static int compareKey(
     nKey = pCell->h.nKey;
   }
   n = nKey;
-  if( n>MX_LOCAL_PAYLOAD ){
-    n = MX_LOCAL_PAYLOAD;
+  if( n>pBt->mxLocal ){
+    n = pBt->mxLocal;
   }
   c = memcmp(pCell->aPayload, pKey, n);
   if( c!=0 ){
@@ -917,20 +1541,21 @@ static int compareKey(
   }
   pKey += n;
   nKey -= n;
-  nextPage = pCell->ovfl;
+  nextPage = CELL_OVFL(pBt, pCell);
   while( nKey>0 ){
     OverflowPage *pOvfl;
     if( nextPage==0 ){
       return MNDB_CORRUPT;
     }
-    rc = mndbpager_get(pCur->pBt->pPager, nextPage, (void**)&pOvfl);
+    rc = getData(pBt, nextPage, (void**)&pOvfl);
     if( rc ){
       return rc;
     }
+    mndbpager_set_priority(pOvfl, MNDB_PAGE_OVERFLOW);
     nextPage = pOvfl->iNext;
     n = nKey;
-    if( n>OVERFLOW_SIZE ){
-      n = OVERFLOW_SIZE;
+    if( n>pBt->ovflSize ){
+      n = pBt->ovflSize;
     }
     c = memcmp(pOvfl->aPayload, pKey, n);
     mndbpager_unref(pOvfl);
@@ -946,19 +1571,49 @@ static int compareKey(
   return MNDB_OK;
 }
 
+/*
+** The cursor is about to step down from pParent onto a leaf.  The cell
+** at index idx of pParent is the one whose left child is that leaf, or
+** idx is pParent->nCell if it is the right child.  A scan will visit
+** the leaves to the right of it next, so ask the pager to start reading
+** a few of them now.  All leaves are at the same depth, so every child
+** of pParent is a leaf.  This is only done when the leaf itself had to
+** be read from disk, as its neighbours are then likely not cached
+** either.
+*/
+static void prefetchSiblings(MemPage *pParent, int idx){
+  Pgno aPgno[N_PREFETCH_LEAF];
+  int i, n = 0;
+  for(i=idx+1; i<=idx+N_PREFETCH_LEAF && i<=pParent->nCell; i++){
+    if( i<pParent->nCell ){
+      aPgno[n++] = pParent->apCell[i]->h.leftChild;
+    }else{
+      aPgno[n++] = pParent->u.hdr->rightChild;
+    }
+  }
+  mndbpager_prefetch_pages(pParent->pBt->pPager, n, aPgno);
+}
+
 /*
 ** Move the cursor down to a new child page.
 */
 static int moveToChild(BtCursor *pCur, int newPgno){
   int rc;
+  int isCold;
   MemPage *pNewPage;
 
-  rc = mndbpager_get(pCur->pBt->pPager, newPgno, (void**)&pNewPage);
-  if( rc ) return rc;
-  rc = initPage(pNewPage, newPgno, pCur->pPage);
+  if( (Pgno)newPgno==pCur->pPage->pgno ) return MNDB_CORRUPT;
+  rc = getPage(pCur->pBt, newPgno, &pNewPage);
   if( rc ) return rc;
-  mndbpager_unref(pCur->pPage);
-  pCur->pPage = pNewPage;
+  rc = latchInitPage(pCur, pNewPage, newPgno, pCur->pPage, &isCold);
+  if( rc ){
+    releasePage(pNewPage);
+    return rc;
+  }
+  if( isCold && pNewPage->u.hdr->rightChild==0 ){
+    prefetchSiblings(pCur->pPage, pCur->idx);
+  }
+  setCursorPage(pCur, pNewPage);
   pCur->idx = 0;
   return MNDB_OK;
 }
@@ -977,9 +1632,17 @@ static int moveToParent(BtCursor *pCur){
   int i;
   pParent = pCur->pPage->pParent;
   if( pParent==0 ) return MNDB_INTERNAL;
-  oldPgno = mndbpager_pagenumber(pCur->pPage);
-  mndbpager_ref(pParent);
-  mndbpager_unref(pCur->pPage);
+  oldPgno = pCur->pPage->pgno;
+  mndbpager_ref(pParent->u.aDisk);
+  if( pCur->eLatch==LATCH_SHARED ){
+    /* Never wait for the latch of a parent while holding a child */
+    unlatchPage(pCur->pPage, LATCH_SHARED);
+    latchPage(pParent, LATCH_SHARED);
+  }else{
+    /* The writer already holds every page above those it changes */
+    assert( pParent->nHold>0 );
+  }
+  releasePage(pCur->pPage);
   pCur->pPage = pParent;
   pCur->idx = pParent->nCell;
   for(i=0; i<pParent->nCell; i++){
@@ -996,13 +1659,28 @@ static int moveToParent(BtCursor *pCur){
 */
 static int moveToRoot(BtCursor *pCur){
   MemPage *pNew;
+  int isCold;
   int rc;
 
-  rc = mndbpager_get(pCur->pBt->pPager, pCur->pgnoRoot, (void**)&pNew);
-  if( rc ) return rc;
-  rc = initPage(pNew, pCur->pgnoRoot, 0);
+  rc = getPage(pCur->pBt, pCur->pgnoRoot, &pNew);
   if( rc ) return rc;
-  mndbpager_unref(pCur->pPage);
+  if( pCur->eLatch==LATCH_SHARED ){
+    if( pNew==pCur->pPage ){
+      /* Already there, and latched */
+      releasePage(pNew);
+      pCur->idx = 0;
+      return MNDB_OK;
+    }
+    /* Never wait for the latch of the root while holding a page below */
+    unlatchPage(pCur->pPage, LATCH_SHARED);
+  }
+  rc = latchInitPage(pCur, pNew, pCur->pgnoRoot, 0, &isCold);
+  if( rc ){
+    releasePage(pNew);
+    if( pCur->eLatch==LATCH_SHARED ) latchPage(pCur->pPage, LATCH_SHARED);
+    return rc;
+  }
+  releasePage(pCur->pPage);
   pCur->pPage = pNew;
   pCur->idx = 0;
   return MNDB_OK;
@@ -1029,14 +1707,17 @@ static int moveToLeftmost(BtCursor *pCur){
 */
 int mndbBtreeFirst(BtCursor *pCur, int *pRes){
   int rc;
+  latchCursor(pCur);
   rc = moveToRoot(pCur);
-  if( rc ) return rc;
-  if( pCur->pPage->nCell==0 ){
-    *pRes = 1;
-    return MNDB_OK;
+  if( rc==MNDB_OK ){
+    if( pCur->pPage->nCell==0 ){
+      *pRes = 1;
+    }else{
+      *pRes = 0;
+      rc = moveToLeftmost(pCur);
+    }
   }
-  *pRes = 0;
-  rc = moveToLeftmost(pCur);
+  unlatchCursor(pCur);
   return rc;
 }
 
@@ -1061,8 +1742,11 @@ int mndbBtreeFirst(BtCursor *pCur, int *pRes){
 **
 **     *pRes>0      The cursor is left pointing at an entry that
 **                  is larger than pKey.
+**
+** moveTo() does the work, with the page of the cursor latched as
+** pCur->eLatch says.  The writer uses it too, see mndbBtreeInsert().
 */
-int mndbBtreeMoveto(BtCursor *pCur, const void *pKey, int nKey, int *pRes){
+static int moveTo(BtCursor *pCur, const void *pKey, int nKey, int *pRes){
   int rc;
   pCur->bSkipNext = 0;
   rc = moveToRoot(pCur);
@@ -1091,7 +1775,7 @@ int mndbBtreeMoveto(BtCursor *pCur, const void *pKey, int nKey, int *pRes){
     }
     assert( lwr==upr+1 );
     if( lwr>=pPage->nCell ){
-      chldPg = pPage->u.hdr.rightChild;
+      chldPg = pPage->u.hdr->rightChild;
     }else{
       chldPg = pPage->apCell[lwr]->h.leftChild;
     }
@@ -1100,11 +1784,19 @@ int mndbBtreeMoveto(BtCursor *pCur, const void *pKey, int nKey, int *pRes){
       if( pRes ) *pRes = c;
       return MNDB_OK;
     }
+    pCur->idx = lwr;
     rc = moveToChild(pCur, chldPg);
     if( rc ) return rc;
   }
   /* NOT REACHED */
 }
+int mndbBtreeMoveto(BtCursor *pCur, const void *pKey, int nKey, int *pRes){
+  int rc;
+  latchCursor(pCur);
+  rc = moveTo(pCur, pKey, nKey, pRes);
+  unlatchCursor(pCur);
+  return rc;
+}
 
 /*
 ** Advance the cursor to the next entry in the database.  If
@@ -1112,7 +1804,7 @@ int mndbBtreeMoveto(BtCursor *pCur, const void *pKey, int nKey, int *pRes){
 ** was already pointing to the last entry in the database before
 ** this routine was called, then set *pRes=1 if pRes!=NULL.
 */
-int mndbBtreeNext(BtCursor *pCur, int *pRes){
+static int moveToNext(BtCursor *pCur, int *pRes){
   int rc;
   if( pCur->bSkipNext ){
     pCur->bSkipNext = 0;
@@ -1121,8 +1813,8 @@ int mndbBtreeNext(BtCursor *pCur, int *pRes){
   }
   pCur->idx++;
   if( pCur->idx>=pCur->pPage->nCell ){
-    if( pCur->pPage->u.hdr.rightChild ){
-      rc = moveToChild(pCur, pCur->pPage->u.hdr.rightChild);
+    if( pCur->pPage->u.hdr->rightChild ){
+      rc = moveToChild(pCur, pCur->pPage->u.hdr->rightChild);
       if( rc ) return rc;
       rc = moveToLeftmost(pCur);
       if( rc ) return rc;
@@ -1145,6 +1837,13 @@ int mndbBtreeNext(BtCursor *pCur, int *pRes){
   if( pRes ) *pRes = 0;
   return MNDB_OK;
 }
+int mndbBtreeNext(BtCursor *pCur, int *pRes){
+  int rc;
+  latchCursor(pCur);
+  rc = moveToNext(pCur, pRes);
+  unlatchCursor(pCur);
+  return rc;
+}
 
 /*
 ** Allocate a new page from the database file.
@@ -1166,21 +1865,21 @@ static int allocatePage(Btree *pBt, MemPage **ppPage, Pgno *pPgno){
     rc = mndbpager_write(pPage1);
     if( rc ) return rc;
     *pPgno = pPage1->freeList;
-    rc = mndbpager_get(pBt->pPager, pPage1->freeList, (void**)&pOvfl);
+    rc = getPage(pBt, pPage1->freeList, ppPage);
     if( rc ) return rc;
-    rc = mndbpager_write(pOvfl);
+    rc = mndbpager_write((*ppPage)->u.aDisk);
     if( rc ){
-      mndbpager_unref(pOvfl);
+      releasePage(*ppPage);
       return rc;
     }
+    pOvfl = (OverflowPage*)(*ppPage)->u.aDisk;
     pPage1->freeList = pOvfl->iNext;
     pPage1->nFree--;
-    *ppPage = (MemPage*)pOvfl;
   }else{
     *pPgno = mndbpager_pagecount(pBt->pPager) + 1;
-    rc = mndbpager_get(pBt->pPager, *pPgno, (void**)ppPage);
+    rc = getPage(pBt, *pPgno, ppPage);
     if( rc ) return rc;
-    rc = mndbpager_write(*ppPage);
+    rc = mndbpager_write((*ppPage)->u.aDisk);
   }
   return rc;
 }
@@ -1189,46 +1888,47 @@ static int allocatePage(Btree *pBt, MemPage **ppPage, Pgno *pPgno){
 ** Add a page of the database file to the freelist.  Either pgno or
 ** pPage but not both may be 0. 
 **
-** mndbpager_unref() is NOT called for pPage.
+** releasePage() is NOT called for pPage.
 */
-static int freePage(Btree *pBt, void *pPage, Pgno pgno){
+static int freePage(Btree *pBt, MemPage *pPage, Pgno pgno){
   PageOne *pPage1 = pBt->page1;
-  OverflowPage *pOvfl = (OverflowPage*)pPage;
+  OverflowPage *pOvfl;
   int rc;
   int needUnref = 0;
-  MemPage *pMemPage;
 
   if( pgno==0 ){
-    assert( pOvfl!=0 );
-    pgno = mndbpager_pagenumber(pOvfl);
+    assert( pPage!=0 );
+    pgno = pPage->pgno;
   }
   assert( pgno>2 );
   rc = mndbpager_write(pPage1);
   if( rc ){
     return rc;
   }
-  if( pOvfl==0 ){
+  if( pPage==0 ){
     assert( pgno>0 );
-    rc = mndbpager_get(pBt->pPager, pgno, (void**)&pOvfl);
+    rc = getPage(pBt, pgno, &pPage);
     if( rc ) return rc;
     needUnref = 1;
   }
-  rc = mndbpager_write(pOvfl);
+  rc = mndbpager_write(pPage->u.aDisk);
   if( rc ){
-    if( needUnref ) mndbpager_unref(pOvfl);
+    if( needUnref ) releasePage(pPage);
     return rc;
   }
+  latchWrite(pPage);
+  pOvfl = (OverflowPage*)pPage->u.aDisk;
   pOvfl->iNext = pPage1->freeList;
   pPage1->freeList = pgno;
   pPage1->nFree++;
-  memset(pOvfl->aPayload, 0, OVERFLOW_SIZE);
-  pMemPage = (MemPage*)pPage;
-  pMemPage->isInit = 0;
-  if( pMemPage->pParent ){
-    mndbpager_unref(pMemPage->pParent);
-    pMemPage->pParent = 0;
-  }
-  if( needUnref ) rc = mndbpager_unref(pOvfl);
+  memset(pOvfl->aPayload, 0, pBt->ovflSize);
+  pPage->isInit = 0;
+  if( pPage->pParent ){
+    releasePage(pPage->pParent);
+    pPage->pParent = 0;
+  }
+  unlatchWrite(pPage);
+  if( needUnref ) rc = releasePage(pPage);
   return rc;
 }
 
@@ -1237,23 +1937,22 @@ static int freePage(Btree *pBt, void *pPage, Pgno pgno){
 ** pages back the freelist.
 */
 static int clearCell(Btree *pBt, Cell *pCell){
-  Pager *pPager = pBt->pPager;
-  OverflowPage *pOvfl;
+  MemPage *pOvfl;
   Pgno ovfl, nextOvfl;
   int rc;
 
-  if( pCell->h.nKey + pCell->h.nData <= MX_LOCAL_PAYLOAD ){
+  if( pCell->h.nKey + pCell->h.nData <= (u32)pBt->mxLocal ){
     return MNDB_OK;
   }
-  ovfl = pCell->ovfl;
-  pCell->ovfl = 0;
+  ovfl = CELL_OVFL(pBt, pCell);
+  CELL_OVFL(pBt, pCell) = 0;
   while( ovfl ){
-    rc = mndbpager_get(pPager, ovfl, (void**)&pOvfl);
+    rc = getPage(pBt, ovfl, &pOvfl);
     if( rc ) return rc;
-    nextOvfl = pOvfl->iNext;
+    nextOvfl = ((OverflowPage*)pOvfl->u.aDisk)->iNext;
     rc = freePage(pBt, pOvfl, ovfl);
     if( rc ) return rc;
-    mndbpager_unref(pOvfl);
+    releasePage(pOvfl);
     ovfl = nextOvfl;
   }
   return MNDB_OK;
@@ -1269,7 +1968,7 @@ static int fillInCell(
   const void *pKey, int nKey,    /* The key */
   const void *pData,int nData    /* The data */
 ){
-  OverflowPage *pOvfl, *pPrior;
+  MemPage *pOvfl, *pPrior;
   Pgno *pNext;
   int spaceLeft;
   int n, rc;
@@ -1282,28 +1981,29 @@ static int fillInCell(
   pCell->h.nData = nData;
   pCell->h.iNext = 0;
 
-  pNext = &pCell->ovfl;
+  pNext = &CELL_OVFL(pBt, pCell);
   pSpace = pCell->aPayload;
-  spaceLeft = MX_LOCAL_PAYLOAD;
+  spaceLeft = pBt->mxLocal;
   pPayload = pKey;
   pKey = 0;
   nPayload = nKey;
   pPrior = 0;
   while( nPayload>0 ){
     if( spaceLeft==0 ){
-      rc = allocatePage(pBt, (MemPage**)&pOvfl, pNext);
+      rc = allocatePage(pBt, &pOvfl, pNext);
       if( rc ){
         *pNext = 0;
       }
-      if( pPrior ) mndbpager_unref(pPrior);
+      if( pPrior ) releasePage(pPrior);
       if( rc ){
         clearCell(pBt, pCell);
         return rc;
       }
+      mndbpager_set_priority(pOvfl->u.aDisk, MNDB_PAGE_OVERFLOW);
       pPrior = pOvfl;
-      spaceLeft = OVERFLOW_SIZE;
-      pSpace = pOvfl->aPayload;
-      pNext = &pOvfl->iNext;
+      spaceLeft = pBt->ovflSize;
+      pSpace = ((OverflowPage*)pOvfl->u.aDisk)->aPayload;
+      pNext = &((OverflowPage*)pOvfl->u.aDisk)->iNext;
     }
     n = nPayload;
     if( n>spaceLeft ) n = spaceLeft;
@@ -1321,7 +2021,7 @@ static int fillInCell(
   }
   *pNext = 0;
   if( pPrior ){
-    mndbpager_unref(pPrior);
+    releasePage(pPrior);
   }
   return MNDB_OK;
 }
@@ -1333,18 +2033,23 @@ static int fillInCell(
 */
 static void reparentPage(Pager *pPager, Pgno pgno, MemPage *pNewParent){
   MemPage *pThis;
+  void *pData;
 
   if( pgno==0 ) return;
   assert( pPager!=0 );
-  pThis = mndbpager_lookup(pPager, pgno);
-  if( pThis && pThis->isInit ){
+  pData = mndbpager_lookup(pPager, pgno);
+  if( pData==0 ) return;
+  pThis = (MemPage*)mndbpager_getextra(pData);
+  latchWrite(pThis);
+  if( pThis->isInit ){
     if( pThis->pParent!=pNewParent ){
-      if( pThis->pParent ) mndbpager_unref(pThis->pParent);
+      if( pThis->pParent ) releasePage(pThis->pParent);
       pThis->pParent = pNewParent;
-      if( pNewParent ) mndbpager_ref(pNewParent);
+      if( pNewParent ) mndbpager_ref(pNewParent->u.aDisk);
     }
-    mndbpager_unref(pThis);
   }
+  unlatchWrite(pThis);
+  mndbpager_unref(pData);
 }
 
 /*
@@ -1360,7 +2065,7 @@ static void reparentChildPages(Pager *pPager, MemPage *pPage){
   for(i=0; i<pPage->nCell; i++){
     reparentPage(pPager, pPage->apCell[i]->h.leftChild, pPage);
   }
-  reparentPage(pPager, pPage->u.hdr.rightChild, pPage);
+  reparentPage(pPager, pPage->u.hdr->rightChild, pPage);
 }
 
 /*
@@ -1380,9 +2085,9 @@ static void reparentChildPages(Pager *pPager, MemPage *pPage){
 static void dropCell(MemPage *pPage, int idx, int sz){
   int j;
   assert( idx>=0 && idx<pPage->nCell );
-  assert( sz==cellSize(pPage->apCell[idx]) );
-  assert( mndbpager_iswriteable(pPage) );
-  freeSpace(pPage, Addr(pPage->apCell[idx]) - Addr(pPage), sz);
+  assert( sz==cellSize(pPage->pBt, pPage->apCell[idx]) );
+  assert( mndbpager_iswriteable(pPage->u.aDisk) );
+  freeSpace(pPage, Addr(pPage->apCell[idx]) - Addr(pPage->u.aDisk), sz);
   for(j=idx; j<pPage->nCell-1; j++){
     pPage->apCell[j] = pPage->apCell[j+1];
   }
@@ -1405,8 +2110,8 @@ static void dropCell(MemPage *pPage, int idx, int sz){
 static void insertCell(MemPage *pPage, int i, Cell *pCell, int sz){
   int idx, j;
   assert( i>=0 && i<=pPage->nCell );
-  assert( sz==cellSize(pCell) );
-  assert( mndbpager_iswriteable(pPage) );
+  assert( sz==cellSize(pPage->pBt, pCell) );
+  assert( mndbpager_iswriteable(pPage->u.aDisk) );
   idx = allocateSpace(pPage, sz);
   for(j=pPage->nCell; j>i; j--){
     pPage->apCell[j] = pPage->apCell[j-1];
@@ -1430,11 +2135,11 @@ static void insertCell(MemPage *pPage, int i, Cell *pCell, int sz){
 static void relinkCellList(MemPage *pPage){
   int i;
   u16 *pIdx;
-  assert( mndbpager_iswriteable(pPage) );
-  pIdx = &pPage->u.hdr.firstCell;
+  assert( mndbpager_iswriteable(pPage->u.aDisk) );
+  pIdx = &pPage->u.hdr->firstCell;
   for(i=0; i<pPage->nCell; i++){
-    int idx = Addr(pPage->apCell[i]) - Addr(pPage);
-    assert( idx>0 && idx<MNDB_PAGE_SIZE );
+    int idx = Addr(pPage->apCell[i]) - Addr(pPage->u.aDisk);
+    assert( idx>0 && idx<pPage->pBt->pageSize );
     *pIdx = idx;
     pIdx = &pPage->apCell[i]->h.iNext;
   }
@@ -1450,17 +2155,18 @@ static void relinkCellList(MemPage *pPage){
 static void copyPage(MemPage *pTo, MemPage *pFrom){
   uptr from, to;
   int i;
-  memcpy(pTo->u.aDisk, pFrom->u.aDisk, MNDB_PAGE_SIZE);
+  int pageSize = pFrom->pBt->pageSize;
+  memcpy(pTo->u.aDisk, pFrom->u.aDisk, pageSize);
   pTo->pParent = 0;
   pTo->isInit = 1;
   pTo->nCell = pFrom->nCell;
   pTo->nFree = pFrom->nFree;
   pTo->isOverfull = pFrom->isOverfull;
-  to = Addr(pTo);
-  from = Addr(pFrom);
+  to = Addr(pTo->u.aDisk);
+  from = Addr(pFrom->u.aDisk);
   for(i=0; i<pTo->nCell; i++){
     uptr x = Addr(pFrom->apCell[i]);
-    if( x>from && x<from+MNDB_PAGE_SIZE ){
+    if( x>from && x<from+pageSize ){
       *((uptr*)&pTo->apCell[i]) = x + to - from;
     }else{
       pTo->apCell[i] = pFrom->apCell[i];
@@ -1532,17 +2238,20 @@ static int balance(Btree *pBt, MemPage *pPage, BtCursor *pCur){
   int szNew[4];                /* Combined size of cells place on i-th page */
   MemPage *extraUnref = 0;     /* A page that needs to be unref-ed */
   Pgno pgno;                   /* Page number */
-  Cell *apCell[MX_CELL*3+5];   /* All cells from pages being balanceed */
-  int szCell[MX_CELL*3+5];     /* Local size of all cells */
-  Cell aTemp[2];               /* Temporary holding area for apDiv[] */
+  Cell **apCell;               /* All cells from pages being balanceed */
+  int *szCell;                 /* Local size of all cells */
+  Cell *aTemp;                 /* Temporary holding area for apDiv[] */
   MemPage aOld[3];             /* Temporary copies of pPage and its siblings */
+  char *pSpace = 0;            /* Memory holding apCell[], szCell[], etc. */
+  int nMaxCell;                /* Number of slots in apCell[] and szCell[] */
 
   /* 
   ** Return without doing any work if pPage is neither overfull nor
   ** underfull.
   */
-  assert( mndbpager_iswriteable(pPage) );
-  if( !pPage->isOverfull && pPage->nFree<MNDB_PAGE_SIZE/2 
+  assert( mndbpager_iswriteable(pPage->u.aDisk) );
+  assert( pPage->nHold>0 );
+  if( !pPage->isOverfull && pPage->nFree<pBt->pageSize/2 
         && pPage->nCell>=2){
     relinkCellList(pPage);
     return MNDB_OK;
@@ -1558,27 +2267,32 @@ static int balance(Btree *pBt, MemPage *pPage, BtCursor *pCur){
     Pgno pgnoChild;
     MemPage *pChild;
     if( pPage->nCell==0 ){
-      if( pPage->u.hdr.rightChild ){
+      if( pPage->u.hdr->rightChild ){
         /*
         ** The root page is empty.  Copy the one child page
         ** into the root page and return.  This reduces the depth
         ** of the BTree by one.
         */
-        pgnoChild = pPage->u.hdr.rightChild;
-        rc = mndbpager_get(pBt->pPager, pgnoChild, (void**)&pChild);
+        pgnoChild = pPage->u.hdr->rightChild;
+        rc = getPage(pBt, pgnoChild, &pChild);
         if( rc ) return rc;
-        memcpy(pPage, pChild, MNDB_PAGE_SIZE);
+        rc = holdPage(pBt, pChild);
+        if( rc ){
+          releasePage(pChild);
+          return rc;
+        }
+        memcpy(pPage->u.aDisk, pChild->u.aDisk, pBt->pageSize);
         pPage->isInit = 0;
-        rc = initPage(pPage, mndbpager_pagenumber(pPage), 0);
+        rc = initPage(pPage, pPage->pgno, 0);
         assert( rc==MNDB_OK );
         reparentChildPages(pBt->pPager, pPage);
         if( pCur && pCur->pPage==pChild ){
-          mndbpager_unref(pChild);
+          releasePage(pChild);
           pCur->pPage = pPage;
-          mndbpager_ref(pPage);
+          mndbpager_ref(pPage->u.aDisk);
         }
         freePage(pBt, pChild, pgnoChild);
-        mndbpager_unref(pChild);
+        releasePage(pChild);
       }else{
         relinkCellList(pPage);
       }
@@ -1598,27 +2312,33 @@ static int balance(Btree *pBt, MemPage *pPage, BtCursor *pCur){
     ** child.  Then fall thru to the code below which will cause
     ** the overfull child page to be split.
     */
-    rc = mndbpager_write(pPage);
+    rc = mndbpager_write(pPage->u.aDisk);
     if( rc ) return rc;
     rc = allocatePage(pBt, &pChild, &pgnoChild);
     if( rc ) return rc;
-    assert( mndbpager_iswriteable(pChild) );
+    rc = holdPage(pBt, pChild);
+    if( rc ){
+      releasePage(pChild);
+      return rc;
+    }
+    assert( mndbpager_iswriteable(pChild->u.aDisk) );
     copyPage(pChild, pPage);
     pChild->pParent = pPage;
-    mndbpager_ref(pPage);
+    mndbpager_ref(pPage->u.aDisk);
     pChild->isOverfull = 1;
     if( pCur && pCur->pPage==pPage ){
-      mndbpager_unref(pPage);
+      releasePage(pPage);
       pCur->pPage = pChild;
     }else{
       extraUnref = pChild;
     }
     zeroPage(pPage);
-    pPage->u.hdr.rightChild = pgnoChild;
+    pPage->u.hdr->rightChild = pgnoChild;
     pParent = pPage;
     pPage = pChild;
   }
-  rc = mndbpager_write(pParent);
+  assert( pParent->nHold>0 );
+  rc = mndbpager_write(pParent->u.aDisk);
   if( rc ) return rc;
   
   /*
@@ -1627,14 +2347,14 @@ static int balance(Btree *pBt, MemPage *pPage, BtCursor *pCur){
   ** is the rightmost child of pParent then set idx to pParent->nCell 
   */
   idx = -1;
-  pgno = mndbpager_pagenumber(pPage);
+  pgno = pPage->pgno;
   for(i=0; i<pParent->nCell; i++){
     if( pParent->apCell[i]->h.leftChild==pgno ){
       idx = i;
       break;
     }
   }
-  if( idx<0 && pParent->u.hdr.rightChild==pgno ){
+  if( idx<0 && pParent->u.hdr->rightChild==pgno ){
     idx = pParent->nCell;
   }
   if( idx<0 ){
@@ -1646,7 +2366,34 @@ static int balance(Btree *pBt, MemPage *pPage, BtCursor *pCur){
   ** directly to balance_cleanup at any moment.
   */
   nOld = nNew = 0;
-  mndbpager_ref(pParent);
+  mndbpager_ref(pParent->u.aDisk);
+
+  /*
+  ** The cell arrays and the copies of the sibling pages are sized by
+  ** the page size, so they come from the heap rather than the stack.
+  ** One allocation holds all of them.
+  */
+  nMaxCell = pBt->mxCell*3 + 5;
+  pSpace = mndbMalloc( nMaxCell*sizeof(Cell*)
+                     + 3*(pBt->mxCell+2)*sizeof(Cell*)
+                     + 2*sizeof(Cell)
+                     + nMaxCell*sizeof(int)
+                     + 3*pBt->pageSize );
+  if( pSpace==0 ){
+    rc = MNDB_NOMEM;
+    goto balance_cleanup;
+  }
+  apCell = (Cell**)pSpace;
+  for(i=0; i<3; i++){
+    aOld[i].apCell = &apCell[nMaxCell + i*(pBt->mxCell+2)];
+  }
+  aTemp = (Cell*)&apCell[nMaxCell + 3*(pBt->mxCell+2)];
+  szCell = (int*)&aTemp[2];
+  for(i=0; i<3; i++){
+    aOld[i].u.aDisk = (char*)&szCell[nMaxCell] + i*pBt->pageSize;
+    aOld[i].pBt = pBt;
+    aOld[i].pgno = 0;
+  }
 
   /*
   ** Find sibling pages to pPage and the Cells in pParent that divide
@@ -1669,12 +2416,17 @@ static int balance(Btree *pBt, MemPage *pPage, BtCursor *pCur){
       nDiv++;
       pgnoOld[i] = apDiv[i]->h.leftChild;
     }else if( k==pParent->nCell ){
-      pgnoOld[i] = pParent->u.hdr.rightChild;
+      pgnoOld[i] = pParent->u.hdr->rightChild;
     }else{
       break;
     }
-    rc = mndbpager_get(pBt->pPager, pgnoOld[i], (void**)&apOld[i]);
+    rc = getPage(pBt, pgnoOld[i], &apOld[i]);
     if( rc ) goto balance_cleanup;
+    rc = holdPage(pBt, apOld[i]);
+    if( rc ){
+      releasePage(apOld[i]);
+      goto balance_cleanup;
+    }
     rc = initPage(apOld[i], pgnoOld[i], pParent);
     if( rc ) goto balance_cleanup;
     nOld++;
@@ -1714,7 +2466,7 @@ static int balance(Btree *pBt, MemPage *pPage, BtCursor *pCur){
     copyPage(&aOld[i], apOld[i]);
     rc = freePage(pBt, apOld[i], pgnoOld[i]);
     if( rc ) goto balance_cleanup;
-    mndbpager_unref(apOld[i]);
+    releasePage(apOld[i]);
     apOld[i] = &aOld[i];
   }
 
@@ -1728,16 +2480,16 @@ static int balance(Btree *pBt, MemPage *pPage, BtCursor *pCur){
     MemPage *pOld = apOld[i];
     for(j=0; j<pOld->nCell; j++){
       apCell[nCell] = pOld->apCell[j];
-      szCell[nCell] = cellSize(apCell[nCell]);
+      szCell[nCell] = cellSize(pBt, apCell[nCell]);
       nCell++;
     }
     if( i<nOld-1 ){
-      szCell[nCell] = cellSize(apDiv[i]);
+      szCell[nCell] = cellSize(pBt, apDiv[i]);
       memcpy(&aTemp[i], apDiv[i], szCell[nCell]);
       apCell[nCell] = &aTemp[i];
       dropCell(pParent, nxDiv, szCell[nCell]);
       assert( apCell[nCell]->h.leftChild==pgnoOld[i] );
-      apCell[nCell]->h.leftChild = pOld->u.hdr.rightChild;
+      apCell[nCell]->h.leftChild = pOld->u.hdr->rightChild;
       nCell++;
     }
   }
@@ -1758,7 +2510,7 @@ static int balance(Btree *pBt, MemPage *pPage, BtCursor *pCur){
   }
   for(subtotal=k=i=0; i<nCell; i++){
     subtotal += szCell[i];
-    if( subtotal > USABLE_SPACE ){
+    if( subtotal > pBt->usableSpace ){
       szNew[k] = subtotal - szCell[i];
       cntNew[k] = i;
       subtotal = 0;
@@ -1769,7 +2521,7 @@ static int balance(Btree *pBt, MemPage *pPage, BtCursor *pCur){
   cntNew[k] = nCell;
   k++;
   for(i=k-1; i>0; i--){
-    while( szNew[i]<USABLE_SPACE/2 ){
+    while( szNew[i]<pBt->usableSpace/2 ){
       cntNew[i-1]--;
       assert( cntNew[i-1]>0 );
       szNew[i] += szCell[cntNew[i-1]];
@@ -1785,6 +2537,8 @@ static int balance(Btree *pBt, MemPage *pPage, BtCursor *pCur){
     rc = allocatePage(pBt, &apNew[i], &pgnoNew[i]);
     if( rc ) goto balance_cleanup;
     nNew++;
+    rc = holdPage(pBt, apNew[i]);
+    if( rc ) goto balance_cleanup;
     zeroPage(apNew[i]);
     apNew[i]->isInit = 1;
   }
@@ -1806,7 +2560,7 @@ static int balance(Btree *pBt, MemPage *pPage, BtCursor *pCur){
     assert( !pNew->isOverfull );
     relinkCellList(pNew);
     if( i<nNew-1 && j<nCell ){
-      pNew->u.hdr.rightChild = apCell[j]->h.leftChild;
+      pNew->u.hdr->rightChild = apCell[j]->h.leftChild;
       apCell[j]->h.leftChild = pgnoNew[i];
       if( pCur && iCur==j ){ pCur->pPage = pParent; pCur->idx = nxDiv; }
       insertCell(pParent, nxDiv, apCell[j], szCell[j]);
@@ -1815,9 +2569,9 @@ static int balance(Btree *pBt, MemPage *pPage, BtCursor *pCur){
     }
   }
   assert( j==nCell );
-  apNew[nNew-1]->u.hdr.rightChild = apOld[nOld-1]->u.hdr.rightChild;
+  apNew[nNew-1]->u.hdr->rightChild = apOld[nOld-1]->u.hdr->rightChild;
   if( nxDiv==pParent->nCell ){
-    pParent->u.hdr.rightChild = pgnoNew[nNew-1];
+    pParent->u.hdr->rightChild = pgnoNew[nNew-1];
   }else{
     pParent->apCell[nxDiv]->h.leftChild = pgnoNew[nNew-1];
   }
@@ -1827,8 +2581,8 @@ static int balance(Btree *pBt, MemPage *pPage, BtCursor *pCur){
       pCur->idx += nNew - nOld;
     }else{
       assert( pOldCurPage!=0 );
-      mndbpager_ref(pCur->pPage);
-      mndbpager_unref(pOldCurPage);
+      mndbpager_ref(pCur->pPage->u.aDisk);
+      releasePage(pOldCurPage);
     }
   }
 
@@ -1850,62 +2604,94 @@ static int balance(Btree *pBt, MemPage *pPage, BtCursor *pCur){
   */
 balance_cleanup:
   if( extraUnref ){
-    mndbpager_unref(extraUnref);
+    releasePage(extraUnref);
   }
   for(i=0; i<nOld; i++){
-    if( apOld[i]!=&aOld[i] ) mndbpager_unref(apOld[i]);
+    if( apOld[i]!=&aOld[i] ) releasePage(apOld[i]);
   }
   for(i=0; i<nNew; i++){
-    mndbpager_unref(apNew[i]);
+    releasePage(apNew[i]);
   }
   if( pCur && pCur->pPage==0 ){
     pCur->pPage = pParent;
     pCur->idx = 0;
   }else{
-    mndbpager_unref(pParent);
+    releasePage(pParent);
   }
+  mndbFree(pSpace);
   return rc;
 }
 
 /*
-** Insert a new record into the BTree.  The key is given by (pKey,nKey)
-** and the data is given by (pData,nData).  The cursor is used only to
-** define what database the record should be inserted into.  The cursor
-** is left pointing at the new record.
+** Return true if a cell of szNew bytes can go into the page of cursor
+** pCur, which moveTo() left with result loc, without balance() having
+** to touch any page but that one.
 */
-int mndbBtreeInsert(
-  BtCursor *pCur,                /* Insert data into the table of this cursor */
-  const void *pKey, int nKey,    /* The key of the new record */
-  const void *pData, int nData   /* The data of the new record */
+static int insertIsSafe(BtCursor *pCur, int loc, int szNew){
+  MemPage *pPage = pCur->pPage;
+  int nFree = pPage->nFree - szNew;
+  int nCell = pPage->nCell + 1;
+  if( pPage->isOverfull ) return 0;
+  if( loc==0 ){
+    nFree += cellSize(pCur->pBt, pPage->apCell[pCur->idx]);
+    nCell--;
+  }
+  if( nFree<0 ) return 0;
+  if( pPage->pParent==0 ) return 1;
+  return nFree<pCur->pBt->pageSize/2 && nCell>=2;
+}
+
+/*
+** Do the work of mndbBtreeInsert().
+**
+** Most inserts change only the one leaf they land on.  So first find
+** that leaf with shared latches, as a reader would, and if the new cell
+** fits there hold only that page.  Nothing can change in between, as
+** this thread is the only writer.  Otherwise search again, holding
+** every page on the way down so that balance() may change any of them.
+*/
+static int insertEntry(
+  BtCursor *pCur,
+  const void *pKey, int nKey,
+  const void *pData, int nData
 ){
   Cell newCell;
   int rc;
   int loc;
   int szNew;
+  int isSafe;
   MemPage *pPage;
   Btree *pBt = pCur->pBt;
 
-  if( !pCur->pBt->inTrans || nKey+nData==0 ){
-    return MNDB_ERROR;  /* Must start a transaction first */
+  szNew = cellSizeOf(pBt, nKey+nData);
+  latchCursor(pCur);
+  rc = moveTo(pCur, pKey, nKey, &loc);
+  isSafe = rc==MNDB_OK && insertIsSafe(pCur, loc, szNew);
+  unlatchCursor(pCur);
+  if( rc ) return rc;
+  pCur->eLatch = LATCH_EXCL;
+  if( isSafe ){
+    rc = holdPage(pBt, pCur->pPage);
+  }else{
+    rc = moveTo(pCur, pKey, nKey, &loc);
   }
-  rc = mndbBtreeMoveto(pCur, pKey, nKey, &loc);
   if( rc ) return rc;
   pPage = pCur->pPage;
-  rc = mndbpager_write(pPage);
+  rc = mndbpager_write(pPage->u.aDisk);
   if( rc ) return rc;
   rc = fillInCell(pBt, &newCell, pKey, nKey, pData, nData);
   if( rc ) return rc;
-  szNew = cellSize(&newCell);
+  szNew = cellSize(pBt, &newCell);
   if( loc==0 ){
     newCell.h.leftChild = pPage->apCell[pCur->idx]->h.leftChild;
     rc = clearCell(pBt, pPage->apCell[pCur->idx]);
     if( rc ) return rc;
-    dropCell(pPage, pCur->idx, cellSize(pPage->apCell[pCur->idx]));
+    dropCell(pPage, pCur->idx, cellSize(pBt, pPage->apCell[pCur->idx]));
   }else if( loc<0 && pPage->nCell>0 ){
-    assert( pPage->u.hdr.rightChild==0 );  /* Must be a leaf page */
+    assert( pPage->u.hdr->rightChild==0 );  /* Must be a leaf page */
     pCur->idx++;
   }else{
-    assert( pPage->u.hdr.rightChild==0 );  /* Must be a leaf page */
+    assert( pPage->u.hdr->rightChild==0 );  /* Must be a leaf page */
   }
   insertCell(pPage, pCur->idx, &newCell, szNew);
   rc = balance(pCur->pBt, pPage, pCur);
@@ -1914,6 +2700,32 @@ int mndbBtreeInsert(
   return rc;
 }
 
+/*
+** Insert a new record into the BTree.  The key is given by (pKey,nKey)
+** and the data is given by (pData,nData).  The cursor is used only to
+** define what database the record should be inserted into.  The cursor
+** is left pointing at the new record.
+*/
+int mndbBtreeInsert(
+  BtCursor *pCur,                /* Insert data into the table of this cursor */
+  const void *pKey, int nKey,    /* The key of the new record */
+  const void *pData, int nData   /* The data of the new record */
+){
+  Btree *pBt = pCur->pBt;
+  int rc;
+
+  mndbOsMutexEnter(pBt->pMutex);
+  if( !pBt->inTrans || nKey+nData==0 ){
+    rc = MNDB_ERROR;  /* Must start a transaction first */
+  }else{
+    rc = insertEntry(pCur, pKey, nKey, pData, nData);
+    releaseHeldPages(pBt);
+    pCur->eLatch = 0;
+  }
+  mndbOsMutexLeave(pBt->pMutex);
+  return rc;
+}
+
 /*
 ** Delete the entry that the cursor is pointing to.
 **
@@ -1923,20 +2735,21 @@ int mndbBtreeInsert(
 ** mndbBtreeNext() to be a no-op.  That way, you can always call
 ** mndbBtreeNext() after a delete and the cursor will be left
 ** pointing to the first entry after the deleted entry.
+**
+** The page of the cursor and every page above it are held while the
+** entry is deleted, as balance() may change any of them.
 */
-int mndbBtreeDelete(BtCursor *pCur){
+static int deleteEntry(BtCursor *pCur){
   MemPage *pPage = pCur->pPage;
+  Btree *pBt = pCur->pBt;
   Cell *pCell;
   int rc;
   Pgno pgnoChild;
 
-  if( !pCur->pBt->inTrans ){
-    return MNDB_ERROR;  /* Must start a transaction first */
-  }
   if( pCur->idx >= pPage->nCell ){
     return MNDB_ERROR;  /* The cursor is not pointing to anything */
   }
-  rc = mndbpager_write(pPage);
+  rc = mndbpager_write(pPage->u.aDisk);
   if( rc ) return rc;
   pCell = pPage->apCell[pCur->idx];
   pgnoChild = pCell->h.leftChild;
@@ -1953,15 +2766,15 @@ int mndbBtreeDelete(BtCursor *pCur){
     Cell *pNext;
     int szNext;
     getTempCursor(pCur, &leafCur);
-    rc = mndbBtreeNext(&leafCur, 0);
+    rc = moveToNext(&leafCur, 0);
     if( rc!=MNDB_OK ){
       return MNDB_CORRUPT;
     }
-    rc = mndbpager_write(leafCur.pPage);
+    rc = mndbpager_write(leafCur.pPage->u.aDisk);
     if( rc ) return rc;
-    dropCell(pPage, pCur->idx, cellSize(pCell));
+    dropCell(pPage, pCur->idx, cellSize(pBt, pCell));
     pNext = leafCur.pPage->apCell[leafCur.idx];
-    szNext = cellSize(pNext);
+    szNext = cellSize(pBt, pNext);
     pNext->h.leftChild = pgnoChild;
     insertCell(pPage, pCur->idx, pNext, szNext);
     rc = balance(pCur->pBt, pPage, pCur);
@@ -1971,7 +2784,7 @@ int mndbBtreeDelete(BtCursor *pCur){
     rc = balance(pCur->pBt, leafCur.pPage, 0);
     releaseTempCursor(&leafCur);
   }else{
-    dropCell(pPage, pCur->idx, cellSize(pCell));
+    dropCell(pPage, pCur->idx, cellSize(pBt, pCell));
     if( pCur->idx>=pPage->nCell ){
       pCur->idx = pPage->nCell-1;
       if( pCur->idx<0 ){ pCur->idx = 0; }
@@ -1983,6 +2796,23 @@ int mndbBtreeDelete(BtCursor *pCur){
   }
   return rc;
 }
+int mndbBtreeDelete(BtCursor *pCur){
+  Btree *pBt = pCur->pBt;
+  int rc;
+
+  mndbOsMutexEnter(pBt->pMutex);
+  if( !pBt->inTrans ){
+    rc = MNDB_ERROR;  /* Must start a transaction first */
+  }else{
+    pCur->eLatch = LATCH_EXCL;
+    rc = holdPath(pBt, pCur->pPage);
+    if( rc==MNDB_OK ) rc = deleteEntry(pCur);
+    releaseHeldPages(pBt);
+    pCur->eLatch = 0;
+  }
+  mndbOsMutexLeave(pBt->pMutex);
+  return rc;
+}
 
 /*
 ** Create a new BTree in the same file.  Write into *piTable the index
@@ -1992,16 +2822,22 @@ int mndbBtreeCreateTable(Btree *pBt, int *piTable){
   MemPage *pRoot;
   Pgno pgnoRoot;
   int rc;
+  mndbOsMutexEnter(pBt->pMutex);
   if( !pBt->inTrans ){
-    return MNDB_ERROR;  /* Must start a transaction first */
+    rc = MNDB_ERROR;  /* Must start a transaction first */
+    goto create_out;
   }
   rc = allocatePage(pBt, &pRoot, &pgnoRoot);
-  if( rc ) return rc;
-  assert( mndbpager_iswriteable(pRoot) );
+  if( rc ) goto create_out;
+  assert( mndbpager_iswriteable(pRoot->u.aDisk) );
+  latchWrite(pRoot);
   zeroPage(pRoot);
-  mndbpager_unref(pRoot);
+  unlatchWrite(pRoot);
+  releasePage(pRoot);
   *piTable = (int)pgnoRoot;
-  return MNDB_OK;
+create_out:
+  mndbOsMutexLeave(pBt->pMutex);
+  return rc;
 }
 
 /*
@@ -2014,31 +2850,34 @@ static int clearDatabasePage(Btree *pBt, Pgno pgno, int freePageFlag){
   Cell *pCell;
   int idx;
 
-  rc = mndbpager_get(pBt->pPager, pgno, (void**)&pPage);
+  rc = getPage(pBt, pgno, &pPage);
   if( rc ) return rc;
-  rc = mndbpager_write(pPage);
-  if( rc ) return rc;
-  idx = pPage->u.hdr.firstCell;
+  latchWrite(pPage);
+  rc = mndbpager_write(pPage->u.aDisk);
+  if( rc ) goto clear_out;
+  idx = pPage->u.hdr->firstCell;
   while( idx>0 ){
     pCell = (Cell*)&pPage->u.aDisk[idx];
     idx = pCell->h.iNext;
     if( pCell->h.leftChild ){
       rc = clearDatabasePage(pBt, pCell->h.leftChild, 1);
-      if( rc ) return rc;
+      if( rc ) goto clear_out;
     }
     rc = clearCell(pBt, pCell);
-    if( rc ) return rc;
+    if( rc ) goto clear_out;
   }
-  if( pPage->u.hdr.rightChild ){
-    rc = clearDatabasePage(pBt, pPage->u.hdr.rightChild, 1);
-    if( rc ) return rc;
+  if( pPage->u.hdr->rightChild ){
+    rc = clearDatabasePage(pBt, pPage->u.hdr->rightChild, 1);
+    if( rc ) goto clear_out;
   }
   if( freePageFlag ){
     rc = freePage(pBt, pPage, pgno);
   }else{
     zeroPage(pPage);
   }
-  mndbpager_unref(pPage);
+clear_out:
+  unlatchWrite(pPage);
+  releasePage(pPage);
   return rc;
 }
 
@@ -2047,10 +2886,13 @@ static int clearDatabasePage(Btree *pBt, Pgno pgno, int freePageFlag){
 */
 int mndbBtreeClearTable(Btree *pBt, int iTable){
   int rc;
+  mndbOsMutexEnter(pBt->pMutex);
   if( !pBt->inTrans ){
-    return MNDB_ERROR;  /* Must start a transaction first */
+    rc = MNDB_ERROR;  /* Must start a transaction first */
+  }else{
+    rc = clearDatabasePage(pBt, (Pgno)iTable, 0);
   }
-  rc = clearDatabasePage(pBt, (Pgno)iTable, 0);
+  mndbOsMutexLeave(pBt->pMutex);
   return rc;
 }
 
@@ -2062,20 +2904,359 @@ int mndbBtreeClearTable(Btree *pBt, int iTable){
 int mndbBtreeDropTable(Btree *pBt, int iTable){
   int rc;
   MemPage *pPage;
+  mndbOsMutexEnter(pBt->pMutex);
   if( !pBt->inTrans ){
-    return MNDB_ERROR;  /* Must start a transaction first */
+    rc = MNDB_ERROR;  /* Must start a transaction first */
+    goto drop_out;
   }
-  rc = mndbpager_get(pBt->pPager, (Pgno)iTable, (void**)&pPage);
+  rc = getPage(pBt, (Pgno)iTable, &pPage);
+  if( rc ) goto drop_out;
+  rc = clearDatabasePage(pBt, (Pgno)iTable, 0);
+  if( rc==MNDB_OK ){
+    latchWrite(pPage);
+    if( iTable>2 ){
+      rc = freePage(pBt, pPage, iTable);
+    }else{
+      zeroPage(pPage);
+    }
+    unlatchWrite(pPage);
+  }
+  releasePage(pPage);
+drop_out:
+  mndbOsMutexLeave(pBt->pMutex);
+  return rc;  
+}
+
+/*
+** Incremental vacuum.  Pages that are freed go onto the freelist and
+** the file never gets any shorter by itself.  mndbBtreeIncrVacuum()
+** moves pages in use from the end of the file into free pages nearer
+** the front and then cuts the file off after the last page in use.
+**
+** Nothing records which page points at a given page, so the pointer
+** to a page that is moved is found by going through the trees.  Each
+** step looks for the pointers to all the pages it moves in one pass,
+** and stops as soon as it has found them.
+*/
+typedef struct VacuumMove VacuumMove;
+struct VacuumMove {
+  Pgno pgno;                 /* Page in use near the end of the file */
+  Pgno pgnoTo;               /* Free page that it is moved to */
+  Pgno pgnoRef;              /* Page with the pointer to pgno, or 0 */
+  int iRef;                  /* Offset of that pointer in pgnoRef */
+};
+
+typedef struct Vacuum Vacuum;
+struct Vacuum {
+  Btree *pBt;                /* The Btree being vacuumed */
+  int nPage;                 /* Pages in the file */
+  Hash moves;                /* Maps a page number to its VacuumMove */
+  int nLeft;                 /* Moves whose pointer is not found yet */
+};
+
+/*
+** Remember that the pointer to page pgno is at offset iRef of page
+** pgnoRef, if pgno is one of the pages to be moved.
+*/
+static void vacuumNoteRef(Vacuum *pVac, Pgno pgno, Pgno pgnoRef, int iRef){
+  VacuumMove *pMove = mndbHashFind(&pVac->moves, 0, pgno);
+  if( pMove && pMove->pgnoRef==0 ){
+    pMove->pgnoRef = pgnoRef;
+    pMove->iRef = iRef;
+    pVac->nLeft--;
+  }
+}
+
+/*
+** Look for the pointers to the pages to be moved on tree page pgno,
+** on the overflow pages of its cells and on every page below it.
+*/
+static int vacuumFindRefs(Vacuum *pVac, Pgno pgno){
+  Btree *pBt = pVac->pBt;
+  MemPage *pPage;
+  Cell *pCell;
+  OverflowPage *pOvfl;
+  Pgno ovfl, pgnoRef;
+  int idx, iRef;
+  int rc;
+
+  if( pgno<2 || pgno>(Pgno)pVac->nPage ) return MNDB_CORRUPT;
+  rc = getPage(pBt, pgno, &pPage);
+  if( rc ) return rc;
+  idx = pPage->u.hdr->firstCell;
+  while( rc==MNDB_OK && idx>0 && pVac->nLeft>0 ){
+    if( idx>pBt->pageSize-(int)MIN_CELL_SIZE ){
+      rc = MNDB_CORRUPT;
+      break;
+    }
+    pCell = (Cell*)&pPage->u.aDisk[idx];
+    if( pCell->h.leftChild ){
+      vacuumNoteRef(pVac, pCell->h.leftChild, pgno, idx);
+      rc = vacuumFindRefs(pVac, pCell->h.leftChild);
+    }
+    if( pCell->h.nKey + pCell->h.nData > (u32)pBt->mxLocal ){
+      pgnoRef = pgno;
+      iRef = (int)((char*)&CELL_OVFL(pBt, pCell) - pPage->u.aDisk);
+      ovfl = CELL_OVFL(pBt, pCell);
+      while( rc==MNDB_OK && ovfl && pVac->nLeft>0 ){
+        if( ovfl>(Pgno)pVac->nPage ){
+          rc = MNDB_CORRUPT;
+          break;
+        }
+        vacuumNoteRef(pVac, ovfl, pgnoRef, iRef);
+        rc = mndbpager_get(pBt->pPager, ovfl, (void**)&pOvfl);
+        if( rc ) break;
+        pgnoRef = ovfl;
+        iRef = 0;
+        ovfl = pOvfl->iNext;
+        mndbpager_unref(pOvfl);
+      }
+    }
+    idx = pCell->h.iNext;
+  }
+  if( rc==MNDB_OK && pPage->u.hdr->rightChild && pVac->nLeft>0 ){
+    vacuumNoteRef(pVac, pPage->u.hdr->rightChild, pgno,
+                  (int)((char*)&pPage->u.hdr->rightChild - pPage->u.aDisk));
+    rc = vacuumFindRefs(pVac, pPage->u.hdr->rightChild);
+  }
+  releasePage(pPage);
+  return rc;
+}
+
+/*
+** Copy page pMove->pgno over the free page it moves to.  What the
+** MemPage of that page knew about it no longer holds.
+*/
+static int vacuumCopyPage(Btree *pBt, VacuumMove *pMove){
+  MemPage *pFrom, *pTo;
+  int rc;
+  rc = getPage(pBt, pMove->pgno, &pFrom);
+  if( rc ) return rc;
+  rc = getPage(pBt, pMove->pgnoTo, &pTo);
+  if( rc==MNDB_OK ){
+    rc = mndbpager_write(pTo->u.aDisk);
+    if( rc==MNDB_OK ){
+      memcpy(pTo->u.aDisk, pFrom->u.aDisk, pBt->pageSize);
+      pTo->isInit = 0;
+    }
+    releasePage(pTo);
+  }
+  releasePage(pFrom);
+  return rc;
+}
+
+/*
+** Point the pointer to page pMove->pgno at the page it was moved to.
+** The page holding the pointer may have been moved as well.
+*/
+static int vacuumSetRef(Vacuum *pVac, VacuumMove *pMove){
+  VacuumMove *pRefMove;
+  Pgno pgnoRef = pMove->pgnoRef;
+  char *aRef;
+  int rc;
+  pRefMove = mndbHashFind(&pVac->moves, 0, pgnoRef);
+  if( pRefMove ) pgnoRef = pRefMove->pgnoTo;
+  rc = mndbpager_get(pVac->pBt->pPager, pgnoRef, (void**)&aRef);
   if( rc ) return rc;
-  rc = mndbBtreeClearTable(pBt, iTable);
+  rc = mndbpager_write(aRef);
+  if( rc==MNDB_OK ){
+    *(Pgno*)&aRef[pMove->iRef] = pMove->pgnoTo;
+  }
+  mndbpager_unref(aRef);
+  return rc;
+}
+
+/*
+** Make free page pgnoPrev, or the head of the freelist if pgnoPrev is
+** 0, point at free page pgno.
+*/
+static int vacuumLinkFree(Btree *pBt, Pgno pgnoPrev, Pgno pgno){
+  OverflowPage *pPrev;
+  int rc;
+  if( pgnoPrev==0 ){
+    pBt->page1->freeList = pgno;
+    return MNDB_OK;
+  }
+  rc = mndbpager_get(pBt->pPager, pgnoPrev, (void**)&pPrev);
   if( rc ) return rc;
-  if( iTable>2 ){
-    rc = freePage(pBt, pPage, iTable);
+  if( pPrev->iNext!=pgno ){
+    rc = mndbpager_write(pPrev);
+    if( rc==MNDB_OK ) pPrev->iNext = pgno;
+  }
+  mndbpager_unref(pPrev);
+  return rc;
+}
+
+/*
+** Compare two page numbers for qsort().
+*/
+static int vacuumCompare(const void *pA, const void *pB){
+  Pgno a = *(const Pgno*)pA;
+  Pgno b = *(const Pgno*)pB;
+  return a<b ? -1 : a>b;
+}
+
+/*
+** Do the work of mndbBtreeIncrVacuum().
+*/
+static int incrVacuum(Btree *pBt, int *aRoot, int nRoot, int nStep){
+  PageOne *pPage1 = pBt->page1;
+  Vacuum sVac;
+  Pgno *aFree;               /* The freelist, in the order it is linked */
+  Pgno *aSort;               /* The freelist, in page number order */
+  VacuumMove *aMove;         /* Pages to move, last page of the file first */
+  int nFree = pPage1->nFree;
+  int nMove = 0;
+  int lo, hi;                /* aSort[lo..hi] are free pages left alone */
+  Pgno nNew;                 /* Pages in the file when done */
+  Pgno pgno, pgnoPrev;
+  void *pData;
+  int i, j;
+  int rc = MNDB_OK;
+
+  if( nFree<=0 ) return MNDB_OK;
+  if( nStep<0 ) nStep = 0;
+  sVac.pBt = pBt;
+  sVac.nPage = mndbpager_pagecount(pBt->pPager);
+  sVac.nLeft = 0;
+  mndbHashInit(&sVac.moves, MNDB_HASH_INT, 0);
+  aFree = mndbMalloc( 2*nFree*sizeof(Pgno) + nStep*sizeof(VacuumMove) );
+  if( aFree==0 ) return MNDB_NOMEM;
+  aSort = &aFree[nFree];
+  aMove = (VacuumMove*)&aSort[nFree];
+
+  pgno = pPage1->freeList;
+  for(i=0; i<nFree; i++){
+    if( pgno<3 || pgno>(Pgno)sVac.nPage ){
+      rc = MNDB_CORRUPT;
+      goto vacuum_out;
+    }
+    aFree[i] = pgno;
+    rc = mndbpager_get(pBt->pPager, pgno, &pData);
+    if( rc ) goto vacuum_out;
+    pgno = ((OverflowPage*)pData)->iNext;
+    mndbpager_unref(pData);
+  }
+  memcpy(aSort, aFree, nFree*sizeof(Pgno));
+  qsort(aSort, nFree, sizeof(Pgno), vacuumCompare);
+  for(i=1; i<nFree; i++){
+    if( aSort[i]==aSort[i-1] ){
+      rc = MNDB_CORRUPT;
+      goto vacuum_out;
+    }
+  }
+
+  /* Work back from the end of the file.  Free pages there are simply
+  ** dropped.  A page in use is moved into the lowest free page, unless
+  ** it is the root of a tree, whose page number the caller knows.
+  */
+  nNew = sVac.nPage;
+  lo = 0;
+  hi = nFree - 1;
+  while( nNew>2 ){
+    if( lo<=hi && aSort[hi]==nNew ){
+      hi--;
+    }else if( lo<=hi && nMove<nStep ){
+      for(j=0; j<nRoot && (Pgno)aRoot[j]!=nNew; j++){}
+      if( j<nRoot ) break;
+      aMove[nMove].pgno = nNew;
+      aMove[nMove].pgnoTo = aSort[lo++];
+      aMove[nMove].pgnoRef = 0;
+      mndbHashInsert(&sVac.moves, 0, nNew, &aMove[nMove]);
+      nMove++;
+    }else{
+      break;
+    }
+    nNew--;
+  }
+  if( nMove>0 && mndbHashCount(&sVac.moves)<nMove ){
+    rc = MNDB_NOMEM;
+    goto vacuum_out;
+  }
+
+  /* A page whose pointer is not found is in none of the trees given,
+  ** so it stays where it is and so must every page before it.
+  */
+  sVac.nLeft = nMove;
+  for(i=0; rc==MNDB_OK && i<nRoot && sVac.nLeft>0; i++){
+    rc = vacuumFindRefs(&sVac, (Pgno)aRoot[i]);
+  }
+  if( rc ) goto vacuum_out;
+  for(i=0; i<nMove && aMove[i].pgnoRef!=0; i++){}
+  if( i<nMove ){
+    nNew = aMove[i].pgno;
+    for(j=i; j<nMove; j++){
+      mndbHashInsert(&sVac.moves, 0, aMove[j].pgno, 0);
+    }
+    nMove = i;
+  }
+  if( nNew==(Pgno)sVac.nPage ) goto vacuum_out;
+
+  for(i=0; rc==MNDB_OK && i<nMove; i++){
+    rc = vacuumCopyPage(pBt, &aMove[i]);
+  }
+  for(i=0; rc==MNDB_OK && i<nMove; i++){
+    rc = vacuumSetRef(&sVac, &aMove[i]);
+  }
+  if( rc ) goto vacuum_out;
+
+  /* Take the pages that were moved into and those past the new end
+  ** off the freelist.  The pages moved into are the nMove lowest.
+  */
+  rc = mndbpager_write(pPage1);
+  if( rc ) goto vacuum_out;
+  pgnoPrev = 0;
+  j = 0;
+  for(i=0; rc==MNDB_OK && i<nFree; i++){
+    pgno = aFree[i];
+    if( pgno>nNew || (nMove>0 && pgno<=aSort[nMove-1]) ) continue;
+    rc = vacuumLinkFree(pBt, pgnoPrev, pgno);
+    pgnoPrev = pgno;
+    j++;
+  }
+  if( rc==MNDB_OK ) rc = vacuumLinkFree(pBt, pgnoPrev, 0);
+  if( rc ) goto vacuum_out;
+  pPage1->nFree = j;
+  rc = mndbpager_truncate(pBt->pPager, nNew);
+
+vacuum_out:
+  mndbHashClear(&sVac.moves);
+  mndbFree(aFree);
+  return rc;
+}
+
+/*
+** Make the database file shorter by moving up to nStep pages that are
+** in use from its end into free pages, and then cutting off the free
+** pages at its end.  A small nStep keeps each call short, so this can
+** be done a little at a time when the database is otherwise idle.
+** *pnFree is set to the number of free pages left in the file, and
+** when no progress can be made any more, because the pages at the end
+** are in use and cannot be moved, a call does nothing.
+**
+** aRoot[] holds the root pages of all nRoot trees in the file.  Pages
+** that are not in one of them, or on the freelist, are never moved,
+** and neither are the roots themselves.  This must be done within a
+** transaction, with no cursor open, and takes effect at commit.
+*/
+int mndbBtreeIncrVacuum(
+  Btree *pBt,                /* The Btree to make shorter */
+  int *aRoot, int nRoot,     /* Root pages of every tree in the file */
+  int nStep,                 /* Move at most this many pages */
+  int *pnFree                /* Write the number of free pages left here */
+){
+  int rc;
+  mndbOsMutexEnter(pBt->pMutex);
+  if( !pBt->inTrans ){
+    rc = MNDB_ERROR;  /* Must start a transaction first */
+  }else if( pBt->pCursor ){
+    rc = MNDB_LOCKED;  /* Cursors would be left on pages that moved */
   }else{
-    zeroPage(pPage);
+    rc = incrVacuum(pBt, aRoot, nRoot, nStep);
   }
-  mndbpager_unref(pPage);
-  return rc;  
+  if( pnFree ) *pnFree = pBt->page1 ? pBt->page1->nFree : 0;
+  mndbOsMutexLeave(pBt->pMutex);
+  return rc;
 }
 
 
@@ -2100,16 +3281,16 @@ int mndbBtreePageDump(Btree *pBt, int pgno, int recursive){
   u16 idx;
   char range[20];
   unsigned char payload[20];
-  rc = mndbpager_get(pBt->pPager, (Pgno)pgno, (void**)&pPage);
+  rc = getPage(pBt, (Pgno)pgno, &pPage);
   if( rc ){
     return rc;
   }
   if( recursive ) printf("PAGE %d:\n", pgno);
   i = 0;
-  idx = pPage->u.hdr.firstCell;
-  while( idx>0 && idx<=MNDB_PAGE_SIZE-MIN_CELL_SIZE ){
+  idx = pPage->u.hdr->firstCell;
+  while( idx>0 && idx<=pBt->pageSize-MIN_CELL_SIZE ){
     Cell *pCell = (Cell*)&pPage->u.aDisk[idx];
-    int sz = cellSize(pCell);
+    int sz = cellSize(pBt, pCell);
     sprintf(range,"%d..%d", idx, idx+sz-1);
     sz = pCell->h.nKey + pCell->h.nData;
     if( sz>sizeof(payload)-1 ) sz = sizeof(payload)-1;
@@ -2132,11 +3313,11 @@ int mndbBtreePageDump(Btree *pBt, int pgno, int recursive){
   if( idx!=0 ){
     printf("ERROR: next cell index out of range: %d\n", idx);
   }
-  printf("right_child: %d\n", pPage->u.hdr.rightChild);
+  printf("right_child: %d\n", pPage->u.hdr->rightChild);
   nFree = 0;
   i = 0;
-  idx = pPage->u.hdr.firstFree;
-  while( idx>0 && idx<MNDB_PAGE_SIZE ){
+  idx = pPage->u.hdr->firstFree;
+  while( idx>0 && idx<pBt->pageSize ){
     FreeBlk *p = (FreeBlk*)&pPage->u.aDisk[idx];
     sprintf(range,"%d..%d", idx, idx+p->iSize-1);
     nFree += p->iSize;
@@ -2148,16 +3329,16 @@ int mndbBtreePageDump(Btree *pBt, int pgno, int recursive){
   if( idx!=0 ){
     printf("ERROR: next freeblock index out of range: %d\n", idx);
   }
-  if( recursive && pPage->u.hdr.rightChild!=0 ){
-    idx = pPage->u.hdr.firstCell;
-    while( idx>0 && idx<MNDB_PAGE_SIZE-MIN_CELL_SIZE ){
+  if( recursive && pPage->u.hdr->rightChild!=0 ){
+    idx = pPage->u.hdr->firstCell;
+    while( idx>0 && idx<pBt->pageSize-MIN_CELL_SIZE ){
       Cell *pCell = (Cell*)&pPage->u.aDisk[idx];
       mndbBtreePageDump(pBt, pCell->h.leftChild, 1);
       idx = pCell->h.iNext;
     }
-    mndbBtreePageDump(pBt, pPage->u.hdr.rightChild, 1);
+    mndbBtreePageDump(pBt, pPage->u.hdr->rightChild, 1);
   }
-  mndbpager_unref(pPage);
+  releasePage(pPage);
   return MNDB_OK;
 }
 
@@ -2179,11 +3360,12 @@ int mndbBtreePageDump(Btree *pBt, int pgno, int recursive){
 int mndbBtreeCursorDump(BtCursor *pCur, int *aResult){
   int cnt, idx;
   MemPage *pPage = pCur->pPage;
-  aResult[0] = mndbpager_pagenumber(pPage);
+  Btree *pBt = pCur->pBt;
+  aResult[0] = pPage->pgno;
   aResult[1] = pCur->idx;
   aResult[2] = pPage->nCell;
   if( pCur->idx>=0 && pCur->idx<pPage->nCell ){
-    aResult[3] = cellSize(pPage->apCell[pCur->idx]);
+    aResult[3] = cellSize(pBt, pPage->apCell[pCur->idx]);
     aResult[6] = pPage->apCell[pCur->idx]->h.leftChild;
   }else{
     aResult[3] = 0;
@@ -2191,13 +3373,13 @@ int mndbBtreeCursorDump(BtCursor *pCur, int *aResult){
   }
   aResult[4] = pPage->nFree;
   cnt = 0;
-  idx = pPage->u.hdr.firstFree;
-  while( idx>0 && idx<MNDB_PAGE_SIZE ){
+  idx = pPage->u.hdr->firstFree;
+  while( idx>0 && idx<pBt->pageSize ){
     cnt++;
     idx = ((FreeBlk*)&pPage->u.aDisk[idx])->iNext;
   }
   aResult[5] = cnt;
-  aResult[7] = pPage->u.hdr.rightChild;
+  aResult[7] = pPage->u.hdr->rightChild;
   return MNDB_OK;
 }
 
@@ -2319,14 +3501,15 @@ static int checkTreePage(
   BtCursor cur;
   char zMsg[100];
   char zContext[100];
-  char hit[MNDB_PAGE_SIZE];
+  char *hit;
+  Btree *pBt = pCheck->pBt;
 
   /* Check that the page exists
   */
   if( iPage==0 ) return 0;
   if( checkRef(pCheck, iPage, zParentContext) ) return 0;
   sprintf(zContext, "On tree page %d: ", iPage);
-  if( (rc = mndbpager_get(pCheck->pPager, (Pgno)iPage, (void**)&pPage))!=0 ){
+  if( (rc = getPage(pCheck->pBt, (Pgno)iPage, &pPage))!=0 ){
     sprintf(zMsg, "unable to get the page. error code=%d", rc);
     checkAppendMsg(pCheck, zContext, zMsg);
     return 0;
@@ -2334,7 +3517,7 @@ static int checkTreePage(
   if( (rc = initPage(pPage, (Pgno)iPage, pParent))!=0 ){
     sprintf(zMsg, "initPage() returns error code %d", rc);
     checkAppendMsg(pCheck, zContext, zMsg);
-    mndbpager_unref(pPage);
+    releasePage(pPage);
     return 0;
   }
 
@@ -2352,9 +3535,9 @@ static int checkTreePage(
     */
     sz = pCell->h.nKey + pCell->h.nData;
     sprintf(zContext, "On page %d cell %d: ", iPage, i);
-    if( sz>MX_LOCAL_PAYLOAD ){
-      int nPage = (sz - MX_LOCAL_PAYLOAD + OVERFLOW_SIZE - 1)/OVERFLOW_SIZE;
-      checkList(pCheck, pCell->ovfl, nPage, zContext);
+    if( sz>pBt->mxLocal ){
+      int nPage = (sz - pBt->mxLocal + pBt->ovflSize - 1)/pBt->ovflSize;
+      checkList(pCheck, CELL_OVFL(pBt, pCell), nPage, zContext);
     }
 
     /* Check that keys are in the right order
@@ -2377,28 +3560,34 @@ static int checkTreePage(
     mndbFree(zKey1);
     zKey1 = zKey2;
   }
-  pgno = pPage->u.hdr.rightChild;
+  pgno = pPage->u.hdr->rightChild;
   sprintf(zContext, "On page %d at right child: ", iPage);
   checkTreePage(pCheck, pgno, pPage, zContext, zKey1, zUpperBound);
   mndbFree(zKey1);
  
   /* Check for complete coverage of the page
   */
-  memset(hit, 0, sizeof(hit));
+  hit = mndbMalloc( pBt->pageSize );
+  if( hit==0 ){
+    checkAppendMsg(pCheck, zContext, "out of memory");
+    releasePage(pPage);
+    return depth;
+  }
+  memset(hit, 0, pBt->pageSize);
   memset(hit, 1, sizeof(PageHdr));
-  for(i=pPage->u.hdr.firstCell; i>0 && i<MNDB_PAGE_SIZE; ){
+  for(i=pPage->u.hdr->firstCell; i>0 && i<pBt->pageSize; ){
     Cell *pCell = (Cell*)&pPage->u.aDisk[i];
     int j;
-    for(j=i+cellSize(pCell)-1; j>=i; j--) hit[j]++;
+    for(j=i+cellSize(pBt, pCell)-1; j>=i; j--) hit[j]++;
     i = pCell->h.iNext;
   }
-  for(i=pPage->u.hdr.firstFree; i>0 && i<MNDB_PAGE_SIZE; ){
+  for(i=pPage->u.hdr->firstFree; i>0 && i<pBt->pageSize; ){
     FreeBlk *pFBlk = (FreeBlk*)&pPage->u.aDisk[i];
     int j;
     for(j=i+pFBlk->iSize-1; j>=i; j--) hit[j]++;
     i = pFBlk->iNext;
   }
-  for(i=0; i<MNDB_PAGE_SIZE; i++){
+  for(i=0; i<pBt->pageSize; i++){
     if( hit[i]==0 ){
       sprintf(zMsg, "Unused space at byte %d of page %d", i, iPage);
       checkAppendMsg(pCheck, zMsg, 0);
@@ -2409,13 +3598,14 @@ static int checkTreePage(
       break;
     }
   }
+  mndbFree(hit);
 
   /* Check that free space is kept to a minimum
   */
 #if 0
-  if( pParent && pParent->nCell>2 && pPage->nFree>3*MNDB_PAGE_SIZE/4 ){
+  if( pParent && pParent->nCell>2 && pPage->nFree>3*pBt->pageSize/4 ){
     sprintf(zMsg, "free space (%d) greater than max (%d)", pPage->nFree,
-       MNDB_PAGE_SIZE/3);
+       pBt->pageSize/3);
     checkAppendMsg(pCheck, zContext, zMsg);
   }
 #endif
@@ -2423,9 +3613,9 @@ static int checkTreePage(
   /* Update freespace totals.
   */
   pCheck->nTreePage++;
-  pCheck->nByte += USABLE_SPACE - pPage->nFree;
+  pCheck->nByte += pBt->usableSpace - pPage->nFree;
 
-  mndbpager_unref(pPage);
+  releasePage(pPage);
   return depth;
 }
 
@@ -2443,8 +3633,10 @@ char *mndbBtreeSanityCheck(Btree *pBt, int *aRoot, int nRoot){
   int i;
   int nRef;
   SanityCheck sCheck;
+  PagerStats stat;
 
-  nRef = *mndbpager_stats(pBt->pPager);
+  mndbpager_stats(pBt->pPager, &stat, 0);
+  nRef = stat.nRef;
   if( lockBtree(pBt)!=MNDB_OK ){
     return mndbStrDup("Unable to acquire a read lock on the database");
   }
@@ -2479,11 +3671,12 @@ char *mndbBtreeSanityCheck(Btree *pBt, int *aRoot, int nRoot){
   /* Make sure this analysis did not leave any unref() pages
   */
   unlockBtreeIfUnused(pBt);
-  if( nRef != *mndbpager_stats(pBt->pPager) ){
+  mndbpager_stats(pBt->pPager, &stat, 0);
+  if( nRef != stat.nRef ){
     char zBuf[100];
     sprintf(zBuf, 
       "Outstanding page count goes from %d to %d during this analysis",
-      nRef, *mndbpager_stats(pBt->pPager)
+      nRef, stat.nRef
     );
     checkAppendMsg(&sCheck, zBuf, 0);
   }
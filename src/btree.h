@@ -34,7 +34,17 @@ typedef struct BtCursor BtCursor;
 
 int mndbBtreeOpen(const char *zFilename,  int nPg, Btree **ppBtree);
 int mndbBtreeClose(Btree*);
+int mndbBtreeSnapshot(Btree*, Btree **ppSnap);
 //int mndbBtreeSetCacheSize(Btree*, int);
+int mndbBtreeSetPageSize(Btree*, int);
+int mndbBtreeGetPageSize(Btree*);
+int mndbBtreeSetWal(Btree*, int);
+int mndbBtreeCheckpoint(Btree*);
+int mndbBtreeSetBgWriter(Btree*, int);
+int mndbBtreeSetDirect(Btree*, int);
+int mndbBtreeSetCompress(Btree*, int);
+int mndbBtreeSetChunkSize(Btree*, int);
+int mndbBtreeSetWarm(Btree*, int);
 
 // 写操作时调用tans
 int mndbBtreeBeginTrans(Btree*);
@@ -43,6 +53,7 @@ int mndbBtreeCommit(Btree*);
 int mndbBtreeCreateTable(Btree*, int*);
 int mndbBtreeDropTable(Btree*, int);
 int mndbBtreeClearTable(Btree*, int);
+int mndbBtreeIncrVacuum(Btree*, int *aRoot, int nRoot, int nStep, int *pnFree);
 
 int mndbBtreeCursor(Btree*, int iTable, BtCursor **ppCur);
 int mndbBtreeMoveto(BtCursor*, const void *pKey, int nKey, int *pRes);
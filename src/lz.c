@@ -0,0 +1,158 @@
+/*
+** 2016 Feb
+** This file implements a small LZ77 compressor for database pages.  It
+** trades compression ratio for speed, in the manner of LZ4, whose block
+** format it follows: the output is a sequence of
+**
+**     token       high 4 bits: literal count, low 4 bits: match length-4
+**     [count]     more literal count if the high bits were 15
+**     literals    copied to the output as they are
+**     offset      2 bytes, little-endian, how far back the match starts
+**     [length]    more match length if the low bits were 15
+**
+** A count or length of 15 is extended by the bytes that follow it, each
+** adding its value, until one is less than 255.  The last sequence ends
+** after its literals and has no offset.  A match may overlap the bytes
+** it produces, which is how runs are encoded.
+**
+** The compressor looks up the last position that began with the same
+** four bytes in a small hash table and takes the match if it is real.
+** It never looks further, so it runs in one pass over the input.
+*/
+#include "mndbInt.h"
+#include "lz.h"
+
+#define LZ_MIN_MATCH   4             /* Shortest match that is encoded */
+#define LZ_MAX_OFFSET  65535         /* Furthest back a match can start */
+#define LZ_HASH_BITS   12            /* log2 of the hash table size */
+
+#define lzRead32(Z) \
+  ((u32)(Z)[0] | ((u32)(Z)[1]<<8) | ((u32)(Z)[2]<<16) | ((u32)(Z)[3]<<24))
+#define lzHash(V)  ((int)(((V)*2654435761U)>>(32-LZ_HASH_BITS)))
+
+/*
+** Write the extra bytes of a literal count or match length of n, which
+** has already had 15 taken off by the token.  Return the new output
+** offset.
+*/
+static int lzPutCount(unsigned char *zOut, int iOut, int n){
+  while( n>=255 ){
+    zOut[iOut++] = 255;
+    n -= 255;
+  }
+  zOut[iOut++] = (unsigned char)n;
+  return iOut;
+}
+
+/*
+** Append one sequence to the output: nLit literals from zLit and then,
+** unless nMatch is 0, a match of nMatch bytes iOffset back.  Return the
+** new output offset, or -1 if there is not room for it in nOut bytes.
+*/
+static int lzEmit(
+  unsigned char *zOut, int iOut, int nOut,
+  const unsigned char *zLit, int nLit,
+  int iOffset, int nMatch
+){
+  int nNeed = 1 + nLit + nLit/255 + 1;
+  if( nMatch ) nNeed += 2 + (nMatch-LZ_MIN_MATCH)/255 + 1;
+  if( nNeed>nOut-iOut ) return -1;
+  zOut[iOut++] = (unsigned char)((nLit<15 ? nLit : 15)<<4
+         | (nMatch==0 ? 0 : nMatch-LZ_MIN_MATCH<15 ? nMatch-LZ_MIN_MATCH : 15));
+  if( nLit>=15 ) iOut = lzPutCount(zOut, iOut, nLit-15);
+  memcpy(&zOut[iOut], zLit, nLit);
+  iOut += nLit;
+  if( nMatch ){
+    zOut[iOut++] = (unsigned char)(iOffset & 0xff);
+    zOut[iOut++] = (unsigned char)(iOffset>>8);
+    if( nMatch-LZ_MIN_MATCH>=15 ){
+      iOut = lzPutCount(zOut, iOut, nMatch-LZ_MIN_MATCH-15);
+    }
+  }
+  return iOut;
+}
+
+/*
+** Compress the nIn bytes of zIn into zOut, which has room for nOut
+** bytes.  Return the size of the compressed data, or 0 if it does not
+** fit.
+*/
+int mndbLzCompress(
+  const unsigned char *zIn, int nIn,
+  unsigned char *zOut, int nOut
+){
+  int aHash[1<<LZ_HASH_BITS];
+  int iIn = 0;                /* Next input byte to look at */
+  int iLit = 0;               /* First input byte not yet written */
+  int iOut = 0;               /* Bytes written to zOut */
+  int i;
+
+  for(i=0; i<(1<<LZ_HASH_BITS); i++) aHash[i] = -1;
+  while( iIn+LZ_MIN_MATCH<=nIn ){
+    u32 v = lzRead32(&zIn[iIn]);
+    int h = lzHash(v);
+    int iRef = aHash[h];
+    int nMatch;
+    aHash[h] = iIn;
+    if( iRef<0 || iIn-iRef>LZ_MAX_OFFSET || lzRead32(&zIn[iRef])!=v ){
+      iIn++;
+      continue;
+    }
+    for(nMatch=LZ_MIN_MATCH;
+        iIn+nMatch<nIn && zIn[iRef+nMatch]==zIn[iIn+nMatch]; nMatch++){}
+    iOut = lzEmit(zOut, iOut, nOut, &zIn[iLit], iIn-iLit, iIn-iRef, nMatch);
+    if( iOut<0 ) return 0;
+    iIn += nMatch;
+    iLit = iIn;
+  }
+  iOut = lzEmit(zOut, iOut, nOut, &zIn[iLit], nIn-iLit, 0, 0);
+  return iOut<0 ? 0 : iOut;
+}
+
+/*
+** Decompress the nIn bytes of zIn into zOut, which has room for nOut
+** bytes.  Return the number of bytes produced, or -1 if the input is
+** not valid or would produce more than nOut bytes.
+*/
+int mndbLzDecompress(
+  const unsigned char *zIn, int nIn,
+  unsigned char *zOut, int nOut
+){
+  int iIn = 0, iOut = 0;
+  while( iIn<nIn ){
+    int token = zIn[iIn++];
+    int nLit = token>>4;
+    int nMatch, iOffset, c;
+    if( nLit==15 ){
+      do{
+        if( iIn>=nIn ) return -1;
+        c = zIn[iIn++];
+        nLit += c;
+      }while( c==255 );
+    }
+    if( nLit>nIn-iIn || nLit>nOut-iOut ) return -1;
+    memcpy(&zOut[iOut], &zIn[iIn], nLit);
+    iIn += nLit;
+    iOut += nLit;
+    if( iIn==nIn ) break;       /* The last sequence has no match */
+
+    if( nIn-iIn<2 ) return -1;
+    iOffset = zIn[iIn] | (zIn[iIn+1]<<8);
+    iIn += 2;
+    if( iOffset==0 || iOffset>iOut ) return -1;
+    nMatch = token & 15;
+    if( nMatch==15 ){
+      do{
+        if( iIn>=nIn ) return -1;
+        c = zIn[iIn++];
+        nMatch += c;
+      }while( c==255 );
+    }
+    nMatch += LZ_MIN_MATCH;
+    if( nMatch>nOut-iOut ) return -1;
+    for(c=0; c<nMatch; c++, iOut++){
+      zOut[iOut] = zOut[iOut-iOffset];
+    }
+  }
+  return iOut;
+}
@@ -0,0 +1,14 @@
+/*
+** 2016 Feb
+** This header file defines the interface to the page compressor used by
+** the pager for compressed database files.  See lz.c.
+*/
+#ifndef _LZ_H_
+#define _LZ_H_
+
+int mndbLzCompress(const unsigned char *zIn, int nIn,
+                   unsigned char *zOut, int nOut);
+int mndbLzDecompress(const unsigned char *zIn, int nIn,
+                     unsigned char *zOut, int nOut);
+
+#endif /* _LZ_H_ */
@@ -9,6 +9,11 @@
 #include"mndb.h"
 
 
+#if defined(_MSC_VER) || defined(__BORLANDC__)
+  typedef unsigned __int64 u64;
+#else
+  typedef unsigned long long u64;
+#endif
 typedef unsigned int u32;
 typedef unsigned short int u16;
 typedef unsigned char u8;
@@ -16,6 +21,36 @@ typedef signed char i8;
 
 extern int mndb_malloc_failed;
 
+/*
+** Memory allocation and string routines from util.c and random.c.
+*/
+#ifdef MEMORY_DEBUG
+# define mndbMalloc(X)    mndbMalloc_(X,1,__FILE__,__LINE__)
+# define mndbMallocRaw(X) mndbMalloc_(X,0,__FILE__,__LINE__)
+# define mndbFree(X)      mndbFree_(X,__FILE__,__LINE__)
+# define mndbRealloc(X,Y) mndbRealloc_(X,Y,__FILE__,__LINE__)
+# define mndbStrDup(X)    mndbStrDup_(X,__FILE__,__LINE__)
+# define mndbStrNDup(X,Y) mndbStrNDup_(X,Y,__FILE__,__LINE__)
+void *mndbMalloc_(int,int,char*,int);
+void mndbFree_(void*,char*,int);
+void *mndbRealloc_(void*,int,char*,int);
+char *mndbStrDup_(const char*,char*,int);
+char *mndbStrNDup_(const char*, int,char*,int);
+void mndbCheckMemory(void*,int);
+#else
+void *mndbMalloc(int);
+void *mndbMallocRaw(int);
+void mndbFree(void*);
+void *mndbRealloc(void*,int);
+char *mndbStrDup(const char*);
+char *mndbStrNDup(const char*, int);
+#endif
+void mndbSetString(char **, const char *, ...);
+int mndbHashNoCase(const char *, int);
+int mndbStrICmp(const char *, const char *);
+int mndbStrNICmp(const char *, const char *, int);
+void mndbRandomness(int, void*);
+
 
 
 
@@ -17,6 +17,9 @@
 
 //zs  表示原来文件有，被我注释掉了
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+# define _GNU_SOURCE 1   /* For O_DIRECT and statx() */
+#endif
 #include "os.h"          /* Must be first to enable large file support */
 #include "mndbInt.h"
 
@@ -24,6 +27,11 @@
 # include <time.h>
 # include <errno.h>
 # include <unistd.h>
+# include <sys/uio.h>
+# include <sys/mman.h>
+# if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#  define MAP_ANONYMOUS MAP_ANON
+# endif
 # ifndef O_LARGEFILE
 #  define O_LARGEFILE 0
 # endif
@@ -39,6 +47,24 @@
 # endif
 #endif
 
+/*
+** Batched I/O goes through an io_uring on Linux kernels that have one.
+** The ring is driven with raw system calls so that no extra library is
+** needed.  Compile with -DMNDB_OMIT_URING to leave it out.
+*/
+#if OS_UNIX && defined(__linux__) && !defined(MNDB_OMIT_URING)
+# include <sys/syscall.h>
+# if defined(__has_include)
+#  if __has_include(<linux/io_uring.h>) && defined(__NR_io_uring_setup)
+#   include <linux/io_uring.h>
+#   define MNDB_HAVE_URING 1
+#  endif
+# endif
+#endif
+#ifndef MNDB_HAVE_URING
+# define MNDB_HAVE_URING 0
+#endif
+
 
 #if OS_WIN
 # include <winbase.h>
@@ -72,6 +98,7 @@
 */
 #if OS_UNIX && defined(THREADSAFE) && THREADSAFE
 # include <pthread.h>
+# include <sched.h>
 # define MNDB_UNIX_THREADS 1
 #endif
 #if OS_WIN && defined(THREADSAFE) && THREADSAFE
@@ -471,6 +498,9 @@ int mndbOsOpenReadWrite(
 #if OS_UNIX
   int rc;
   id->dirfd = -1;
+  id->pRing = 0;
+  id->noRing = 0;
+  id->directAlign = 0;
   id->fd = open(zFilename, O_RDWR|O_CREAT|O_LARGEFILE|O_BINARY, 0644);
   if( id->fd<0 ){
     id->fd = open(zFilename, O_RDONLY|O_LARGEFILE|O_BINARY);
@@ -597,6 +627,9 @@ int mndbOsOpenExclusive(const char *zFilename, OsFile *id, int delFlag){
     return MNDB_CANTOPEN;
   }
   id->dirfd = -1;
+  id->pRing = 0;
+  id->noRing = 0;
+  id->directAlign = 0;
   id->fd = open(zFilename,
                 O_RDWR|O_CREAT|O_EXCL|O_NOFOLLOW|O_LARGEFILE|O_BINARY, 0600);
   if( id->fd<0 ){
@@ -685,6 +718,9 @@ int mndbOsOpenReadOnly(const char *zFilename, OsFile *id){
 #if OS_UNIX
   int rc;
   id->dirfd = -1;
+  id->pRing = 0;
+  id->noRing = 0;
+  id->directAlign = 0;
   id->fd = open(zFilename, O_RDONLY|O_LARGEFILE|O_BINARY);
   if( id->fd<0 ){
     return MNDB_CANTOPEN;
@@ -885,12 +921,141 @@ int mndbOsTempFileName(char *zBuf){
   return MNDB_OK; 
 }
 
+/*
+** The depth of the io_uring of a file: the most requests that are in
+** flight at once.  Longer batches are submitted in pieces of this many.
+*/
+#ifndef MNDB_URING_DEPTH
+# define MNDB_URING_DEPTH 64
+#endif
+
+#if MNDB_HAVE_URING
+
+/*
+** An io_uring set up for one file and the parts of it mapped into our
+** address space.  See mndbOsReadPages().  Only one batch at a time may
+** use it, and that batch holds the mutex from before its first request
+** is queued until its last completion has been taken.
+*/
+struct OsRing {
+#ifdef MNDB_UNIX_THREADS
+  pthread_mutex_t mutex;        /* Held by the batch using the ring */
+#endif
+  int fd;                       /* From io_uring_setup() */
+  unsigned nEntry;              /* Slots in the submission queue */
+  unsigned *sqHead;             /* Submission queue head, kernel owned */
+  unsigned *sqTail;             /* Submission queue tail, ours */
+  unsigned *sqMask;             /* Mask for submission queue indices */
+  unsigned *sqArray;            /* Slots of the submission queue */
+  struct io_uring_sqe *aSqe;    /* Submission queue entries */
+  unsigned *cqHead;             /* Completion queue head, ours */
+  unsigned *cqTail;             /* Completion queue tail, kernel owned */
+  unsigned *cqMask;             /* Mask for completion queue indices */
+  struct io_uring_cqe *aCqe;    /* Completion queue entries */
+  void *pSqMap;                 /* Mapping of the submission queue */
+  size_t szSqMap;               /* Size of pSqMap */
+  void *pCqMap;                 /* Mapping of the completion queue */
+  size_t szCqMap;               /* Size of pCqMap, 0 if it is pSqMap */
+  size_t szSqe;                 /* Size of the mapping of aSqe */
+};
+
+/*
+** Release an io_uring made by unixRingOpen().
+*/
+static void unixRingClose(struct OsRing *pRing){
+  if( pRing->aSqe ) munmap(pRing->aSqe, pRing->szSqe);
+  if( pRing->pCqMap && pRing->szCqMap ) munmap(pRing->pCqMap, pRing->szCqMap);
+  if( pRing->pSqMap ) munmap(pRing->pSqMap, pRing->szSqMap);
+  close(pRing->fd);
+#ifdef MNDB_UNIX_THREADS
+  pthread_mutex_destroy(&pRing->mutex);
+#endif
+  mndbFree(pRing);
+}
+
+/*
+** Set up an io_uring.  Return NULL if the kernel does not allow it, or
+** does not allow it any more, or if a malloc() fails.
+*/
+static struct OsRing *unixRingOpen(void){
+  struct io_uring_params p;
+  struct OsRing *pRing;
+  char *zSq, *zCq;
+  int fd;
+
+  memset(&p, 0, sizeof(p));
+  fd = syscall(__NR_io_uring_setup, MNDB_URING_DEPTH, &p);
+  if( fd<0 ) return 0;
+  pRing = mndbMalloc( sizeof(*pRing) );
+  if( pRing==0 ){
+    close(fd);
+    return 0;
+  }
+  memset(pRing, 0, sizeof(*pRing));
+#ifdef MNDB_UNIX_THREADS
+  pthread_mutex_init(&pRing->mutex, 0);
+#endif
+  pRing->fd = fd;
+  pRing->nEntry = p.sq_entries;
+  pRing->szSqMap = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+  pRing->szCqMap = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+  if( p.features & IORING_FEAT_SINGLE_MMAP ){
+    if( pRing->szCqMap>pRing->szSqMap ) pRing->szSqMap = pRing->szCqMap;
+    pRing->szCqMap = 0;
+  }
+  pRing->pSqMap = mmap(0, pRing->szSqMap, PROT_READ|PROT_WRITE,
+                       MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  if( pRing->pSqMap==MAP_FAILED ){
+    pRing->pSqMap = 0;
+    goto ring_failed;
+  }
+  if( pRing->szCqMap ){
+    pRing->pCqMap = mmap(0, pRing->szCqMap, PROT_READ|PROT_WRITE,
+                         MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    if( pRing->pCqMap==MAP_FAILED ){
+      pRing->pCqMap = 0;
+      goto ring_failed;
+    }
+  }else{
+    pRing->pCqMap = pRing->pSqMap;
+  }
+  pRing->szSqe = p.sq_entries*sizeof(struct io_uring_sqe);
+  pRing->aSqe = mmap(0, pRing->szSqe, PROT_READ|PROT_WRITE,
+                     MAP_SHARED|MAP_POPULATE, fd, IORING_OFF_SQES);
+  if( pRing->aSqe==MAP_FAILED ){
+    pRing->aSqe = 0;
+    goto ring_failed;
+  }
+  zSq = (char*)pRing->pSqMap;
+  zCq = (char*)pRing->pCqMap;
+  pRing->sqHead = (unsigned*)&zSq[p.sq_off.head];
+  pRing->sqTail = (unsigned*)&zSq[p.sq_off.tail];
+  pRing->sqMask = (unsigned*)&zSq[p.sq_off.ring_mask];
+  pRing->sqArray = (unsigned*)&zSq[p.sq_off.array];
+  pRing->cqHead = (unsigned*)&zCq[p.cq_off.head];
+  pRing->cqTail = (unsigned*)&zCq[p.cq_off.tail];
+  pRing->cqMask = (unsigned*)&zCq[p.cq_off.ring_mask];
+  pRing->aCqe = (struct io_uring_cqe*)&zCq[p.cq_off.cqes];
+  return pRing;
+
+ring_failed:
+  unixRingClose(pRing);
+  return 0;
+}
+#endif /* MNDB_HAVE_URING */
+
 /*
 ** Close a file.
 */
 int mndbOsClose(OsFile *id){
 #if OS_UNIX
   mndbOsUnlock(id);
+#if MNDB_HAVE_URING
+  if( id->pRing ){
+    unixRingClose(id->pRing);
+    id->pRing = 0;
+  }
+#endif
   if( id->dirfd>=0 ) close(id->dirfd);
   id->dirfd = -1;
   mndbOsEnterMutex();
@@ -1055,6 +1220,517 @@ int mndbOsWrite(OsFile *id, const void *pBuf, int amt){
 #endif
 }
 
+/*
+** The following routines are positional versions of mndbOsRead() and
+** mndbOsWrite().  They transfer data at the given offset without using
+** or changing the file offset, so on Unix each call is a single pread()
+** or pwrite() and several threads may read one OsFile concurrently.
+** The return codes are the same as for mndbOsRead() and mndbOsWrite().
+**
+** Windows and the Mac do not have an equivalent, so these fall back
+** to a seek followed by a read or write.
+*/
+#if OS_UNIX
+/*
+** Read from a file opened for direct I/O when the transfer is not
+** aligned.  The aligned range that covers it is read into a buffer of
+** its own and the part asked for is copied out.  The return value is
+** that of pread().
+*/
+static int unixDirectRead(OsFile *id, void *pBuf, int amt, off_t offset){
+  int align = id->directAlign;
+  off_t iStart = offset & ~(off_t)(align-1);
+  int nSkip = (int)(offset - iStart);
+  size_t nByte = (nSkip + amt + align - 1) & ~(size_t)(align-1);
+  void *pAligned;
+  int got;
+  if( posix_memalign(&pAligned, align, nByte)!=0 ) return -1;
+  got = (int)pread(id->fd, pAligned, nByte, iStart);
+  if( got>=0 ){
+    got = got>nSkip ? got-nSkip : 0;
+    if( got>amt ) got = amt;
+    memcpy(pBuf, &((char*)pAligned)[nSkip], got);
+  }
+  free(pAligned);
+  return got;
+}
+#endif
+
+int mndbOsReadAt(OsFile *id, void *pBuf, int amt, off_t offset){
+#if OS_UNIX
+  int got;
+  SEEK(offset/1024 + 1);
+  SimulateIOError(MNDB_IOERR);
+  TIMER_START;
+  if( id->directAlign
+   && (((size_t)pBuf | (size_t)amt | (size_t)offset) & (id->directAlign-1)) ){
+    got = unixDirectRead(id, pBuf, amt, offset);
+  }else{
+    got = pread(id->fd, pBuf, amt, offset);
+  }
+  TIMER_END;
+  TRACE4("PREAD   %-3d %7d %d\n", id->fd, last_page, elapse);
+  SEEK(0);
+  if( got==amt ){
+    return MNDB_OK;
+  }else{
+    return MNDB_IOERR;
+  }
+#else
+  int rc = mndbOsSeek(id, offset);
+  if( rc!=MNDB_OK ) return rc;
+  return mndbOsRead(id, pBuf, amt);
+#endif
+}
+int mndbOsWriteAt(OsFile *id, const void *pBuf, int amt, off_t offset){
+#if OS_UNIX
+  int wrote = 0;
+  SEEK(offset/1024 + 1);
+  SimulateIOError(MNDB_IOERR);
+  TIMER_START;
+  while( amt>0 && (wrote = pwrite(id->fd, pBuf, amt, offset))>0 ){
+    amt -= wrote;
+    offset += wrote;
+    pBuf = &((char*)pBuf)[wrote];
+  }
+  TIMER_END;
+  TRACE4("PWRITE  %-3d %7d %d\n", id->fd, last_page, elapse);
+  SEEK(0);
+  if( amt>0 ){
+    return MNDB_FULL;
+  }
+  return MNDB_OK;
+#else
+  int rc = mndbOsSeek(id, offset);
+  if( rc!=MNDB_OK ) return rc;
+  return mndbOsWrite(id, pBuf, amt);
+#endif
+}
+
+/*
+** Vectored versions of mndbOsReadAt() and mndbOsWriteAt().  nBuf
+** buffers of amt bytes each are transfered to or from consecutive
+** locations in the file beginning at offset.  On Unix the whole
+** transfer is one preadv() or pwritev() call.  nBuf must not be larger
+** than MNDB_MAX_IOV.
+*/
+#if OS_UNIX
+static int unixTransferv(
+  OsFile *id,               /* The file to read or write */
+  void *const*apBuf,        /* The buffers */
+  int nBuf,                 /* Number of buffers */
+  int amt,                  /* Bytes in each buffer */
+  off_t offset,             /* Offset of the first byte in the file */
+  int isWrite               /* True to write, false to read */
+){
+  struct iovec aIov[MNDB_MAX_IOV];
+  int i, iFirst;
+  ssize_t n;
+  assert( nBuf>0 && nBuf<=MNDB_MAX_IOV );
+  for(i=0; i<nBuf; i++){
+    aIov[i].iov_base = apBuf[i];
+    aIov[i].iov_len = amt;
+  }
+  iFirst = 0;
+  while( iFirst<nBuf ){
+    if( isWrite ){
+      n = pwritev(id->fd, &aIov[iFirst], nBuf-iFirst, offset);
+    }else{
+      n = preadv(id->fd, &aIov[iFirst], nBuf-iFirst, offset);
+    }
+    if( n<=0 ) break;
+    offset += n;
+    while( iFirst<nBuf && n>=(ssize_t)aIov[iFirst].iov_len ){
+      n -= aIov[iFirst].iov_len;
+      iFirst++;
+    }
+    if( iFirst<nBuf ){
+      aIov[iFirst].iov_base = &((char*)aIov[iFirst].iov_base)[n];
+      aIov[iFirst].iov_len -= n;
+    }
+  }
+  return iFirst==nBuf;
+}
+#endif
+
+int mndbOsReadvAt(OsFile *id, void *const*apBuf, int nBuf, int amt, off_t offset){
+#if OS_UNIX
+  int ok;
+  SEEK(offset/1024 + 1);
+  SimulateIOError(MNDB_IOERR);
+  TIMER_START;
+  ok = unixTransferv(id, apBuf, nBuf, amt, offset, 0);
+  TIMER_END;
+  TRACE5("PREADV  %-3d %7d %d %d\n", id->fd, last_page, nBuf, elapse);
+  SEEK(0);
+  return ok ? MNDB_OK : MNDB_IOERR;
+#else
+  int i, rc;
+  for(i=0; i<nBuf; i++){
+    rc = mndbOsReadAt(id, apBuf[i], amt, offset + i*(off_t)amt);
+    if( rc!=MNDB_OK ) return rc;
+  }
+  return MNDB_OK;
+#endif
+}
+int mndbOsWritevAt(OsFile *id, void *const*apBuf, int nBuf, int amt, off_t offset){
+#if OS_UNIX
+  int ok;
+  SEEK(offset/1024 + 1);
+  SimulateIOError(MNDB_IOERR);
+  TIMER_START;
+  ok = unixTransferv(id, apBuf, nBuf, amt, offset, 1);
+  TIMER_END;
+  TRACE5("PWRITEV %-3d %7d %d %d\n", id->fd, last_page, nBuf, elapse);
+  SEEK(0);
+  return ok ? MNDB_OK : MNDB_FULL;
+#else
+  int i, rc;
+  for(i=0; i<nBuf; i++){
+    rc = mndbOsWriteAt(id, apBuf[i], amt, offset + i*(off_t)amt);
+    if( rc!=MNDB_OK ) return rc;
+  }
+  return MNDB_OK;
+#endif
+}
+
+/*
+** Batched page I/O.  n buffers of amt bytes each are moved to or from
+** the file offsets in aOffset[].  mndbOsReadExtents() and
+** mndbOsWriteExtents() do the same for buffers of aAmt[] bytes.
+** Buffers whose offsets follow on from one another are merged into one
+** vectored request.  Where the file
+** has an io_uring all of the requests are handed to the kernel at once,
+** so that the device sees them together, and the call returns when the
+** last has finished.  Otherwise they are done one after another.
+**
+** Parts of a read that lie past the end of the file are zero filled.
+** Threads may use a file at the same time, such as the background
+** writer of a pager and a reader of its cache.  Only one batch at a
+** time uses the io_uring, though.  A batch that finds it in use does
+** its requests one after another instead of waiting.
+*/
+#if OS_UNIX
+
+/*
+** One request of a batch: nIov buffers at consecutive offsets.
+*/
+struct unixBatchReq {
+  struct iovec *aIov;       /* The buffers */
+  int nIov;                 /* Number of buffers */
+  ssize_t nByte;            /* Total size of the buffers */
+  off_t offset;             /* Offset of the first byte in the file */
+  ssize_t nDone;            /* Bytes moved by the io_uring, or -errno */
+};
+
+/*
+** Finish a request of a batch with blocking system calls, starting
+** nDone bytes in.  Return true on success.
+*/
+static int unixFinishReq(OsFile *id, struct unixBatchReq *pReq, int isWrite){
+  struct iovec aIov[MNDB_MAX_IOV];
+  off_t offset = pReq->offset + pReq->nDone;
+  ssize_t nSkip = pReq->nDone;
+  ssize_t n;
+  int i, nIov = 0, iFirst = 0;
+  for(i=0; i<pReq->nIov; i++){
+    if( nSkip>=(ssize_t)pReq->aIov[i].iov_len ){
+      nSkip -= pReq->aIov[i].iov_len;
+      continue;
+    }
+    aIov[nIov].iov_base = &((char*)pReq->aIov[i].iov_base)[nSkip];
+    aIov[nIov].iov_len = pReq->aIov[i].iov_len - nSkip;
+    nSkip = 0;
+    nIov++;
+  }
+  while( iFirst<nIov ){
+    if( isWrite ){
+      n = pwritev(id->fd, &aIov[iFirst], nIov-iFirst, offset);
+    }else{
+      n = preadv(id->fd, &aIov[iFirst], nIov-iFirst, offset);
+    }
+    if( n<0 && errno==EINTR ) continue;
+    if( n==0 && !isWrite ){
+      /* End of file.  The rest of the buffers read as zeros. */
+      for(; iFirst<nIov; iFirst++){
+        memset(aIov[iFirst].iov_base, 0, aIov[iFirst].iov_len);
+      }
+      break;
+    }
+    if( n<=0 ) break;
+    offset += n;
+    while( iFirst<nIov && n>=(ssize_t)aIov[iFirst].iov_len ){
+      n -= aIov[iFirst].iov_len;
+      iFirst++;
+    }
+    if( iFirst<nIov ){
+      aIov[iFirst].iov_base = &((char*)aIov[iFirst].iov_base)[n];
+      aIov[iFirst].iov_len -= n;
+    }
+  }
+  return iFirst==nIov;
+}
+
+#if MNDB_HAVE_URING
+/*
+** Take the io_uring of a file for one batch, or return false at once if
+** another thread has it.
+*/
+static int unixRingTryEnter(struct OsRing *pRing){
+#ifdef MNDB_UNIX_THREADS
+  return pthread_mutex_trylock(&pRing->mutex)==0;
+#else
+  return 1;
+#endif
+}
+static void unixRingLeave(struct OsRing *pRing){
+#ifdef MNDB_UNIX_THREADS
+  pthread_mutex_unlock(&pRing->mutex);
+#endif
+}
+
+/*
+** Hand the nReq requests in aReq[] to the io_uring of a file and wait
+** for all of them.  The result of each is left in aReq[].nDone.
+** Return false if the kernel would not take some of them, in which case
+** their nDone is 0 and the caller does them another way.  The caller
+** must have the ring, see unixRingTryEnter(), so every completion that
+** turns up is for one of these requests.
+*/
+static int unixRingSubmit(
+  struct OsRing *pRing,     /* The io_uring */
+  int fd,                   /* The file */
+  struct unixBatchReq *aReq,  /* The requests */
+  int nReq,                 /* Number of requests */
+  int isWrite               /* True to write, false to read */
+){
+  unsigned tail = *pRing->sqTail;
+  unsigned head;
+  int i, rc;
+  int nSubmit = 0;          /* Requests the kernel has taken */
+  int nComplete = 0;        /* Requests the kernel has finished */
+
+  assert( nReq>0 && nReq<=(int)pRing->nEntry );
+  for(i=0; i<nReq; i++){
+    unsigned idx = (tail+i) & *pRing->sqMask;
+    struct io_uring_sqe *pSqe = &pRing->aSqe[idx];
+    memset(pSqe, 0, sizeof(*pSqe));
+    pSqe->opcode = isWrite ? IORING_OP_WRITEV : IORING_OP_READV;
+    pSqe->fd = fd;
+    pSqe->off = aReq[i].offset;
+    pSqe->addr = (unsigned long)aReq[i].aIov;
+    pSqe->len = aReq[i].nIov;
+    pSqe->user_data = i;
+    pRing->sqArray[idx] = idx;
+    aReq[i].nDone = 0;
+  }
+  __atomic_store_n(pRing->sqTail, tail+nReq, __ATOMIC_RELEASE);
+
+  while( nComplete<nSubmit || nSubmit<nReq ){
+    rc = syscall(__NR_io_uring_enter, pRing->fd, nReq-nSubmit,
+                 nComplete<nSubmit ? 1 : 0, IORING_ENTER_GETEVENTS, 0, 0);
+    if( rc<0 ){
+      if( nComplete==nSubmit && errno!=EINTR ){
+        /* Nothing is in flight and the kernel will not take the rest.
+        ** Take them back out of the queue. */
+        __atomic_store_n(pRing->sqTail, tail+nSubmit, __ATOMIC_RELEASE);
+        return 0;
+      }
+      rc = 0;
+    }
+    nSubmit += rc;
+    head = *pRing->cqHead;
+    while( head!=__atomic_load_n(pRing->cqTail, __ATOMIC_ACQUIRE) ){
+      struct io_uring_cqe *pCqe = &pRing->aCqe[head & *pRing->cqMask];
+      assert( pCqe->user_data<(unsigned)nReq );
+      if( pCqe->res==-EAGAIN || pCqe->res==-EINTR ){
+        aReq[pCqe->user_data].nDone = 0;
+      }else{
+        aReq[pCqe->user_data].nDone = pCqe->res;
+      }
+      head++;
+      nComplete++;
+    }
+    __atomic_store_n(pRing->cqHead, head, __ATOMIC_RELEASE);
+  }
+  return 1;
+}
+#endif /* MNDB_HAVE_URING */
+
+static int unixTransferPages(
+  OsFile *id,               /* The file to read or write */
+  int n,                    /* Number of buffers */
+  void *const*apBuf,        /* The buffers */
+  const off_t *aOffset,     /* Where each buffer goes in the file */
+  const int *aAmt,          /* Bytes in each buffer, or NULL */
+  int amt,                  /* Bytes in each buffer if aAmt is NULL */
+  int isWrite               /* True to write, false to read */
+){
+  struct iovec aIov[MNDB_URING_DEPTH*4];
+  struct unixBatchReq aReq[MNDB_URING_DEPTH];
+  int mxIov = sizeof(aIov)/sizeof(aIov[0]);
+  int mxReq = MNDB_URING_DEPTH;
+  int i = 0;
+  int iReq, nIov, nReq;
+  int useRing = 0;
+#if MNDB_HAVE_URING
+  struct OsRing *pRing = 0;
+
+  if( mndbOsAsyncIO(id) ){
+    pRing = mndbOsAtomicLoad(&id->pRing);
+    useRing = 1;
+    if( mxReq>(int)pRing->nEntry ) mxReq = pRing->nEntry;
+  }
+#endif
+  while( i<n ){
+    nIov = nReq = 0;
+    while( i<n && nIov<mxIov && nReq<mxReq ){
+      aReq[nReq].aIov = &aIov[nIov];
+      aReq[nReq].nIov = 0;
+      aReq[nReq].nByte = 0;
+      aReq[nReq].offset = aOffset[i];
+      aReq[nReq].nDone = 0;
+      do{
+        aIov[nIov].iov_base = apBuf[i];
+        aIov[nIov].iov_len = aAmt ? aAmt[i] : amt;
+        aReq[nReq].nByte += aIov[nIov].iov_len;
+        nIov++;
+        aReq[nReq].nIov++;
+        i++;
+      }while( i<n && nIov<mxIov && aReq[nReq].nIov<MNDB_MAX_IOV
+               && aOffset[i]==aReq[nReq].offset+aReq[nReq].nByte );
+      nReq++;
+    }
+#if MNDB_HAVE_URING
+    /* A lone request gains nothing from the io_uring */
+    if( useRing && nReq>1 && unixRingTryEnter(pRing) ){
+      if( unixRingSubmit(pRing, id->fd, aReq, nReq, isWrite)==0 ){
+        useRing = 0;
+      }
+      unixRingLeave(pRing);
+    }
+#endif
+    for(iReq=0; iReq<nReq; iReq++){
+      struct unixBatchReq *pReq = &aReq[iReq];
+      if( pReq->nDone<0 ) return 0;
+      if( pReq->nDone==pReq->nByte ) continue;
+      if( !unixFinishReq(id, pReq, isWrite) ) return 0;
+    }
+  }
+  return 1;
+}
+#endif /* OS_UNIX */
+
+static int osTransferBatch(
+  OsFile *id,               /* The file to read or write */
+  int n,                    /* Number of buffers */
+  void *const*apBuf,        /* The buffers */
+  const off_t *aOffset,     /* Where each buffer goes in the file */
+  const int *aAmt,          /* Bytes in each buffer, or NULL */
+  int amt,                  /* Bytes in each buffer if aAmt is NULL */
+  int isWrite               /* True to write, false to read */
+){
+#if OS_UNIX
+  int ok;
+  SimulateIOError(MNDB_IOERR);
+  TIMER_START;
+  ok = unixTransferPages(id, n, apBuf, aOffset, aAmt, amt, isWrite);
+  TIMER_END;
+  TRACE5("%s %-3d %d %d\n", isWrite ? "WBATCH " : "RBATCH ", id->fd, n, elapse);
+  if( ok ) return MNDB_OK;
+  return isWrite ? MNDB_FULL : MNDB_IOERR;
+#else
+  int i, rc;
+  for(i=0; i<n; i++){
+    if( isWrite ){
+      rc = mndbOsWriteAt(id, apBuf[i], aAmt ? aAmt[i] : amt, aOffset[i]);
+    }else{
+      rc = mndbOsReadAt(id, apBuf[i], aAmt ? aAmt[i] : amt, aOffset[i]);
+    }
+    if( rc!=MNDB_OK ) return rc;
+  }
+  return MNDB_OK;
+#endif
+}
+
+int mndbOsReadPages(
+  OsFile *id,
+  int n,
+  void *const*apBuf,
+  const off_t *aOffset,
+  int amt
+){
+  return osTransferBatch(id, n, apBuf, aOffset, 0, amt, 0);
+}
+int mndbOsWritePages(
+  OsFile *id,
+  int n,
+  void *const*apBuf,
+  const off_t *aOffset,
+  int amt
+){
+  return osTransferBatch(id, n, apBuf, aOffset, 0, amt, 1);
+}
+int mndbOsReadExtents(
+  OsFile *id,
+  int n,
+  void *const*apBuf,
+  const off_t *aOffset,
+  const int *aAmt
+){
+  return osTransferBatch(id, n, apBuf, aOffset, aAmt, 0, 0);
+}
+int mndbOsWriteExtents(
+  OsFile *id,
+  int n,
+  void *const*apBuf,
+  const off_t *aOffset,
+  const int *aAmt
+){
+  return osTransferBatch(id, n, apBuf, aOffset, aAmt, 0, 1);
+}
+
+/*
+** Return true if batches passed to mndbOsReadPages() and
+** mndbOsWritePages() for this file are done with many requests in
+** flight at once, and false if they are done one request at a time.
+** The io_uring is set up here the first time it is asked for, under
+** mndbOsEnterMutex() since threads sharing the file may ask together.
+*/
+int mndbOsAsyncIO(OsFile *id){
+#if MNDB_HAVE_URING
+  if( mndbOsAtomicLoad(&id->pRing)==0 && !mndbOsAtomicLoad(&id->noRing) ){
+    mndbOsEnterMutex();
+    if( id->pRing==0 && !id->noRing ){
+      struct OsRing *pRing = unixRingOpen();
+      if( pRing ){
+        mndbOsAtomicStore(&id->pRing, pRing);
+      }else{
+        mndbOsAtomicStore(&id->noRing, 1);
+      }
+    }
+    mndbOsLeaveMutex();
+  }
+  return mndbOsAtomicLoad(&id->pRing)!=0;
+#else
+  return 0;
+#endif
+}
+
+/*
+** Tell the operating system that nByte bytes starting at offset will
+** be read soon, so that it can start bringing them into its own cache
+** in the background.  This is only a hint.  It cannot fail and it does
+** nothing where there is no way to pass it on.
+*/
+void mndbOsReadAhead(OsFile *id, off_t offset, off_t nByte){
+#if OS_UNIX && defined(POSIX_FADV_WILLNEED)
+  TRACE4("AHEAD   %-3d %7d %d\n", id->fd, (int)(offset/1024 + 1),
+         (int)(nByte/1024));
+  posix_fadvise(id->fd, offset, nByte, POSIX_FADV_WILLNEED);
+#endif
+}
+
 /*
 ** Move the read/write pointer in a file.
 */
@@ -1177,6 +1853,45 @@ int mndbOsTruncate(OsFile *id, off_t nByte){
 #endif
 }
 
+/*
+** Tell the file system that the nByte bytes at offset in a file are no
+** longer needed.  They read as zeros afterwards and, where the file
+** system can do it, the whole blocks among them stop taking up space.
+** The size of the file does not change.  On systems that cannot punch
+** holes this does nothing.
+*/
+int mndbOsPunchHole(OsFile *id, off_t offset, off_t nByte){
+#if OS_UNIX && defined(FALLOC_FL_PUNCH_HOLE)
+  SimulateIOError(MNDB_IOERR);
+  TRACE4("PUNCH   %-3d %lld %lld\n", id->fd, (long long)offset, (long long)nByte);
+  if( nByte>0 && fallocate(id->fd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE,
+                           offset, nByte)!=0 && errno!=EOPNOTSUPP ){
+    return MNDB_IOERR;
+  }
+#endif
+  return MNDB_OK;
+}
+
+/*
+** Have the file system set aside blocks for the nByte bytes at offset
+** in a file, so that writing there later neither has to allocate them
+** nor fails for want of space.  The size of the file does not change:
+** the bytes past its end are only reserved and do not read as part of
+** it until they are written.  On systems that cannot do this it does
+** nothing.  MNDB_FULL is returned if the disk has no room.
+*/
+int mndbOsAllocate(OsFile *id, off_t offset, off_t nByte){
+#if OS_UNIX && defined(FALLOC_FL_KEEP_SIZE)
+  SimulateIOError(MNDB_IOERR);
+  TRACE4("ALLOC   %-3d %lld %lld\n", id->fd, (long long)offset, (long long)nByte);
+  if( nByte>0 && fallocate(id->fd, FALLOC_FL_KEEP_SIZE, offset, nByte)!=0 ){
+    if( errno==ENOSPC ) return MNDB_FULL;
+    if( errno!=EOPNOTSUPP && errno!=ENOSYS ) return MNDB_IOERR;
+  }
+#endif
+  return MNDB_OK;
+}
+
 /*
 ** Determine the current size of a file in bytes
 */
@@ -1680,6 +2395,12 @@ int mndbOsSleep(int ms){
 static int inMutex = 0;
 #ifdef MNDB_UNIX_THREADS
   static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+  static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+#endif
+#ifdef MNDB_UNIX_THREADS
+struct OsThread {
+  pthread_t tid;
+};
 #endif
 #ifdef MNDB_W32_THREADS
   static CRITICAL_SECTION cs;
@@ -1743,6 +2464,170 @@ void mndbOsLeaveMutex(){
 #endif
 }
 
+/*
+** Release the mutex until another thread calls mndbOsBroadcast(), then
+** take it again.  The caller must hold the mutex.  Wakeups can happen
+** without a broadcast, so the caller has to check what it was waiting
+** for and wait again if need be.  Where there is no condition variable
+** to wait on, this just sleeps for a moment.
+*/
+void mndbOsWait(){
+#ifdef MNDB_UNIX_THREADS
+  assert( inMutex );
+  inMutex = 0;
+  pthread_cond_wait(&cond, &mutex);
+  inMutex = 1;
+#else
+  mndbOsLeaveMutex();
+  mndbOsSleep(1);
+  mndbOsEnterMutex();
+#endif
+}
+
+/*
+** Wake up every thread waiting in mndbOsWait().
+*/
+void mndbOsBroadcast(){
+#ifdef MNDB_UNIX_THREADS
+  pthread_cond_broadcast(&cond);
+#endif
+}
+
+/*
+** Give the processor to another thread that is ready to run, if there
+** is one.  For a thread that is spinning on something another thread
+** will soon let go of.
+*/
+void mndbOsYield(){
+#ifdef MNDB_UNIX_THREADS
+  sched_yield();
+#endif
+#ifdef MNDB_W32_THREADS
+  Sleep(0);
+#endif
+#ifdef MNDB_MACOS_MULTITASKING
+  MPYield();
+#endif
+}
+
+/*
+** Mutexes other than the one of mndbOsEnterMutex().  Only Posix threads
+** get a real one.  Elsewhere a build with THREADSAFE shares the single
+** mutex, which cannot be entered twice, so nothing is done there either
+** and threads cannot share a structure that needs one.
+*/
+struct OsMutex {
+#ifdef MNDB_UNIX_THREADS
+  pthread_mutex_t mutex;
+#else
+  int notUsed;
+#endif
+};
+
+/*
+** Allocate a new mutex.  Return NULL if there is no memory.
+*/
+OsMutex *mndbOsMutexAlloc(void){
+  OsMutex *p = mndbMalloc( sizeof(*p) );
+#ifdef MNDB_UNIX_THREADS
+  if( p ){
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&p->mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+  }
+#endif
+  return p;
+}
+void mndbOsMutexFree(OsMutex *p){
+  if( p==0 ) return;
+#ifdef MNDB_UNIX_THREADS
+  pthread_mutex_destroy(&p->mutex);
+#endif
+  mndbFree(p);
+}
+void mndbOsMutexEnter(OsMutex *p){
+#ifdef MNDB_UNIX_THREADS
+  pthread_mutex_lock(&p->mutex);
+#endif
+}
+void mndbOsMutexLeave(OsMutex *p){
+#ifdef MNDB_UNIX_THREADS
+  pthread_mutex_unlock(&p->mutex);
+#endif
+}
+
+struct OsCond {
+#ifdef MNDB_UNIX_THREADS
+  pthread_cond_t cond;
+#else
+  int notUsed;
+#endif
+};
+
+/*
+** Allocate a new condition variable.  Return NULL if there is no memory.
+*/
+OsCond *mndbOsCondAlloc(void){
+  OsCond *p = mndbMalloc( sizeof(*p) );
+#ifdef MNDB_UNIX_THREADS
+  if( p ) pthread_cond_init(&p->cond, 0);
+#endif
+  return p;
+}
+void mndbOsCondFree(OsCond *p){
+  if( p==0 ) return;
+#ifdef MNDB_UNIX_THREADS
+  pthread_cond_destroy(&p->cond);
+#endif
+  mndbFree(p);
+}
+void mndbOsCondWait(OsCond *p, OsMutex *pMutex){
+#ifdef MNDB_UNIX_THREADS
+  pthread_cond_wait(&p->cond, &pMutex->mutex);
+#else
+  mndbOsMutexLeave(pMutex);
+  mndbOsSleep(1);
+  mndbOsMutexEnter(pMutex);
+#endif
+}
+void mndbOsCondBroadcast(OsCond *p){
+#ifdef MNDB_UNIX_THREADS
+  pthread_cond_broadcast(&p->cond);
+#endif
+}
+
+/*
+** Start a new thread running xTask(pArg).  Return MNDB_ERROR if this
+** build has no thread support.
+*/
+int mndbOsThreadCreate(OsThread **ppThread, void *(*xTask)(void*), void *pArg){
+#ifdef MNDB_UNIX_THREADS
+  OsThread *p = mndbMalloc( sizeof(*p) );
+  if( p==0 ) return MNDB_NOMEM;
+  if( pthread_create(&p->tid, 0, xTask, pArg)!=0 ){
+    mndbFree(p);
+    return MNDB_ERROR;
+  }
+  *ppThread = p;
+  return MNDB_OK;
+#else
+  *ppThread = 0;
+  return MNDB_ERROR;
+#endif
+}
+
+/*
+** Wait for a thread started by mndbOsThreadCreate() to return.
+*/
+void mndbOsThreadJoin(OsThread *pThread){
+#ifdef MNDB_UNIX_THREADS
+  pthread_join(pThread->tid, 0);
+  mndbFree(pThread);
+#endif
+}
+
 /*
 ** Turn a relative pathname into a full pathname.  Return a pointer
 ** to the full pathname stored in space obtained from mndbMalloc().
@@ -1789,6 +2674,133 @@ char *mndbOsFullPathname(const char *zRelative){
 #endif
 }
 
+/*
+** Allocate nByte bytes of memory for the page cache to carve frames
+** from.  The memory comes straight from the operating system rather than
+** from mndbMalloc(), so on Unix it is page aligned and carries none of
+** the bookkeeping of the debugging allocator.  If useHuge is true and
+** nByte is a multiple of MNDB_HUGE_PAGE_SIZE, try to back the memory
+** with huge pages, falling back to ordinary pages.
+**
+** Return NULL if the memory is not available.
+*/
+void *mndbOsAllocArena(int nByte, int useHuge){
+#if OS_UNIX
+  void *p = MAP_FAILED;
+#ifdef MAP_HUGETLB
+  if( useHuge && nByte%MNDB_HUGE_PAGE_SIZE==0 ){
+    p = mmap(0, nByte, PROT_READ|PROT_WRITE,
+             MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+  }
+#endif
+  if( p==MAP_FAILED ){
+    p = mmap(0, nByte, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  }
+  if( p==MAP_FAILED ){
+    return 0;
+  }
+  return p;
+#else
+  return malloc(nByte);
+#endif
+}
+
+/*
+** Give back memory obtained from mndbOsAllocArena().
+*/
+void mndbOsFreeArena(void *p, int nByte){
+#if OS_UNIX
+  munmap(p, nByte);
+#else
+  free(p);
+#endif
+}
+
+/*
+** Map the first nByte bytes of a file into memory for reading.  The
+** mapping is shared, so it shows whatever is written to the file
+** through the same or any other file descriptor, and it uses the pages
+** the operating system already caches for the file rather than copies
+** of them.  nByte must not exceed the size of the file.
+**
+** *ppMap is set to zero and MNDB_IOERR returned if the file cannot be
+** mapped, or always on systems without mmap().
+*/
+int mndbOsMapFile(OsFile *id, off_t nByte, void **ppMap){
+#if OS_UNIX
+  void *p;
+  *ppMap = 0;
+  if( nByte<=0 || (off_t)(size_t)nByte!=nByte ) return MNDB_IOERR;
+  p = mmap(0, (size_t)nByte, PROT_READ, MAP_SHARED, id->fd, 0);
+  if( p==MAP_FAILED ) return MNDB_IOERR;
+  *ppMap = p;
+  return MNDB_OK;
+#else
+  *ppMap = 0;
+  return MNDB_IOERR;
+#endif
+}
+void mndbOsUnmapFile(void *pMap, off_t nByte){
+#if OS_UNIX
+  if( pMap ) munmap(pMap, (size_t)nByte);
+#endif
+}
+
+/*
+** Turn direct I/O on or off for a file.  With direct I/O, reads and
+** writes bypass the cache the operating system keeps of the file, so
+** its pages are not held in memory a second time by the kernel.  The
+** file offset, length and memory address of every transfer must then
+** be a multiple of an alignment that depends on the file system and
+** device.  It is written to *pAlign, or 0 when direct I/O is turned
+** off.  mndbOsReadAt() still accepts any transfer and reads it through
+** an aligned buffer, but all other reads and writes must be aligned.
+**
+** This is done on a file that is already open, rather than when it is
+** opened, so that it does not need closing and reopening, which would
+** drop its locks.
+**
+** MNDB_ERROR is returned if direct I/O is not available.
+*/
+int mndbOsSetDirect(OsFile *id, int useDirect, int *pAlign){
+#if OS_UNIX && defined(O_DIRECT)
+  int flags = fcntl(id->fd, F_GETFL);
+  int align = 512;
+  *pAlign = 0;
+  if( flags<0 ) return MNDB_ERROR;
+  flags = useDirect ? (flags | O_DIRECT) : (flags & ~O_DIRECT);
+  if( fcntl(id->fd, F_SETFL, flags)!=0 ){
+    return MNDB_ERROR;
+  }
+  if( !useDirect ){
+    id->directAlign = 0;
+    return MNDB_OK;
+  }
+#if defined(STATX_DIOALIGN)
+  {
+    struct statx sx;
+    if( statx(id->fd, "", AT_EMPTY_PATH, STATX_DIOALIGN, &sx)==0
+     && (sx.stx_mask & STATX_DIOALIGN)!=0 ){
+      if( sx.stx_dio_offset_align==0 ){
+        /* The file system does not do direct I/O for this file */
+        fcntl(id->fd, F_SETFL, flags & ~O_DIRECT);
+        return MNDB_ERROR;
+      }
+      align = sx.stx_dio_offset_align;
+      if( (int)sx.stx_dio_mem_align>align ) align = sx.stx_dio_mem_align;
+    }
+  }
+#endif
+  TRACE3("DIRECT  %-3d %d\n", id->fd, align);
+  id->directAlign = align;
+  *pAlign = align;
+  return MNDB_OK;
+#else
+  *pAlign = 0;
+  return useDirect ? MNDB_ERROR : MNDB_OK;
+#endif
+}
+
 /*
 ** The following variable, if set to a non-zero value, becomes the result
 ** returned from mndbOsCurrentTime().  This is used for testing.
@@ -1825,3 +2837,29 @@ int mndbOsCurrentTime(double *prNow){
 #endif
   return 0;
 }
+
+/*
+** Write into *prNow the number of seconds since some fixed point in the
+** past.  Unlike mndbOsCurrentTime(), this clock never goes backwards
+** and resolves microseconds, so it is what I/O latencies are measured
+** with.  Return 0.
+*/
+int mndbOsClock(double *prNow){
+#if OS_UNIX
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  *prNow = ts.tv_sec + ts.tv_nsec/1000000000.0;
+#endif
+#if OS_WIN
+  LARGE_INTEGER n, f;
+  QueryPerformanceCounter(&n);
+  QueryPerformanceFrequency(&f);
+  *prNow = (double)n.QuadPart/(double)f.QuadPart;
+#endif
+#if OS_MAC
+  UnsignedWide t;
+  Microseconds(&t);
+  *prNow = (t.hi*4294967296.0 + t.lo)/1000000.0;
+#endif
+  return 0;
+}
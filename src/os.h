@@ -95,6 +95,22 @@
 # endif
 #endif
 
+/*
+** The largest number of buffers that may be passed to a single
+** vectored I/O call such as mndbOsWritevAt().
+*/
+#ifndef MNDB_MAX_IOV
+# define MNDB_MAX_IOV 64
+#endif
+
+/*
+** The size of a huge page.  Memory from mndbOsAllocArena() can only be
+** backed by huge pages if its size is a multiple of this.
+*/
+#ifndef MNDB_HUGE_PAGE_SIZE
+# define MNDB_HUGE_PAGE_SIZE (2*1024*1024)
+#endif
+
 /*
 ** A handle for an open file is stored in an OsFile object.
 */
@@ -110,6 +126,9 @@
     int fd;                   /* The file descriptor */
     int locked;               /* True if this instance holds the lock */
     int dirfd;                /* File descriptor for the directory */
+    struct OsRing *pRing;     /* io_uring for batched I/O, or NULL */
+    int noRing;               /* True if no io_uring could be set up */
+    int directAlign;          /* Alignment O_DIRECT needs, 0 if not in use */
   };
 # define MNDB_TEMPNAME_SIZE 200
 # if defined(HAVE_USLEEP) && HAVE_USLEEP
@@ -161,6 +180,52 @@
 # define MNDB_MIN_SLEEP_MS 17
 #endif
 
+/*
+** A thread started by mndbOsThreadCreate().  Only builds with THREADSAFE
+** defined can start threads.
+*/
+typedef struct OsThread OsThread;
+
+/*
+** A mutex of its own, for a structure that threads share, as opposed to
+** the single mutex of mndbOsEnterMutex().  A thread may enter a mutex it
+** already holds, and must leave it as many times.  Without THREADSAFE
+** these do nothing.
+*/
+typedef struct OsMutex OsMutex;
+
+/*
+** A condition variable to go with an OsMutex.  mndbOsCondWait() must be
+** called with the mutex entered exactly once.  It leaves the mutex until
+** mndbOsCondBroadcast() is called on the same condition, then enters it
+** again.  Wakeups can happen without a broadcast.  Where there is no
+** condition variable to wait on, a wait just sleeps for a moment.
+*/
+typedef struct OsCond OsCond;
+
+/*
+** Atomic operations on integers of any size, for counters that threads
+** change without holding a mutex.  mndbOsAtomicAdd() returns the new
+** value.  mndbOsAtomicCas() stores N in *P and returns true if *P
+** equals *pOld, and otherwise copies *P into *pOld and returns false.
+** Compilers without the builtins get plain operations, which are only
+** good enough for builds without THREADSAFE.
+*/
+#if defined(__GNUC__) || defined(__clang__)
+# define mndbOsAtomicLoad(P)  __atomic_load_n((P), __ATOMIC_ACQUIRE)
+# define mndbOsAtomicStore(P,N) __atomic_store_n((P), (N), __ATOMIC_RELEASE)
+# define mndbOsAtomicAdd(P,N) __atomic_add_fetch((P), (N), __ATOMIC_ACQ_REL)
+# define mndbOsAtomicCas(P,pOld,N) \
+    __atomic_compare_exchange_n((P), (pOld), (N), 0, \
+                                __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+#else
+# define mndbOsAtomicLoad(P)  (*(P))
+# define mndbOsAtomicStore(P,N) (*(P) = (N))
+# define mndbOsAtomicAdd(P,N) (*(P) += (N))
+# define mndbOsAtomicCas(P,pOld,N) \
+    (*(P)==*(pOld) ? (*(P) = (N), 1) : (*(pOld) = *(P), 0))
+#endif
+
 int mndbOsDelete(const char*);
 int mndbOsFileExists(const char*);
 int mndbOsFileRename(const char*, const char*);
@@ -172,9 +237,21 @@ int mndbOsTempFileName(char*);
 int mndbOsClose(OsFile*);
 int mndbOsRead(OsFile*, void*, int amt);
 int mndbOsWrite(OsFile*, const void*, int amt);
+int mndbOsReadAt(OsFile*, void*, int amt, off_t offset);
+int mndbOsWriteAt(OsFile*, const void*, int amt, off_t offset);
+int mndbOsReadvAt(OsFile*, void *const*apBuf, int nBuf, int amt, off_t offset);
+int mndbOsWritevAt(OsFile*, void *const*apBuf, int nBuf, int amt, off_t offset);
+int mndbOsReadPages(OsFile*, int n, void *const*apBuf, const off_t *aOffset, int amt);
+int mndbOsWritePages(OsFile*, int n, void *const*apBuf, const off_t *aOffset, int amt);
+int mndbOsReadExtents(OsFile*, int n, void *const*apBuf, const off_t *aOffset, const int *aAmt);
+int mndbOsWriteExtents(OsFile*, int n, void *const*apBuf, const off_t *aOffset, const int *aAmt);
+int mndbOsAsyncIO(OsFile*);
+void mndbOsReadAhead(OsFile*, off_t offset, off_t nByte);
 int mndbOsSeek(OsFile*, off_t offset);
 int mndbOsSync(OsFile*);
 int mndbOsTruncate(OsFile*, off_t size);
+int mndbOsPunchHole(OsFile*, off_t offset, off_t nByte);
+int mndbOsAllocate(OsFile*, off_t offset, off_t nByte);
 int mndbOsFileSize(OsFile*, off_t *pSize);
 int mndbOsReadLock(OsFile*);
 int mndbOsWriteLock(OsFile*);
@@ -182,9 +259,28 @@ int mndbOsUnlock(OsFile*);
 int mndbOsRandomSeed(char*);
 int mndbOsSleep(int ms);
 int mndbOsCurrentTime(double*);
+int mndbOsClock(double*);
 void mndbOsEnterMutex(void);
 void mndbOsLeaveMutex(void);
+void mndbOsWait(void);
+void mndbOsBroadcast(void);
+void mndbOsYield(void);
+OsMutex *mndbOsMutexAlloc(void);
+void mndbOsMutexFree(OsMutex*);
+void mndbOsMutexEnter(OsMutex*);
+void mndbOsMutexLeave(OsMutex*);
+OsCond *mndbOsCondAlloc(void);
+void mndbOsCondFree(OsCond*);
+void mndbOsCondWait(OsCond*, OsMutex*);
+void mndbOsCondBroadcast(OsCond*);
+int mndbOsThreadCreate(OsThread**, void *(*)(void*), void*);
+void mndbOsThreadJoin(OsThread*);
 char *mndbOsFullPathname(const char*);
+void *mndbOsAllocArena(int nByte, int useHuge);
+void mndbOsFreeArena(void*, int nByte);
+int mndbOsMapFile(OsFile*, off_t nByte, void **ppMap);
+void mndbOsUnmapFile(void*, off_t nByte);
+int mndbOsSetDirect(OsFile*, int useDirect, int *pAlign);
 
 
 
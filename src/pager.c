@@ -9,6 +9,8 @@
 #include "os.h"
 #include "mndbInt.h"
 #include "pager.h"
+#include "wal.h"
+#include "lz.h"
 #include "assert.h"
 #include "string.h"
   
@@ -23,14 +25,20 @@ typedef struct PgHdr PgHdr;
 struct PgHdr{
   Pager *pPager;
   Pgno pgno;
-  PgHdr *pNextHash, *pPrevHash;//hash bucket里面的所有pageHdr
   PgHdr *pNextAll, *pPrevAll;//和pager的pAll相关，是所有page的列表中的节点，且此列表不是循环列表，从表头插入即pAll处插入
   int nRef;
   PgHdr *pNextFree, *pPrevFree;//和pager的pFirst、pLast一样与free list有关，该list非循环列表，
   u8 dirty;
-  PgHdr *pDirty; //?Tudo: if it is point to the next dirty page or just the head of the dirty page list.(maybe the head,which has smallest pgno)
-  /*MNDB_PAGE_SIZE bytes of page data follow this header*/
-  /*Pager.nExtra bytes of local data follow the page data, specified by the parama nEx passed by the open function*/
+  u8 inA1;                         /* On the A1in queue of the 2Q policy */
+  u8 eClass;                       /* MNDB_PAGE_LEAF, MNDB_PAGE_ROOT, ... */
+  u8 iHold;                        /* 1 + index of the aHold[] list it is on */
+  u8 busy;                         /* Being loaded, released or recycled */
+  int iRead;                       /* Pager.nRead when the page was read in */
+  PgHdr *pNextDirty, *pPrevDirty;  /* List of all dirty pages, see Pager.pDirty */
+  PgHdr *pDirty;                   /* Next page in a list handed to pager_write_pagelist() */
+  PagerSnap *pSnap;                /* Snapshot a private copy belongs to */
+  /*Pager.pageSize bytes of page data follow this header*/
+  /*Pager.nExtra bytes of local data come right before this header, specified by the parama nEx passed by the open function*/
 };
 /*
 ** Convert a pointer to a PgHdr into a pointer to its data
@@ -38,17 +46,234 @@ struct PgHdr{
 */
 #define PGHDR_TO_DATA(P) ((void*)(&(P)[1]))
 #define DATA_TO_PGHDR(D) (&((PgHdr*)(D))[-1])
-#define PGHDR_TO_EXTRA(P) ((void*)&((char*)(&(P)[1]))[MNDB_PAGE_SIZE])
+#define PGHDR_TO_EXTRA(P) ((void*)&((char*)(P))[-(P)->pPager->szExtra])
 
 /*
-** How big to make the hash table used for locating in-memory pages by page number
+** In-memory pages ("frames") are not obtained from mndbMalloc() one at a
+** time.  They are carved out of large arenas obtained from the operating
+** system with mndbOsAllocArena().  Each frame is laid out like this:
+**
+**      | padding | extra | PgHdr | page data |
+**
+** The extra space goes in front of the header so that the page data can
+** start on a Pager.szAlign byte boundary.  That is MNDB_FRAME_ALIGN, or
+** more if direct I/O on the file needs it (see mndbpager_set_direct()).
+** Frames are never freed one by one.  pager_reset() just marks every
+** arena as unused and the frames are handed out again in place.  The
+** arenas are given back when the pager is closed.
+*/
+#ifndef MNDB_FRAME_ALIGN
+# define MNDB_FRAME_ALIGN 512
+#endif
+#ifndef MNDB_ARENA_SIZE
+# define MNDB_ARENA_SIZE MNDB_HUGE_PAGE_SIZE
+#endif
+#define ROUND_UP(X,N)  (((X)+(N)-1)&~((N)-1))
+
+typedef struct PgArena PgArena;
+struct PgArena {
+  PgArena *pNext;             /* Next arena belonging to the same pager */
+  int nByte;                  /* Size of the arena, this header included */
+  int nFrame;                 /* Number of frames in the arena */
+  int nUsed;                  /* Frames handed out since the last reset */
+  char *aFrame;               /* Start of the first frame */
+};
+
+/*
+** Free root and interior pages are not put on the free lists of the
+** cache policy but on lists of their own, one per class, and only
+** recycled once no other page is free.  Each shard of the cache (see
+** PgShard) has lists of its own, which hold no more than its share of
+** the budget of the class.  When one would, the page that has been on
+** it longest goes to the end of the ordinary free list.  Interior pages
+** are in aHold[0] and roots in aHold[1], in the order they are given
+** up when nothing else is free.  See page_link_free().
+*/
+#define PAGER_N_HOLD 2
+#ifndef MNDB_HOLD_INTERIOR
+# define MNDB_HOLD_INTERIOR 25   /* Default budget of interior pages, in % */
+#endif
+#ifndef MNDB_HOLD_ROOT
+# define MNDB_HOLD_ROOT 10       /* Default budget of root pages, in % */
+#endif
+
+typedef struct PgHold PgHold;
+struct PgHold {
+  PgHdr *pFirst, *pLast;      /* Pages held longest and most recently */
+  int n;                      /* Pages on the list */
+  int mx;                     /* The budget: most pages the list may hold */
+};
+
+/*
+** The share of a budget of MX pages that the lists of each shard get.
+*/
+#define pager_hold_share(MX) (((MX)+PAGER_N_SHARD-1)/PAGER_N_SHARD)
+
+/*
+** In-memory pages are located by page number through an open addressing
+** hash table with linear probing.  Each slot holds the page number next
+** to the page pointer, so a probe never has to look at the PgHdr and a
+** lookup usually touches a single cache line.
+**
+** The table is split into PAGER_N_SHARD shards by page number, each with
+** a latch of its own, so that threads sharing the pager can look up
+** pages without taking the latch of the whole pager.  A shard starts out
+** with N_PG_HASH slots and doubles whenever it becomes half full.
+**
+** The free lists are split the same way.  A page that is not referenced
+** is on the lists of the shard its number falls in, so taking it off to
+** hand it out, or putting it back when it is released, only needs the
+** latch of that shard.  See pager_ref_cached() and mndbpager_unref().
+** Pager.pLatch is only taken for a miss, and to recycle a page, which
+** takes the coldest page of each shard in turn.  See
+** pager_choose_victim().
+**
+** A page in the table that is being loaded, released or recycled is
+** marked busy.  It is neither referenced nor on a free list, and nobody
+** may take a reference to it until that is done, so a thread that looks
+** it up waits on PgShard.pCond.  That is what lets a miss read the page
+** after Pager.pLatch has been let go, see pager_load().
+**
+** Counts that change under the latch of a shard are kept in the shard
+** and added into the statistics of the pager by pager_stats().
+*/
+#ifndef PAGER_N_SHARD
+# define PAGER_N_SHARD 8
+#endif
+#define N_PG_HASH 32
+
+typedef struct PgSlot PgSlot;
+struct PgSlot {
+  Pgno pgno;                  /* Page number.  0 if the slot is empty */
+  PgHdr *pPg;                 /* The page with that number */
+};
+
+typedef struct PgShard PgShard;
+struct PgShard {
+  OsMutex *pLatch;            /* Protects everything below */
+  OsCond *pCond;              /* Broadcast when a page stops being busy */
+  PgSlot *aSlot;              /* The slots */
+  int nSlot;                  /* Number of slots in aSlot[], a power of 2 */
+  int nSlotShift;             /* 32 - log2(nSlot) */
+  int nSlotUsed;              /* Number of pages in aSlot[] */
+  PgHdr *pFirst, *pLast;      /* Free pages that are clean */
+  PgHdr *pFirstDirty, *pLastDirty;  /* Free pages that are dirty */
+  PgHdr *pFirstA1, *pLastA1;  /* 2Q: clean free pages on the A1in queue */
+  PgHdr *pFirstDirtyA1, *pLastDirtyA1;  /* 2Q: dirty ones */
+  PgHold aHold[PAGER_N_HOLD]; /* Free interior and root pages held back */
+  u64 nPromote;               /* Pages moved from A1in to Am when reused */
+  u64 nDemote;                /* Pages let go of by a hold list */
+  PagerIoStats read;          /* Reads done without Pager.pLatch */
+};
+#define pager_shard(P,PN)  (&(P)->aShard[(PN)%PAGER_N_SHARD])
+
+/*
+** Hash a page number into a table of 2**(32-SHIFT) slots.  Multiplying
+** by the golden ratio spreads consecutive page numbers over the table.
+*/
+#define pager_hash(PN,SHIFT) ((int)(((u32)(PN)*0x9e3779b1U)>>(SHIFT)))
+
+/*
+** Pages of the database file reserved at a time as it grows, or 0 to
+** let it grow a page at a time.  See mndbpager_set_chunksize().
+*/
+#ifndef MNDB_CHUNK_SIZE
+# define MNDB_CHUNK_SIZE 0
+#endif
+
+/*
+** The background writer.  When it is turned on, the pager hands dirty
+** pages at the cold end of its free lists to a thread of their own before
+** the cache runs short of clean pages, so that a page can nearly always
+** be recycled without being written first.  See pager_bgw_schedule().
+**
+** A page that is handed over is copied into a slot of the aData[] ring
+** and marked clean at once.  The thread writes the slots out in the
+** order they were filled.  Until it has done so, the slot holds the
+** newest image of the page, so a cache miss looks there before it reads
+** the file.  Any other write of pages waits for the ring to drain first,
+** so an older image can never land on top of a newer one.
+**
+** iHead, nQueued, rc and exit are protected by PgWriter.pMutex, and the
+** thread and the pager wait on PgWriter.pCond for each other.  Only the
+** pager fills slots and only the thread empties them.
 */
-#define N_PG_HASH 2048
+#ifndef MNDB_BGW_SLOTS
+# define MNDB_BGW_SLOTS 32
+#endif
+
+typedef struct PgWriter PgWriter;
+struct PgWriter {
+  Pager *pPager;              /* Pager whose pages are written */
+  OsThread *pThread;          /* The thread doing the writes */
+  OsMutex *pMutex;            /* Protects the ring */
+  OsCond *pCond;              /* Broadcast when the ring changes */
+  int nKeepClean;             /* Free pages the pager wants to be clean */
+  Pgno aPgno[MNDB_BGW_SLOTS]; /* Page held by each slot */
+  char *aData;                /* MNDB_BGW_SLOTS page images */
+  u32 aExtent[MNDB_BGW_SLOTS];/* Compressed: old extent of each slot's page */
+  char *aPack;                /* Compressed: slot buffers of the thread */
+  int iHead;                  /* First slot waiting to be written */
+  int nQueued;                /* Slots waiting or being written */
+  u64 nWrite;                 /* Pages written by the thread */
+  PagerIoStats write;         /* Its writes, for mndbpager_stats() */
+  int rc;                     /* First error hit by the thread */
+  u8 exit;                    /* Set to tell the thread to finish */
+};
 
 /*
-** Hash a page number
+** Snapshots.  A snapshot sees the database as it was when the snapshot
+** began, however many transactions the pager commits after that.  It
+** holds no lock on the database file in between, so it does not stop
+** anyone from writing.
+**
+** Pager.iSeq counts the commits made through the pager.  While
+** snapshots are in use, mndbpager_write() keeps the image a page had
+** before the transaction in progress changed it, tagged with the number
+** that commit will get.  A snapshot that began after commit N reads page
+** P from the oldest image of P tagged later than N, or from the cache if
+** there is none.  Images are let go once no snapshot that is open, or
+** that could still begin, would read them.
+**
+** A transaction keeps images if a snapshot is open when it begins, or
+** if one began or was refused since the last transaction began.  It
+** then keeps them from its first change, so that a snapshot can begin
+** at any point of it.  Otherwise it keeps none until a snapshot begins,
+** and a snapshot that tries to begin after it has changed a page gets
+** MNDB_BUSY.
+**
+** The pages of a snapshot are private copies, laid out like the frames
+** of the cache and handed out and released the same way, so that the
+** layer above can use them as it uses any page.  They cannot be made
+** writable.  A snapshot keeps up to MNDB_SNAP_CACHE of them after they
+** are released, since they never change.
+**
+** Another connection may still commit to the file.  The pager finds out
+** when it next takes a lock on the file, and from then on the snapshots
+** that were open return MNDB_BUSY.  See pager_snapshot_stale().
 */
-#define pager_hash(PN) ((PN)&(N_PG_HASH-1))
+#ifndef MNDB_SNAP_CACHE
+# define MNDB_SNAP_CACHE 32
+#endif
+
+typedef struct PgVersion PgVersion;
+struct PgVersion {
+  Pgno pgno;                  /* Page it is an image of */
+  u32 iSeq;                   /* The commit that changed the page */
+  PgVersion *pNextPg;         /* Next newer image of the same page */
+  PgVersion *pNext;           /* Next image kept, in the order they were */
+  /* Pager.pageSize bytes of page data follow */
+};
+
+struct PagerSnap {
+  Pager *pPager;              /* Pager the snapshot reads through */
+  u32 iSeq;                   /* Pager.iSeq when the snapshot began */
+  u8 isStale;                 /* Another connection has committed since */
+  PagerSnap *pNext;           /* Next open snapshot of the same pager */
+  Hash copies;                /* Maps a page number to its private copy */
+  PgHdr *pFirst, *pLast;      /* Copies not referenced, oldest first */
+  int nIdle;                  /* Number of copies on that list */
+};
 
 /*
 ** A open page cache is an instance of the following structure.
@@ -59,20 +284,67 @@ struct Pager{
   OsFile fd;
   int dbSize;
   int origDbSize; //?
-  int nExtra; /* Total number of in-memory pages */
+  int pageSize;               /* Number of bytes in a page */
+  int nExtra;                 /* Add this many bytes to each in-memory page */
+  int szExtra;                /* nExtra rounded up to a multiple of 8 */
+  int szFrame;                /* Bytes in each frame of an arena */
+  int szAlign;                /* Alignment of page data in a frame */
+  u8 useDirect;               /* File is read and written with O_DIRECT */
+  u8 useCompress;             /* Pages are stored compressed */
+  int szSlot;                 /* Bytes of the file given to each page */
+  u32 *aExtent;               /* Compressed: bytes in use in each slot */
+  int nExtent;                /* Number of entries in aExtent[] */
+  char *aPack;                /* Compressed: N_PACK_BATCH slot buffers */
+  u8 useHugePages;            /* Try to back arenas with huge pages */
+  u8 useMmap;                 /* Copy pages out of a mapping of the file */
+  char *pMap;                 /* Read-only mapping of the file, or NULL */
+  off_t szMap;                /* Number of bytes mapped at pMap */
+  u8 useWal;                  /* Keep changes in a write-ahead log */
+  u8 useWarm;                 /* Save the pages cached to a file at close */
+  Wal *pWal;                  /* The write-ahead log, once it is open */
+  PgArena *pArena;            /* Arenas that frames are carved from */
+  PgArena *pArenaCur;         /* Arena to take the next frame from */
   void (*xDestructor)(void*);
   int nPage; /* Total number of in-memory pages */
   int nRef;
   int mxPage;
-  int nHit, nMiss, nOvfl; /* Cache hits, missing, and LRU overflows */    
+  int nRead;                  /* Pages read in so far, the clock of 2Q */
+  PagerStats stat;            /* Statistics, see mndbpager_stats() */
+  u64 nWalCommitBase;         /* Log commits when stat was last reset */
+  u64 nWalSyncBase;           /* Log syncs when stat was last reset */
+  u32 iChange;                /* Change counter the cached pages agree with */
   u8 state;
   u8 errMask;
   u8 tempFile; //?
+  u8 memDb;                   /* True for a ":memory:" database */
   u8 readOnly;
   u8 dirtyFile;               /* True if database file has changed in any way */
-  PgHdr *pFirst, *pLast; //List of free pages
+  u8 needTruncate;            /* Cut the file down to dbSize pages at commit */
+  int nChunk;                 /* Pages reserved in the file at a time, or 0 */
+  off_t szAlloc;              /* Bytes of the file known to be reserved */
+  u8 ePolicy;                 /* MNDB_CACHE_LRU or MNDB_CACHE_2Q */
+  int nA1;                    /* 2Q: number of pages on the A1in queue */
+  Pgno *aGhost;               /* 2Q: ring of pages recently evicted from A1in */
+  int nGhost;                 /* 2Q: number of slots in aGhost[] */
+  int iGhost;                 /* 2Q: next slot of aGhost[] to be used */
+  Hash ghostHash;             /* 2Q: maps a page number to its aGhost[] slot */
   PgHdr *pAll;
-  PgHdr *aHash[N_PG_HASH];
+  PgHdr *pDirty;              /* List of dirty pages, maintained by mndbpager_write() */
+  int nDirtyFree;             /* Dirty pages on the free lists */
+  PgWriter *pWriter;          /* Background writer, or NULL */
+  PgShard aShard[PAGER_N_SHARD];  /* Hash table and free lists, see PgShard */
+  int iVictim;                /* Shard to recycle a page from next */
+  char *pLoadPack;            /* Compressed: slot buffers for pager_load() */
+  OsMutex *pLatch;            /* Held by a thread using the pager */
+  u64 nHitShared;             /* Hits that took no latch, see mndbpager_get() */
+  u32 iSeq;                   /* Commits made, see PagerSnap */
+  u8 useVersion;              /* Keep old images, see PagerSnap */
+  u8 wantVersion;             /* Snapshots used since the last begin */
+  u8 noVersion;               /* Pages changed with no old image kept */
+  PagerSnap *pSnap;           /* Snapshots that are open */
+  Hash versions;              /* Maps a page number to its oldest PgVersion */
+  PgVersion *pFirstVer, *pLastVer;  /* Every PgVersion, oldest first */
+  int nVersion;               /* Number of PgVersions */
 };
 
 #define PAGER_ERR_FULL    0X01
@@ -106,578 +378,3896 @@ static int pager_errcode(Pager *pPager){
 }
 
 /*
-** Unlock the database and clear the in-memory cache.  This routine
-** sets the state of the pager back to what it was when it was first
-** opened.  Any outstanding pages are invalidated and subsequent attempts
-** to access those pages will likely result in a coredump.
+** Count an I/O request of nByte bytes that was started at time rStart,
+** as read from mndbOsClock(), in *pIo.
 */
-static PgHdr* pager_lookup(Pager *pPager, Pgno pgno){
-  PgHdr *p = pPager->aHash[pager_hash(pgno)];
-  while(p && p->pgno != pgno)
-    p = p->pNextHash;
-  return p;
+static void pager_record_io(PagerIoStats *pIo, int nByte, double rStart){
+  double rNow;
+  u64 us;
+  int i;
+  mndbOsClock(&rNow);
+  us = (u64)((rNow - rStart)*1000000.0);
+  for(i=0; us>0 && i<MNDB_N_LATENCY-1; i++){
+    us >>= 1;
+  }
+  pIo->nCall++;
+  pIo->nByte += nByte;
+  pIo->aLatency[i]++;
 }
 
 /*
-** When this routine is called, the pager has the journal file open and
-** a write lock on the database.  This routine releases the database
-** write lock and acquires a read lock in its place.  The journal file
-** is deleted and closed.
-**
-** TODO: Consider keeping the journal file open for temporary databases.
-** This might give a performance improvement on windows where opening
-** a file is an expensive operation.
+** Add the counts in *pFrom to those in *pTo.
 */
-static int pager_unwritelock(Pager *pPager){
-  // error 
-  if(pPager->state < MNDB_WRITELOCK) return MNDB_OK;
+static void pager_merge_io(PagerIoStats *pTo, const PagerIoStats *pFrom){
+  int i;
+  pTo->nCall += pFrom->nCall;
+  pTo->nByte += pFrom->nByte;
+  for(i=0; i<MNDB_N_LATENCY; i++){
+    pTo->aLatency[i] += pFrom->aLatency[i];
+  }
+}
 
-  assert(pPager->dirtyFile == 0);
-  
-  int rc;
-  rc = mndbOsReadLock(&pPager->fd);
-  if(rc == MNDB_OK){
-    pPager->state = MNDB_READLOCK;
+/*
+** Find page pgno in the hash table, or return NULL.  The caller holds
+** the latch of its shard, since a load that fails takes the page out
+** of the table without Pager.pLatch.  See pager_load_done().
+*/
+static PgHdr* pager_lookup(Pager *pPager, Pgno pgno){
+  PgShard *pShard = pager_shard(pPager, pgno);
+  PgSlot *a = pShard->aSlot;
+  int mask = pShard->nSlot - 1;
+  int h;
+  if( a==0 ) return 0;
+  for(h=pager_hash(pgno, pShard->nSlotShift); a[h].pgno; h=(h+1)&mask){
+    if( a[h].pgno==pgno ) return a[h].pPg;
   }
-  else{
-    /* This can only happen if a process does a BEGIN, then forks and the
-    ** child process does the COMMIT.  Because of the semantics of unix
-    ** file locking, the unlock will fail.
-    */
-    pPager->state = MNDB_UNLOCK;
+  return 0;
+}
+
+/*
+** Put a page into the slots of a shard.  There must be a free one.
+*/
+static void pager_shard_insert(PgShard *pShard, PgHdr *pPg){
+  PgSlot *a = pShard->aSlot;
+  int mask = pShard->nSlot - 1;
+  int h;
+  assert( pShard->nSlotUsed < pShard->nSlot );
+  for(h=pager_hash(pPg->pgno, pShard->nSlotShift); a[h].pgno; h=(h+1)&mask){
+    assert( a[h].pgno!=pPg->pgno );
   }
-  return rc; 
+  a[h].pgno = pPg->pgno;
+  a[h].pPg = pPg;
+  pShard->nSlotUsed++;
 }
 
 /*
-** Unlock the database and clear the in-memory cache.  This routine
-** sets the state of the pager back to what it was when it was first
-** opened.  Any outstanding pages are invalidated and subsequent attempts
-** to access those pages will likely result in a coredump.
+** Return true if page pgno is in the cache.
 */
-static void pager_reset(Pager *pPager){
-  PgHdr *pPg, *pNext;
-  for(pPg = pPager->pAll; pPg; pPg = pNext){
-    pNext = pPg->pNextAll;
-    mndbFree(pPg);
+static int pager_has_page(Pager *pPager, Pgno pgno){
+  PgShard *pShard = pager_shard(pPager, pgno);
+  int has;
+  mndbOsMutexEnter(pShard->pLatch);
+  has = pager_lookup(pPager, pgno)!=0;
+  mndbOsMutexLeave(pShard->pLatch);
+  return has;
+}
+
+/*
+** Add a page to the hash table.  There must be a free slot, see
+** pager_hash_reserve().
+*/
+static void pager_hash_insert(Pager *pPager, PgHdr *pPg){
+  PgShard *pShard = pager_shard(pPager, pPg->pgno);
+  mndbOsMutexEnter(pShard->pLatch);
+  pager_shard_insert(pShard, pPg);
+  mndbOsMutexLeave(pShard->pLatch);
+}
+
+/*
+** Remove a page from the hash table.  Entries that follow it in the same
+** probe sequence are shifted back into the hole, so the table never
+** needs tombstones.
+*/
+static void pager_hash_remove(Pager *pPager, PgHdr *pPg){
+  PgShard *pShard = pager_shard(pPager, pPg->pgno);
+  PgSlot *a = pShard->aSlot;
+  int mask = pShard->nSlot - 1;
+  int i, j, h;
+  mndbOsMutexEnter(pShard->pLatch);
+  for(i=pager_hash(pPg->pgno, pShard->nSlotShift); a[i].pPg!=pPg;
+      i=(i+1)&mask){
+    assert( a[i].pgno!=0 );
   }
-  
-  pPager->pFirst = 0;
-  pPager->pLast = 0;
-  pPager->pAll = 0;
-  memset(pPager->aHash, 0, sizeof(pPager->aHash));
-  pPager->nPage = 0;
-  //simply report the when lockstate >= write
-  //assert(pPager->state >= MNDB_WRITELOCK);
-  pager_unwritelock(pPager);
-  mndbOsUnlock(&pPager->fd);
-  pPager->state = MNDB_UNLOCK;
-  pPager->dbSize = -1;
-  pPager->nRef = 0;
+  for(j=(i+1)&mask; a[j].pgno; j=(j+1)&mask){
+    /* a[j] can fill the hole at i unless its home slot h lies
+    ** cyclically in (i, j] */
+    h = pager_hash(a[j].pgno, pShard->nSlotShift);
+    if( i<j ? (h<=i || h>j) : (h<=i && h>j) ){
+      a[i] = a[j];
+      i = j;
+    }
+  }
+  a[i].pgno = 0;
+  a[i].pPg = 0;
+  pShard->nSlotUsed--;
+  mndbOsMutexLeave(pShard->pLatch);
 }
 
 /*
-** Open a temporary file.  Write the name of the file into zName
-** (zName must be at least MNDB_TEMPNAME_SIZE bytes long.)  Write
-** the file descriptor into *fd.  Return MNDB_OK on success or some
-** other error code if we fail.
-**
-** The OS will automatically delete the temporary file when it is
-** closed.
+** Make sure the shard of page pgno has room for one more page.  It is
+** doubled before it becomes more than half full.  The shard stays
+** latched while the new slots are filled in, since a load that fails
+** may take a page out of it meanwhile.  If there is not enough memory,
+** the old slots keep being used until they are full.
 */
-static int mndbpager_opentemp(char *zFile, OsFile *fd){
-  int cnt = 8;
-  int rc;
-  do{
-    cnt--;
-    mndbOsTempFileName(zFile);
-  }while( cnt>0 && rc!=MNDB_OK );
+static int pager_hash_reserve(Pager *pPager, Pgno pgno){
+  PgShard *pShard = pager_shard(pPager, pgno);
+  PgShard sNew;
+  PgSlot *aOld;
+  int nOld;
+  int rc = MNDB_OK;
+  int i;
+  mndbOsMutexEnter(pShard->pLatch);
+  aOld = pShard->aSlot;
+  nOld = pShard->nSlot;
+  if( (pShard->nSlotUsed+1)*2<=nOld ) goto reserve_out;
+  sNew.nSlot = nOld ? nOld*2 : N_PG_HASH;
+  sNew.aSlot = mndbMalloc( sNew.nSlot*sizeof(PgSlot) );
+  if( sNew.aSlot==0 ){
+    if( pShard->nSlotUsed+1>=nOld ) rc = MNDB_NOMEM;
+    goto reserve_out;
+  }
+  for(sNew.nSlotShift=32; (1<<(32-sNew.nSlotShift))<sNew.nSlot;
+      sNew.nSlotShift--){}
+  sNew.nSlotUsed = 0;
+  for(i=0; i<nOld; i++){
+    if( aOld[i].pgno ) pager_shard_insert(&sNew, aOld[i].pPg);
+  }
+  pShard->aSlot = sNew.aSlot;
+  pShard->nSlot = sNew.nSlot;
+  pShard->nSlotShift = sNew.nSlotShift;
+  pShard->nSlotUsed = sNew.nSlotUsed;
+  mndbFree(aOld);
+
+reserve_out:
+  mndbOsMutexLeave(pShard->pLatch);
   return rc;
 }
 
 /*
-** Create a new page cache and put a pointer to the page cache in *ppPager.
-** The file to be cached need not exist.  The file is not locked until
-** the first call to sqlitepager_get() and is only held open until the
-** last page is released using sqlitepager_unref().
+** Compressed database files.  Once mndbpager_set_compress() has been
+** used on a new file, every page but the first is compressed before it
+** is written.  Page N still has a slot of its own in the file, at
+** pager_offset(N), so that the layer above keeps seeing fixed size
+** pages and a page is always written with a single positioned write.
+** A slot is Pager.szSlot bytes, somewhat more than a page, so that a
+** page that does not compress fits in it as well.  It holds
 **
-** If zFilename is NULL then a randomly-named temporary file is created
-** and used as the file to be cached.  The file will be deleted
-** automatically when it is closed.
+**      | length | encoding | data | zero padding |
+**
+** The length and encoding are 32-bit integers in native byte order.
+** The encoding is PAGER_PACK_LZ for data made by mndbLzCompress() and
+** PAGER_PACK_RAW for a page stored as it is.  A slot of zeros, such as
+** a hole in the file, holds a page of zeros.  Only the part of a slot
+** in use, rounded up to Pager.szAlign bytes, is written.  The rest is
+** handed back to the file system with mndbOsPunchHole(), which is
+** where the space is saved.
+**
+** Page 1 is stored as it is at the start of its slot, without a header,
+** so that the file header and the change counter are read the same way
+** as in a plain file.  MNDB_FORMAT_OFFSET of page 1 says which layout a
+** file has.
+**
+** How much of each slot is in use is kept in Pager.aExtent[], as it is
+** learned from the header of the slot when the page is read, and when
+** the page is written.  A read only reads that much of the slot if it
+** is known, and a write only punches a hole when the page used to take
+** more of its slot or when that is not known.
 */
-  int mndbpager_open(Pager **ppPager, const char *zFilename, int mxPage, int nExtra){
-  Pager *pPager;
-  char *zFullPathname;
-  int nameLen;
-  OsFile fd;
-  int rc, i;
-  int tempFile;
-  int readOnly = 0;
-  char zTemp[MNDB_TEMPNAME_SIZE];
+#define PAGER_PACK_HDR 8         /* Bytes in the header of a slot */
+#define PAGER_PACK_RAW 0         /* The page is stored as it is */
+#define PAGER_PACK_LZ  1         /* The page is compressed by mndbLzCompress() */
+#define PAGER_MAX_PAD  4096      /* Most bytes a slot adds to a page */
 
-  *ppPager = 0;
-  if(mndb_malloc_failed){
-    return MNDB_NOMEM;
+/*
+** Slot buffers in Pager.aPack and PgWriter.aPack.  It is also the most
+** pages that are compressed or uncompressed for one batch of I/O.
+*/
+#ifndef N_PACK_BATCH
+# define N_PACK_BATCH 16
+#endif
+
+/*
+** Return the offset of the slot of page pgno in the database file.
+*/
+static off_t pager_offset(Pager *pPager, Pgno pgno){
+  return (pgno-1)*(off_t)pPager->szSlot;
+}
+
+/*
+** Return how many bytes of the slot of page pgno are in use, or 0 if
+** that is not known.
+*/
+static u32 pager_extent(Pager *pPager, Pgno pgno){
+  return pgno<(Pgno)pPager->nExtent ? pPager->aExtent[pgno] : 0;
+}
+
+/*
+** Remember that nUsed bytes of the slot of page pgno are in use.  The
+** map is only a hint, so nothing is done if it cannot be grown.
+*/
+static void pager_set_extent(Pager *pPager, Pgno pgno, u32 nUsed){
+  if( pgno>=(Pgno)pPager->nExtent ){
+    int nNew = pPager->nExtent ? pPager->nExtent*2 : 256;
+    u32 *aNew;
+    if( nUsed==0 ) return;
+    while( (Pgno)nNew<=pgno ) nNew *= 2;
+    aNew = mndbRealloc(pPager->aExtent, nNew*sizeof(u32));
+    if( aNew==0 ) return;
+    memset(&aNew[pPager->nExtent], 0, (nNew-pPager->nExtent)*sizeof(u32));
+    pPager->aExtent = aNew;
+    pPager->nExtent = nNew;
   }
-  if(zFilename && zFilename[0]){
-    zFullPathname = mndbOsFullPathname(zFilename);
-    rc = mndbOsOpenReadWrite(zFullPathname, &fd, &readOnly);
-    tempFile = 0;
+  pPager->aExtent[pgno] = nUsed;
+}
+
+/*
+** Allocate N_PACK_BATCH slot buffers for *paPack unless that has been
+** done already.
+*/
+static int pager_pack_alloc(Pager *pPager, char **paPack){
+  if( *paPack==0 ){
+    *paPack = mndbOsAllocArena(N_PACK_BATCH*pPager->szSlot, 0);
+    if( *paPack==0 ) return MNDB_NOMEM;
+  }
+  return MNDB_OK;
+}
+
+/*
+** Take a slot buffer for pager_load() off Pager.pLoadPack, or allocate
+** one if there is none there.  Buffers on that list are linked through
+** their first bytes.  Return NULL if there is not enough memory.
+*/
+static char *pager_load_pack_get(Pager *pPager){
+  char *zSlot = pPager->pLoadPack;
+  if( zSlot ){
+    memcpy(&pPager->pLoadPack, zSlot, sizeof(char*));
   }else{
-    rc = mndbpager_opentemp(zTemp, &fd);
-    zFilename = zTemp;
-    zFullPathname = mndbOsFullPathname(zFilename);
-    tempFile = 1;
+    zSlot = mndbOsAllocArena(pPager->szSlot, 0);
   }
-  
-  if(mndb_malloc_failed) return MNDB_NOMEM;
-  if( rc!=MNDB_OK ){
-    mndbFree(zFullPathname);
-    return MNDB_CANTOPEN;
-  } 
-  nameLen = strlen(zFullPathname);
-  pPager = mndbMalloc( sizeof(*pPager) + nameLen*2 + 30 ); // 因为filename filedirectory 的空间也存储在此后
+  return zSlot;
+}
 
-  if( pPager==0 ){
-    mndbOsClose(&fd);
-    mndbFree(zFullPathname);
-    return MNDB_NOMEM;
+/*
+** Put a slot buffer taken by pager_load_pack_get() back on the list.
+*/
+static void pager_load_pack_put(Pager *pPager, char *zSlot){
+  memcpy(zSlot, &pPager->pLoadPack, sizeof(char*));
+  pPager->pLoadPack = zSlot;
+}
+
+/*
+** Give back the slot buffers of the pager.  This must be done before
+** the size of a slot changes.
+*/
+static void pager_pack_free(Pager *pPager){
+  if( pPager->aPack ){
+    mndbOsFreeArena(pPager->aPack, N_PACK_BATCH*pPager->szSlot);
+    pPager->aPack = 0;
   }
+  while( pPager->pLoadPack ){
+    char *zSlot = pager_load_pack_get(pPager);
+    mndbOsFreeArena(zSlot, pPager->szSlot);
+  }
+}
 
-  pPager->zFilename = (char*)&pPager[1];
-  pPager->zDirectory = &pPager->zFilename[nameLen+1];
-  strcpy(pPager->zFilename, zFullPathname);
-  strcpy(pPager->zDirectory, zFullPathname);
-  for(i=nameLen; i>0 && pPager->zDirectory[i-1]!='/'; i--){}
-  if( i>0 ) pPager->zDirectory[i-1] = 0;
-  mndbFree(zFullPathname);
+/*
+** Return how many bytes of the slot whose image is at zSlot are in use,
+** header included.  A damaged header gives a number larger than a slot.
+*/
+static u32 pager_packed_size(const void *zSlot){
+  u32 nData;
+  memcpy(&nData, zSlot, 4);
+  return nData>MNDB_MAX_PAGE_SIZE ? nData : PAGER_PACK_HDR+nData;
+}
 
-  pPager->fd = fd;
-  pPager->nRef = 0;
-  pPager->dbSize = -1;
-  pPager->nPage = 0;
-  pPager->mxPage = mxPage>5 ? mxPage : 10;
-  pPager->state = MNDB_UNLOCK;
-  pPager->errMask = 0;
-  pPager->tempFile = tempFile;
-  pPager->readOnly = readOnly;
-  pPager->pFirst = 0;
-  pPager->pLast = 0;
-  pPager->nExtra = nExtra;
-  memset(pPager->aHash, 0, sizeof(pPager->aHash));
-  *ppPager = pPager;
-  return MNDB_OK;
-}  
-  
 /*
-** Set the destructor for this pager.  If not NULL, the destructor is called
-** when the reference count on each page reaches zero.  The destructor can
-** be used to clean up information in the extra segment appended to each page.
-**
-** The destructor is not called as a result sqlitepager_close().  
-** Destructors are only called by sqlitepager_unref().
+** Build the image of the slot of a page in zSlot from the data of the
+** page at pData.  Return the number of bytes of it to write.  The page
+** is only stored compressed if that saves at least one Pager.szAlign
+** unit of the file.
 */
-void mndbpager_set_destructor(Pager *pPager, void (*xDesc)(void*)){
-  pPager->xDestructor = xDesc;
+static int pager_pack(Pager *pPager, const void *pData, char *zSlot){
+  int nMax = pPager->pageSize - pPager->szAlign - PAGER_PACK_HDR;
+  int n = 0;
+  int nWrite;
+  u32 aHdr[2];
+  if( nMax>0 ){
+    n = mndbLzCompress(pData, pPager->pageSize,
+                       (unsigned char*)&zSlot[PAGER_PACK_HDR], nMax);
+  }
+  if( n>0 ){
+    aHdr[1] = PAGER_PACK_LZ;
+  }else{
+    n = pPager->pageSize;
+    memcpy(&zSlot[PAGER_PACK_HDR], pData, n);
+    aHdr[1] = PAGER_PACK_RAW;
+  }
+  aHdr[0] = n;
+  memcpy(zSlot, aHdr, PAGER_PACK_HDR);
+  nWrite = ROUND_UP(PAGER_PACK_HDR+n, pPager->szAlign);
+  memset(&zSlot[PAGER_PACK_HDR+n], 0, nWrite-PAGER_PACK_HDR-n);
+  return nWrite;
 }
 
 /*
-** Return the total number of pages in the disk file associated with
-** pPager.
+** Recover the data of a page from the image of its slot at zSlot into
+** pData.  The whole of the slot in use must have been read.  Return
+** MNDB_CORRUPT if the slot does not hold a page.
 */
-int mndbpager_pagecount(Pager *pPager){
-  off_t n;
-  assert( pPager!=0 );
-  if( pPager->dbSize>=0 ){
-    return pPager->dbSize;
+static int pager_unpack(Pager *pPager, const char *zSlot, void *pData){
+  u32 aHdr[2];
+  memcpy(aHdr, zSlot, PAGER_PACK_HDR);
+  if( aHdr[0]==0 && aHdr[1]==0 ){
+    memset(pData, 0, pPager->pageSize);
+    return MNDB_OK;
   }
-  if( mndbOsFileSize(&pPager->fd, &n)!=MNDB_OK ){
-    pPager->errMask |= PAGER_ERR_DISK;
-    return 0; 
+  if( aHdr[1]==PAGER_PACK_RAW && aHdr[0]==(u32)pPager->pageSize ){
+    memcpy(pData, &zSlot[PAGER_PACK_HDR], pPager->pageSize);
+    return MNDB_OK;
   }
-  n /= MNDB_PAGE_SIZE;
-  if( pPager->state!=MNDB_UNLOCK ){
-    pPager->dbSize = n;
+  if( aHdr[1]==PAGER_PACK_LZ && aHdr[0]<(u32)pPager->pageSize
+   && mndbLzDecompress((const unsigned char*)&zSlot[PAGER_PACK_HDR],
+                       (int)aHdr[0], pData, pPager->pageSize)
+        ==pPager->pageSize ){
+    return MNDB_OK;
   }
-  return n;
+  return MNDB_CORRUPT;
 }
 
 /*
-** Shutdown the page cache.  Free all memory and close all files.
-**
-** If a transaction was in progress when this routine is called, that
-** transaction is rolled back.  All outstanding pages are invalidated
-** and their memory is freed.  Any attempt to use a page associated
-** with this page cache after this function returns will likely
-** result in a coredump.
+** Read the n pages of aPgno[] from a compressed file into apData[].
+** Each batch of N_PACK_BATCH pages goes to mndbOsReadExtents() at once,
+** with each slot read only as far as it is known to be in use.  A slot
+** that turns out to hold more than that is read again whole.  Slots
+** past the end of the file read as zeros and so hold pages of zeros.
 **
-** Tudo: what if the page is dirty;
+** On entry aExtent[] holds how many bytes of the slot of each page are
+** known to be in use, or 0, and on exit how many are.  aPack is as many
+** slot buffers as there are pages, up to N_PACK_BATCH.  Like
+** pager_write_packed(), nothing but the file and the arguments is
+** touched, so that pager_load() can call it without Pager.pLatch.
 */
-int mndbpager_close(Pager *pPager){
-  PgHdr *pPg, *pNext;
-  switch( pPager->state ){
-    case MNDB_WRITELOCK:
-    case MNDB_READLOCK: {
-      mndbOsUnlock(&pPager->fd);
-      break;
+static int pager_read_packed(
+  Pager *pPager,              /* The pager */
+  char *aPack,                /* Slot buffers */
+  int n,                      /* Number of pages */
+  void *const*apData,         /* Where their data goes */
+  const Pgno *aPgno,          /* Their page numbers */
+  u32 *aExtent,               /* Bytes in use in their slots */
+  PagerIoStats *pIo           /* Count the reads here */
+){
+  void *apBuf[N_PACK_BATCH];
+  off_t aOffset[N_PACK_BATCH];
+  int aAmt[N_PACK_BATCH];
+  double rStart;
+  int i, j, nBatch, nByte;
+  int rc;
+
+  for(i=0; i<n; i+=nBatch){
+    nBatch = n-i<N_PACK_BATCH ? n-i : N_PACK_BATCH;
+    nByte = 0;
+    for(j=0; j<nBatch; j++){
+      Pgno pgno = aPgno[i+j];
+      u32 nUsed = aExtent[i+j];
+      aOffset[j] = pager_offset(pPager, pgno);
+      if( pgno==1 ){
+        apBuf[j] = apData[i+j];
+        aAmt[j] = pPager->pageSize;
+      }else{
+        apBuf[j] = &aPack[j*(size_t)pPager->szSlot];
+        aAmt[j] = nUsed ? ROUND_UP((int)nUsed, pPager->szAlign)
+                        : pPager->szSlot;
+      }
+      nByte += aAmt[j];
     }
-    default: {
-      /* Do nothing */
+    mndbOsClock(&rStart);
+    rc = mndbOsReadExtents(&pPager->fd, nBatch, apBuf, aOffset, aAmt);
+    pager_record_io(pIo, nByte, rStart);
+    if( rc!=MNDB_OK ) return rc;
+    for(j=0; j<nBatch; j++){
+      Pgno pgno = aPgno[i+j];
+      u32 nUsed;
+      if( pgno==1 ) continue;
+      nUsed = pager_packed_size(apBuf[j]);
+      if( nUsed>(u32)aAmt[j] && aAmt[j]<pPager->szSlot ){
+        aAmt[j] = pPager->szSlot;
+        mndbOsClock(&rStart);
+        rc = mndbOsReadExtents(&pPager->fd, 1, &apBuf[j], &aOffset[j],
+                               &aAmt[j]);
+        pager_record_io(pIo, aAmt[j], rStart);
+        if( rc!=MNDB_OK ) return rc;
+        nUsed = pager_packed_size(apBuf[j]);
+      }
+      if( nUsed>(u32)aAmt[j] ) return MNDB_CORRUPT;
+      rc = pager_unpack(pPager, apBuf[j], apData[i+j]);
+      if( rc!=MNDB_OK ) return rc;
+      aExtent[i+j] = nUsed;
+    }
+  }
+  return MNDB_OK;
+}
+
+/*
+** Write the n pages of aPgno[], whose data is at apData[], to a
+** compressed file.  On entry aExtent[] holds how many bytes of the slot
+** of each page were in use, or 0 if that is not known.  On exit it
+** holds how many are now.  aPack is N_PACK_BATCH slot buffers for the
+** compressed images.
+**
+** The background writer thread calls this too, so nothing but the file
+** and the arguments is touched.
+*/
+static int pager_write_packed(
+  Pager *pPager,              /* The pager */
+  char *aPack,                /* Slot buffers */
+  int n,                      /* Number of pages */
+  void *const*apData,         /* Their data */
+  const Pgno *aPgno,          /* Their page numbers */
+  u32 *aExtent,               /* Bytes in use in their slots */
+  PagerIoStats *pIo           /* Count the writes here */
+){
+  void *apBuf[N_PACK_BATCH];
+  off_t aOffset[N_PACK_BATCH];
+  int aAmt[N_PACK_BATCH];
+  double rStart;
+  int i, j, nBatch, nByte;
+  int rc = MNDB_OK;
+
+  for(i=0; rc==MNDB_OK && i<n; i+=nBatch){
+    nBatch = n-i<N_PACK_BATCH ? n-i : N_PACK_BATCH;
+    nByte = 0;
+    for(j=0; j<nBatch; j++){
+      Pgno pgno = aPgno[i+j];
+      aOffset[j] = pager_offset(pPager, pgno);
+      if( pgno==1 ){
+        apBuf[j] = apData[i+j];
+        aAmt[j] = pPager->pageSize;
+      }else{
+        apBuf[j] = &aPack[j*(size_t)pPager->szSlot];
+        aAmt[j] = pager_pack(pPager, apData[i+j], apBuf[j]);
+      }
+      nByte += aAmt[j];
+    }
+    mndbOsClock(&rStart);
+    rc = mndbOsWriteExtents(&pPager->fd, nBatch, apBuf, aOffset, aAmt);
+    pager_record_io(pIo, nByte, rStart);
+    for(j=0; rc==MNDB_OK && j<nBatch; j++){
+      u32 nOld = aExtent[i+j];
+      if( aPgno[i+j]==1 ) continue;
+      if( nOld==0 || ROUND_UP((int)nOld, pPager->szAlign)>aAmt[j] ){
+        rc = mndbOsPunchHole(&pPager->fd, aOffset[j]+aAmt[j],
+                             pPager->szSlot-aAmt[j]);
+      }
+      aExtent[i+j] = pager_packed_size(apBuf[j]);
+    }
+  }
+  return rc;
+}
+
+/*
+** Write n pages straight into the database file, or append them to the
+** log in WAL mode.  Runs of adjacent pages go out in a single write.
+** This is what the background writer thread does with the ring.
+*/
+static int pager_bgw_write(
+  Pager *pPager,              /* The pager */
+  int n,                      /* Number of pages */
+  Pgno *aPgno,                /* Their page numbers */
+  void **apData,              /* Their images */
+  u32 *aExtent,               /* Compressed: bytes in use in their slots */
+  PagerIoStats *pIo           /* Count the writes here */
+){
+  double rStart;
+  int i, nRun;
+  int rc = MNDB_OK;
+  mndbOsClock(&rStart);
+  if( pPager->useCompress ){
+    return pager_write_packed(pPager, pPager->pWriter->aPack, n, apData,
+                              aPgno, aExtent, pIo);
+  }
+  if( pPager->pWal ){
+    rc = mndbWalWriteFrames(pPager->pWal, n, aPgno, apData, 0);
+    pager_record_io(pIo, n*pPager->pageSize, rStart);
+    return rc;
+  }
+  for(i=0; rc==MNDB_OK && i<n; i+=nRun){
+    for(nRun=1; i+nRun<n && aPgno[i+nRun]==aPgno[i]+nRun; nRun++){}
+    mndbOsClock(&rStart);
+    rc = mndbOsWritevAt(&pPager->fd, &apData[i], nRun, pPager->pageSize,
+                        (aPgno[i]-1)*(off_t)pPager->pageSize);
+    pager_record_io(pIo, nRun*pPager->pageSize, rStart);
+  }
+  return rc;
+}
+
+/*
+** The background writer thread.  It writes the slots of the ring as
+** they are filled, oldest first, until it is told to finish and the
+** ring is empty.
+*/
+static void *pager_bgw_main(void *pArg){
+  PgWriter *pW = (PgWriter*)pArg;
+  Pager *pPager = pW->pPager;
+  Pgno aPgno[MNDB_MAX_IOV];
+  void *apData[MNDB_MAX_IOV];
+  u32 aExtent[MNDB_MAX_IOV];
+  PagerIoStats io;
+  int i, n, rc;
+
+  mndbOsMutexEnter(pW->pMutex);
+  for(;;){
+    if( pW->nQueued==0 ){
+      if( pW->exit ) break;
+      mndbOsCondWait(pW->pCond, pW->pMutex);
+      continue;
+    }
+    n = pW->nQueued;
+    if( n>MNDB_BGW_SLOTS-pW->iHead ) n = MNDB_BGW_SLOTS-pW->iHead;
+    if( n>MNDB_MAX_IOV ) n = MNDB_MAX_IOV;
+    for(i=0; i<n; i++){
+      aPgno[i] = pW->aPgno[pW->iHead+i];
+      apData[i] = &pW->aData[(pW->iHead+i)*(size_t)pPager->pageSize];
+      aExtent[i] = pW->aExtent[pW->iHead+i];
+    }
+    mndbOsMutexLeave(pW->pMutex);
+    memset(&io, 0, sizeof(io));
+    rc = pager_bgw_write(pPager, n, aPgno, apData, aExtent, &io);
+    mndbOsMutexEnter(pW->pMutex);
+    if( rc!=MNDB_OK && pW->rc==MNDB_OK ) pW->rc = rc;
+    pW->iHead = (pW->iHead+n) % MNDB_BGW_SLOTS;
+    pW->nQueued -= n;
+    pW->nWrite += n;
+    pager_merge_io(&pW->write, &io);
+    mndbOsCondBroadcast(pW->pCond);
+  }
+  mndbOsMutexLeave(pW->pMutex);
+  return 0;
+}
+
+/*
+** Wait until the background writer has written every page handed to
+** it.  Return the first error it ran into since the last time.
+*/
+static int pager_bgw_drain(Pager *pPager){
+  PgWriter *pW = pPager->pWriter;
+  int rc;
+  if( pW==0 ) return MNDB_OK;
+  mndbOsMutexEnter(pW->pMutex);
+  while( pW->nQueued>0 ){
+    mndbOsCondWait(pW->pCond, pW->pMutex);
+  }
+  rc = pW->rc;
+  pW->rc = MNDB_OK;
+  mndbOsMutexLeave(pW->pMutex);
+  return rc;
+}
+
+/*
+** If the background writer still holds an image of page pgno, copy the
+** newest one into pBuf and return true.  Otherwise return false.
+*/
+static int pager_bgw_read(Pager *pPager, Pgno pgno, void *pBuf){
+  PgWriter *pW = pPager->pWriter;
+  int i, iSlot = -1;
+  mndbOsMutexEnter(pW->pMutex);
+  for(i=pW->nQueued-1; i>=0; i--){
+    if( pW->aPgno[(pW->iHead+i) % MNDB_BGW_SLOTS]==pgno ){
+      iSlot = (pW->iHead+i) % MNDB_BGW_SLOTS;
       break;
     }
   }
-  for(pPg=pPager->pAll; pPg; pPg=pNext){
-    pNext = pPg->pNextAll;
-    mndbFree(pPg);
+  mndbOsMutexLeave(pW->pMutex);
+  if( iSlot<0 ) return 0;
+  memcpy(pBuf, &pW->aData[iSlot*(size_t)pPager->pageSize], pPager->pageSize);
+  return 1;
+}
+
+/*
+** Start the background writer.  It keeps pctClean percent of the cache
+** clean.
+*/
+static int pager_bgw_start(Pager *pPager, int pctClean){
+  PgWriter *pW;
+  int rc;
+  pW = mndbMalloc( sizeof(*pW) );
+  if( pW==0 ) return MNDB_NOMEM;
+  pW->pPager = pPager;
+  pW->nKeepClean = pPager->mxPage*pctClean/100;
+  if( pW->nKeepClean<1 ) pW->nKeepClean = 1;
+  pW->aData = mndbOsAllocArena(MNDB_BGW_SLOTS*pPager->pageSize, 0);
+  if( pW->aData==0 ){
+    mndbFree(pW);
+    return MNDB_NOMEM;
   }
-  mndbOsClose(&pPager->fd);
-  /* Temp files are automatically deleted by the OS
-  ** if( pPager->tempFile ){
-  **   sqliteOsDelete(pPager->zFilename);
-  ** }
+  pW->aPack = 0;
+  rc = MNDB_OK;
+  pW->pMutex = mndbOsMutexAlloc();
+  pW->pCond = mndbOsCondAlloc();
+  if( pW->pMutex==0 || pW->pCond==0 ){
+    rc = MNDB_NOMEM;
+  }
+  if( rc==MNDB_OK && pPager->useCompress ){
+    rc = pager_pack_alloc(pPager, &pW->aPack);
+  }
+  if( rc==MNDB_OK ){
+    rc = mndbOsThreadCreate(&pW->pThread, pager_bgw_main, pW);
+  }
+  if( rc!=MNDB_OK ){
+    mndbOsMutexFree(pW->pMutex);
+    mndbOsCondFree(pW->pCond);
+    if( pW->aPack ) mndbOsFreeArena(pW->aPack, N_PACK_BATCH*pPager->szSlot);
+    mndbOsFreeArena(pW->aData, MNDB_BGW_SLOTS*pPager->pageSize);
+    mndbFree(pW);
+    return rc;
+  }
+  pPager->pWriter = pW;
+  return MNDB_OK;
+}
+
+/*
+** Stop the background writer once it has written everything it holds.
+*/
+static void pager_bgw_stop(Pager *pPager){
+  PgWriter *pW = pPager->pWriter;
+  if( pW==0 ) return;
+  mndbOsMutexEnter(pW->pMutex);
+  pW->exit = 1;
+  mndbOsCondBroadcast(pW->pCond);
+  mndbOsMutexLeave(pW->pMutex);
+  mndbOsThreadJoin(pW->pThread);
+  mndbOsMutexFree(pW->pMutex);
+  mndbOsCondFree(pW->pCond);
+  pPager->stat.nBgWrite += pW->nWrite;
+  pager_merge_io(&pPager->stat.write, &pW->write);
+  mndbOsFreeArena(pW->aData, MNDB_BGW_SLOTS*pPager->pageSize);
+  if( pW->aPack ) mndbOsFreeArena(pW->aPack, N_PACK_BATCH*pPager->szSlot);
+  mndbFree(pW);
+  pPager->pWriter = 0;
+}
+
+/*
+** When this routine is called, the pager has the journal file open and
+** a write lock on the database.  This routine releases the database
+** write lock and acquires a read lock in its place.  The journal file
+** is deleted and closed.
+**
+** TODO: Consider keeping the journal file open for temporary databases.
+** This might give a performance improvement on windows where opening
+** a file is an expensive operation.
+*/
+static int pager_unwritelock(Pager *pPager){
+  // error 
+  if(pPager->state < MNDB_WRITELOCK) return MNDB_OK;
+
+  assert(pPager->dirtyFile == 0);
+  
+  int rc;
+  pPager->noVersion = 0;
+  /* Pages handed to the background writer belong to this transaction.
   */
-	      //  CLR_PAGER(pPager);
-  if( pPager->zFilename!=(char*)&pPager[1] ){
-    assert( 0 );  /* Cannot happen */
-    mndbFree(pPager->zFilename);
-    mndbFree(pPager->zDirectory);
+  if( pager_bgw_drain(pPager)!=MNDB_OK ){
+    pPager->errMask |= PAGER_ERR_DISK;
+  }
+  if( pPager->memDb ){
+    pPager->state = MNDB_READLOCK;
+    return MNDB_OK;
+  }
+  if( pPager->pWal ){
+    mndbWalEndWrite(pPager->pWal);
+    pPager->state = MNDB_READLOCK;
+    return MNDB_OK;
+  }
+  rc = mndbOsReadLock(&pPager->fd);
+  if(rc == MNDB_OK){
+    pPager->state = MNDB_READLOCK;
+  }
+  else{
+    /* This can only happen if a process does a BEGIN, then forks and the
+    ** child process does the COMMIT.  Because of the semantics of unix
+    ** file locking, the unlock will fail.
+    */
+    pPager->state = MNDB_UNLOCK;
+  }
+  return rc; 
+}
+
+/*
+** Compute the size of a frame from the page size and the amount of
+** extra space, and the size of the slot of a page in the file.  In a
+** compressed file a slot has room for the header and a page that did
+** not compress, and is kept a multiple of the file system block so
+** that the holes punched in it are whole blocks.
+*/
+static void pager_frame_geometry(Pager *pPager){
+  pPager->szExtra = ROUND_UP(pPager->nExtra, 8);
+  pPager->szFrame = ROUND_UP(pPager->szExtra + (int)sizeof(PgHdr),
+                             pPager->szAlign) + pPager->pageSize;
+  pPager->szSlot = pPager->pageSize;
+  if( pPager->useCompress ){
+    pPager->szSlot += pPager->pageSize<PAGER_MAX_PAD ? pPager->pageSize
+                                                     : PAGER_MAX_PAD;
+  }
+}
+
+/*
+** Give every arena back to the operating system.  The cache must be
+** empty.
+*/
+static void pager_free_arenas(Pager *pPager){
+  PgArena *pArena, *pNext;
+  for(pArena = pPager->pArena; pArena; pArena = pNext){
+    pNext = pArena->pNext;
+    mndbOsFreeArena(pArena, pArena->nByte);
+  }
+  pPager->pArena = 0;
+  pPager->pArenaCur = 0;
+}
+
+/*
+** Get a new frame for a page.  Frames are taken from the current arena
+** in order.  A new arena is added when all of them are used up.  It is
+** sized for the pages the cache may still need, up to MNDB_ARENA_SIZE
+** bytes, or rounded to a whole number of huge pages if those are in use.
+**
+** Return NULL if there is no memory.
+*/
+static PgHdr *pager_alloc_frame(Pager *pPager){
+  PgArena *pArena = pPager->pArenaCur;
+  PgArena **ppTail;
+  char *aData;
+  while( pArena && pArena->nUsed==pArena->nFrame ){
+    pArena = pArena->pNext;
+  }
+  if( pArena==0 ){
+    int nWant = pPager->mxPage - pPager->nPage;
+    int nHdr = sizeof(PgArena) + pPager->szAlign;
+    int nByte;
+    if( nWant<1 ){
+      /* The cache of a ":memory:" database has no limit.  Let it double */
+      nWant = pPager->memDb ? pPager->nPage : 1;
+      if( nWant<1 ) nWant = 1;
+    }
+    if( nWant > (MNDB_ARENA_SIZE-nHdr)/pPager->szFrame ){
+      nWant = (MNDB_ARENA_SIZE-nHdr)/pPager->szFrame;
+      if( nWant<1 ) nWant = 1;
+    }
+    nByte = nHdr + nWant*pPager->szFrame;
+    if( pPager->useHugePages ){
+      nByte = ROUND_UP(nByte, MNDB_HUGE_PAGE_SIZE);
+    }
+    pArena = mndbOsAllocArena(nByte, pPager->useHugePages);
+    if( pArena==0 ){
+      return 0;
+    }
+    pArena->pNext = 0;
+    pArena->nByte = nByte;
+    pArena->nUsed = 0;
+    pArena->aFrame = (char*)ROUND_UP((size_t)&pArena[1], pPager->szAlign);
+    pArena->nFrame = (int)(((char*)pArena + nByte - pArena->aFrame)
+                                 / pPager->szFrame);
+    for(ppTail=&pPager->pArena; *ppTail; ppTail=&(*ppTail)->pNext){}
+    *ppTail = pArena;
+  }
+  pPager->pArenaCur = pArena;
+  aData = &pArena->aFrame[pArena->nUsed*pPager->szFrame + pPager->szFrame
+                          - pPager->pageSize];
+  pArena->nUsed++;
+  return DATA_TO_PGHDR(aData);
+}
+
+/*
+** Unlock the database and clear the in-memory cache.  This routine
+** sets the state of the pager back to what it was when it was first
+** opened.  Any outstanding pages are invalidated and subsequent attempts
+** to access those pages will likely result in a coredump.
+*/
+static void pager_reset(Pager *pPager){
+  PgArena *pArena;
+  int i;
+  for(pArena = pPager->pArena; pArena; pArena = pArena->pNext){
+    pArena->nUsed = 0;
+  }
+  pPager->pArenaCur = pPager->pArena;
+  
+  pPager->nA1 = 0;
+  pPager->pAll = 0;
+  pPager->pDirty = 0;
+  pPager->nDirtyFree = 0;
+  pPager->dirtyFile = 0;
+  for(i=0; i<PAGER_N_SHARD; i++){
+    PgShard *pShard = &pPager->aShard[i];
+    int j;
+    mndbOsMutexEnter(pShard->pLatch);
+    if( pShard->aSlot ){
+      memset(pShard->aSlot, 0, pShard->nSlot*sizeof(PgSlot));
+    }
+    pShard->nSlotUsed = 0;
+    pShard->pFirst = pShard->pLast = 0;
+    pShard->pFirstDirty = pShard->pLastDirty = 0;
+    pShard->pFirstA1 = pShard->pLastA1 = 0;
+    pShard->pFirstDirtyA1 = pShard->pLastDirtyA1 = 0;
+    for(j=0; j<PAGER_N_HOLD; j++){
+      pShard->aHold[j].pFirst = pShard->aHold[j].pLast = 0;
+      pShard->aHold[j].n = 0;
+    }
+    mndbOsMutexLeave(pShard->pLatch);
+  }
+  pPager->nPage = 0;
+  if( pPager->aExtent ){
+    memset(pPager->aExtent, 0, pPager->nExtent*sizeof(u32));
+  }
+}
+
+/*
+** Drop every lock on the database file.  This is called when the last
+** page reference is released.  Pages in the cache are kept, but they
+** may not be used again until pager_validate_cache() has checked them
+** under a new read lock.
+*/
+static void pager_unlock(Pager *pPager){
+  //simply report the when lockstate >= write
+  //assert(pPager->state >= MNDB_WRITELOCK);
+  pager_unwritelock(pPager);
+  pPager->state = MNDB_UNLOCK;
+  mndbOsAtomicStore(&pPager->nRef, 0);
+  if( pPager->memDb ){
+    return;
+  }
+  if( pPager->pWal ){
+    mndbWalEndRead(pPager->pWal);
+  }else{
+    mndbOsUnlock(&pPager->fd);
+  }
+  pPager->dbSize = -1;
+}
+
+/*
+** Drop the mapping of the database file, if there is one.
+*/
+static void pager_unmap(Pager *pPager){
+  mndbOsUnmapFile(pPager->pMap, pPager->szMap);
+  pPager->pMap = 0;
+  pPager->szMap = 0;
+}
+
+/*
+** Read the change counter and the format word from the header of the
+** database file.  *pIsCompressed is set to 1 for a compressed file, to
+** 0 for a plain one and to -1 if the file is too short to tell, as a
+** new file is.  A file too short to hold the counter has a counter of
+** zero.
+*/
+static int pager_read_header(Pager *pPager, u32 *piChange,
+                             int *pIsCompressed){
+  double rStart;
+  u32 aHdr[2];
+  off_t n;
+  int nByte;
+  int rc;
+  *piChange = 0;
+  *pIsCompressed = -1;
+  rc = mndbOsFileSize(&pPager->fd, &n);
+  if( rc!=MNDB_OK ) return rc;
+  if( n<MNDB_CHANGE_COUNTER_OFFSET+4 ) return MNDB_OK;
+  assert( MNDB_FORMAT_OFFSET==MNDB_CHANGE_COUNTER_OFFSET+4 );
+  nByte = n<MNDB_FORMAT_OFFSET+4 ? 4 : 8;
+  mndbOsClock(&rStart);
+  rc = mndbOsReadAt(&pPager->fd, aHdr, nByte, MNDB_CHANGE_COUNTER_OFFSET);
+  pager_record_io(&pPager->stat.read, nByte, rStart);
+  if( rc!=MNDB_OK ) return rc;
+  *piChange = aHdr[0];
+  if( nByte==8 ){
+    *pIsCompressed = aHdr[1]==MNDB_FORMAT_COMPRESSED;
+  }
+  return MNDB_OK;
+}
+
+/*
+** Switch the pager between the plain and the compressed layout of the
+** database file.  No page may be referenced.  The cache is emptied,
+** since the slot buffers and what is known about the slots belong to
+** the old layout.  A compressed file cannot be mapped.
+**
+** The background writer is started again for the new layout.  If that
+** fails the layout is switched all the same, the writer is left off
+** and the error is returned.
+*/
+static int pager_set_format(Pager *pPager, int useCompress){
+  int rc = MNDB_OK;
+  pager_reset(pPager);
+  pager_pack_free(pPager);
+  if( pPager->pWriter ){
+    /* The writer has slot buffers of its own */
+    int pctClean = pPager->pWriter->nKeepClean*100/pPager->mxPage;
+    pager_bgw_stop(pPager);
+    pPager->useCompress = useCompress;
+    pager_frame_geometry(pPager);
+    rc = pager_bgw_start(pPager, pctClean);
+  }
+  pPager->useCompress = useCompress;
+  pager_frame_geometry(pPager);
+  if( useCompress ){
+    pager_unmap(pPager);
+    pPager->useMmap = 0;
+  }
+  pPager->dbSize = -1;
+  return rc;
+}
+
+/*
+** Return true if the database file is, or is about to be made,
+** compressed.  The layout of a file is only adopted when it is locked,
+** so the header of the file is looked at as well.
+*/
+static int pager_is_compressed(Pager *pPager){
+  u32 iChange;
+  int isCompressed;
+  if( pPager->useCompress ) return 1;
+  if( pager_read_header(pPager, &iChange, &isCompressed)!=MNDB_OK ){
+    return 0;
+  }
+  return isCompressed>0;
+}
+
+/*
+** Another connection has committed to the database file.  The old
+** images this pager kept do not show what it changed, so no snapshot
+** that is open can go on, and the commit is counted like one of our own
+** so that no snapshot begun from now on reads an image older than it.
+*/
+static void pager_snapshot_stale(Pager *pPager){
+  PagerSnap *pSnap;
+  pPager->iSeq++;
+  for(pSnap=pPager->pSnap; pSnap; pSnap=pSnap->pNext){
+    pSnap->isStale = 1;
+  }
+}
+
+/*
+** This routine is called right after a read lock has been acquired
+** with nothing in the cache referenced.  Pages left over from before
+** the lock was last released are still good if the change counter in
+** the file header is the one we saw, or wrote, last time.  Otherwise
+** some other connection has committed to the file and the whole
+** cache is thrown away.
+*/
+static int pager_validate_cache(Pager *pPager){
+  u32 iChange;
+  int isCompressed;
+  int rc;
+  rc = pager_read_header(pPager, &iChange, &isCompressed);
+  if( rc!=MNDB_OK ){
+    pager_reset(pPager);
+    return rc;
+  }
+  if( isCompressed>=0 && isCompressed!=pPager->useCompress ){
+    /* The file was created in the other layout */
+    rc = pager_set_format(pPager, isCompressed);
+  }else if( iChange!=pPager->iChange ){
+    if( pPager->nPage>0 ){
+      pager_reset(pPager);
+      pPager->stat.nStale++;
+    }
+    pager_snapshot_stale(pPager);
+  }
+  pPager->iChange = iChange;
+  return rc;
+}
+
+/*
+** Make the mapping of the database file cover every whole page in the
+** file.  This is called with a read lock held, so the file cannot
+** shrink while the mapping is in use.  If the file cannot be mapped
+** pages are read the ordinary way.
+*/
+static void pager_map(Pager *pPager){
+  off_t n;
+  void *pMap;
+  if( mndbOsFileSize(&pPager->fd, &n)!=MNDB_OK ){
+    pager_unmap(pPager);
+    return;
+  }
+  n -= n % pPager->pageSize;
+  if( n==pPager->szMap && pPager->pMap ) return;
+  pager_unmap(pPager);
+  if( n>0 && mndbOsMapFile(&pPager->fd, n, &pMap)==MNDB_OK ){
+    pPager->pMap = pMap;
+    pPager->szMap = n;
+  }
+}
+
+/*
+** Open the write-ahead log.  The commit and sync counts of the log are
+** shared with other connections, so mndbpager_stats() reports how far
+** they have moved since this point.
+*/
+static int pager_wal_open(Pager *pPager){
+  int rc;
+  rc = mndbWalOpen(&pPager->fd, pPager->zFilename, &pPager->pWal);
+  if( rc==MNDB_OK ){
+    mndbWalSyncStats(pPager->pWal, &pPager->nWalCommitBase,
+                     &pPager->nWalSyncBase);
+  }
+  return rc;
+}
+
+/*
+** Start a read transaction on the write-ahead log, opening the log first
+** if need be.  This takes the place of the read lock in WAL mode.  The
+** cache is discarded if another connection has committed since this
+** one last looked.
+*/
+static int pager_wal_begin_read(Pager *pPager){
+  int isChanged = 0;
+  int rc;
+  if( pPager->pWal==0 ){
+    rc = pager_wal_open(pPager);
+    if( rc!=MNDB_OK ) return rc;
+  }
+  rc = mndbWalBeginRead(pPager->pWal, pPager->pageSize, &isChanged);
+  if( rc!=MNDB_OK ) return rc;
+  if( isChanged ){
+    pager_reset(pPager);
+    pPager->stat.nStale++;
+    pager_snapshot_stale(pPager);
+  }
+  pPager->state = MNDB_READLOCK;
+  return MNDB_OK;
+}
+
+/*
+** Open a temporary file.  Write the name of the file into zName
+** (zName must be at least MNDB_TEMPNAME_SIZE bytes long.)  Write
+** the file descriptor into *fd.  Return MNDB_OK on success or some
+** other error code if we fail.
+**
+** The OS will automatically delete the temporary file when it is
+** closed.
+*/
+static int mndbpager_opentemp(char *zFile, OsFile *fd){
+  int cnt = 8;
+  int rc;
+  do{
+    cnt--;
+    mndbOsTempFileName(zFile);
+    rc = mndbOsOpenExclusive(zFile, fd, 1);
+  }while( cnt>0 && rc!=MNDB_OK );
+  return rc;
+}
+
+/*
+** Set up the latch of the pager and the empty shards of its hash table,
+** each with a latch and a condition of its own.
+*/
+static int pager_alloc_latches(Pager *pPager){
+  int i;
+  pPager->pLatch = mndbOsMutexAlloc();
+  for(i=0; i<PAGER_N_SHARD; i++){
+    PgShard *pShard = &pPager->aShard[i];
+    memset(pShard, 0, sizeof(*pShard));
+    pShard->pLatch = mndbOsMutexAlloc();
+    pShard->pCond = mndbOsCondAlloc();
+    pShard->nSlotShift = 32;
+    if( pShard->pLatch==0 || pShard->pCond==0 ) return MNDB_NOMEM;
+  }
+  return pPager->pLatch ? MNDB_OK : MNDB_NOMEM;
+}
+
+/*
+** Free the hash table and the latches.
+*/
+static void pager_free_latches(Pager *pPager){
+  int i;
+  for(i=0; i<PAGER_N_SHARD; i++){
+    mndbFree(pPager->aShard[i].aSlot);
+    mndbOsMutexFree(pPager->aShard[i].pLatch);
+    mndbOsCondFree(pPager->aShard[i].pCond);
+  }
+  mndbOsMutexFree(pPager->pLatch);
+}
+
+/*
+** Create a new page cache and put a pointer to the page cache in *ppPager.
+** The file to be cached need not exist.  The file is not locked until
+** the first call to sqlitepager_get() and is only held open until the
+** last page is released using sqlitepager_unref().
+**
+** If zFilename is NULL then a randomly-named temporary file is created
+** and used as the file to be cached.  The file will be deleted
+** automatically when it is closed.
+**
+** If zFilename is ":memory:" there is no file at all.  Every page lives
+** in the cache, which grows as needed, and neither the operating system
+** layer nor locking is used.  The database goes away when the pager is
+** closed.  There is nothing to roll back to, so changes are kept even
+** when they are not committed.  WAL mode, memory mapped reads, direct
+** I/O, compression and the background writer have nothing to work on,
+** and MNDB_ERROR is returned if they are turned on.
+**
+** In a build with THREADSAFE the pager may be shared by several threads,
+** which then share one cache.  Any of them may get, look up and release
+** pages at the same time.  Writing is for one thread at a time, from
+** mndbpager_begin() to mndbpager_commit(), and the mndbpager_set_*()
+** routines are for before the pager is shared.  See mndbpager_get().
+*/
+  int mndbpager_open(Pager **ppPager, const char *zFilename, int mxPage, int nExtra){
+  Pager *pPager;
+  char *zFullPathname;
+  int nameLen;
+  OsFile fd;
+  int rc, i;
+  int tempFile;
+  int memDb = 0;
+  int readOnly = 0;
+  char zTemp[MNDB_TEMPNAME_SIZE];
+
+  *ppPager = 0;
+  if(mndb_malloc_failed){
+    return MNDB_NOMEM;
+  }
+  if( zFilename && strcmp(zFilename, ":memory:")==0 ){
+    memset(&fd, 0, sizeof(fd));
+    zFullPathname = mndbStrDup(zFilename);
+    rc = MNDB_OK;
+    tempFile = 1;
+    memDb = 1;
+  }else if(zFilename && zFilename[0]){
+    zFullPathname = mndbOsFullPathname(zFilename);
+    rc = mndbOsOpenReadWrite(zFullPathname, &fd, &readOnly);
+    tempFile = 0;
+  }else{
+    rc = mndbpager_opentemp(zTemp, &fd);
+    zFilename = zTemp;
+    zFullPathname = mndbOsFullPathname(zFilename);
+    tempFile = 1;
+  }
+  
+  if(mndb_malloc_failed) return MNDB_NOMEM;
+  if( rc!=MNDB_OK ){
+    mndbFree(zFullPathname);
+    return MNDB_CANTOPEN;
+  } 
+  nameLen = strlen(zFullPathname);
+  pPager = mndbMalloc( sizeof(*pPager) + nameLen*2 + 30 ); // 因为filename filedirectory 的空间也存储在此后
+
+  if( pPager==0 ){
+    if( !memDb ) mndbOsClose(&fd);
+    mndbFree(zFullPathname);
+    return MNDB_NOMEM;
+  }
+
+  pPager->zFilename = (char*)&pPager[1];
+  pPager->zDirectory = &pPager->zFilename[nameLen+1];
+  strcpy(pPager->zFilename, zFullPathname);
+  strcpy(pPager->zDirectory, zFullPathname);
+  for(i=nameLen; i>0 && pPager->zDirectory[i-1]!='/'; i--){}
+  if( i>0 ) pPager->zDirectory[i-1] = 0;
+  mndbFree(zFullPathname);
+
+  pPager->fd = fd;
+  pPager->nRef = 0;
+  pPager->dbSize = -1;
+  pPager->nPage = 0;
+  pPager->mxPage = mxPage>5 ? mxPage : 10;
+  pPager->state = MNDB_UNLOCK;
+  pPager->errMask = 0;
+  pPager->tempFile = tempFile;
+  pPager->memDb = memDb;
+  if( memDb ) pPager->dbSize = 0;
+  pPager->nChunk = memDb ? 0 : MNDB_CHUNK_SIZE;
+  pPager->szAlloc = 0;
+  pPager->readOnly = readOnly;
+  pPager->ePolicy = MNDB_CACHE_LRU;
+  pPager->nA1 = 0;
+  pPager->aGhost = 0;
+  pPager->nGhost = 0;
+  pPager->iGhost = 0;
+  mndbHashInit(&pPager->ghostHash, MNDB_HASH_INT, 0);
+  pPager->pAll = 0;
+  pPager->pDirty = 0;
+  pPager->nDirtyFree = 0;
+  pPager->pWriter = 0;
+  pPager->pageSize = MNDB_PAGE_SIZE;
+  pPager->nExtra = nExtra;
+  pPager->szAlign = MNDB_FRAME_ALIGN;
+  pPager->useDirect = 0;
+  pPager->useCompress = 0;
+  pPager->aExtent = 0;
+  pPager->nExtent = 0;
+  pPager->aPack = 0;
+  pPager->pLoadPack = 0;
+  pPager->iVictim = 0;
+  pager_frame_geometry(pPager);
+  pPager->useHugePages = 0;
+  pPager->pArena = 0;
+  pPager->pArenaCur = 0;
+  pPager->nHitShared = 0;
+  pPager->iSeq = 0;
+  pPager->useVersion = 0;
+  pPager->wantVersion = 0;
+  pPager->noVersion = 0;
+  pPager->pSnap = 0;
+  mndbHashInit(&pPager->versions, MNDB_HASH_INT, 0);
+  pPager->pFirstVer = pPager->pLastVer = 0;
+  pPager->nVersion = 0;
+  if( pager_alloc_latches(pPager)!=MNDB_OK ){
+    pager_free_latches(pPager);
+    if( !memDb ) mndbOsClose(&fd);
+    mndbFree(pPager);
+    return MNDB_NOMEM;
+  }
+  for(i=0; i<PAGER_N_SHARD; i++){
+    PgHold *aHold = pPager->aShard[i].aHold;
+    aHold[0].mx = pager_hold_share(pPager->mxPage*MNDB_HOLD_INTERIOR/100);
+    aHold[1].mx = pager_hold_share(pPager->mxPage*MNDB_HOLD_ROOT/100);
+  }
+  pPager->pWal = 0;
+
+  /* A log left behind by a connection in WAL mode holds committed
+  ** changes that are not in the database file yet, so it has to be
+  ** used.  The log is copied back and deleted when the last connection
+  ** in WAL mode closes.
+  */
+  pPager->useWal = 0;
+  if( !tempFile ){
+    char *zWal = mndbMalloc( nameLen+5 );
+    if( zWal ){
+      strcpy(zWal, pPager->zFilename);
+      strcat(zWal, "-wal");
+      pPager->useWal = mndbOsFileExists(zWal);
+      mndbFree(zWal);
+    }
+  }
+  *ppPager = pPager;
+  return MNDB_OK;
+}  
+  
+/*
+** Set the destructor for this pager.  If not NULL, the destructor is called
+** when the reference count on each page reaches zero.  The destructor can
+** be used to clean up information in the extra segment appended to each page.
+**
+** The destructor is not called as a result sqlitepager_close().  
+** Destructors are only called by sqlitepager_unref().
+*/
+void mndbpager_set_destructor(Pager *pPager, void (*xDesc)(void*)){
+  pPager->xDestructor = xDesc;
+}
+
+/*
+** Change the page size used by the pager and the number of extra bytes
+** appended to each in-memory page.  The page size must be a power of
+** two between MNDB_MIN_PAGE_SIZE and MNDB_MAX_PAGE_SIZE.
+**
+** The page size can only be changed while no page is referenced, which
+** is to say before the first page is acquired or after the last page
+** has been released.  MNDB_MISUSE is returned otherwise.  Any pages
+** still cached are discarded.  If the background writer cannot be
+** started again for the new size, the size is changed all the same, the
+** writer is left off and the error is returned.
+*/
+int mndbpager_set_pagesize(Pager *pPager, int pageSize, int nExtra){
+  int rc;
+  if( pageSize<MNDB_MIN_PAGE_SIZE || pageSize>MNDB_MAX_PAGE_SIZE
+        || (pageSize & (pageSize-1))!=0 ){
+    return MNDB_ERROR;
+  }
+  if( mndbOsAtomicLoad(&pPager->nRef)>0 ){
+    return MNDB_MISUSE;
+  }
+  if( pPager->useDirect && pageSize<pPager->fd.directAlign ){
+    return MNDB_ERROR;
+  }
+  if( pPager->memDb && pPager->dbSize>0 ){
+    /* The cache is all there is of the database */
+    return MNDB_MISUSE;
+  }
+  pager_reset(pPager);
+  if( pPager->pageSize!=pageSize || pPager->nExtra!=nExtra ){
+    pager_free_arenas(pPager);
+  }
+  pager_pack_free(pPager);
+  rc = MNDB_OK;
+  if( pPager->pWriter && pPager->pageSize!=pageSize ){
+    /* The ring of the background writer holds whole pages */
+    int pctClean = pPager->pWriter->nKeepClean*100/pPager->mxPage;
+    pager_bgw_stop(pPager);
+    pPager->pageSize = pageSize;
+    pager_frame_geometry(pPager);
+    rc = pager_bgw_start(pPager, pctClean);
+  }
+  pPager->pageSize = pageSize;
+  pPager->nExtra = nExtra;
+  pager_frame_geometry(pPager);
+  if( !pPager->memDb ) pPager->dbSize = -1;
+  return rc;
+}
+
+/*
+** Ask for the memory of the page cache to be backed by huge pages,
+** when the operating system can provide them.  This applies to memory
+** allocated from now on.
+*/
+void mndbpager_set_hugepages(Pager *pPager, int useHugePages){
+  pPager->useHugePages = useHugePages!=0;
+}
+
+/*
+** Turn memory mapped reads on or off.  While they are on, the database
+** file is mapped into memory whenever it is locked, and a page that is
+** not in the cache is copied out of the mapping instead of being read
+** with a system call.  The mapping uses the pages that the operating
+** system caches for the file, so processes that open the same file
+** share one copy of it.  Pages are still written with ordinary writes.
+**
+** This is not a zero-copy mode.  It saves the system call of a cache
+** miss but not the copy: pages handed out by mndbpager_get() are always
+** private copies held in the cache.  Pointing them straight into the
+** mapping is not possible because every page carries its header and
+** the extra space of the layer above right in front of the data.
+**
+** Neither direct I/O nor a compressed file can be mapped.  MNDB_MISUSE
+** is returned for those, and if any page is referenced.
+*/
+int mndbpager_set_mmap(Pager *pPager, int useMmap){
+  if( useMmap && pPager->memDb ){
+    return MNDB_ERROR;
+  }
+  if( mndbOsAtomicLoad(&pPager->nRef)>0 || (useMmap && pPager->useDirect)
+   || (useMmap && pager_is_compressed(pPager)) ){
+    return MNDB_MISUSE;
+  }
+  if( !useMmap ){
+    pager_unmap(pPager);
+  }
+  pPager->useMmap = useMmap!=0;
+  return MNDB_OK;
+}
+
+/*
+** Turn direct I/O on or off for the database file.  With direct I/O the
+** file is read and written around the cache of the operating system,
+** so a page is held in memory once, by this cache, and not a second
+** time by the kernel.  How much memory the database takes is then set
+** by the size of this cache alone.
+**
+** Page data in the cache is aligned as the file system needs.  If that
+** alignment is larger than the page size, direct I/O cannot be used and
+** MNDB_ERROR is returned, as it is where direct I/O is not available.
+** Memory mapped reads go through the cache of the operating system, so
+** they cannot be used together with direct I/O.
+**
+** This can only be changed while no page is referenced.  MNDB_MISUSE
+** is returned otherwise.
+*/
+int mndbpager_set_direct(Pager *pPager, int useDirect){
+  int align;
+  int rc;
+  if( mndbOsAtomicLoad(&pPager->nRef)>0 || (useDirect && pPager->useMmap) ){
+    return MNDB_MISUSE;
+  }
+  if( useDirect && pPager->memDb ){
+    return MNDB_ERROR;
+  }
+  useDirect = useDirect!=0;
+  if( useDirect==pPager->useDirect ){
+    return MNDB_OK;
+  }
+  rc = mndbOsSetDirect(&pPager->fd, useDirect, &align);
+  if( rc!=MNDB_OK ){
+    return rc;
+  }
+  if( align>pPager->pageSize
+   || (pPager->useCompress && align>PAGER_MAX_PAD) ){
+    mndbOsSetDirect(&pPager->fd, 0, &align);
+    return MNDB_ERROR;
+  }
+  if( align<MNDB_FRAME_ALIGN ) align = MNDB_FRAME_ALIGN;
+  if( align!=pPager->szAlign ){
+    /* Frames are laid out for the old alignment */
+    pager_reset(pPager);
+    pager_free_arenas(pPager);
+    pPager->szAlign = align;
+    pager_frame_geometry(pPager);
+  }
+  pPager->useDirect = useDirect;
+  return MNDB_OK;
+}
+
+/*
+** Turn page compression on or off for a new database file.  In a
+** compressed file every page but the first is compressed before it is
+** written, and only as many file system blocks as it then needs are
+** kept in the file.  The layer above still sees whole pages.  Pages of
+** text or sparse records often shrink to half their size or less.  The
+** saving is largest when pages are several times as large as a block
+** of the file system.  See the comment ahead of pager_offset() for the
+** layout of the file.
+**
+** Whether a file is compressed is decided when it is created, and is
+** recorded in it.  An existing file is always opened in the layout it
+** has, and MNDB_ERROR is returned for an attempt to change that.  A
+** compressed file cannot be used in WAL mode or mapped into memory, so
+** MNDB_MISUSE is returned if either is turned on, as it is if any page
+** is referenced.
+*/
+int mndbpager_set_compress(Pager *pPager, int useCompress){
+  u32 iChange;
+  int isCompressed;
+  int rc;
+  if( mndbOsAtomicLoad(&pPager->nRef)>0 ){
+    return MNDB_MISUSE;
+  }
+  useCompress = useCompress!=0;
+  if( useCompress && pPager->memDb ){
+    return MNDB_ERROR;
+  }
+  if( useCompress && (pPager->useWal || pPager->useMmap) ){
+    return MNDB_MISUSE;
+  }
+  if( useCompress && pPager->szAlign>PAGER_MAX_PAD ){
+    return MNDB_ERROR;
+  }
+  rc = pager_read_header(pPager, &iChange, &isCompressed);
+  if( rc!=MNDB_OK ){
+    return rc;
+  }
+  if( isCompressed>=0 && isCompressed!=useCompress ){
+    return MNDB_ERROR;
+  }
+  if( useCompress!=pPager->useCompress ){
+    rc = pager_set_format(pPager, useCompress);
+  }
+  return rc;
+}
+
+/*
+** Turn WAL mode on or off.  In WAL mode a commit appends the changed
+** pages to a write-ahead log instead of writing them into the database
+** file, readers see the database as it was when their read transaction
+** began, and readers and a writer do not block each other.  The log is
+** copied back into the database by checkpoints, which happen when it
+** grows long, when mndbpager_checkpoint() is called and when the last
+** connection leaves WAL mode.  See wal.c for the details.
+**
+** While a connection of this process is in WAL mode, other processes
+** cannot use the database.  A compressed file cannot be used in WAL
+** mode, since checkpoints copy plain pages into the file.
+**
+** This can only be changed while no page is referenced.  MNDB_MISUSE
+** is returned otherwise, and for a compressed file.
+*/
+int mndbpager_set_wal(Pager *pPager, int useWal){
+  if( useWal && pPager->memDb ){
+    return MNDB_ERROR;
+  }
+  if( mndbOsAtomicLoad(&pPager->nRef)>0
+   || (useWal && pager_is_compressed(pPager)) ){
+    return MNDB_MISUSE;
+  }
+  if( !useWal && pPager->pWal ){
+    mndbWalClose(pPager->pWal);
+    pPager->pWal = 0;
+    pager_reset(pPager);
+  }
+  pPager->useWal = useWal!=0;
+  return MNDB_OK;
+}
+
+/*
+** Copy as much of the write-ahead log into the database file as the
+** read transactions of other connections allow.  This is a no-op
+** outside of WAL mode.
+*/
+static int pager_checkpoint(Pager *pPager){
+  if( pPager->pWal==0 ){
+    return MNDB_OK;
+  }
+  return mndbWalCheckpoint(pPager->pWal);
+}
+int mndbpager_checkpoint(Pager *pPager){
+  int rc;
+  mndbOsMutexEnter(pPager->pLatch);
+  rc = pager_checkpoint(pPager);
+  mndbOsMutexLeave(pPager->pLatch);
+  return rc;
+}
+
+/*
+** Turn the background writer on or off.  While it is on, a thread of
+** its own writes out dirty pages that nobody references, so that
+** pctClean percent of the cache is kept clean and a cache miss almost
+** never has to write a page before it can read one.  A pctClean of 0
+** turns the writer off.
+**
+** This can only be done while no page is referenced.  MNDB_ERROR is
+** returned if the library was built without thread support.
+*/
+int mndbpager_set_bgwriter(Pager *pPager, int pctClean){
+  if( mndbOsAtomicLoad(&pPager->nRef)>0 ){
+    return MNDB_MISUSE;
+  }
+  if( pctClean>100 ) pctClean = 100;
+  if( pctClean<=0 ){
+    pager_bgw_stop(pPager);
+    return MNDB_OK;
+  }
+  if( pPager->memDb ){
+    return MNDB_ERROR;
+  }
+  if( pPager->pWriter ){
+    pPager->pWriter->nKeepClean = pPager->mxPage*pctClean/100;
+    if( pPager->pWriter->nKeepClean<1 ) pPager->pWriter->nKeepClean = 1;
+    return MNDB_OK;
+  }
+  return pager_bgw_start(pPager, pctClean);
+}
+
+/*
+** Reserve space in the database file nPage pages at a time as it grows,
+** rather than letting every commit that adds pages extend it by exactly
+** those.  Bulk inserts then do not update the metadata of the file on
+** each commit, and the file is laid out in long runs of blocks, which
+** keeps scans sequential on disk.  The size of the file, and of the
+** database, still grows a page at a time: the space past the last page
+** is reserved but not part of the file.  A commit that makes the
+** database shorter gives it back.
+**
+** An nPage of 0 or 1 turns this off.  It makes no difference to a
+** ":memory:" database, to a compressed file or in WAL mode, where the
+** database file only grows at checkpoints.
+*/
+int mndbpager_set_chunksize(Pager *pPager, int nPage){
+  if( nPage<0 ){
+    return MNDB_ERROR;
+  }
+  mndbOsMutexEnter(pPager->pLatch);
+  pPager->nChunk = pPager->memDb ? 0 : nPage;
+  mndbOsMutexLeave(pPager->pLatch);
+  return MNDB_OK;
+}
+
+/*
+** Return the page size in bytes.
+*/
+int mndbpager_pagesize(Pager *pPager){
+  return pPager->pageSize;
+}
+
+/*
+** Select the algorithm used to choose which unreferenced page is
+** recycled when the cache is full.
+**
+**   MNDB_CACHE_LRU   The page released longest ago is recycled.  This is
+**                    the default.
+**
+**   MNDB_CACHE_2Q    Simplified 2Q.  A page read from disk goes on the
+**                    A1in queue and is recycled ahead of everything else
+**                    once that queue holds more than a quarter of the
+**                    cache.  A page moves to the main (Am) LRU queue when
+**                    it is used again after more than a quarter of the
+**                    cache has been read in since it was loaded, or when
+**                    it is read again soon after being recycled from
+**                    A1in (the page numbers of such pages are remembered
+**                    in a ghost queue of half the cache size).  Repeated
+**                    use within a short window, as when a cursor steps
+**                    through the cells of a page, does not count.  A
+**                    single scan therefore cycles through A1in and
+**                    cannot push the pages in Am out of the cache.
+**
+** The policy can only be changed while no page is referenced.  Any
+** pages still cached are discarded.
+*/
+int mndbpager_set_cachepolicy(Pager *pPager, int ePolicy){
+  Pgno *aGhost = 0;
+  int nGhost = 0;
+  if( ePolicy!=MNDB_CACHE_LRU && ePolicy!=MNDB_CACHE_2Q ){
+    return MNDB_ERROR;
+  }
+  if( mndbOsAtomicLoad(&pPager->nRef)>0 || (pPager->memDb && pPager->nPage>0) ){
+    return MNDB_MISUSE;
+  }
+  if( ePolicy==MNDB_CACHE_2Q ){
+    nGhost = pPager->mxPage/2;
+    aGhost = mndbMalloc( nGhost*sizeof(Pgno) );
+    if( aGhost==0 ) return MNDB_NOMEM;
+  }
+  pager_reset(pPager);
+  mndbHashClear(&pPager->ghostHash);
+  mndbFree(pPager->aGhost);
+  pPager->aGhost = aGhost;
+  pPager->nGhost = nGhost;
+  pPager->iGhost = 0;
+  pPager->ePolicy = ePolicy;
+  return MNDB_OK;
+}
+
+/*
+** Read the first N bytes of the database file into pDest, without
+** going through the cache and without taking a lock.  This is used to
+** look at the file header, the page size in particular, before the
+** first page is acquired.  If the file is shorter than N bytes the
+** rest of pDest is zero filled.  In WAL mode the latest committed image
+** of page 1 is read from the log if it is there.  A ":memory:" database
+** has it in the cache.
+*/
+static int pager_read_fileheader(Pager *pPager, int N, unsigned char *pDest){
+  double rStart;
+  off_t n;
+  int isInWal = 0;
+  int rc;
+  memset(pDest, 0, N);
+  if( pPager->memDb ){
+    PgShard *pShard = pager_shard(pPager, 1);
+    PgHdr *pPg;
+    if( N>pPager->pageSize ) N = pPager->pageSize;
+    mndbOsMutexEnter(pShard->pLatch);
+    pPg = pager_lookup(pPager, 1);
+    if( pPg ) memcpy(pDest, PGHDR_TO_DATA(pPg), N);
+    mndbOsMutexLeave(pShard->pLatch);
+    return MNDB_OK;
+  }
+  if( pPager->useWal ){
+    if( pPager->pWal==0 ){
+      rc = pager_wal_open(pPager);
+      if( rc!=MNDB_OK ) return rc;
+    }
+    mndbOsClock(&rStart);
+    rc = mndbWalRead(pPager->pWal, 1, N, pDest, &isInWal);
+    if( isInWal ) pager_record_io(&pPager->stat.read, N, rStart);
+    if( rc!=MNDB_OK || isInWal ) return rc;
+  }
+  rc = mndbOsFileSize(&pPager->fd, &n);
+  if( rc!=MNDB_OK ) return rc;
+  if( n<N ) N = (int)n;
+  if( N==0 ) return MNDB_OK;
+  mndbOsClock(&rStart);
+  rc = mndbOsReadAt(&pPager->fd, pDest, N, 0);
+  pager_record_io(&pPager->stat.read, N, rStart);
+  return rc;
+}
+int mndbpager_read_fileheader(Pager *pPager, int N, unsigned char *pDest){
+  int rc;
+  mndbOsMutexEnter(pPager->pLatch);
+  rc = pager_read_fileheader(pPager, N, pDest);
+  mndbOsMutexLeave(pPager->pLatch);
+  return rc;
+}
+
+/*
+** Return the total number of pages in the disk file associated with
+** pPager.
+*/
+static int pager_pagecount(Pager *pPager){
+  off_t n;
+  assert( pPager!=0 );
+  if( pPager->dbSize>=0 || pPager->memDb ){
+    return pPager->dbSize;
+  }
+  if( pPager->pWal && pPager->state!=MNDB_UNLOCK
+        && (n = mndbWalDbSize(pPager->pWal))>0 ){
+    pPager->dbSize = n;
+    return n;
+  }
+  if( mndbOsFileSize(&pPager->fd, &n)!=MNDB_OK ){
+    pPager->errMask |= PAGER_ERR_DISK;
+    return 0; 
+  }
+  if( pPager->useCompress ){
+    /* The last slot ends where its page does */
+    n = (n + pPager->szSlot - 1)/pPager->szSlot;
+  }else{
+    n /= pPager->pageSize;
+  }
+  if( pPager->state!=MNDB_UNLOCK ){
+    pPager->dbSize = n;
+  }
+  return n;
+}
+int mndbpager_pagecount(Pager *pPager){
+  int n;
+  mndbOsMutexEnter(pPager->pLatch);
+  n = pager_pagecount(pPager);
+  mndbOsMutexLeave(pPager->pLatch);
+  return n;
+}
+
+/*
+** Warm restarts.  While mndbpager_set_warm() is turned on, the numbers of
+** the pages in the cache are written to a side file when the pager is
+** closed.  The file has the name of the database file with "-warm"
+** added.  Turning it on again after a restart reads those pages back in
+** with a few large reads, so that the working set does not have to be
+** built up again one cache miss at a time.  The file holds
+**
+**      | PAGER_WARM_MAGIC | page size | N | N page numbers |
+**
+** as 32-bit integers in native byte order, hottest page first.  It is
+** only a hint.  Pages are read from the database as it is when they are
+** loaded, so a file that is out of date costs nothing but the reads.
+*/
+#define PAGER_WARM_MAGIC 0x6d72574d
+#define PAGER_WARM_HDR   12
+
+/*
+** Return the name of the side file of warm restarts, obtained from
+** mndbMalloc(), or NULL if there is no memory for it.
+*/
+static char *pager_warm_name(Pager *pPager){
+  char *zWarm = mndbMalloc( strlen(pPager->zFilename)+6 );
+  if( zWarm ){
+    strcpy(zWarm, pPager->zFilename);
+    strcat(zWarm, "-warm");
+  }
+  return zWarm;
+}
+
+/*
+** Write the numbers of the pages in the cache to the side file, hottest
+** first: referenced pages, then held root and interior pages, then the
+** free lists of the main queue and of the A1in queue, each from the end
+** most recently used.  Errors are ignored, as the file is only a hint.
+*/
+static void pager_warm_save(Pager *pPager){
+  PgHdr *apList[6];
+  Pgno *aPgno;
+  char *zWarm;
+  OsFile fd;
+  u32 aHdr[3];
+  PgHdr *p;
+  int n = 0, i, j, readOnly;
+
+  aPgno = mndbMalloc( (pPager->nPage+1)*sizeof(Pgno) );
+  zWarm = pager_warm_name(pPager);
+  if( aPgno==0 || zWarm==0 ) goto warm_save_out;
+  for(p=pPager->pAll; p; p=p->pNextAll){
+    if( p->pgno && mndbOsAtomicLoad(&p->nRef)>0 ) aPgno[n++] = p->pgno;
+  }
+  for(i=0; i<6; i++){
+    for(j=0; j<PAGER_N_SHARD; j++){
+      PgShard *pShard = &pPager->aShard[j];
+      mndbOsMutexEnter(pShard->pLatch);
+      apList[0] = pShard->aHold[1].pLast;
+      apList[1] = pShard->aHold[0].pLast;
+      apList[2] = pShard->pLast;
+      apList[3] = pShard->pLastDirty;
+      apList[4] = pShard->pLastA1;
+      apList[5] = pShard->pLastDirtyA1;
+      for(p=apList[i]; p && n<pPager->nPage; p=p->pPrevFree){
+        if( p->pgno ) aPgno[n++] = p->pgno;
+      }
+      mndbOsMutexLeave(pShard->pLatch);
+    }
+  }
+  if( mndbOsOpenReadWrite(zWarm, &fd, &readOnly)!=MNDB_OK ){
+    goto warm_save_out;
+  }
+  aHdr[0] = PAGER_WARM_MAGIC;
+  aHdr[1] = pPager->pageSize;
+  aHdr[2] = n;
+  if( !readOnly && mndbOsTruncate(&fd, 0)==MNDB_OK
+   && mndbOsWrite(&fd, aHdr, PAGER_WARM_HDR)==MNDB_OK ){
+    mndbOsWrite(&fd, aPgno, n*sizeof(Pgno));
+  }
+  mndbOsClose(&fd);
+
+warm_save_out:
+  mndbFree(aPgno);
+  mndbFree(zWarm);
+}
+
+/*
+** Let go of the old page images that no snapshot can read, because it
+** has seen the commit that replaced them, or would have by the time it
+** began.  Images are kept in the order of those commits.
+*/
+static void pager_version_trim(Pager *pPager){
+  PagerSnap *pSnap;
+  PgVersion *pVer;
+  u32 iOldest = pPager->iSeq;
+  for(pSnap=pPager->pSnap; pSnap; pSnap=pSnap->pNext){
+    if( pSnap->iSeq<iOldest ) iOldest = pSnap->iSeq;
+  }
+  while( (pVer = pPager->pFirstVer)!=0 && pVer->iSeq<=iOldest ){
+    /* The oldest image kept is also the oldest of its page */
+    mndbHashInsert(&pPager->versions, 0, pVer->pgno, pVer->pNextPg);
+    pPager->pFirstVer = pVer->pNext;
+    pPager->nVersion--;
+    mndbFree(pVer);
+  }
+  if( pPager->pFirstVer==0 ) pPager->pLastVer = 0;
+}
+
+/*
+** Shutdown the page cache.  Free all memory and close all files.
+**
+** If a transaction was in progress when this routine is called, that
+** transaction is rolled back.  All outstanding pages are invalidated
+** and their memory is freed.  Any attempt to use a page associated
+** with this page cache after this function returns will likely
+** result in a coredump.  Every snapshot must have ended.
+**
+** Tudo: what if the page is dirty;
+*/
+int mndbpager_close(Pager *pPager){
+  if( pPager->useWarm ){
+    pager_warm_save(pPager);
+  }
+  pager_bgw_stop(pPager);
+  switch( pPager->memDb ? MNDB_UNLOCK : pPager->state ){
+    case MNDB_WRITELOCK:
+    case MNDB_READLOCK: {
+      mndbOsUnlock(&pPager->fd);
+      break;
+    }
+    default: {
+      /* Do nothing */
+      break;
+    }
+  }
+  if( pPager->pWal ){
+    mndbWalClose(pPager->pWal);
+  }
+  pager_unmap(pPager);
+  pager_free_arenas(pPager);
+  pager_pack_free(pPager);
+  mndbFree(pPager->aExtent);
+  pager_free_latches(pPager);
+  mndbHashClear(&pPager->ghostHash);
+  mndbFree(pPager->aGhost);
+  assert( pPager->pSnap==0 );
+  while( pPager->pFirstVer ){
+    PgVersion *pVer = pPager->pFirstVer;
+    pPager->pFirstVer = pVer->pNext;
+    mndbFree(pVer);
+  }
+  mndbHashClear(&pPager->versions);
+  if( !pPager->memDb ){
+    mndbOsClose(&pPager->fd);
+  }
+  /* Temp files are automatically deleted by the OS
+  ** if( pPager->tempFile ){
+  **   sqliteOsDelete(pPager->zFilename);
+  ** }
+  */
+	      //  CLR_PAGER(pPager);
+  if( pPager->zFilename!=(char*)&pPager[1] ){
+    assert( 0 );  /* Cannot happen */
+    mndbFree(pPager->zFilename);
+    mndbFree(pPager->zDirectory);
+  }
+  mndbFree(pPager);
+  return MNDB_OK;
+}
+
+/*
+** Return the page number for the given page data.
+*/
+Pgno mndbpager_pagenumber(void *pData){
+  PgHdr *pPg = DATA_TO_PGHDR(pData);
+  return pPg->pgno;
+}
+
+/*
+** Return a pointer to the Pager.nExtra bytes of extra space that
+** follow the page data.
+*/
+void *mndbpager_getextra(void *pData){
+  PgHdr *pPg = DATA_TO_PGHDR(pData);
+  return PGHDR_TO_EXTRA(pPg);
+}
+
+/*
+** Tell the pager what the page at pData is used for, one of the
+** MNDB_PAGE_ classes.  The class decides which free list the page goes
+** on whenever it is released, until it leaves the cache.  The page must
+** be referenced.
+*/
+void mndbpager_set_priority(void *pData, int eClass){
+  PgHdr *pPg = DATA_TO_PGHDR(pData);
+  assert( mndbOsAtomicLoad(&pPg->nRef)>0 );
+  assert( eClass>=MNDB_PAGE_LEAF && eClass<=MNDB_PAGE_ROOT );
+  if( mndbOsAtomicLoad(&pPg->eClass)!=eClass ){
+    mndbOsAtomicStore(&pPg->eClass, (u8)eClass);
+  }
+}
+
+/*
+** Add a page to the end of the list from *ppFirst to *ppLast, or to
+** the front if isCold is true.
+*/
+static void page_list_add(
+  PgHdr **ppFirst,
+  PgHdr **ppLast,
+  PgHdr *pPg,
+  int isCold
+){
+  if( isCold ){
+    pPg->pPrevFree = 0;
+    pPg->pNextFree = *ppFirst;
+    *ppFirst = pPg;
+    if( pPg->pNextFree ){
+      pPg->pNextFree->pPrevFree = pPg;
+    }else{
+      *ppLast = pPg;
+    }
+  }else{
+    pPg->pNextFree = 0;
+    pPg->pPrevFree = *ppLast;
+    *ppLast = pPg;
+    if( pPg->pPrevFree ){
+      pPg->pPrevFree->pNextFree = pPg;
+    }else{
+      *ppFirst = pPg;
+    }
+  }
+}
+
+/*
+** Remove a page from the list from *ppFirst to *ppLast.
+*/
+static void page_list_remove(PgHdr **ppFirst, PgHdr **ppLast, PgHdr *pPg){
+  if( pPg->pPrevFree ){
+    pPg->pPrevFree->pNextFree = pPg->pNextFree;
+  }else{
+    assert( *ppFirst==pPg );
+    *ppFirst = pPg->pNextFree;
+  }
+  if( pPg->pNextFree ){
+    pPg->pNextFree->pPrevFree = pPg->pPrevFree;
+  }else{
+    assert( *ppLast==pPg );
+    *ppLast = pPg->pPrevFree;
+  }
+  pPg->pNextFree = pPg->pPrevFree = 0;
+}
+
+/*
+** Free a private copy of a snapshot page, which is not referenced.
+*/
+static void page_free_copy(PgHdr *pPg){
+  PagerSnap *pSnap = pPg->pSnap;
+  mndbHashInsert(&pSnap->copies, 0, pPg->pgno, 0);
+  mndbFree(PGHDR_TO_EXTRA(pPg));
+}
+
+/*
+** A private copy of a snapshot page has lost its last reference.  Keep
+** it for the snapshot to hand out again, making room by freeing the
+** copy released longest ago.
+*/
+static void page_link_idle(PgHdr *pPg){
+  PagerSnap *pSnap = pPg->pSnap;
+  page_list_add(&pSnap->pFirst, &pSnap->pLast, pPg, 0);
+  pSnap->nIdle++;
+  if( pSnap->nIdle>MNDB_SNAP_CACHE ){
+    PgHdr *pOld = pSnap->pFirst;
+    page_list_remove(&pSnap->pFirst, &pSnap->pLast, pOld);
+    pSnap->nIdle--;
+    page_free_copy(pOld);
+  }
+}
+
+/*
+** Take a private copy of a snapshot page that is about to be referenced
+** again off the list of copies that are not.
+*/
+static void page_unlink_idle(PgHdr *pPg){
+  PagerSnap *pSnap = pPg->pSnap;
+  page_list_remove(&pSnap->pFirst, &pSnap->pLast, pPg);
+  pSnap->nIdle--;
+}
+
+/*
+** Return the first and, through *pppLast, the last entry of the free list
+** that pPg belongs on, unless it is held.  Each queue of the cache policy
+** is split in two, so that a clean page to recycle is always found at
+** the front of a list, and the dirty pages are all in one place for the
+** background writer.  The lists are those of the shard of the page.
+*/
+static PgHdr **page_free_list(PgHdr *pPg, PgHdr ***pppLast){
+  PgShard *pShard = pager_shard(pPg->pPager, pPg->pgno);
+  if( pPg->inA1 ){
+    *pppLast = pPg->dirty ? &pShard->pLastDirtyA1 : &pShard->pLastA1;
+    return pPg->dirty ? &pShard->pFirstDirtyA1 : &pShard->pFirstA1;
+  }
+  *pppLast = pPg->dirty ? &pShard->pLastDirty : &pShard->pLast;
+  return pPg->dirty ? &pShard->pFirstDirty : &pShard->pFirst;
+}
+
+/*
+** Let go of the pages held longest on a hold list of a shard until it
+** is within its budget.  They go to the end of the ordinary free list.
+** The caller holds the latch of the shard.
+*/
+static void pager_hold_trim(PgShard *pShard, PgHold *pHold){
+  PgHdr **ppFirst, **ppLast;
+  while( pHold->n>pHold->mx ){
+    PgHdr *pPg = pHold->pFirst;
+    page_list_remove(&pHold->pFirst, &pHold->pLast, pPg);
+    pHold->n--;
+    pPg->iHold = 0;
+    ppFirst = page_free_list(pPg, &ppLast);
+    page_list_add(ppFirst, ppLast, pPg, 0);
+    pShard->nDemote++;
+  }
+}
+
+/*
+** Append a page whose reference count just reached zero to the end of
+** the free list it belongs on.  Pages on the A1in queue of the 2Q
+** policy go on the A1 lists, all others on the main lists, and dirty
+** pages on the dirty list of either.  See page_free_list().
+**
+** Root and interior pages go on the aHold[] list of their class instead,
+** unless its budget is 0, and leave the A1in queue for good.  Overflow
+** pages go at the front of their list, to be recycled first: a scan of
+** large records would otherwise push everything else out of the cache,
+** and its pages are seldom wanted again soon.
+**
+** The caller holds the latch of the shard of the page.
+*/
+static void page_link_free(PgHdr *pPg){
+  Pager *pPager = pPg->pPager;
+  PgShard *pShard = pager_shard(pPager, pPg->pgno);
+  int eClass = mndbOsAtomicLoad(&pPg->eClass);
+  PgHdr **ppFirst, **ppLast;
+  PgHold *pHold;
+  if( pPg->dirty ) mndbOsAtomicAdd(&pPager->nDirtyFree, 1);
+  if( eClass>=MNDB_PAGE_INTERIOR ){
+    pHold = &pShard->aHold[eClass-MNDB_PAGE_INTERIOR];
+    if( pHold->mx>0 ){
+      if( pPg->inA1 ){
+        pPg->inA1 = 0;
+        mndbOsAtomicAdd(&pPager->nA1, -1);
+      }
+      pPg->iHold = (u8)(eClass-MNDB_PAGE_INTERIOR+1);
+      page_list_add(&pHold->pFirst, &pHold->pLast, pPg, 0);
+      pHold->n++;
+      pager_hold_trim(pShard, pHold);
+      return;
+    }
+  }
+  ppFirst = page_free_list(pPg, &ppLast);
+  page_list_add(ppFirst, ppLast, pPg, eClass==MNDB_PAGE_OVERFLOW);
+}
+
+/*
+** Remove a page from the free list it is on.  The caller holds the
+** latch of the shard of the page.
+*/
+static void page_unlink_free(PgHdr *pPg){
+  Pager *pPager = pPg->pPager;
+  if( pPg->dirty ) mndbOsAtomicAdd(&pPager->nDirtyFree, -1);
+  if( pPg->iHold ){
+    PgShard *pShard = pager_shard(pPager, pPg->pgno);
+    PgHold *pHold = &pShard->aHold[pPg->iHold-1];
+    page_list_remove(&pHold->pFirst, &pHold->pLast, pPg);
+    pHold->n--;
+    pPg->iHold = 0;
+  }else{
+    PgHdr **ppLast;
+    PgHdr **ppFirst = page_free_list(pPg, &ppLast);
+    page_list_remove(ppFirst, ppLast, pPg);
+  }
+}
+
+/*
+** Set the budget of a class of pages that are held in the cache, as a
+** percentage of the cache.  Up to that many free pages of the class
+** are kept ahead of all other free pages, and only recycled when no
+** other page is free.  Past it, the page that has been free the longest
+** is treated like any other.  A budget of 0 turns holding off for the
+** class.  The defaults are MNDB_HOLD_INTERIOR and MNDB_HOLD_ROOT.  Each
+** shard of the cache holds its share of the budget.
+**
+** Only MNDB_PAGE_INTERIOR and MNDB_PAGE_ROOT pages are held.
+** MNDB_ERROR is returned for other classes.
+*/
+static int pager_set_budget(Pager *pPager, int eClass, int pctCache){
+  int mx, i;
+  if( eClass!=MNDB_PAGE_INTERIOR && eClass!=MNDB_PAGE_ROOT ){
+    return MNDB_ERROR;
+  }
+  if( pctCache<0 ) pctCache = 0;
+  if( pctCache>100 ) pctCache = 100;
+  mx = pPager->mxPage*pctCache/100;
+  if( mx<1 && pctCache>0 ) mx = 1;
+  for(i=0; i<PAGER_N_SHARD; i++){
+    PgShard *pShard = &pPager->aShard[i];
+    PgHold *pHold = &pShard->aHold[eClass-MNDB_PAGE_INTERIOR];
+    mndbOsMutexEnter(pShard->pLatch);
+    pHold->mx = pager_hold_share(mx);
+    pager_hold_trim(pShard, pHold);
+    mndbOsMutexLeave(pShard->pLatch);
+  }
+  return MNDB_OK;
+}
+int mndbpager_set_budget(Pager *pPager, int eClass, int pctCache){
+  int rc;
+  mndbOsMutexEnter(pPager->pLatch);
+  rc = pager_set_budget(pPager, eClass, pctCache);
+  mndbOsMutexLeave(pPager->pLatch);
+  return rc;
+}
+
+/*
+** Return the page at the front of free list iList of a shard, in the
+** order pager_choose_victim() tries them, or NULL if it is empty.  The
+** caller holds the latch of the shard.
+*/
+static PgHdr *pager_shard_victim(PgShard *pShard, int iList, int useA1){
+  PgHdr *p = 0;
+  int i;
+  switch( iList ){
+    case 0:  p = useA1 ? pShard->pFirstA1 : pShard->pFirst;  break;
+    case 1:  p = useA1 ? pShard->pFirst : pShard->pFirstA1;  break;
+    case 2:  p = useA1 ? pShard->pFirstDirtyA1 : pShard->pFirstDirty;  break;
+    case 3:  p = useA1 ? pShard->pFirstDirty : pShard->pFirstDirtyA1;  break;
+    case 4: {
+      for(i=0; p==0 && i<PAGER_N_HOLD; i++){
+        for(p=pShard->aHold[i].pFirst; p && p->dirty; p=p->pNextFree){}
+      }
+      break;
+    }
+    default: {
+      for(i=0; p==0 && i<PAGER_N_HOLD; i++){
+        p = pShard->aHold[i].pFirst;
+      }
+      break;
+    }
+  }
+  return p;
+}
+
+/*
+** Choose an unreferenced page to be recycled, take it off its free list
+** and mark it busy.  Return NULL if no page is free.  Under 2Q the A1in
+** queue is drained first whenever it holds more than its share of the
+** cache.  A clean page is preferred, since recycling a dirty page means
+** writing it out first, and one is found at the front of the clean list
+** of the chosen queue or, failing that, of the other queue.  Only if no
+** clean page is free is the oldest dirty page returned, and the caller
+** has to write it.  Held root and interior pages are only taken when no
+** other page is free, interior pages first.  If onlyClean is true only
+** a clean page that is not held is taken.
+**
+** Each shard has free lists of its own.  The shards are tried in turn,
+** starting after the one the last page was recycled from, so the page
+** is the coldest of its shard rather than of the whole cache.
+*/
+static PgHdr *pager_choose_victim(Pager *pPager, int onlyClean){
+  int useA1 = 0;
+  int iList, i;
+  if( pPager->ePolicy==MNDB_CACHE_2Q ){
+    useA1 = mndbOsAtomicLoad(&pPager->nA1) > pPager->mxPage/4;
+  }
+  for(iList=0; iList<(onlyClean ? 2 : 6); iList++){
+    for(i=0; i<PAGER_N_SHARD; i++){
+      int iShard = (pPager->iVictim + i) % PAGER_N_SHARD;
+      PgShard *pShard = &pPager->aShard[iShard];
+      PgHdr *p;
+      mndbOsMutexEnter(pShard->pLatch);
+      p = pager_shard_victim(pShard, iList, useA1);
+      if( p ){
+        page_unlink_free(p);
+        p->busy = 1;
+      }
+      mndbOsMutexLeave(pShard->pLatch);
+      if( p ){
+        pPager->iVictim = (iShard+1) % PAGER_N_SHARD;
+        return p;
+      }
+    }
+  }
+  return 0;
+}
+
+/*
+** Remember that page pgno was recently recycled from the A1in queue.
+** The oldest remembered page is forgotten to make room.
+*/
+static void pager_ghost_add(Pager *pPager, Pgno pgno){
+  int i = pPager->iGhost;
+  Pgno old;
+  if( pPager->nGhost==0 ) return;
+  old = pPager->aGhost[i];
+  if( old && mndbHashFind(&pPager->ghostHash, 0, old)==(void*)(size_t)(i+1) ){
+    mndbHashInsert(&pPager->ghostHash, 0, old, 0);
+  }
+  pPager->aGhost[i] = pgno;
+  mndbHashInsert(&pPager->ghostHash, 0, pgno, (void*)(size_t)(i+1));
+  pPager->iGhost = (i+1) % pPager->nGhost;
+}
+
+/*
+** Decide which queue a page that was just read into the cache goes on.
+** Under 2Q a page goes on Am if it was recently recycled from A1in and
+** on A1in otherwise.  Under LRU there is only one queue.
+*/
+static void pager_classify_page(Pager *pPager, PgHdr *pPg){
+  pPg->inA1 = 0;
+  pPg->iRead = mndbOsAtomicLoad(&pPager->nRead);
+  if( pPager->ePolicy!=MNDB_CACHE_2Q ) return;
+  if( mndbHashFind(&pPager->ghostHash, 0, pPg->pgno) ){
+    mndbHashInsert(&pPager->ghostHash, 0, pPg->pgno, 0);
+    pPager->stat.nPromote++;
+  }else{
+    pPg->inA1 = 1;
+    mndbOsAtomicAdd(&pPager->nA1, 1);
+  }
+}
+
+/*
+** PgHdr.nRef and Pager.nRef are changed with atomic operations, since
+** threads sharing the pager take and drop references without holding
+** any latch.  Taking the first reference to a page or dropping the
+** last one moves it off or on the free lists of its shard, and is only
+** done holding the latch of the shard.  Pager.nRef counts the pages
+** that are referenced.  Its first count takes a lock on the file and its
+** last one drops the lock, so those are only done holding Pager.pLatch.
+**
+** Add N, which is 1 or -1, to the count at *pnRef and return true if
+** the count is above zero both before and after.  Otherwise return
+** false and leave it alone.
+*/
+static int ref_count_held(int *pnRef, int N){
+  int n = mndbOsAtomicLoad(pnRef);
+  while( n>0 && n+N>0 ){
+    if( mndbOsAtomicCas(pnRef, &n, n+N) ) return 1;
+  }
+  return 0;
+}
+#define page_ref_held(P)     ref_count_held(&(P)->nRef, 1)
+#define page_unref_held(P)   ref_count_held(&(P)->nRef, -1)
+#define pager_count_held(P)  ref_count_held(&(P)->nRef, 1)
+#define pager_uncount_held(P) ref_count_held(&(P)->nRef, -1)
+
+/*
+** Give the first reference to a page that is on a free list.  The caller
+** holds the latch of its shard and has counted it in Pager.nRef.  Under
+** 2Q a page that is used again long enough after it was read in moves
+** from A1in to Am.
+*/
+static void page_ref_free(PgHdr *pPg){
+  Pager *pPager = pPg->pPager;
+  assert( !pPg->busy );
+  page_unlink_free(pPg);
+  if( pPg->inA1
+   && mndbOsAtomicLoad(&pPager->nRead) - pPg->iRead > pPager->mxPage/4 ){
+    pPg->inA1 = 0;
+    mndbOsAtomicAdd(&pPager->nA1, -1);
+    pager_shard(pPager, pPg->pgno)->nPromote++;
+  }
+  mndbOsAtomicStore(&pPg->nRef, 1);
+}
+
+/*
+** Look up page pgno and add a reference to it if it is in the cache,
+** holding only the latch of its shard.  A page that is busy is waited
+** for.  A page that is not referenced is taken off the free lists, but
+** only while some other page is, since the lock on the file that comes
+** with the first reference is what keeps the cache current.  A caller
+** that holds Pager.pLatch and has taken that lock sets hasLock.
+**
+** Return the page, or NULL if it is not in the cache or Pager.pLatch is
+** needed to get it.
+*/
+static PgHdr *pager_ref_cached(Pager *pPager, Pgno pgno, int hasLock){
+  PgShard *pShard = pager_shard(pPager, pgno);
+  PgHdr *pPg;
+  mndbOsMutexEnter(pShard->pLatch);
+  while( (pPg = pager_lookup(pPager, pgno))!=0 && pPg->busy ){
+    mndbOsCondWait(pShard->pCond, pShard->pLatch);
+  }
+  if( pPg && !page_ref_held(pPg) ){
+    if( hasLock ){
+      mndbOsAtomicAdd(&pPager->nRef, 1);
+      page_ref_free(pPg);
+    }else if( pager_count_held(pPager) ){
+      page_ref_free(pPg);
+    }else{
+      pPg = 0;
+    }
+  }
+  mndbOsMutexLeave(pShard->pLatch);
+  return pPg;
+}
+
+/* 
+** Increment the refrence to the given page. If the page
+** is in the free page list, then remove it from the list.
+** The caller holds Pager.pLatch.
+*/
+#define page_ref(P) (page_ref_held(P) ? 1 : (_page_ref(P), 1))
+static void _page_ref(PgHdr *pPg){
+  Pager *pPager = pPg->pPager;
+  if( pPg->pSnap ){
+    if( mndbOsAtomicLoad(&pPg->nRef)==0 ) page_unlink_idle(pPg);
+    mndbOsAtomicAdd(&pPg->nRef, 1);
+  }else{
+    PgShard *pShard = pager_shard(pPager, pPg->pgno);
+    mndbOsMutexEnter(pShard->pLatch);
+    while( pPg->busy ){
+      mndbOsCondWait(pShard->pCond, pShard->pLatch);
+    }
+    if( !page_ref_held(pPg) ){
+      mndbOsAtomicAdd(&pPager->nRef, 1);
+      page_ref_free(pPg);
+    }
+    mndbOsMutexLeave(pShard->pLatch);
+  }
+  //test:REFINFO(pPg);
+}
+
+/*
+** Increment the reference count for a page
+*/
+int mndbpager_ref(void *pData){
+  PgHdr *p = DATA_TO_PGHDR(pData);
+  if( !page_ref_held(p) ){
+    Pager *pPager = p->pPager;
+    mndbOsMutexEnter(pPager->pLatch);
+    _page_ref(p);
+    mndbOsMutexLeave(pPager->pLatch);
+  }
+  return MNDB_OK;
+}
+
+/*
+** Add a page to the list of dirty pages held by its pager.  This
+** is a no-op if the page is already dirty.
+*/
+static void page_add_to_dirty_list(PgHdr *pPg){
+  Pager *pPager = pPg->pPager;
+  if( pPg->dirty ) return;
+  assert( mndbOsAtomicLoad(&pPg->nRef)>0 );
+  pPg->dirty = 1;
+  pPg->pPrevDirty = 0;
+  pPg->pNextDirty = pPager->pDirty;
+  if( pPager->pDirty ){
+    pPager->pDirty->pPrevDirty = pPg;
+  }
+  pPager->pDirty = pPg;
+}
+
+/*
+** Remove a page from the list of dirty pages and mark it clean.  If the
+** page is free it moves from the dirty free list of its queue to the
+** clean one, at the front if isCold is true and otherwise at the end,
+** as the most recently used.  A page that is busy is on no free list.
+*/
+static void page_remove_from_dirty_list(PgHdr *pPg, int isCold){
+  Pager *pPager = pPg->pPager;
+  PgShard *pShard;
+  if( !pPg->dirty ) return;
+  if( pPg->pPrevDirty ){
+    pPg->pPrevDirty->pNextDirty = pPg->pNextDirty;
+  }else{
+    assert( pPager->pDirty==pPg );
+    pPager->pDirty = pPg->pNextDirty;
+  }
+  if( pPg->pNextDirty ){
+    pPg->pNextDirty->pPrevDirty = pPg->pPrevDirty;
+  }
+  pPg->pNextDirty = pPg->pPrevDirty = 0;
+  pShard = pager_shard(pPager, pPg->pgno);
+  mndbOsMutexEnter(pShard->pLatch);
+  if( mndbOsAtomicLoad(&pPg->nRef)==0 && !pPg->busy ){
+    mndbOsAtomicAdd(&pPager->nDirtyFree, -1);
+    if( !pPg->iHold ){
+      PgHdr **ppLast;
+      PgHdr **ppFirst = page_free_list(pPg, &ppLast);
+      page_list_remove(ppFirst, ppLast, pPg);
+      pPg->dirty = 0;
+      ppFirst = page_free_list(pPg, &ppLast);
+      page_list_add(ppFirst, ppLast, pPg, isCold);
+    }
+  }
+  pPg->dirty = 0;
+  mndbOsMutexLeave(pShard->pLatch);
+}
+
+/*
+** Cut the database file down to Pager.dbSize pages after a commit
+** that made the database shorter.  The mapping of the file, if any,
+** is dropped first, as it would reach past the end of the file.
+** In a compressed file the slots of the pages past the end are
+** forgotten too.
+*/
+static int pager_truncate_file(Pager *pPager){
+  int i;
+  pPager->needTruncate = 0;
+  if( pPager->memDb ){
+    return MNDB_OK;
+  }
+  pager_unmap(pPager);
+  pPager->szAlloc = 0;
+  for(i=pPager->dbSize+1; i<pPager->nExtent; i++){
+    pPager->aExtent[i] = 0;
+  }
+  return mndbOsTruncate(&pPager->fd, pager_offset(pPager, pPager->dbSize+1));
+}
+
+/*
+** Merge two lists of pages connected by pDirty and in pgno order.
+** Do not bother fixing the pPrevDirty pointers.
+*/
+static PgHdr *merge_pagelist(PgHdr *pA, PgHdr *pB){
+  PgHdr result, *pTail;
+  pTail = &result;
+  while( pA && pB ){
+    if( pA->pgno<pB->pgno ){
+      pTail->pDirty = pA;
+      pTail = pA;
+      pA = pA->pDirty;
+    }else{
+      pTail->pDirty = pB;
+      pTail = pB;
+      pB = pB->pDirty;
+    }
+  }
+  pTail->pDirty = pA ? pA : pB;
+  return result.pDirty;
+}
+
+/*
+** Sort the list of pages in accending order by pgno.  Pages are
+** connected by pDirty pointers.  This is a bottom-up merge sort, so
+** the cost depends only on the number of pages in the list.
+*/
+#define N_SORT_BUCKET 32
+static PgHdr *sort_pagelist(PgHdr *pIn){
+  PgHdr *a[N_SORT_BUCKET], *p;
+  int i;
+  memset(a, 0, sizeof(a));
+  while( pIn ){
+    p = pIn;
+    pIn = p->pDirty;
+    p->pDirty = 0;
+    for(i=0; i<N_SORT_BUCKET-1; i++){
+      if( a[i]==0 ){
+        a[i] = p;
+        break;
+      }else{
+        p = merge_pagelist(a[i], p);
+        a[i] = 0;
+      }
+    }
+    if( i==N_SORT_BUCKET-1 ){
+      a[i] = merge_pagelist(a[i], p);
+    }
+  }
+  p = a[0];
+  for(i=1; i<N_SORT_BUCKET; i++){
+    p = merge_pagelist(p, a[i]);
+  }
+  return p;
+}
+
+/*
+** Append the pages on a pDirty list to the write-ahead log and mark them
+** clean.  If isCommit is true, the last frame commits the transaction.
+** Dirty pages recycled in the middle of a transaction go to the log
+** uncommitted, where only this connection can see them.
+*/
+static int pager_wal_write_pagelist(PgHdr *pList, int isCommit){
+  Pager *pPager = pList->pPager;
+  Pgno aPgno[MNDB_MAX_IOV];
+  void *apData[MNDB_MAX_IOV];
+  PgHdr *pRun;
+  double rStart;
+  int nRun;
+  int rc;
+
+  rc = pager_bgw_drain(pPager);
+  if( rc!=MNDB_OK ) return rc;
+  while( pList ){
+    pRun = pList;
+    for(nRun=0; pList && nRun<MNDB_MAX_IOV; nRun++){
+      assert( pList->dirty );
+      aPgno[nRun] = pList->pgno;
+      apData[nRun] = PGHDR_TO_DATA(pList);
+      pList = pList->pDirty;
+    }
+    mndbOsClock(&rStart);
+    rc = mndbWalWriteFrames(pPager->pWal, nRun, aPgno, apData,
+                            (isCommit && pList==0) ? pPager->dbSize : 0);
+    pager_record_io(&pPager->stat.write, nRun*pPager->pageSize, rStart);
+    if( rc!=MNDB_OK ) return rc;
+    while( nRun-- ){
+      page_remove_from_dirty_list(pRun, 0);
+      pRun = pRun->pDirty;
+    }
+  }
+  return MNDB_OK;
+}
+
+/*
+** The most pages pager_write_pagelist() hands to the operating system
+** layer in one batch.
+*/
+#ifndef N_WRITE_BATCH
+# define N_WRITE_BATCH 256
+#endif
+
+/*
+** The database file is about to be written up to page pgno.  If that is
+** past the space reserved for it so far, reserve up to the next multiple
+** of Pager.nChunk pages, so that the file grows a chunk at a time and
+** its blocks stay together.  Pager.szAlloc only remembers how far that
+** is known to reach, not the size of the file, which mndbpager_pagecount()
+** still goes by.  It is only a hint, so a failure is not reported: the
+** write that follows reports it if it matters.
+**
+** A compressed file is not reserved, as that would fill in the holes
+** its slots are meant to leave, and neither is the file in WAL mode,
+** where pages go to the log.
+*/
+static void pager_reserve(Pager *pPager, Pgno pgno){
+  off_t szNeed, szNew;
+  int nChunk = pPager->nChunk;
+  if( nChunk<=1 || pPager->memDb || pPager->useCompress || pPager->pWal ){
+    return;
+  }
+  szNeed = pgno*(off_t)pPager->pageSize;
+  if( szNeed<=pPager->szAlloc ) return;
+  if( pPager->szAlloc==0 ){
+    /* Nothing reserved yet.  Start from the end of the file. */
+    if( mndbOsFileSize(&pPager->fd, &pPager->szAlloc)!=MNDB_OK ){
+      pPager->szAlloc = 0;
+    }
+    if( szNeed<=pPager->szAlloc ) return;
+  }
+  szNew = ((pgno+nChunk-1)/nChunk)*(off_t)nChunk*pPager->pageSize;
+  mndbOsAllocate(&pPager->fd, pPager->szAlloc, szNew-pPager->szAlloc);
+  pPager->szAlloc = szNew;
+}
+
+/*
+** Write the pages on the pDirty list back to the database file and
+** mark them clean.  The list must be sorted by page number.  The pages
+** go to mndbOsWritePages() in batches, which merges runs of adjacent
+** pages into single vectored writes and, where it can, has all of the
+** writes of a batch in flight at once.  Pages of a compressed file go
+** to pager_write_packed() instead.
+**
+** Called by commit and when a dirty page has to be recycled.
+*/
+static int pager_write_pagelist(PgHdr *pList){
+  Pager *pPager;
+  void *apBuf[N_WRITE_BATCH];
+  off_t aOffset[N_WRITE_BATCH];
+  Pgno aPgno[N_WRITE_BATCH];
+  u32 aExtent[N_WRITE_BATCH];
+  PgHdr *pBatch;
+  double rStart;
+  int n;
+  int rc;
+
+  if(pList == 0) return MNDB_OK;
+  pPager = pList->pPager;
+  rc = pager_bgw_drain(pPager);
+  if( rc!=MNDB_OK ) return rc;
+  if( pPager->pWal ){
+    return pager_wal_write_pagelist(pList, 0);
+  }
+  if( pPager->memDb ){
+    /* The cache is where the pages are kept */
+    for(; pList; pList=pList->pDirty){
+      page_remove_from_dirty_list(pList, 0);
+    }
+    return MNDB_OK;
+  }
+  while( pList ){
+    pBatch = pList;
+    for(n=0; pList && n<N_WRITE_BATCH; n++, pList=pList->pDirty){
+      assert( pList->dirty );
+      apBuf[n] = PGHDR_TO_DATA(pList);
+      aOffset[n] = (pList->pgno-1)*(off_t)pPager->pageSize;
+      aPgno[n] = pList->pgno;
+      aExtent[n] = pager_extent(pPager, pList->pgno);
+    }
+    pager_reserve(pPager, aPgno[n-1]);
+    if( pPager->useCompress ){
+      int i;
+      rc = pager_pack_alloc(pPager, &pPager->aPack);
+      if( rc==MNDB_OK ){
+        rc = pager_write_packed(pPager, pPager->aPack, n, apBuf, aPgno,
+                                aExtent, &pPager->stat.write);
+      }
+      for(i=0; i<n; i++){
+        pager_set_extent(pPager, aPgno[i], rc==MNDB_OK ? aExtent[i] : 0);
+      }
+    }else{
+      mndbOsClock(&rStart);
+      rc = mndbOsWritePages(&pPager->fd, n, apBuf, aOffset, pPager->pageSize);
+      pager_record_io(&pPager->stat.write, n*pPager->pageSize, rStart);
+    }
+    if(rc) return rc; //some one failed
+    while( n-- ){
+      page_remove_from_dirty_list(pBatch, 0);
+      pBatch = pBatch->pDirty;
+    }
+  }
+  return MNDB_OK;
+}
+
+/*
+** Return every dirty page, sorted by page number and linked through
+** pDirty.  Only the dirty list is visited, never the whole cache.
+*/
+static PgHdr* pager_get_all_dirty_pages(Pager *pPager){
+  PgHdr *p;
+  for(p = pPager->pDirty; p; p = p->pNextDirty){
+    p->pDirty = p->pNextDirty;
+  }
+  return sort_pagelist(pPager->pDirty);
+}
+
+/*
+** Copy dirty page pPg into slot iSlot of the ring of the background
+** writer and mark it clean.  For a compressed file the extent the page
+** had in its slot goes along, for the thread to decide what to punch,
+** and the pager forgets it, since only the thread learns the new one.
+*/
+static void pager_bgw_fill(PgWriter *pW, int iSlot, PgHdr *pPg){
+  Pager *pPager = pPg->pPager;
+  pager_reserve(pPager, pPg->pgno);
+  pW->aPgno[iSlot] = pPg->pgno;
+  memcpy(&pW->aData[iSlot*(size_t)pPager->pageSize], PGHDR_TO_DATA(pPg),
+         pPager->pageSize);
+  if( pPager->useCompress ){
+    pW->aExtent[iSlot] = pager_extent(pPager, pPg->pgno);
+    pager_set_extent(pPager, pPg->pgno, 0);
+  }
+  page_remove_from_dirty_list(pPg, 1);
+}
+
+/*
+** Hand a single dirty page to the background writer, waiting for room
+** in the ring if it is full.  This is how a dirty page picked for
+** recycling is cleaned when the writer has fallen behind.
+*/
+static void pager_bgw_push(PgHdr *pPg){
+  Pager *pPager = pPg->pPager;
+  PgWriter *pW = pPager->pWriter;
+  int iSlot;
+  mndbOsMutexEnter(pW->pMutex);
+  while( pW->nQueued==MNDB_BGW_SLOTS ){
+    mndbOsCondWait(pW->pCond, pW->pMutex);
+  }
+  iSlot = (pW->iHead + pW->nQueued) % MNDB_BGW_SLOTS;
+  mndbOsMutexLeave(pW->pMutex);
+  pager_bgw_fill(pW, iSlot, pPg);
+  mndbOsMutexEnter(pW->pMutex);
+  pW->nQueued++;
+  mndbOsCondBroadcast(pW->pCond);
+  mndbOsMutexLeave(pW->pMutex);
+}
+
+/*
+** Hand dirty pages at the cold end of the free lists to the background
+** writer until at least PgWriter.nKeepClean unreferenced pages are clean,
+** or the ring is full.  This only starts once the cache is full, since
+** until then a miss takes a new frame and recycles nothing.
+**
+** Pages are copied into the ring without any I/O, so this is cheap
+** enough to call each time mndbpager_get() recycles a page.  A page is
+** copied holding the latch of its shard, so that no thread can take a
+** reference to it and change it meanwhile.
+*/
+static void pager_bgw_schedule(Pager *pPager){
+  PgWriter *pW = pPager->pWriter;
+  PgHdr *p, *pNext;
+  int nWant, nRoom, iTail, i, j, n;
+
+  if( pPager->nPage<pPager->mxPage ) return;
+  nWant = pW->nKeepClean - (pPager->nPage - mndbOsAtomicLoad(&pPager->nRef)
+                            - mndbOsAtomicLoad(&pPager->nDirtyFree));
+  if( nWant<=0 ) return;
+  mndbOsMutexEnter(pW->pMutex);
+  nRoom = MNDB_BGW_SLOTS - pW->nQueued;
+  iTail = pW->iHead + pW->nQueued;
+  mndbOsMutexLeave(pW->pMutex);
+  if( nWant>nRoom ) nWant = nRoom;
+
+  /* Pages leave A1in first under 2Q, so it is cleaned first.  The
+  ** dirty lists hold nothing else, oldest first.
+  */
+  n = 0;
+  for(i=0; i<2 && n<nWant; i++){
+    for(j=0; j<PAGER_N_SHARD && n<nWant; j++){
+      PgShard *pShard = &pPager->aShard[j];
+      mndbOsMutexEnter(pShard->pLatch);
+      p = i==0 ? pShard->pFirstDirtyA1 : pShard->pFirstDirty;
+      for(; p && n<nWant; p=pNext){
+        int iSlot = (iTail+n) % MNDB_BGW_SLOTS;
+        pNext = p->pNextFree;
+        pager_bgw_fill(pW, iSlot, p);
+        n++;
+      }
+      mndbOsMutexLeave(pShard->pLatch);
+    }
+  }
+  if( n>0 ){
+    mndbOsMutexEnter(pW->pMutex);
+    pW->nQueued += n;
+    mndbOsCondBroadcast(pW->pCond);
+    mndbOsMutexLeave(pW->pMutex);
+  }
+}
+
+/*
+** Find a frame for a page that is about to be loaded into the cache.
+** A new frame is allocated while the cache is below its limit.  After
+** that an unreferenced page is recycled, after it has been written out
+** or handed to the background writer if it is dirty.  If onlyClean is
+** true no page is written, and *ppPg is left NULL if the cache is full
+** and no clean page is free.
+**
+** The frame is left out of the hash table and off the free lists, and
+** its page number and contents are for the caller to fill in.  There
+** is room in the hash table for page pgno when MNDB_OK is returned.
+*/
+static int pager_new_frame(
+  Pager *pPager,              /* The pager */
+  Pgno pgno,                  /* Page the frame is for */
+  int onlyClean,              /* Do not write a page to make room */
+  PgHdr **ppPg                /* OUT: The frame */
+){
+  PgHdr *pPg = 0;
+  PgShard *pShard;
+  int rc;
+
+  *ppPg = 0;
+  rc = pager_hash_reserve(pPager, pgno);
+  if( rc!=MNDB_OK ){
+    return rc;
+  }
+  if( pPager->nPage>=pPager->mxPage && !pPager->memDb ){
+    pPg = pager_choose_victim(pPager, onlyClean);
+    if( pPg==0 && onlyClean ) return MNDB_OK;
+  }
+  if( pPg==0 ){
+    /* Create a new page */
+    pPg = pager_alloc_frame(pPager);
+    if( pPg==0 ){
+      pager_unwritelock(pPager);
+      pPager->errMask |= PAGER_ERR_MEM;
+      return MNDB_NOMEM;
+    }
+    memset(pPg, 0, sizeof(*pPg));
+    pPg->pPager = pPager;
+    pPg->pNextAll = pPager->pAll;
+    if( pPager->pAll ){
+      pPager->pAll->pPrevAll = pPg;
+    }
+    pPg->pPrevAll = 0;
+    pPager->pAll = pPg;
+    pPager->nPage++;
+  }else{
+    /* Recycle the page pager_choose_victim() took off its free list.
+    ** It is busy, so no other thread takes a reference to it.
+    */
+    if( pPg->dirty ){
+      pPager->stat.nEvictDirty++;
+    }else{
+      pPager->stat.nEvictClean++;
+    }
+
+    /* Write the page to the database file if it is dirty.  With a
+    ** background writer, the write is left to it.
+    */
+    if( pPg->dirty && pPager->pWriter ){
+      pager_bgw_push(pPg);
+    }else if( pPg->dirty ){
+      pPg->pDirty = 0;
+      assert( mndbOsAtomicLoad(&pPg->nRef)==0 );
+      rc = pager_write_pagelist( pPg );
+      if( rc!=MNDB_OK ){
+        pShard = pager_shard(pPager, pPg->pgno);
+        mndbOsMutexEnter(pShard->pLatch);
+        pPg->busy = 0;
+        page_link_free(pPg);
+        mndbOsCondBroadcast(pShard->pCond);
+        mndbOsMutexLeave(pShard->pLatch);
+        return rc;
+      }
+    }
+    assert( mndbOsAtomicLoad(&pPg->nRef)==0 );
+    assert(pPg->dirty == 0);
+      
+    /* Take the old page out of the hash table.  A frame whose prefetch
+    ** failed has no page in it.
+    */
+    pShard = pager_shard(pPager, pPg->pgno);
+    mndbOsMutexEnter(pShard->pLatch);
+    if( pPg->pgno ){
+      pager_hash_remove(pPager, pPg);
+    }
+    pPg->busy = 0;
+    mndbOsCondBroadcast(pShard->pCond);
+    mndbOsMutexLeave(pShard->pLatch);
+    pPg->eClass = MNDB_PAGE_LEAF;
+    if( pPg->inA1 ){
+      mndbOsAtomicAdd(&pPager->nA1, -1);
+      pPager->stat.nEvictA1++;
+      pager_ghost_add(pPager, pPg->pgno);
+    }
+    if( pPager->pWriter ){
+      pager_bgw_schedule(pPager);
+    }
+  }
+  *ppPg = pPg;
+  return MNDB_OK;
+}
+
+/*
+** A page that pager_get_begin() did not find in the cache and left for
+** pager_load() to read in.  The page is in the hash table and busy.
+*/
+typedef struct PgLoad PgLoad;
+struct PgLoad {
+  PgHdr *pPg;                 /* The page, or NULL if it is loaded already */
+  Wal *pWal;                  /* Log to look for the page in first, or NULL */
+  char *zSlot;                /* Compressed: a slot buffer, or NULL */
+  u32 nUsed;                  /* Compressed: bytes known in use in the slot */
+};
+
+/*
+** Drop the count in Pager.nRef of a page that is no longer referenced.
+** When the last one goes the lock on the database file is dropped.
+** Clean pages stay in the cache for the next transaction, but changes
+** that were never committed are thrown away.
+*/
+static void pager_release(Pager *pPager){
+  if( pager_uncount_held(pPager) ) return;
+  mndbOsMutexEnter(pPager->pLatch);
+  if( mndbOsAtomicAdd(&pPager->nRef, -1)==0 ){
+    if( pPager->dirtyFile && !pPager->memDb ){
+      pager_reset(pPager);
+    }
+    pager_unlock(pPager);
+  }
+  assert( mndbOsAtomicLoad(&pPager->nRef)>=0 );
+  mndbOsMutexLeave(pPager->pLatch);
+}
+
+/*
+** Finish loading a page that pager_get_begin() left busy, and wake the
+** threads waiting for it.  If rc is MNDB_OK the page gets the reference
+** of the thread that loaded it.  Otherwise it is taken out of the hash
+** table and its frame goes on the free lists, empty.  The reads done
+** for the page are counted from *pIo, unless pIo is NULL.
+*/
+static void pager_load_done(PgHdr *pPg, int rc, const PagerIoStats *pIo){
+  Pager *pPager = pPg->pPager;
+  PgShard *pShard = pager_shard(pPager, pPg->pgno);
+  mndbOsMutexEnter(pShard->pLatch);
+  if( pIo ) pager_merge_io(&pShard->read, pIo);
+  pPg->busy = 0;
+  if( rc==MNDB_OK ){
+    mndbOsAtomicStore(&pPg->nRef, 1);
+  }else{
+    pager_hash_remove(pPager, pPg);
+  }
+  mndbOsCondBroadcast(pShard->pCond);
+  mndbOsMutexLeave(pShard->pLatch);
+  if( rc!=MNDB_OK ){
+    /* Page numbers of frames are only changed holding Pager.pLatch */
+    mndbOsMutexEnter(pPager->pLatch);
+    pPg->pgno = 0;
+    pShard = pager_shard(pPager, 0);
+    mndbOsMutexEnter(pShard->pLatch);
+    page_link_free(pPg);
+    mndbOsMutexLeave(pShard->pLatch);
+    mndbOsMutexLeave(pPager->pLatch);
+    pager_release(pPager);
+  }
+}
+
+/*
+** The part of pager_get() done holding Pager.pLatch.  A page found in
+** the cache is returned in *ppPage.  Otherwise a frame is found for
+** the page, put in the hash table and marked busy.  If the page can
+** be filled in at once, without reading the file or the log, it is,
+** and returned in *ppPage.  Otherwise *pLoad says how to read it and
+** pager_load() has to be called to finish the job.
+**
+** Pages in the mapped part of the file are copied in here, since the
+** mapping may go away once the latch is let go.
+*/
+static int pager_get_begin(
+  Pager *pPager,              /* The pager */
+  Pgno pgno,                  /* The page */
+  void **ppPage,              /* OUT: The page, if it is ready */
+  PgLoad *pLoad               /* OUT: What is left for pager_load() */
+){
+  PgHdr *pPg;
+  double rStart;
+  int isLoaded;
+  int rc;
+
+  /* Make sure we have not hit any critical errors.
+  */ 
+  assert( pPager!=0 );
+  assert( pgno!=0 );
+  *ppPage = 0;
+  pLoad->pPg = 0;
+  if( pPager->errMask & ~(PAGER_ERR_FULL) ){
+     return pager_errcode(pPager);
+   }
+
+  /* If this is the first page accessed, then get a read lock
+  ** on the database file.
+  */
+  if( mndbOsAtomicLoad(&pPager->nRef)==0 && pPager->memDb ){
+    pPager->state = MNDB_READLOCK;
+  }else if( mndbOsAtomicLoad(&pPager->nRef)==0 ){
+    if( pPager->useWal ){
+      rc = pager_wal_begin_read(pPager);
+      if( rc!=MNDB_OK ){
+        return rc;
+      }
+    }else{
+      rc = mndbOsReadLock(&pPager->fd);
+      if( rc!=MNDB_OK ){
+        return rc;
+      }
+      pPager->state = MNDB_READLOCK;
+      rc = pager_validate_cache(pPager);
+      if( rc!=MNDB_OK ){
+        pager_unlock(pPager);
+        return rc;
+      }
+    }
+    if( pPager->useMmap ){
+      pager_map(pPager);
+    }
+  }
+
+  /* Search for page in cache */
+  pPg = pager_ref_cached(pPager, pgno, 1);
+  if( pPg ){
+    /* The requested page is in the page cache. */
+    pPager->stat.nHit++;
+    *ppPage = PGHDR_TO_DATA(pPg);
+    return MNDB_OK;
+  }
+
+  /* The requested page is not in the page cache. */
+  mndbOsAtomicAdd(&pPager->nRead, 1);
+  pPager->stat.nMiss++;
+  rc = pager_new_frame(pPager, pgno, 0, &pPg);
+  if( rc!=MNDB_OK ){
+    return rc;
+  }
+  pPg->pgno = pgno;
+  assert( pPg->dirty==0 );
+  pager_classify_page(pPager, pPg);
+  //test    REFINFO(pPg);
+  mndbOsAtomicAdd(&pPager->nRef, 1);
+  if(pPager->nExtra>0){
+    memset(PGHDR_TO_EXTRA(pPg),0,pPager->nExtra);
+  }
+  /* Threads that find a busy page in the hash table wait for it, so
+  ** the page goes in before it is loaded and gets its first reference
+  ** once it has been.
+  */
+  pPg->busy = 1;
+  pager_hash_insert(pPager, pPg);
+  if( pPager->dbSize<0 ) mndbpager_pagecount(pPager);
+  //!!
+  if( pPager->errMask!=0 ){
+    rc = pager_errcode(pPager);
+    pager_load_done(pPg, rc, 0);
+    return rc;
+  }
+  //!!
+
+  /* The background writer may hold a newer image of the page than the
+  ** database file, and in WAL mode the log may.
+  */
+  isLoaded = 0;
+  if( pPager->pWriter && pager_bgw_read(pPager, pgno, PGHDR_TO_DATA(pPg)) ){
+    isLoaded = 1;
+  }else if( pPager->dbSize<(int)pgno || pPager->memDb ){
+    memset(PGHDR_TO_DATA(pPg), 0, pPager->pageSize);
+    if( pPager->useCompress ){
+      /* Past the end of the file, so the slot is empty */
+      pager_set_extent(pPager, pgno, PAGER_PACK_HDR);
+    }
+    isLoaded = 1;
+  }else if( pgno*(off_t)pPager->pageSize<=pPager->szMap ){
+    if( pPager->pWal ){
+      mndbOsClock(&rStart);
+      rc = mndbWalRead(pPager->pWal, pgno, pPager->pageSize,
+                       PGHDR_TO_DATA(pPg), &isLoaded);
+      if( isLoaded ){
+        pager_record_io(&pPager->stat.read, pPager->pageSize, rStart);
+      }
+      if( rc!=MNDB_OK ){
+        pager_load_done(pPg, rc, 0);
+        return rc;
+      }
+    }
+    if( !isLoaded ){
+      memcpy(PGHDR_TO_DATA(pPg),
+             &pPager->pMap[(pgno-1)*(off_t)pPager->pageSize],
+             pPager->pageSize);
+      isLoaded = 1;
+    }
+  }
+  if( isLoaded ){
+    pager_load_done(pPg, MNDB_OK, 0);
+    *ppPage = PGHDR_TO_DATA(pPg);
+    return MNDB_OK;
+  }
+
+  pLoad->pWal = pPager->pWal;
+  pLoad->zSlot = 0;
+  pLoad->nUsed = 0;
+  if( pPager->useCompress ){
+    pLoad->zSlot = pager_load_pack_get(pPager);
+    if( pLoad->zSlot==0 ){
+      pager_load_done(pPg, MNDB_NOMEM, 0);
+      return MNDB_NOMEM;
+    }
+    pLoad->nUsed = pager_extent(pPager, pgno);
+  }
+  pLoad->pPg = pPg;
+  return MNDB_OK;
+}
+
+/*
+** Read in the page that pager_get_begin() left busy, from the log or
+** the database file, and return it in *ppPage.  Pager.pLatch is not
+** held, so other threads can use the cache while the read is going on.
+** Nothing but the page, the file and *pLoad is touched until the page
+** has been handed over.  After that a compressed pager takes the latch
+** again to give back the slot buffer and remember how much of the slot
+** is in use.
+*/
+static int pager_load(Pager *pPager, PgLoad *pLoad, void **ppPage){
+  PgHdr *pPg = pLoad->pPg;
+  Pgno pgno = pPg->pgno;
+  void *pData = PGHDR_TO_DATA(pPg);
+  PagerIoStats io;
+  double rStart;
+  int isLoaded = 0;
+  int rc = MNDB_OK;
+
+  memset(&io, 0, sizeof(io));
+  if( pLoad->pWal ){
+    mndbOsClock(&rStart);
+    rc = mndbWalRead(pLoad->pWal, pgno, pPager->pageSize, pData, &isLoaded);
+    if( isLoaded ){
+      pager_record_io(&io, pPager->pageSize, rStart);
+    }
+  }
+  if( rc!=MNDB_OK || isLoaded ){
+    /* Nothing more to do */
+  }else if( pLoad->zSlot ){
+    rc = pager_read_packed(pPager, pLoad->zSlot, 1, &pData, &pgno,
+                           &pLoad->nUsed, &io);
+  }else{
+    mndbOsClock(&rStart);
+    rc = mndbOsReadAt(&pPager->fd, pData, pPager->pageSize,
+                      (pgno-1)*(off_t)pPager->pageSize);
+    pager_record_io(&io, pPager->pageSize, rStart);
+    //!TRACE2("FETCH %d\n", pPg->pgno);
+
+    if( rc!=MNDB_OK ){
+      off_t fileSize;
+      if( mndbOsFileSize(&pPager->fd,&fileSize)==MNDB_OK
+       && fileSize<pgno*(off_t)pPager->pageSize ){
+        memset(pData, 0, pPager->pageSize);
+        rc = MNDB_OK;
+      }
+    }
+  }
+  pager_load_done(pPg, rc, &io);
+  if( pLoad->zSlot ){
+    mndbOsMutexEnter(pPager->pLatch);
+    if( rc==MNDB_OK && pager_extent(pPager, pgno)==0 ){
+      pager_set_extent(pPager, pgno, pLoad->nUsed);
+    }
+    pager_load_pack_put(pPager, pLoad->zSlot);
+    mndbOsMutexLeave(pPager->pLatch);
+  }
+  if( rc==MNDB_OK ){
+    *ppPage = pData;
+  }
+  return rc;
+}
+
+/*
+** Acquire a page.
+**
+** A read lock on the disk file is obtained when the first page is acquired. 
+** This read lock is dropped when the last page is released.
+**
+** A _get works for any page number greater than 0.  If the database
+** file is smaller than the requested page, then no actual disk
+** read occurs and the memory image of the page is initialized to
+** all zeros.  The extra data appended to a page is always initialized
+** to zeros the first time a page is loaded into memory.
+**
+** The acquisition might fail for several reasons.  In all cases,
+** an appropriate error code is returned and *ppPage is set to NULL.
+**
+** See also sqlitepager_lookup().  Both this routine and _lookup() attempt
+** to find a page in the in-memory cache first.  If the page is not already
+** in memory, this routine goes to disk to read it in whereas _lookup()
+** just returns 0.  This routine acquires a read-lock the first time it
+** has to go to disk, and could also playback an old journal if necessary.
+** Since _lookup() never goes to disk, it never has to deal with locks
+** or journal files.
+**
+** The caller holds Pager.pLatch.
+*/
+static int pager_get(Pager *pPager, Pgno pgno, void **ppPage){
+  PgLoad load;
+  int rc = pager_get_begin(pPager, pgno, ppPage, &load);
+  if( rc==MNDB_OK && load.pPg ){
+    rc = pager_load(pPager, &load, ppPage);
+  }
+  return rc;
+}
+
+/*
+** Threads that share a pager take a reference to a page in the cache
+** holding only the latch of its shard, see pager_ref_cached().  A miss
+** takes Pager.pLatch, but only to find a frame for the page.  The page
+** is read after the latch has been let go, and threads that want it
+** meanwhile wait for it.
+*/
+int mndbpager_get(Pager *pPager, Pgno pgno, void **ppPage){
+  PgLoad load;
+  PgHdr *pPg;
+  int rc;
+  assert( pPager!=0 );
+  assert( pgno!=0 );
+  if( mndbOsAtomicLoad(&pPager->errMask)==0
+   && (pPg = pager_ref_cached(pPager, pgno, 0))!=0 ){
+    mndbOsAtomicAdd(&pPager->nHitShared, 1);
+    *ppPage = PGHDR_TO_DATA(pPg);
+    return MNDB_OK;
+  }
+  mndbOsMutexEnter(pPager->pLatch);
+  rc = pager_get_begin(pPager, pgno, ppPage, &load);
+  mndbOsMutexLeave(pPager->pLatch);
+  if( rc==MNDB_OK && load.pPg ){
+    rc = pager_load(pPager, &load, ppPage);
+  }
+  return rc;
+}
+/*
+** Acquire a page if it is already in the in-memory cache.  Do
+** not read the page from disk.  Return a pointer to the page,
+** or 0 if the page is not in cache.
+**
+** See also sqlitepager_get().  The difference between this routine
+** and sqlitepager_get() is that _get() will go to the disk and read
+** in the page if the page is not already in cache.  This routine
+** returns NULL if the page is not in cache or if a disk I/O error 
+** has ever happened.
+*/
+void *mndbpager_lookup(Pager *pPager, Pgno pgno){
+  PgHdr *pPg;
+
+  assert( pPager!=0 );
+  assert( pgno!=0 );
+  if( mndbOsAtomicLoad(&pPager->errMask)==0
+   && (pPg = pager_ref_cached(pPager, pgno, 0))!=0 ){
+    return PGHDR_TO_DATA(pPg);
+  }
+  mndbOsMutexEnter(pPager->pLatch);
+  if( (pPager->errMask & ~(PAGER_ERR_FULL))!=0
+   || mndbOsAtomicLoad(&pPager->nRef)==0 ){
+    /* Cached pages have not been validated without a lock */
+    pPg = 0;
+  }else{
+    pPg = pager_ref_cached(pPager, pgno, 1);
+  }
+  mndbOsMutexLeave(pPager->pLatch);
+  return pPg ? PGHDR_TO_DATA(pPg) : 0;
+}
+
+/*
+** The most pages a single prefetch loads into the cache.
+*/
+#ifndef N_PREFETCH_MAX
+# define N_PREFETCH_MAX 64
+#endif
+
+/*
+** Return true if page pgno would be worth reading ahead: it is in the
+** file, not in the cache and not in the mapped part of the file.
+*/
+static int pager_want_prefetch(Pager *pPager, Pgno pgno){
+  return pgno!=0 && pgno<=(Pgno)pPager->dbSize
+      && pgno*(off_t)pPager->pageSize>pPager->szMap
+      && !pager_has_page(pPager, pgno);
+}
+
+/*
+** Read the pages of aPgno[] that are worth reading ahead into the cache,
+** no more than mxLoad of them, with one batch of reads, which the
+** operating system layer keeps in flight together, and leave them there
+** unreferenced.  mxLoad may not be more than N_PREFETCH_MAX.  Only clean
+** pages are recycled for them.  Return how many entries of aPgno[] were
+** dealt with, which is less than n if there was no room for the rest.
+**
+** The pages are busy while they are read, which is done holding
+** Pager.pLatch, and then go on the free lists as if they had just been
+** released.  If the read fails they are left empty.
+*/
+static int pager_load_pages(
+  Pager *pPager,              /* The pager */
+  int n,                      /* Number of entries in aPgno[] */
+  const Pgno *aPgno,          /* Pages to load */
+  int mxLoad                  /* Most pages to load */
+){
+  PgHdr *apPg[N_PREFETCH_MAX];
+  void *apBuf[N_PREFETCH_MAX];
+  off_t aOffset[N_PREFETCH_MAX];
+  Pgno aPgnoRead[N_PREFETCH_MAX];
+  u32 aExtent[N_PREFETCH_MAX];
+  double rStart;
+  int nLoad, nRead, nDone, i;
+  int rc;
+
+  assert( mxLoad<=N_PREFETCH_MAX );
+  nLoad = nRead = 0;
+  for(i=0; i<n && nLoad<mxLoad; i++){
+    PgHdr *pPg;
+    Pgno pgno = aPgno[i];
+    if( !pager_want_prefetch(pPager, pgno) ) continue;
+    if( pager_new_frame(pPager, pgno, 1, &pPg)!=MNDB_OK || pPg==0 ) break;
+    pPg->pgno = pgno;
+    pPg->inA1 = 0;
+    pPg->busy = 1;
+    apPg[nLoad++] = pPg;
+    pager_hash_insert(pPager, pPg);
+    if( pPager->nExtra>0 ){
+      memset(PGHDR_TO_EXTRA(pPg), 0, pPager->nExtra);
+    }
+    if( pPager->pWriter && pager_bgw_read(pPager, pgno, PGHDR_TO_DATA(pPg)) ){
+      continue;
+    }
+    apBuf[nRead] = PGHDR_TO_DATA(pPg);
+    aOffset[nRead] = (pgno-1)*(off_t)pPager->pageSize;
+    aPgnoRead[nRead] = pgno;
+    aExtent[nRead] = pPager->useCompress ? pager_extent(pPager, pgno) : 0;
+    nRead++;
+  }
+  nDone = i;
+  if( nRead>0 && pPager->useCompress ){
+    rc = pager_pack_alloc(pPager, &pPager->aPack);
+    if( rc==MNDB_OK ){
+      rc = pager_read_packed(pPager, pPager->aPack, nRead, apBuf, aPgnoRead,
+                             aExtent, &pPager->stat.read);
+    }
+    for(i=0; rc==MNDB_OK && i<nRead; i++){
+      pager_set_extent(pPager, aPgnoRead[i], aExtent[i]);
+    }
+  }else if( nRead>0 ){
+    mndbOsClock(&rStart);
+    rc = mndbOsReadPages(&pPager->fd, nRead, apBuf, aOffset,
+                         pPager->pageSize);
+    pager_record_io(&pPager->stat.read, nRead*pPager->pageSize, rStart);
+  }else{
+    rc = MNDB_OK;
+  }
+  for(i=0; i<nLoad; i++){
+    PgHdr *pPg = apPg[i];
+    PgShard *pShard = pager_shard(pPager, pPg->pgno);
+    mndbOsMutexEnter(pShard->pLatch);
+    pPg->busy = 0;
+    if( rc!=MNDB_OK ){
+      pager_hash_remove(pPager, pPg);
+    }else{
+      mndbOsAtomicAdd(&pPager->nRead, 1);
+      pPager->stat.nMiss++;
+      pager_classify_page(pPager, pPg);
+      page_link_free(pPg);
+    }
+    mndbOsCondBroadcast(pShard->pCond);
+    mndbOsMutexLeave(pShard->pLatch);
+    if( rc!=MNDB_OK ){
+      pPg->pgno = 0;
+      pShard = pager_shard(pPager, 0);
+      mndbOsMutexEnter(pShard->pLatch);
+      page_link_free(pPg);
+      mndbOsMutexLeave(pShard->pLatch);
+    }
+  }
+  return nDone;
+}
+
+/*
+** Read the pages of aPgno[] that are worth reading ahead into the cache
+** with pager_load_pages().  A quarter of the cache at most is filled
+** this way, so that a prefetch cannot push out the working set.  Nothing
+** is done for fewer than two pages, since a single read would only
+** block the caller for a page it has not yet asked for.
+*/
+static void pager_prefetch_load(Pager *pPager, int n, const Pgno *aPgno){
+  int mxLoad, nLoad, i;
+  mxLoad = pPager->mxPage/4;
+  if( mxLoad>N_PREFETCH_MAX ) mxLoad = N_PREFETCH_MAX;
+  for(i=nLoad=0; i<n && nLoad<2; i++){
+    if( pager_want_prefetch(pPager, aPgno[i]) ) nLoad++;
+  }
+  if( nLoad<2 || mxLoad<2 ) return;
+  pager_load_pages(pPager, n, aPgno, mxLoad);
+}
+
+/*
+** Tell the operating system about runs of pages of aPgno[] that are
+** worth reading ahead.  See mndbOsReadAhead().
+*/
+static void pager_prefetch_hint(Pager *pPager, int n, const Pgno *aPgno){
+  Pgno iRun = 0;
+  int nRun = 0;
+  int i;
+  for(i=0; i<n; i++){
+    Pgno pgno = aPgno[i];
+    if( !pager_want_prefetch(pPager, pgno) ) continue;
+    if( nRun>0 && pgno==iRun+nRun ){
+      nRun++;
+      continue;
+    }
+    if( nRun>0 ){
+      mndbOsReadAhead(&pPager->fd, pager_offset(pPager, iRun),
+                      nRun*(off_t)pPager->szSlot);
+    }
+    iRun = pgno;
+    nRun = 1;
+  }
+  if( nRun>0 ){
+    mndbOsReadAhead(&pPager->fd, pager_offset(pPager, iRun),
+                    nRun*(off_t)pPager->szSlot);
+  }
+}
+
+/*
+** Hint that the n pages of aPgno[] are about to be requested.  Pages
+** that are already in the cache or lie past the end of the file are
+** skipped.  Where the file supports asynchronous I/O (see
+** mndbOsAsyncIO()) the others are read into the cache with one batch of
+** reads, all in flight at once.  Anything not read that way is passed
+** to mndbOsReadAhead(), so that the operating system reads it in the
+** background while the caller does something else.  No references are
+** taken, so the call cannot fail.
+**
+** In WAL mode a page may have to come from the log rather than the
+** file, so only the hint is given.
+**
+** The cache is only known to be current while some page is referenced,
+** so the hint is ignored at other times.
+*/
+static void pager_prefetch_pages(Pager *pPager, int n, const Pgno *aPgno){
+  if( mndbOsAtomicLoad(&pPager->nRef)==0 || pPager->errMask!=0 || n<=0
+   || pPager->memDb ) return;
+  if( pPager->dbSize<0 ) mndbpager_pagecount(pPager);
+  if( pPager->pWal==0 && n>1 && mndbOsAsyncIO(&pPager->fd) ){
+    pager_prefetch_load(pPager, n, aPgno);
+  }
+  pager_prefetch_hint(pPager, n, aPgno);
+}
+void mndbpager_prefetch_pages(Pager *pPager, int n, const Pgno *aPgno){
+  mndbOsMutexEnter(pPager->pLatch);
+  pager_prefetch_pages(pPager, n, aPgno);
+  mndbOsMutexLeave(pPager->pLatch);
+}
+
+/*
+** Hint that pages first through first+n-1 are about to be requested.
+** See mndbpager_prefetch_pages().  Only the first N_PREFETCH_MAX pages
+** may be loaded into the cache, the rest are only hinted.
+*/
+static void pager_prefetch(Pager *pPager, Pgno first, int n){
+  Pgno aPgno[N_PREFETCH_MAX];
+  Pgno last;
+  int i, isFirst = 1;
+  if( mndbOsAtomicLoad(&pPager->nRef)==0 || pPager->errMask!=0
+   || first==0 || n<=0 || pPager->memDb ) return;
+  if( pPager->dbSize<0 ) mndbpager_pagecount(pPager);
+  last = first + n - 1;
+  if( last>(Pgno)pPager->dbSize ) last = pPager->dbSize;
+  while( first<=last ){
+    for(i=0; i<N_PREFETCH_MAX && first+i<=last; i++){
+      aPgno[i] = first + i;
+    }
+    if( isFirst ){
+      pager_prefetch_pages(pPager, i, aPgno);
+      isFirst = 0;
+    }else{
+      pager_prefetch_hint(pPager, i, aPgno);
+    }
+    first += i;
+  }
+}
+void mndbpager_prefetch(Pager *pPager, Pgno first, int n){
+  mndbOsMutexEnter(pPager->pLatch);
+  pager_prefetch(pPager, first, n);
+  mndbOsMutexLeave(pPager->pLatch);
+}
+
+/*
+** Compare two page numbers, for qsort().
+*/
+static int pager_pgno_compare(const void *pA, const void *pB){
+  Pgno a = *(const Pgno*)pA;
+  Pgno b = *(const Pgno*)pB;
+  return a<b ? -1 : a>b;
+}
+
+/*
+** Load the pages named by the side file of warm restarts into the free
+** part of the cache, as many of the hottest as there is room for.  They
+** are read in page number order, N_PREFETCH_MAX at a time, so that each
+** run of adjacent pages takes one read.  Then the free lists are put in
+** the order of the file, with the hottest page the most recently used.
+** Under 2Q the pages go on the main queue, since they are known to be
+** wanted.  In WAL mode a page may have to come from the log, so the
+** operating system is told to read ahead and the pages are then got
+** one at a time.
+**
+** A missing or unusable side file is not an error.
+*/
+static int pager_warm_load(Pager *pPager){
+  Pgno *aPgno = 0, *aSort = 0;
+  char *zWarm;
+  void *pPage1 = 0;
+  OsFile fd;
+  off_t sz;
+  u32 aHdr[3];
+  int n, nRoom, i, nDone;
+  int rc;
+
+  nRoom = pPager->mxPage - pPager->nPage;
+  zWarm = pager_warm_name(pPager);
+  if( zWarm==0 ) return MNDB_NOMEM;
+  if( nRoom<=0 || !mndbOsFileExists(zWarm)
+   || mndbOsOpenReadOnly(zWarm, &fd)!=MNDB_OK ){
+    mndbFree(zWarm);
+    return MNDB_OK;
+  }
+  mndbFree(zWarm);
+  rc = mndbOsFileSize(&fd, &sz);
+  if( rc==MNDB_OK && sz>=PAGER_WARM_HDR ){
+    rc = mndbOsRead(&fd, aHdr, PAGER_WARM_HDR);
+  }
+  n = 0;
+  if( rc==MNDB_OK && sz>=PAGER_WARM_HDR && aHdr[0]==PAGER_WARM_MAGIC
+   && aHdr[1]==(u32)pPager->pageSize
+   && aHdr[2]<=(sz-PAGER_WARM_HDR)/sizeof(Pgno) ){
+    n = aHdr[2]<(u32)nRoom ? (int)aHdr[2] : nRoom;
+  }
+  if( n>0 ){
+    aPgno = mndbMalloc( 2*n*sizeof(Pgno) );
+    if( aPgno==0 ){
+      rc = MNDB_NOMEM;
+    }else{
+      rc = mndbOsRead(&fd, aPgno, n*sizeof(Pgno));
+    }
+  }
+  mndbOsClose(&fd);
+  if( n==0 || rc!=MNDB_OK ){
+    mndbFree(aPgno);
+    return rc==MNDB_NOMEM ? rc : MNDB_OK;
+  }
+
+  /* Page 1 takes the read lock, under which the cache is current */
+  rc = pager_get(pPager, 1, &pPage1);
+  if( rc!=MNDB_OK ){
+    mndbFree(aPgno);
+    return rc;
+  }
+  if( pPager->dbSize<0 ) mndbpager_pagecount(pPager);
+  aSort = &aPgno[n];
+  memcpy(aSort, aPgno, n*sizeof(Pgno));
+  qsort(aSort, n, sizeof(Pgno), pager_pgno_compare);
+  if( pPager->pWal ){
+    /* Pages are read one by one, as any might be in the log, but the
+    ** read-ahead makes most of those reads cheap.
+    */
+    pager_prefetch_hint(pPager, n, aSort);
+    for(i=0; i<n && pPager->nPage<pPager->mxPage; i++){
+      void *pData;
+      if( aSort[i]>(Pgno)pPager->dbSize || pager_has_page(pPager, aSort[i]) ){
+        continue;
+      }
+      if( pager_get(pPager, aSort[i], &pData)!=MNDB_OK ) break;
+      mndbpager_unref(pData);
+    }
+  }else{
+    for(i=0; i<n; i+=nDone){
+      nDone = pager_load_pages(pPager, n-i, &aSort[i], N_PREFETCH_MAX);
+      if( nDone==0 ) break;
+    }
+  }
+  for(i=n-1; i>=0; i--){
+    PgShard *pShard = pager_shard(pPager, aPgno[i]);
+    PgHdr *pPg;
+    mndbOsMutexEnter(pShard->pLatch);
+    pPg = pager_lookup(pPager, aPgno[i]);
+    if( pPg && mndbOsAtomicLoad(&pPg->nRef)==0 && !pPg->busy ){
+      page_unlink_free(pPg);
+      if( pPg->inA1 ){
+        pPg->inA1 = 0;
+        mndbOsAtomicAdd(&pPager->nA1, -1);
+      }
+      page_link_free(pPg);
+    }
+    mndbOsMutexLeave(pShard->pLatch);
+  }
+  mndbFree(aPgno);
+  return mndbpager_unref(pPage1);
+}
+
+/*
+** Turn warm restarts on or off.  While they are on, the numbers of the
+** pages in the cache are saved in a side file when the pager is closed.
+** Turning them on loads the pages saved there by the last pager that
+** closed the file, as many as there is room for in the cache.  Call it
+** right after mndbpager_open() to start with the cache the last run of
+** the program ended with.  The side file is described ahead of
+** pager_warm_name().
+**
+** MNDB_ERROR is returned for a ":memory:" database.
+*/
+int mndbpager_set_warm(Pager *pPager, int useWarm){
+  int rc = MNDB_OK;
+  if( useWarm && pPager->memDb ){
+    return MNDB_ERROR;
+  }
+  mndbOsMutexEnter(pPager->pLatch);
+  pPager->useWarm = useWarm!=0;
+  if( useWarm ){
+    rc = pager_warm_load(pPager);
+  }
+  mndbOsMutexLeave(pPager->pLatch);
+  return rc;
+}
+
+/*
+** Release a page.  Dropping the last reference to a page takes the
+** latch of its shard, and Pager.pLatch only if it was the last page
+** referenced, see pager_release().  The page is busy while its
+** destructor runs, which is done holding no latch at all.
+*/
+int mndbpager_unref(void *pData){
+  PgHdr *pPg; 
+  Pager *pPager;
+  PgShard *pShard;
+  pPg = DATA_TO_PGHDR(pData);
+  assert( mndbOsAtomicLoad(&pPg->nRef)>0 );
+  if( page_unref_held(pPg) ) return MNDB_OK;
+  pPager = pPg->pPager;
+  //TEST REFINFO(pPg);
+
+  if( pPg->pSnap ){
+    /* A private copy of a snapshot page, see pager_snapshot_get() */
+    mndbOsMutexEnter(pPager->pLatch);
+    if( mndbOsAtomicAdd(&pPg->nRef, -1)==0 ){
+      if( pPager->xDestructor ){
+        pPager->xDestructor(pData);
+      }
+      page_link_idle(pPg);
+    }
+    mndbOsMutexLeave(pPager->pLatch);
+    return MNDB_OK;
+  }
+
+  /* When the number of references to a page reach 0, call the
+  ** destructor and add the page to the freelist.
+  */
+  pShard = pager_shard(pPager, pPg->pgno);
+  mndbOsMutexEnter(pShard->pLatch);
+  if( mndbOsAtomicAdd(&pPg->nRef, -1)>0 ){
+    mndbOsMutexLeave(pShard->pLatch);
+    return MNDB_OK;
   }
-  mndbFree(pPager);
+  pPg->busy = 1;
+  mndbOsMutexLeave(pShard->pLatch);
+  if( pPager->xDestructor ){
+    pPager->xDestructor(pData);
+  }
+  mndbOsMutexEnter(pShard->pLatch);
+  pPg->busy = 0;
+  page_link_free(pPg);
+  mndbOsCondBroadcast(pShard->pCond);
+  mndbOsMutexLeave(pShard->pLatch);
+  pager_release(pPager);
   return MNDB_OK;
 }
 
-/*
-** Return the page number for the given page data.
-*/
-Pgno mndbpager_pagenumber(void *pData){
-  PgHdr *pPg = DATA_TO_PGHDR(pData);
-  return pPg->pgno;
-}
 
-/* 
-** Increment the refrence to the given page. If the page
-** is in the free page list, then remove it from the list
-** 
-** ?Tudo: is free list is a cycle; yesA
+/*
+** Find the image of page pgno that a snapshot begun after commit iSeq
+** reads, or return NULL if it reads the page from the cache.
 */
-#define page_ref(P) ((P)->nRef == 0?_page_ref(P):(P)->nRef++);
-static void _page_ref(PgHdr *pPg){
-  if(pPg->nRef == 0){
-    if(pPg->pPrevFree){
-      pPg->pPrevFree->pNextFree = pPg->pNextFree;
-    }
-    else{
-      pPg->pPager->pFirst = pPg->pNextFree;
-    }
-    if(pPg->pNextFree){
-      pPg->pNextFree->pPrevFree = pPg->pPrevFree;
-    }
-    else{
-      pPg->pPager->pLast = pPg->pPrevFree;
-    }
-    pPg->pPager->nRef++; 
+static PgVersion *pager_version_find(Pager *pPager, Pgno pgno, u32 iSeq){
+  PgVersion *pVer = mndbHashFind(&pPager->versions, 0, pgno);
+  while( pVer && pVer->iSeq<=iSeq ){
+    pVer = pVer->pNextPg;
   }
-  ++pPg->nRef;
-  //test:REFINFO(pPg);
+  return pVer;
 }
 
 /*
-** Increment the reference count for a page
+** Keep the image of page pPg from before the transaction in progress
+** changed it, unless that has been done already.  The page must not
+** have been changed yet.
 */
-int mndbpager_ref(void *pData){
-  PgHdr *p = DATA_TO_PGHDR(pData);
-  page_ref(p);
-  return MNDB_OK;
-}
-
-//只有commit被调用或者回收一页的时候才会调用（懒惰写）；
-static int pager_write_pagelist(PgHdr *pList){
-  Pager *pPager;
-  int rc;
-
-  if(pList == 0) return MNDB_OK;
-  pPager = pList->pPager;
-  while(pList){
-    assert(pList->dirty);
-    mndbOsSeek(&pPager->fd, (pList->pgno-1)*(off_t)MNDB_PAGE_SIZE);
-    //test
-    //TRACE2("STORE %d\n", pList->pgno);
-    rc = mndbOsWrite(&pPager->fd, PGHDR_TO_DATA(pList), MNDB_PAGE_SIZE);
-    if(rc) return rc; //some one failed
-    pList->dirty = 0;
-    pList = pList->pDirty;
+static int pager_keep_version(PgHdr *pPg){
+  Pager *pPager = pPg->pPager;
+  u32 iSeq = pPager->iSeq + 1;
+  PgVersion *pVer, *pLast;
+  pLast = mndbHashFind(&pPager->versions, 0, pPg->pgno);
+  while( pLast && pLast->pNextPg ){
+    pLast = pLast->pNextPg;
   }
-  pPager->dirtyFile = 0;
+  if( pLast && pLast->iSeq==iSeq ){
+    return MNDB_OK;
+  }
+  pVer = mndbMalloc( sizeof(*pVer) + pPager->pageSize );
+  if( pVer==0 ){
+    return MNDB_NOMEM;
+  }
+  pVer->pgno = pPg->pgno;
+  pVer->iSeq = iSeq;
+  memcpy(&pVer[1], PGHDR_TO_DATA(pPg), pPager->pageSize);
+  if( pLast ){
+    pLast->pNextPg = pVer;
+  }else if( mndbHashInsert(&pPager->versions, 0, pPg->pgno, pVer)==pVer ){
+    mndbFree(pVer);
+    return MNDB_NOMEM;
+  }
+  if( pPager->pLastVer ){
+    pPager->pLastVer->pNext = pVer;
+  }else{
+    pPager->pFirstVer = pVer;
+  }
+  pPager->pLastVer = pVer;
+  pPager->nVersion++;
   return MNDB_OK;
 }
 
 /*
-** Collect every dirty pages into a dirty list and return a pointer to the head
-** of the list
+** Begin a snapshot of the database as of the last commit.  Its pages
+** are read with mndbpager_snapshot_get() and released with
+** mndbpager_unref() like any other, and it is ended with
+** mndbpager_snapshot_end().
+**
+** The cache is brought up to date first, so this takes a read lock on
+** the file for a moment.  MNDB_BUSY is returned if the transaction in
+** progress has changed pages without keeping their old images, because
+** no snapshot was in use when it began.  The next one will keep them.
 */
-static PgHdr* pager_get_all_dirty_pages(Pager *pPager){
-  PgHdr *pList, *p;
-  pList = 0;
-  for(p = pPager->pAll; p; p = p->pNextAll){
-    if(p->dirty){
-      p->pDirty = pList;
-      pList = p;
-    }
+static int pager_snapshot_begin(Pager *pPager, PagerSnap **ppSnap){
+  PagerSnap *pSnap;
+  void *pPage1;
+  int rc;
+  *ppSnap = 0;
+  pPager->wantVersion = 1;
+  if( pPager->noVersion ){
+    return MNDB_BUSY;
+  }
+  rc = pager_get(pPager, 1, &pPage1);
+  if( rc!=MNDB_OK ){
+    return rc;
   }
-  return pList;
+  pSnap = mndbMalloc( sizeof(*pSnap) );
+  if( pSnap ){
+    pSnap->pPager = pPager;
+    pSnap->iSeq = pPager->iSeq;
+    mndbHashInit(&pSnap->copies, MNDB_HASH_INT, 0);
+    pSnap->pNext = pPager->pSnap;
+    pPager->pSnap = pSnap;
+    pPager->useVersion = 1;
+  }
+  mndbpager_unref(pPage1);
+  *ppSnap = pSnap;
+  return pSnap ? MNDB_OK : MNDB_NOMEM;
+}
+int mndbpager_snapshot_begin(Pager *pPager, PagerSnap **ppSnap){
+  int rc;
+  mndbOsMutexEnter(pPager->pLatch);
+  rc = pager_snapshot_begin(pPager, ppSnap);
+  mndbOsMutexLeave(pPager->pLatch);
+  return rc;
 }
 
 /*
-** Acquire a page.
-**
-** A read lock on the disk file is obtained when the first page is acquired. 
-** This read lock is dropped when the last page is released.
-**
-** A _get works for any page number greater than 0.  If the database
-** file is smaller than the requested page, then no actual disk
-** read occurs and the memory image of the page is initialized to
-** all zeros.  The extra data appended to a page is always initialized
-** to zeros the first time a page is loaded into memory.
-**
-** The acquisition might fail for several reasons.  In all cases,
-** an appropriate error code is returned and *ppPage is set to NULL.
-**
-** See also sqlitepager_lookup().  Both this routine and _lookup() attempt
-** to find a page in the in-memory cache first.  If the page is not already
-** in memory, this routine goes to disk to read it in whereas _lookup()
-** just returns 0.  This routine acquires a read-lock the first time it
-** has to go to disk, and could also playback an old journal if necessary.
-** Since _lookup() never goes to disk, it never has to deal with locks
-** or journal files.
+** Acquire page pgno as snapshot pSnap sees it.  The page is a private
+** copy, made from the image kept from before the page was changed or,
+** if it has not been changed since the snapshot began, from the page in
+** the cache.  Loading that may take a read lock on the file for a
+** moment, and if another connection turns out to have committed in the
+** meantime, MNDB_BUSY is returned and the snapshot is of no further use.
 */
-int mndbpager_get(Pager *pPager, Pgno pgno, void **ppPage){
+static int pager_snapshot_get(PagerSnap *pSnap, Pgno pgno, void **ppPage){
+  Pager *pPager = pSnap->pPager;
+  PgVersion *pVer;
   PgHdr *pPg;
+  void *pData;
   int rc;
 
-  /* Make sure we have not hit any critical errors.
-  */ 
-  assert( pPager!=0 );
-  assert( pgno!=0 );
   *ppPage = 0;
-  if( pPager->errMask & ~(PAGER_ERR_FULL) ){
-     return pager_errcode(pPager);
-   }
-
-  /* If this is the first page accessed, then get a read lock
-  ** on the database file.
-  */
-  if( pPager->nRef==0 ){
-    rc = mndbOsReadLock(&pPager->fd);
-    if( rc!=MNDB_OK ){
-      return rc;
-    }
-    pPager->state = MNDB_READLOCK;
-
-
-    pPg = 0;
-  }else{
-    /* Search for page in cache */
-    pPg = pager_lookup(pPager, pgno);
+  if( pSnap->isStale ){
+    return MNDB_BUSY;
+  }
+  pPg = mndbHashFind(&pSnap->copies, 0, pgno);
+  if( pPg ){
+    page_ref(pPg);
+    *ppPage = PGHDR_TO_DATA(pPg);
+    return MNDB_OK;
   }
+  pPg = mndbMalloc( pPager->szExtra + sizeof(PgHdr) + pPager->pageSize );
   if( pPg==0 ){
-    /* The requested page is not in the page cache. */
-    int h;
-    pPager->nMiss++;
-    if( pPager->nPage < pPager->mxPage || pPager->pFirst==0 ){
-      /* Create a new page */
-      pPg = mndbMallocRaw( sizeof(*pPg) + MNDB_PAGE_SIZE 
-			   + sizeof(u32)+ pPager->nExtra );//?u32 是什么
-      if( pPg==0 ){
-        pager_unwritelock(pPager);
-        pPager->errMask |= PAGER_ERR_MEM;
-        return MNDB_NOMEM;
-      }
-      memset(pPg, 0, sizeof(*pPg));
-      pPg->pPager = pPager;
-      pPg->pNextAll = pPager->pAll;
-      if( pPager->pAll ){
-        pPager->pAll->pPrevAll = pPg;
-      }
-      pPg->pPrevAll = 0;
-      pPager->pAll = pPg;
-      pPager->nPage++;
-    }else{
-      /* Find a page to recycle.  Try to locate a page that does not
-      ** require us to do an fsync() on the journal.
-      */
-      
-      //?Tudo:what if there is no free pages;
-      pPg = pPager->pFirst;
- 
-      while(pPg && pPg->dirty){
-	pPg = pPg->pNextFree;
-      }
-      /* If we could not find a page that does not require an fsync()
-      ** on the journal file then fsync the journal file.  This is a
-      ** very slow operation, so we work hard to avoid it.  But sometimes
-      ** it can't be helped.
-      */
-      /*
-      ** Tudo : If No free page, recycle the page by LRU.
-      */
-      /* Write the page to the database file if it is dirty.
-      */
-      if(pPg==0 || pPg->dirty){
-        pPg->pDirty = 0;
-	assert( pPg->nRef==0 );
-        rc = pager_write_pagelist( pPg );// 打开一次磁盘上的文件，尽可能多的写入；??
-	pPg = pPager->pFirst;
-      }
-      assert(pPg->ref == 0);
-      assert(pPg->dirty == 0);
-        
-      /* Unlink the old page from the free list and the hash table
-      */
-
-      if( pPg->pPrevFree ){
-        pPg->pPrevFree->pNextFree = pPg->pNextFree;
-      }else{
-        assert( pPager->pFirst==pPg );
-        pPager->pFirst = pPg->pNextFree;
-      }
-      if( pPg->pNextFree ){
-        pPg->pNextFree->pPrevFree = pPg->pPrevFree;
-      }else{
-        assert( pPager->pLast==pPg );
-        pPager->pLast = pPg->pPrevFree;
-      }
-      //remove from the free page table
-      pPg->pNextFree = pPg->pPrevFree = 0;
-      if( pPg->pNextHash ){
-        pPg->pNextHash->pPrevHash = pPg->pPrevHash;
-      }
-      if( pPg->pPrevHash ){
-        pPg->pPrevHash->pNextHash = pPg->pNextHash;
-      }else{
-        h = pager_hash(pPg->pgno);
-        assert( pPager->aHash[h]==pPg );
-        pPager->aHash[h] = pPg->pNextHash;
+    return MNDB_NOMEM;
+  }
+  pPg = (PgHdr*)&((char*)pPg)[pPager->szExtra];
+  pPg->pPager = pPager;
+  pPg->pgno = pgno;
+  pPg->pSnap = pSnap;
+  pVer = pager_version_find(pPager, pgno, pSnap->iSeq);
+  if( pVer ){
+    memcpy(PGHDR_TO_DATA(pPg), &pVer[1], pPager->pageSize);
+  }else{
+    rc = pager_get(pPager, pgno, &pData);
+    if( rc==MNDB_OK ){
+      if( !pSnap->isStale ){
+        memcpy(PGHDR_TO_DATA(pPg), pData, pPager->pageSize);
       }
-      pPg->pNextHash = pPg->pPrevHash = 0;
-      pPager->nOvfl++;
+      mndbpager_unref(pData);
+      if( pSnap->isStale ) rc = MNDB_BUSY;
     }
-    pPg->pgno = pgno;
-    pPg->dirty = 0;
-    pPg->nRef = 1;
-    //test    REFINFO(pPg);
-    pPager->nRef++;
-    h = pager_hash(pgno);
-    pPg->pNextHash = pPager->aHash[h];
-    pPager->aHash[h] = pPg;
-    if( pPg->pNextHash ){
-      assert( pPg->pNextHash->pPrevHash==0 );
-      pPg->pNextHash->pPrevHash = pPg;
-    }
-    if(pPager->nExtra>0){
-      memset(PGHDR_TO_EXTRA(pPg),0,pPager->nExtra);
-    }
-    if( pPager->dbSize<0 ) mndbpager_pagecount(pPager);
-    //!!
-    if( pPager->errMask!=0 ){
-      mndbpager_unref(PGHDR_TO_DATA(pPg));
-      rc = pager_errcode(pPager);
+    if( rc!=MNDB_OK ){
+      mndbFree(PGHDR_TO_EXTRA(pPg));
       return rc;
     }
-    //!!
-
-    if( pPager->dbSize<(int)pgno ){
-      memset(PGHDR_TO_DATA(pPg), 0, MNDB_PAGE_SIZE);
-    }else{
-      int rc;
-      mndbOsSeek(&pPager->fd, (pgno-1)*(off_t)MNDB_PAGE_SIZE);
-      rc = mndbOsRead(&pPager->fd, PGHDR_TO_DATA(pPg), MNDB_PAGE_SIZE);
-      //!TRACE2("FETCH %d\n", pPg->pgno);
- 
-      if( rc!=MNDB_OK ){
-        off_t fileSize;
-        if( mndbOsFileSize(&pPager->fd,&fileSize)!=MNDB_OK
-               || fileSize>=pgno*MNDB_PAGE_SIZE ){
-          mndbpager_unref(PGHDR_TO_DATA(pPg));
-          return rc;
-        }else{
-          memset(PGHDR_TO_DATA(pPg), 0, MNDB_PAGE_SIZE);
-        }
-      }
-    }
-  }else{
-    /* The requested page is in the page cache. */
-    pPager->nHit++;
-    page_ref(pPg);
   }
-  *ppPage =PGHDR_TO_DATA(pPg);
+  if( mndbHashInsert(&pSnap->copies, 0, pgno, pPg)==pPg ){
+    mndbFree(PGHDR_TO_EXTRA(pPg));
+    return MNDB_NOMEM;
+  }
+  mndbOsAtomicStore(&pPg->nRef, 1);
+  *ppPage = PGHDR_TO_DATA(pPg);
   return MNDB_OK;
 }
+int mndbpager_snapshot_get(PagerSnap *pSnap, Pgno pgno, void **ppPage){
+  Pager *pPager = pSnap->pPager;
+  int rc;
+  mndbOsMutexEnter(pPager->pLatch);
+  rc = pager_snapshot_get(pSnap, pgno, ppPage);
+  mndbOsMutexLeave(pPager->pLatch);
+  return rc;
+}
+
 /*
-** Acquire a page if it is already in the in-memory cache.  Do
-** not read the page from disk.  Return a pointer to the page,
-** or 0 if the page is not in cache.
+** End a snapshot.  Every page acquired through it must have been
+** released.  The old images that only it could read are let go.
+*/
+void mndbpager_snapshot_end(PagerSnap *pSnap){
+  Pager *pPager = pSnap->pPager;
+  PagerSnap **pp;
+  mndbOsMutexEnter(pPager->pLatch);
+  while( pSnap->pFirst ){
+    PgHdr *pPg = pSnap->pFirst;
+    page_unlink_idle(pPg);
+    page_free_copy(pPg);
+  }
+  assert( mndbHashCount(&pSnap->copies)==0 );
+  mndbHashClear(&pSnap->copies);
+  for(pp=&pPager->pSnap; *pp!=pSnap; pp=&(*pp)->pNext){}
+  *pp = pSnap->pNext;
+  pager_version_trim(pPager);
+  mndbOsMutexLeave(pPager->pLatch);
+  mndbFree(pSnap);
+}
+
+/*
+** Make the database nPage pages long.  Pages past the new end are
+** forgotten: changes made to them are dropped, and they read as zeros
+** if the database grows again.  The file itself is cut down when the
+** transaction commits or, in WAL mode, by the checkpoint that copies
+** the commit into the file.
 **
-** See also sqlitepager_get().  The difference between this routine
-** and sqlitepager_get() is that _get() will go to the disk and read
-** in the page if the page is not already in cache.  This routine
-** returns NULL if the page is not in cache or if a disk I/O error 
-** has ever happened.
+** This must be done inside a write transaction, and no page past the
+** new end may be referenced.  MNDB_MISUSE is returned otherwise.  A
+** database cannot be made longer this way.  The old images of the pages
+** cut off are kept once a snapshot has begun.
 */
-void *mndbpager_lookup(Pager *pPager, Pgno pgno){
+static int pager_truncate(Pager *pPager, Pgno nPage){
   PgHdr *pPg;
-
-  assert( pPager!=0 );
-  assert( pgno!=0 );
-  if( pPager->errMask & ~(PAGER_ERR_FULL) ){
-    return 0;
+  Pgno pgno;
+  int rc;
+  if( pPager->state!=MNDB_WRITELOCK ){
+    return MNDB_MISUSE;
+  }
+  if( pPager->errMask ){
+    return pager_errcode(pPager);
+  }
+  if( pPager->dbSize<0 ) pager_pagecount(pPager);
+  if( (int)nPage>=pPager->dbSize ){
+    return MNDB_OK;
+  }
+  for(pPg=pPager->pAll; pPg; pPg=pPg->pNextAll){
+    PgShard *pShard;
+    if( pPg->pgno<=nPage ) continue;
+    /* Wait for a page another thread is loading or releasing */
+    pShard = pager_shard(pPager, pPg->pgno);
+    mndbOsMutexEnter(pShard->pLatch);
+    while( pPg->busy ){
+      mndbOsCondWait(pShard->pCond, pShard->pLatch);
+    }
+    mndbOsMutexLeave(pShard->pLatch);
+    if( mndbOsAtomicLoad(&pPg->nRef)>0 ){
+      return MNDB_MISUSE;
+    }
   }
-  /* if( pPager->nRef==0 ){
-  **  return 0;
-  ** }
-  */
-  pPg = pager_lookup(pPager, pgno);
-  if( pPg==0 ) return 0;
-  page_ref(pPg);
-  return PGHDR_TO_DATA(pPg);
-}
 
-int mndbpager_unref(void *pData){
-  PgHdr *pPg; 
-  pPg = DATA_TO_PGHDR(pData);
-  assert(pPg->nRef > 0);
-  --pPg->nRef;
-  //TEST REFINFO(pPg);
+  /* The background writer may still hold images of pages past the end,
+  ** which a cache miss would find.  Let it write them out first.
+  */
+  rc = pager_bgw_drain(pPager);
+  if( rc!=MNDB_OK ){
+    return rc;
+  }
 
-  /* When the number of references to a page reach 0, call the
-  ** destructor and add the page to the freelist.
+  /* Snapshots may still read the pages past the end.
   */
-  if( pPg->nRef==0 ){
-    Pager *pPager;
-    pPager = pPg->pPager;
-    pPg->pNextFree = 0;
-    pPg->pPrevFree = pPager->pLast;
-    pPager->pLast = pPg;
-    if( pPg->pPrevFree ){
-      pPg->pPrevFree->pNextFree = pPg;
-    }else{
-      pPager->pFirst = pPg;
+  for(pgno=nPage+1; pPager->useVersion && pgno<=(Pgno)pPager->dbSize; pgno++){
+    void *pData;
+    rc = pager_get(pPager, pgno, &pData);
+    if( rc!=MNDB_OK ){
+      return rc;
     }
-
-    if( pPager->xDestructor ){
-      pPager->xDestructor(pData);
+    rc = pager_keep_version(DATA_TO_PGHDR(pData));
+    mndbpager_unref(pData);
+    if( rc!=MNDB_OK ){
+      return rc;
     }
-  
-    /* When all pages reach the freelist, drop the read lock from
-    ** the database file.
-    */
-    pPager->nRef--;
-    assert( pPager->nRef>=0 );
-    if( pPager->nRef==0 ){
-      pager_reset(pPager);
+  }
+  for(pPg=pPager->pAll; pPg; pPg=pPg->pNextAll){
+    if( pPg->pgno<=nPage ) continue;
+    page_remove_from_dirty_list(pPg, 0);
+    memset(PGHDR_TO_DATA(pPg), 0, pPager->pageSize);
+    if( pPager->nExtra>0 ){
+      memset(PGHDR_TO_EXTRA(pPg), 0, pPager->nExtra);
     }
   }
+  pPager->dbSize = nPage;
+  pPager->dirtyFile = 1;
+  if( !pPager->useVersion ) pPager->noVersion = 1;
+  pPager->needTruncate = 1;
   return MNDB_OK;
 }
+int mndbpager_truncate(Pager *pPager, Pgno nPage){
+  int rc;
+  mndbOsMutexEnter(pPager->pLatch);
+  rc = pager_truncate(pPager, nPage);
+  mndbOsMutexLeave(pPager->pLatch);
+  return rc;
+}
 
 
 /*
@@ -696,23 +4286,42 @@ int mndbpager_unref(void *pData){
 **
 ** If the database is already write-locked, this routine is a no-op.
 */
-int mndbpager_begin(void *pData){
+static int pager_begin(void *pData){
   PgHdr *pPg = DATA_TO_PGHDR(pData);
   Pager *pPager = pPg->pPager;
   int rc = MNDB_OK;
-  assert( pPg->nRef>0 );
+  assert( mndbOsAtomicLoad(&pPg->nRef)>0 );
+  if( pPg->pSnap ){
+    return MNDB_READONLY;
+  }
   assert( pPager->state!=MNDB_UNLOCK );
   if( pPager->state==MNDB_READLOCK ){
-    rc = mndbOsWriteLock(&pPager->fd);
+    if( pPager->memDb ){
+      rc = MNDB_OK;
+    }else if( pPager->pWal ){
+      rc = mndbWalBeginWrite(pPager->pWal);
+    }else{
+      rc = mndbOsWriteLock(&pPager->fd);
+    }
     if( rc!=MNDB_OK ){
       return rc;
     }
     pPager->state = MNDB_WRITELOCK;
     pPager->dirtyFile = 0;
+    pPager->useVersion = pPager->pSnap!=0 || pPager->wantVersion;
+    pPager->wantVersion = 0;
     //Test TRACE1("TRANSACTION\n");
   }
   return rc;
 }
+int mndbpager_begin(void *pData){
+  Pager *pPager = DATA_TO_PGHDR(pData)->pPager;
+  int rc;
+  mndbOsMutexEnter(pPager->pLatch);
+  rc = pager_begin(pData);
+  mndbOsMutexLeave(pPager->pLatch);
+  return rc;
+}
 
 /*
 ** Mark a data page as writeable.  The page is written into the journal 
@@ -731,7 +4340,7 @@ int mndbpager_begin(void *pData){
 ** is a call to sqlitepager_commit() or sqlitepager_rollback() to
 ** reset.
 */
-int mndbpager_write(void *pData){
+static int pager_write(void *pData){
   PgHdr *pPg = DATA_TO_PGHDR(pData);
   Pager *pPager = pPg->pPager;
   int rc = MNDB_OK;
@@ -744,15 +4353,43 @@ int mndbpager_write(void *pData){
   if( pPager->readOnly ){
     return MNDB_PERM;
   }
+  if( pPg->pSnap ){
+    return MNDB_READONLY;
+  }
 
-  /* Mark the page as dirty.  If the page has already been written
-  ** to the journal then we can return right away.
+  /* Snapshots go on reading the page as it was.
   */
-  pPg->dirty = 1;
+  if( pPager->useVersion ){
+    rc = pager_keep_version(pPg);
+    if( rc!=MNDB_OK ){
+      return rc;
+    }
+  }else{
+    pPager->noVersion = 1;
+  }
+
+  /* Mark the page as dirty and put it on the dirty list so that
+  ** commit never has to search the cache for modified pages.
+  */
+  page_add_to_dirty_list(pPg);
   pPager->dirtyFile = 1;
 
+  /* Writing a page past the end of the file extends the database.
+  */
+  if( pPager->dbSize<0 ) mndbpager_pagecount(pPager);
+  if( pPager->dbSize<(int)pPg->pgno ){
+    pPager->dbSize = pPg->pgno;
+  }
   return MNDB_OK;
 }
+int mndbpager_write(void *pData){
+  Pager *pPager = DATA_TO_PGHDR(pData)->pPager;
+  int rc;
+  mndbOsMutexEnter(pPager->pLatch);
+  rc = pager_write(pData);
+  mndbOsMutexLeave(pPager->pLatch);
+  return rc;
+}
 
 /*
 ** Return TRUE if the page given in the argument was previously passed
@@ -775,7 +4412,7 @@ int mndbpager_overwrite(Pager *pPager, Pgno pgno, void *pData){
   if(rc == MNDB_OK){
     rc = mndbpager_write(pPage);
     if(rc == MNDB_OK){
-      memcpy(pPager, pData, MNDB_PAGE_SIZE);
+      memcpy(pPage, pData, pPager->pageSize);
     }
     mndbpager_unref(pPage);
   }
@@ -790,9 +4427,10 @@ int mndbpager_overwrite(Pager *pPager, Pgno pgno, void *pData){
 ** and an error code is returned.  If the commit worked, MNDB_OK
 ** is returned.
 */
-int mndbpager_commit(Pager *pPager){//TUDO:没有事务用不到??
+static int pager_commit(Pager *pPager){//TUDO:没有事务用不到??
   int rc;
-  PgHdr *pPg;
+  PgHdr *pPg, *p;
+  int nPage = 0;
 
   /*if( pPager->errMask==PAGER_ERR_FULL ){
     rc = sqlitepager_rollback(pPager);
@@ -811,15 +4449,74 @@ int mndbpager_commit(Pager *pPager){//TUDO:没有事务用不到??
 
   //test TRACE1("COMMIT\n");
   if( pPager->dirtyFile!=0 ){
+    /* Bump the change counter so that other connections know to
+    ** discard what they have cached.
+    */
+    void *pPage1;
+    rc = mndbpager_get(pPager, 1, &pPage1);
+    if( rc!=MNDB_OK ) return rc;
+    rc = mndbpager_write(pPage1);
+    if( rc==MNDB_OK ){
+      memcpy(&pPager->iChange, &((char*)pPage1)[MNDB_CHANGE_COUNTER_OFFSET], 4);
+      pPager->iChange++;
+      store32bits(pPager->iChange, DATA_TO_PGHDR(pPage1),
+                  MNDB_CHANGE_COUNTER_OFFSET);
+      if( pPager->useCompress ){
+        store32bits(MNDB_FORMAT_COMPRESSED, DATA_TO_PGHDR(pPage1),
+                    MNDB_FORMAT_OFFSET);
+      }
+    }
+    mndbpager_unref(pPage1);
+    if( rc!=MNDB_OK ) return rc;
     pPg = pager_get_all_dirty_pages(pPager);
-    if( pPg ){
+    for(p=pPg; p; p=p->pDirty){
+      nPage++;
+    }
+    if( pPager->pWal ){
+      rc = pager_wal_write_pagelist(pPg, 1);
+      pPager->needTruncate = 0;   /* Done by a checkpoint */
+    }else{
       rc = pager_write_pagelist(pPg);
-      if(rc != MNDB_OK)
-	return rc;
+      if( rc==MNDB_OK && pPager->needTruncate ){
+        rc = pager_truncate_file(pPager);
+      }
     }
+    if(rc != MNDB_OK)
+      return rc;
+    pPager->dirtyFile = 0;
+    pPager->iSeq++;
+    pager_version_trim(pPager);
+    pPager->stat.nCommit++;
+    pPager->stat.nCommitPage += nPage;
   }
   rc = pager_unwritelock(pPager);
-  pPager->dbSize = -1;
+  if( !pPager->memDb ) pPager->dbSize = -1;
+
+  /* In WAL mode the write transaction has been handed on already, so
+  ** other connections can commit while this one waits for the log to
+  ** be synced.  See mndbWalSync().
+  */
+  if( rc==MNDB_OK && pPager->pWal ){
+    double rStart;
+    mndbOsClock(&rStart);
+    rc = mndbWalSync(pPager->pWal);
+    pager_record_io(&pPager->stat.sync, 0, rStart);
+  }
+
+  /* Once the log has grown long enough, copy it back into the database.
+  ** A checkpoint that fails does not affect the commit.
+  */
+  if( rc==MNDB_OK && pPager->pWal
+        && mndbWalFrameCount(pPager->pWal)>=MNDB_WAL_AUTOCHECKPOINT ){
+    mndbWalCheckpoint(pPager->pWal);
+  }
+  return rc;
+}
+int mndbpager_commit(Pager *pPager){
+  int rc;
+  mndbOsMutexEnter(pPager->pLatch);
+  rc = pager_commit(pPager);
+  mndbOsMutexLeave(pPager->pLatch);
   return rc;
 }
 
@@ -832,39 +4529,69 @@ int mndbpager_isreadonly(Pager *pPager){
 }
 
 /*
-** This routine is used for testing and analysis only.
+** Write the statistics of the pager into *pStats.  If resetFlag is true
+** every counter starts again from zero, so a caller that exports the
+** numbers at intervals can take each one as the activity since the
+** last call.  Nothing is lost between the snapshot and the reset.
 */
-int *mndbpager_stats(Pager *pPager){
-  static int a[9];
-  a[0] = pPager->nRef;
-  a[1] = pPager->nPage;
-  a[2] = pPager->mxPage;
-  a[3] = pPager->dbSize;
-  a[4] = pPager->state;
-  a[5] = pPager->errMask;
-  a[6] = pPager->nHit;
-  a[7] = pPager->nMiss;
-  a[8] = pPager->nOvfl;
-  return a;
+static void pager_stats(Pager *pPager, PagerStats *pStats, int resetFlag){
+  PgWriter *pW = pPager->pWriter;
+  u64 nCommit, nSync, nHit;
+  int i, j;
+
+  *pStats = pPager->stat;
+  nHit = mndbOsAtomicLoad(&pPager->nHitShared);
+  pStats->nHit += nHit;
+  if( resetFlag ) mndbOsAtomicAdd(&pPager->nHitShared, -nHit);
+  pStats->nRef = mndbOsAtomicLoad(&pPager->nRef);
+  pStats->nPage = pPager->nPage;
+  pStats->mxPage = pPager->mxPage;
+  pStats->nHold = 0;
+  for(i=0; i<PAGER_N_SHARD; i++){
+    PgShard *pShard = &pPager->aShard[i];
+    mndbOsMutexEnter(pShard->pLatch);
+    for(j=0; j<PAGER_N_HOLD; j++){
+      pStats->nHold += pShard->aHold[j].n;
+    }
+    pStats->nPromote += pShard->nPromote;
+    pStats->nDemote += pShard->nDemote;
+    pager_merge_io(&pStats->read, &pShard->read);
+    if( resetFlag ){
+      pShard->nPromote = pShard->nDemote = 0;
+      memset(&pShard->read, 0, sizeof(pShard->read));
+    }
+    mndbOsMutexLeave(pShard->pLatch);
+  }
+  pStats->nVersion = pPager->nVersion;
+  if( pW ){
+    mndbOsMutexEnter(pW->pMutex);
+    pStats->nBgWrite += pW->nWrite;
+    pager_merge_io(&pStats->write, &pW->write);
+    if( resetFlag ){
+      pW->nWrite = 0;
+      memset(&pW->write, 0, sizeof(pW->write));
+    }
+    mndbOsMutexLeave(pW->pMutex);
+  }
+  if( pPager->pWal ){
+    mndbWalSyncStats(pPager->pWal, &nCommit, &nSync);
+    pStats->nWalCommit = nCommit - pPager->nWalCommitBase;
+    pStats->nWalSync = nSync - pPager->nWalSyncBase;
+    if( resetFlag ){
+      pPager->nWalCommitBase = nCommit;
+      pPager->nWalSyncBase = nSync;
+    }
+  }
+  if( resetFlag ){
+    memset(&pPager->stat, 0, sizeof(pPager->stat));
+  }
+}
+void mndbpager_stats(Pager *pPager, PagerStats *pStats, int resetFlag){
+  mndbOsMutexEnter(pPager->pLatch);
+  pager_stats(pPager, pStats, resetFlag);
+  mndbOsMutexLeave(pPager->pLatch);
 }
 
 const char* mndbpager_filename(Pager *pPager){
   return pPager->zFilename;
 }
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
-
@@ -3,9 +3,16 @@
 ** This header file defines the interface that the minidb cache subsystem
 */
 
+/*
+** The default page size.  The page size of a particular database is
+** chosen when the file is created and may be anything between
+** MNDB_MIN_PAGE_SIZE and MNDB_MAX_PAGE_SIZE.  See mndbpager_set_pagesize().
+*/
 #ifndef MNDB_PAGE_SIZE 
 #define MNDB_PAGE_SIZE 1024
 #endif
+#define MNDB_MIN_PAGE_SIZE 512
+#define MNDB_MAX_PAGE_SIZE 65536
 
 #ifndef MNDB_PAGE_RESERVE 
 #define MNDB_PAGE_RESERVE 0
@@ -19,6 +26,41 @@
 #define MNDB_MAX_PAGE 1077741823
 #endif
 
+/*
+** Bytes MNDB_CHANGE_COUNTER_OFFSET through MNDB_CHANGE_COUNTER_OFFSET+3 of
+** page 1 hold a counter that the pager increments on every commit.  It
+** is how a pager tells whether pages it kept cached while the file was
+** unlocked are still current.  The layer above must leave them alone.
+*/
+#define MNDB_CHANGE_COUNTER_OFFSET 64
+
+/*
+** Bytes MNDB_FORMAT_OFFSET through MNDB_FORMAT_OFFSET+3 of page 1 tell
+** how the pager lays out the rest of the file.  They hold
+** MNDB_FORMAT_COMPRESSED if pages are stored compressed and zero
+** otherwise.  The layer above must leave them alone too.  See
+** mndbpager_set_compress().
+*/
+#define MNDB_FORMAT_OFFSET 68
+#define MNDB_FORMAT_COMPRESSED 0x4c5a3150
+
+/*
+** Cache replacement policies.  See mndbpager_set_cachepolicy().
+*/
+#define MNDB_CACHE_LRU   0   /* Recycle the least recently released page */
+#define MNDB_CACHE_2Q    1   /* Scan resistant 2Q */
+
+/*
+** What a page is used for, as the layer above tells the pager with
+** mndbpager_set_priority().  Free root and interior pages are held in
+** the cache ahead of other pages, each class within a budget of its
+** own, and overflow pages are recycled first.  See page_link_free().
+*/
+#define MNDB_PAGE_LEAF      0   /* Anything else.  The default */
+#define MNDB_PAGE_OVERFLOW  1   /* Recycled ahead of other pages */
+#define MNDB_PAGE_INTERIOR  2   /* Held, up to a budget */
+#define MNDB_PAGE_ROOT      3   /* Held, up to a budget of their own */
+
 /* The type used to represent a page number, The  firsrt page in a file
 ** is called page 1
 */
@@ -29,17 +71,103 @@ typedef unsigned int Pgno;
 */
 typedef struct Pager Pager;
 
+/*
+** A read-only view of the database as of the last commit before it
+** began.  See mndbpager_snapshot_begin().
+*/
+typedef struct PagerSnap PagerSnap;
+
+/*
+** Statistics of a pager, filled in by mndbpager_stats().  The counters
+** count from when the pager was opened or last reset.
+**
+** I/O is counted per request the pager makes of the operating system
+** layer, or of the write-ahead log in WAL mode, and timed from the pager.
+** Slot i of a latency histogram counts requests that took less than 2**i
+** microseconds but no less than half that; slot 0 counts those under a
+** microsecond and the last slot everything too slow for the others.
+**
+** The sync histogram is only filled in WAL mode, where a commit waits for
+** the log to reach the disk.  A commit in rollback mode writes the journal
+** and the database file without syncing either, so it has nothing to time.
+*/
+#define MNDB_N_LATENCY 24
+
+/*
+** The counters are 64 bits wide.  The type is spelled out here rather
+** than taken from mndbInt.h so that this header can be used on its own.
+*/
+#if defined(_MSC_VER) || defined(__BORLANDC__)
+  typedef unsigned __int64 PagerCounter;
+#else
+  typedef unsigned long long PagerCounter;
+#endif
+
+typedef struct PagerIoStats PagerIoStats;
+struct PagerIoStats {
+  PagerCounter nCall;         /* Requests made */
+  PagerCounter nByte;         /* Bytes moved by them */
+  PagerCounter aLatency[MNDB_N_LATENCY];  /* Latency histogram */
+};
+
+typedef struct PagerStats PagerStats;
+struct PagerStats {
+  int nRef;                   /* Pages referenced right now */
+  int nPage;                  /* Pages in the cache right now */
+  int mxPage;                 /* Most pages the cache may hold */
+  int nHold;                  /* Free root and interior pages held back */
+  int nVersion;               /* Old page images kept for snapshots */
+  PagerCounter nHit;          /* Pages found in the cache */
+  PagerCounter nMiss;         /* Pages that had to be loaded */
+  PagerCounter nEvictClean;   /* Clean pages recycled */
+  PagerCounter nEvictDirty;   /* Dirty pages that were written to be recycled */
+  PagerCounter nEvictA1;      /* 2Q: pages recycled from the A1in queue */
+  PagerCounter nPromote;      /* 2Q: pages moved from A1in to Am */
+  PagerCounter nDemote;       /* Held pages let go for being over budget */
+  PagerCounter nStale;        /* Times the whole cache was found out of date */
+  PagerCounter nCommit;       /* Transactions committed */
+  PagerCounter nCommitPage;   /* Pages written by those commits */
+  PagerCounter nBgWrite;      /* Pages written by the background writer */
+  PagerCounter nWalCommit;    /* WAL: commits to the log, by any connection */
+  PagerCounter nWalSync;      /* WAL: log syncs those commits took */
+  PagerIoStats read;          /* Reads of the database file or log */
+  PagerIoStats write;         /* Writes to the database file or log */
+  PagerIoStats sync;          /* WAL: waits for commits to become durable */
+};
+
 /* 
 ** Routines of pager
 */
 int mndbpager_open(Pager **ppPager, const char *zFilename, int mxPage, int nEx);
 void mndbpager_set_destructor(Pager *pPager, void (*Desc)(void *));
+int mndbpager_set_pagesize(Pager *pPager, int pageSize, int nExtra);
+int mndbpager_pagesize(Pager *pPager);
+int mndbpager_set_cachepolicy(Pager *pPager, int ePolicy);
+int mndbpager_set_budget(Pager *pPager, int eClass, int pctCache);
+void mndbpager_set_hugepages(Pager *pPager, int useHugePages);
+int mndbpager_set_mmap(Pager *pPager, int useMmap);
+int mndbpager_set_direct(Pager *pPager, int useDirect);
+int mndbpager_set_compress(Pager *pPager, int useCompress);
+int mndbpager_set_wal(Pager *pPager, int useWal);
+int mndbpager_checkpoint(Pager *pPager);
+int mndbpager_set_bgwriter(Pager *pPager, int pctClean);
+int mndbpager_set_chunksize(Pager *pPager, int nPage);
+int mndbpager_set_warm(Pager *pPager, int useWarm);
+int mndbpager_read_fileheader(Pager *pPager, int N, unsigned char *pDest);
+void *mndbpager_getextra(void *pData);
+void mndbpager_set_priority(void *pData, int eClass);
 int mndbpager_pagecount(Pager *pPager);
+int mndbpager_truncate(Pager *pPager, Pgno nPage);
+int mndbpager_snapshot_begin(Pager *pPager, PagerSnap **ppSnap);
+int mndbpager_snapshot_get(PagerSnap *pSnap, Pgno pgno, void **ppPage);
+void mndbpager_snapshot_end(PagerSnap *pSnap);
 int mndbpager_close(Pager *pPager);
 Pgno mndbpager_pagenumber(void *pData);
 int mndbpager_ref(void *pData);
 int mndbpager_get(Pager *pPager, Pgno pgno, void **ppPage);
 void* mndbpager_lookup(Pager *pPager, Pgno pgno);
+void mndbpager_prefetch(Pager *pPager, Pgno first, int n);
+void mndbpager_prefetch_pages(Pager *pPager, int n, const Pgno *aPgno);
 int mndbpager_unref(void *pData);
 int mndbpager_begin(void *pData);
 int mndbpager_write(void *pData);
@@ -47,7 +175,7 @@ int mndbpager_iswriteable(void *pData);
 int mndbpager_overwrite(Pager *pPager, Pgno pgno, void *pData);
 int mndbpager_commit(Pager *pPager);
 int mndbpager_isreadonly(Pager *pPager);
-int* mndbpager_stats(Pager *pPager);
+void mndbpager_stats(Pager *pPager, PagerStats *pStats, int resetFlag);
 const char* mndbpager_filename(Pager *pPager);
 #ifdef TEST
 void mndbpager_refdump(Pager*);
@@ -1,43 +1,1313 @@
+/*
+** Tests of the pager.  Build them with "make pager" and run ./testPager.
+** Each check that fails is printed, and the exit status is the number
+** of failures.  The tests that need threads are only built by "make
+** pager-threadsafe".
+*/
+#include"os.h"
+#include"mndbInt.h"
 #include"pager.h"
-void f(void **data){*data = 0;}
-#include<stdio.h>
-int main(){
+#include"lz.h"
+#include<unistd.h>
+#if defined(THREADSAFE) && THREADSAFE
+# include<pthread.h>
+# include<sched.h>
+#endif
+
+static int nFail = 0;
+
+/*
+** Report a check that failed and count it.
+*/
+#define CHECK(X) do{ \
+  if( !(X) ){ printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #X); \
+              nFail++; } \
+}while(0)
+
+/*
+** Fill pages 2 through nPage of the database with the byte v and commit.
+** Return an error code.
+*/
+static int write_pages(Pager *pPager, int nPage, int v){
+  void *pPage1, *pData;
+  int i, rc;
+
+  rc = mndbpager_get(pPager, 1, &pPage1);
+  if( rc!=MNDB_OK ) return rc;
+  rc = mndbpager_begin(pPage1);
+  for(i=2; rc==MNDB_OK && i<=nPage; i++){
+    rc = mndbpager_get(pPager, i, &pData);
+    if( rc!=MNDB_OK ) break;
+    rc = mndbpager_write(pData);
+    if( rc==MNDB_OK ) memset(pData, v, mndbpager_pagesize(pPager));
+    mndbpager_unref(pData);
+  }
+  if( rc==MNDB_OK ) rc = mndbpager_commit(pPager);
+  mndbpager_unref(pPage1);
+  return rc;
+}
+
+/*
+** Get and release pages first through last, in that order.
+*/
+static void read_pages(Pager *pPager, int first, int last){
+  void *pData;
+  int i;
+  for(i=first; i<=last; i++){
+    if( mndbpager_get(pPager, i, &pData)==MNDB_OK ) mndbpager_unref(pData);
+  }
+}
+
+/*
+** Return true if page pgno holds nothing but the byte v.
+*/
+static int page_is(Pager *pPager, Pgno pgno, int v){
+  unsigned char *a;
+  void *pData;
+  int i, n;
+
+  if( mndbpager_get(pPager, pgno, &pData)!=MNDB_OK ) return 0;
+  a = (unsigned char*)pData;
+  n = mndbpager_pagesize(pPager);
+  for(i=0; i<n && a[i]==(unsigned char)v; i++){}
+  mndbpager_unref(pData);
+  return i==n;
+}
+
+/*
+** Return the number of pages from 2 through nPage that are not filled
+** with the byte v.
+*/
+static int count_other_pages(Pager *pPager, int nPage, int v){
+  int i, n = 0;
+  for(i=2; i<=nPage; i++){
+    if( !page_is(pPager, i, v) ) n++;
+  }
+  return n;
+}
+
+/*
+** Counters of the pager, from mndbpager_stats().
+*/
+static int stat_misses(Pager *pPager){
+  PagerStats s;
+  mndbpager_stats(pPager, &s, 0);
+  return (int)s.nMiss;
+}
+
+static int stat_stale(Pager *pPager){
+  PagerStats s;
+  mndbpager_stats(pPager, &s, 0);
+  return (int)s.nStale;
+}
+
+static int stat_pages(Pager *pPager){
+  PagerStats s;
+  mndbpager_stats(pPager, &s, 0);
+  return (int)s.nPage;
+}
+
+#if defined(THREADSAFE) && THREADSAFE
+static int stat_wal_commits(Pager *pPager){
+  PagerStats s;
+  mndbpager_stats(pPager, &s, 0);
+  return (int)s.nWalCommit;
+}
+
+static int stat_wal_syncs(Pager *pPager){
+  PagerStats s;
+  mndbpager_stats(pPager, &s, 0);
+  return (int)s.nWalSync;
+}
+#endif
+
+/*
+** The page hash table of pager.c, while it has no more than its first
+** HASH_SLOTS slots.  Pages whose numbers are HASH_STEP apart are in the
+** same shard of the table.  Return the slot page pgno hashes to, and the
+** first page number of the shard of pgno, from pgno on, that hashes to
+** slot h.
+*/
+#define HASH_SLOTS 32
+#define HASH_SHIFT 27
+#define HASH_STEP  8
+static int hash_home(Pgno pgno){
+  return (int)(((u32)pgno*0x9e3779b1U)>>HASH_SHIFT);
+}
+static Pgno hash_next_at(Pgno pgno, int h){
+  while( hash_home(pgno)!=h ) pgno += HASH_STEP;
+  return pgno;
+}
+
+/*
+** Return the size of a file, or -1 if it does not exist.
+*/
+static long file_size(const char *zFile){
+  FILE *f = fopen(zFile, "rb");
+  long n;
+  if( f==0 ) return -1;
+  fseek(f, 0, SEEK_END);
+  n = ftell(f);
+  fclose(f);
+  return n;
+}
+
+/*
+** Copy file zFrom to zTo, all but its last nOmit bytes, the way a crash
+** in the middle of a write might have left it.  A file that does not
+** exist is copied as a missing file.
+*/
+static void copy_file(const char *zFrom, const char *zTo, long nOmit){
+  char zBuf[4096];
+  FILE *in, *out;
+  long n = file_size(zFrom) - nOmit;
+
+  unlink(zTo);
+  in = fopen(zFrom, "rb");
+  if( in==0 ) return;
+  out = fopen(zTo, "wb");
+  while( out && n>0 ){
+    size_t want = n<(long)sizeof(zBuf) ? (size_t)n : sizeof(zBuf);
+    size_t got = fread(zBuf, 1, want, in);
+    if( got==0 ) break;
+    fwrite(zBuf, 1, got, out);
+    n -= got;
+  }
+  if( out ) fclose(out);
+  fclose(in);
+}
+
+/*
+** Read or write the 4 bytes at iOff of file zFile.
+*/
+static unsigned int file_get32(const char *zFile, long iOff){
+  unsigned int v = 0;
+  FILE *f = fopen(zFile, "rb");
+  if( f==0 ) return 0;
+  fseek(f, iOff, SEEK_SET);
+  if( fread(&v, 4, 1, f)!=1 ) v = 0;
+  fclose(f);
+  return v;
+}
+static void file_put32(const char *zFile, long iOff, unsigned int v){
+  FILE *f = fopen(zFile, "r+b");
+  if( f==0 ) return;
+  fseek(f, iOff, SEEK_SET);
+  fwrite(&v, 4, 1, f);
+  fclose(f);
+}
+
+/*
+** Fill n bytes at iOff of file zFile with the byte v.
+*/
+static void file_fill(const char *zFile, long iOff, int n, int v){
+  FILE *f = fopen(zFile, "r+b");
+  if( f==0 ) return;
+  fseek(f, iOff, SEEK_SET);
+  while( n-->0 ) fputc(v, f);
+  fclose(f);
+}
+
+/*
+** Take and release references to the pages of a small cache, change
+** one of them and read it back after the pager is opened again.
+*/
+static void test_basic(void){
+  Pager *pPager;
+  void *apPage[8];
+  void *pData;
+  int i;
+
+  CHECK( mndbpager_open(&pPager, "test.db", 6, 0)==MNDB_OK );
+  for(i=1; i<=7; i++){
+    CHECK( mndbpager_get(pPager, i, &apPage[i])==MNDB_OK );
+  }
+  CHECK( mndbpager_get(pPager, 3, &pData)==MNDB_OK );
+  CHECK( pData==apPage[3] );
+  mndbpager_unref(pData);
+  mndbpager_unref(apPage[2]);
+  CHECK( mndbpager_lookup(pPager, 7)==apPage[7] );
+  mndbpager_unref(apPage[7]);
+
+  CHECK( mndbpager_begin(apPage[3])==MNDB_OK );
+  CHECK( mndbpager_write(apPage[3])==MNDB_OK );
+  memset(apPage[3], 1, mndbpager_pagesize(pPager));
+  CHECK( mndbpager_commit(pPager)==MNDB_OK );
+  for(i=1; i<=7; i++){
+    if( i!=2 ) mndbpager_unref(apPage[i]);
+  }
+  CHECK( mndbpager_close(pPager)==MNDB_OK );
+
+  CHECK( mndbpager_open(&pPager, "test.db", 6, 0)==MNDB_OK );
+  CHECK( page_is(pPager, 3, 1) );
+  CHECK( mndbpager_close(pPager)==MNDB_OK );
+}
+
+/*
+** Pages changed in no particular order, more of them than the cache
+** holds, are all written by the commit.  So are the few changed by the
+** next transaction, and no other page changes.
+*/
+static void test_dirty_list(void){
+  Pager *pPager;
+  void *pPage1, *pData;
+  int i, nBad;
+  Pgno pgno;
+
+  unlink("testdirty.db");
+  CHECK( mndbpager_open(&pPager, "testdirty.db", 10, 0)==MNDB_OK );
+  CHECK( mndbpager_get(pPager, 1, &pPage1)==MNDB_OK );
+  CHECK( mndbpager_begin(pPage1)==MNDB_OK );
+  for(i=0; i<39; i++){
+    pgno = 2 + (i*17)%39;
+    CHECK( mndbpager_get(pPager, pgno, &pData)==MNDB_OK );
+    CHECK( mndbpager_write(pData)==MNDB_OK );
+    memset(pData, pgno, mndbpager_pagesize(pPager));
+    mndbpager_unref(pData);
+  }
+  CHECK( mndbpager_commit(pPager)==MNDB_OK );
+  CHECK( mndbpager_begin(pPage1)==MNDB_OK );
+  for(pgno=5; pgno<=40; pgno+=7){
+    CHECK( mndbpager_get(pPager, pgno, &pData)==MNDB_OK );
+    CHECK( mndbpager_write(pData)==MNDB_OK );
+    memset(pData, 1, mndbpager_pagesize(pPager));
+    mndbpager_unref(pData);
+  }
+  CHECK( mndbpager_commit(pPager)==MNDB_OK );
+  mndbpager_unref(pPage1);
+  CHECK( mndbpager_close(pPager)==MNDB_OK );
+
+  CHECK( mndbpager_open(&pPager, "testdirty.db", 10, 0)==MNDB_OK );
+  nBad = 0;
+  for(pgno=2; pgno<=40; pgno++){
+    if( !page_is(pPager, pgno, pgno>=5 && (pgno-5)%7==0 ? 1 : pgno) ) nBad++;
+  }
+  CHECK( nBad==0 );
+  CHECK( mndbpager_close(pPager)==MNDB_OK );
+  unlink("testdirty.db");
+}
+
+/*
+** Positional reads and writes neither use nor move the file offset, so
+** they can be mixed with seeks in any order.  The vectored forms move
+** one buffer after another from a single offset.  A read that runs past
+** the end of the file fails.
+*/
+static void test_positional(void){
+  static char a[4][100];
+  char b[100];
+  void *ap[4];
+  OsFile fd;
+  int readOnly, i;
+
+  unlink("testpos.db");
+  CHECK( mndbOsOpenReadWrite("testpos.db", &fd, &readOnly)==MNDB_OK );
+  for(i=0; i<4; i++){
+    memset(a[i], 'a'+i, 100);
+    ap[i] = a[i];
+  }
+  CHECK( mndbOsWriteAt(&fd, a[3], 100, 300)==MNDB_OK );
+  CHECK( mndbOsSeek(&fd, 150)==MNDB_OK );
+  CHECK( mndbOsWritevAt(&fd, ap, 3, 100, 0)==MNDB_OK );
+  CHECK( mndbOsReadAt(&fd, b, 100, 300)==MNDB_OK );
+  CHECK( memcmp(b, a[3], 100)==0 );
+  CHECK( mndbOsRead(&fd, b, 50)==MNDB_OK );
+  CHECK( memcmp(b, &a[1][50], 50)==0 );
+
+  memset(a, 0, sizeof(a));
+  CHECK( mndbOsReadvAt(&fd, ap, 4, 100, 0)==MNDB_OK );
+  for(i=0; i<4; i++){
+    CHECK( a[i][0]=='a'+i && a[i][99]=='a'+i );
+  }
+  CHECK( mndbOsReadAt(&fd, b, 100, 350)!=MNDB_OK );
+  CHECK( mndbOsReadvAt(&fd, ap, 2, 100, 250)!=MNDB_OK );
+  mndbOsClose(&fd);
+  unlink("testpos.db");
+}
+
+/*
+** Under 2Q a scan of more pages than the cache holds goes through the
+** A1in queue, and pages that were used again before it stay in the
+** cache.  Under LRU the scan pushes them out.
+*/
+static void test_2q(void){
+  static const int aPolicy[] = { MNDB_CACHE_LRU, MNDB_CACHE_2Q };
+  Pager *pPager;
+  void *pPage1;
+  int i, nMiss;
+
+  unlink("test2q.db");
+  CHECK( mndbpager_open(&pPager, "test2q.db", 40, 0)==MNDB_OK );
+  CHECK( write_pages(pPager, 300, 1)==MNDB_OK );
+  CHECK( mndbpager_close(pPager)==MNDB_OK );
+  for(i=0; i<2; i++){
+    CHECK( mndbpager_open(&pPager, "test2q.db", 40, 0)==MNDB_OK );
+    CHECK( mndbpager_set_cachepolicy(pPager, aPolicy[i])==MNDB_OK );
+    CHECK( mndbpager_get(pPager, 1, &pPage1)==MNDB_OK );
+
+    /* Pages 2 to 11 are used again after more than a quarter of the
+    ** cache has been read in */
+    read_pages(pPager, 2, 11);
+    read_pages(pPager, 100, 119);
+    read_pages(pPager, 2, 11);
+
+    read_pages(pPager, 120, 300);
+    nMiss = stat_misses(pPager);
+    read_pages(pPager, 2, 11);
+    CHECK( stat_misses(pPager)-nMiss==(aPolicy[i]==MNDB_CACHE_2Q ? 0 : 10) );
+    mndbpager_unref(pPage1);
+    CHECK( mndbpager_close(pPager)==MNDB_OK );
+  }
+  unlink("test2q.db");
+}
+
+/*
+** Pages leave the hash table as they are recycled.  Five pages make
+** one run of slots that wraps around the end of the table: three that
+** hash to its last slot, then one that hashes to slot 0 and one that
+** hashes to slot 1.  Taking pages out of the middle of the run, at the
+** end of the table and at the end of the run must leave every other
+** page where a lookup finds it.
+*/
+static void test_hash_remove(void){
+  /* The pages still in the cache before each step, in the order they
+  ** are released.  The first of them is the one recycled. */
+  static const int aOrder[4][5] = {
+    { 1, 0, 4, 2, 3 },
+    { 0, 2, 4, 3, -1 },
+    { 2, 4, 3, -1, -1 },
+    { 4, 3, -1, -1, -1 },
+  };
+  Pager *pPager;
+  void *pPage1, *apPage[5], *apFill[4];
+  Pgno aPgno[5], pgnoFill;
+  int i, j, k;
+
+  aPgno[0] = hash_next_at(2, HASH_SLOTS-1);
+  aPgno[1] = hash_next_at(aPgno[0]+HASH_STEP, HASH_SLOTS-1);
+  aPgno[2] = hash_next_at(aPgno[1]+HASH_STEP, HASH_SLOTS-1);
+  aPgno[3] = hash_next_at(2, 0);
+  aPgno[4] = hash_next_at(2, 1);
+
+  unlink("testhash.db");
+  CHECK( mndbpager_open(&pPager, "testhash.db", 6, 0)==MNDB_OK );
+  CHECK( mndbpager_get(pPager, 1, &pPage1)==MNDB_OK );
+  for(i=0; i<5; i++){
+    CHECK( mndbpager_get(pPager, aPgno[i], &apPage[i])==MNDB_OK );
+  }
+  pgnoFill = 2;
+  for(i=0; i<4; i++){
+    for(j=0; j<5 && aOrder[i][j]>=0; j++){
+      if( apPage[aOrder[i][j]] ) mndbpager_unref(apPage[aOrder[i][j]]);
+    }
+    pgnoFill = hash_next_at(pgnoFill, HASH_SLOTS/2);
+    CHECK( mndbpager_get(pPager, pgnoFill, &apFill[i])==MNDB_OK );
+    pgnoFill += HASH_STEP;
+    CHECK( mndbpager_lookup(pPager, aPgno[aOrder[i][0]])==0 );
+    for(j=1; j<5 && (k = aOrder[i][j])>=0; j++){
+      apPage[k] = mndbpager_lookup(pPager, aPgno[k]);
+      CHECK( apPage[k]!=0 );
+    }
+  }
+  if( apPage[3] ) mndbpager_unref(apPage[3]);
+  for(i=0; i<4; i++){
+    mndbpager_unref(apFill[i]);
+  }
+  mndbpager_unref(pPage1);
+  CHECK( mndbpager_close(pPager)==MNDB_OK );
+  unlink("testhash.db");
+}
+
+/*
+** Frames carved out of the arenas of the cache do not overlap.  Each
+** page and its extra space are filled with a byte of their own while
+** all of them are referenced, and every one must still hold it after
+** the others have been filled, with huge pages or without.
+*/
+static void test_arena(void){
+  static void *apPage[100];
+  Pager *pPager;
+  unsigned char *a;
+  int useHuge, i, j, n, nBad;
+
+  for(useHuge=0; useHuge<2; useHuge++){
+    CHECK( mndbpager_open(&pPager, "testarena.db", 100, 24)==MNDB_OK );
+    mndbpager_set_hugepages(pPager, useHuge);
+    n = mndbpager_pagesize(pPager);
+    for(i=0; i<100; i++){
+      apPage[i] = 0;
+      CHECK( mndbpager_get(pPager, i+2, &apPage[i])==MNDB_OK );
+      if( apPage[i]==0 ) continue;
+      memset(apPage[i], i, n);
+      memset(mndbpager_getextra(apPage[i]), 255-i, 24);
+    }
+    nBad = 0;
+    for(i=0; i<100; i++){
+      if( apPage[i]==0 ) continue;
+      a = (unsigned char*)apPage[i];
+      for(j=0; j<n && a[j]==i; j++){}
+      if( j<n ) nBad++;
+      a = (unsigned char*)mndbpager_getextra(apPage[i]);
+      for(j=0; j<24 && a[j]==255-i; j++){}
+      if( j<24 ) nBad++;
+      mndbpager_unref(apPage[i]);
+    }
+    CHECK( nBad==0 );
+    CHECK( mndbpager_close(pPager)==MNDB_OK );
+  }
+  unlink("testarena.db");
+}
+
+/*
+** The cache is kept from one transaction to the next for as long as no
+** other connection commits, which the change counter in page one tells.
+** A commit by another connection makes the whole cache out of date, and
+** the pages are read again.
+*/
+static void test_warm_cache(void){
+  Pager *pPager, *pOther;
+  int nMiss, nStale;
+
+  unlink("testcache.db");
+  CHECK( mndbpager_open(&pPager, "testcache.db", 50, 0)==MNDB_OK );
+  CHECK( write_pages(pPager, 20, 1)==MNDB_OK );
+  CHECK( count_other_pages(pPager, 20, 1)==0 );
+  nMiss = stat_misses(pPager);
+  nStale = stat_stale(pPager);
+  CHECK( count_other_pages(pPager, 20, 1)==0 );
+  CHECK( stat_misses(pPager)==nMiss );
+  CHECK( stat_stale(pPager)==nStale );
+
+  CHECK( mndbpager_open(&pOther, "testcache.db", 50, 0)==MNDB_OK );
+  CHECK( write_pages(pOther, 20, 2)==MNDB_OK );
+  CHECK( mndbpager_close(pOther)==MNDB_OK );
+  CHECK( count_other_pages(pPager, 20, 2)==0 );
+  CHECK( stat_stale(pPager)==nStale+1 );
+  CHECK( stat_misses(pPager)>nMiss );
+  CHECK( mndbpager_close(pPager)==MNDB_OK );
+  unlink("testcache.db");
+}
+
+/*
+** A prefetch hint is ignored while no page is referenced, and never
+** loads a page past the end of the file.  Pages read the same after it.
+*/
+static void test_prefetch(void){
+  Pager *pPager;
+  void *pPage1;
+
+  unlink("testpf.db");
+  CHECK( mndbpager_open(&pPager, "testpf.db", 50, 0)==MNDB_OK );
+  CHECK( write_pages(pPager, 30, 1)==MNDB_OK );
+  CHECK( mndbpager_close(pPager)==MNDB_OK );
+
+  CHECK( mndbpager_open(&pPager, "testpf.db", 50, 0)==MNDB_OK );
+  mndbpager_prefetch(pPager, 2, 10);
+  CHECK( stat_pages(pPager)==0 );
+  CHECK( mndbpager_get(pPager, 1, &pPage1)==MNDB_OK );
+  mndbpager_prefetch(pPager, 2, 40);
+  CHECK( stat_pages(pPager)<=30 );
+  CHECK( mndbpager_lookup(pPager, 31)==0 );
+  CHECK( count_other_pages(pPager, 30, 1)==0 );
+  mndbpager_unref(pPage1);
+  CHECK( mndbpager_close(pPager)==MNDB_OK );
+  unlink("testpf.db");
+}
+
+/*
+** A database in WAL mode is left by a crash with its log, which is
+** copied here while the pager still has it open.  Opening the copy
+** recovers every commit that is whole in the log.  A commit whose last
+** frame was torn or damaged is dropped as if it had never happened.
+**
+** Once a checkpoint has copied the whole log back, the next commit
+** starts the log again with new salt values.  Frames of the old log
+** still in the file do not match them and are never used again.
+*/
+static void test_wal(void){
+  const char *zDb = "testwal.db";
+  const char *zWal = "testwal.db-wal";
+  const char *zCopy = "testwal2.db";
+  const char *zCopyWal = "testwal2.db-wal";
+  Pager *pPager, *pCopy;
+  unsigned int iSalt;
+  long szWal, iOff;
+  int szPage;
+
+  unlink(zDb);
+  unlink(zWal);
+  CHECK( mndbpager_open(&pPager, zDb, 10, 0)==MNDB_OK );
+  CHECK( mndbpager_set_wal(pPager, 1)==MNDB_OK );
+  szPage = mndbpager_pagesize(pPager);
+  CHECK( write_pages(pPager, 20, 1)==MNDB_OK );
+  CHECK( write_pages(pPager, 20, 2)==MNDB_OK );
+  szWal = file_size(zWal);
+  CHECK( szWal>40*szPage );
+
+  /* Both commits are recovered from an intact log */
+  copy_file(zDb, zCopy, 0);
+  copy_file(zWal, zCopyWal, 0);
+  CHECK( mndbpager_open(&pCopy, zCopy, 10, 0)==MNDB_OK );
+  CHECK( count_other_pages(pCopy, 20, 2)==0 );
+  CHECK( mndbpager_close(pCopy)==MNDB_OK );
+  CHECK( file_size(zCopyWal)<0 );
+
+  /* The last frame of the second commit was only half written */
+  copy_file(zDb, zCopy, 0);
+  copy_file(zWal, zCopyWal, szPage/2);
+  CHECK( mndbpager_open(&pCopy, zCopy, 10, 0)==MNDB_OK );
+  CHECK( count_other_pages(pCopy, 20, 1)==0 );
+  CHECK( mndbpager_close(pCopy)==MNDB_OK );
+
+  /* The last frame of the second commit was damaged */
+  copy_file(zDb, zCopy, 0);
+  copy_file(zWal, zCopyWal, 0);
+  iOff = szWal - szPage/2;
+  file_put32(zCopyWal, iOff, ~file_get32(zCopyWal, iOff));
+  CHECK( mndbpager_open(&pCopy, zCopy, 10, 0)==MNDB_OK );
+  CHECK( count_other_pages(pCopy, 20, 1)==0 );
+  CHECK( mndbpager_close(pCopy)==MNDB_OK );
+
+  /* Restart the log after a checkpoint.  Salt-1 is at offset 16. */
+  CHECK( write_pages(pPager, 20, 3)==MNDB_OK );
+  CHECK( mndbpager_checkpoint(pPager)==MNDB_OK );
+  szWal = file_size(zWal);
+  iSalt = file_get32(zWal, 16);
+  CHECK( write_pages(pPager, 2, 4)==MNDB_OK );
+  CHECK( file_get32(zWal, 16)!=iSalt );
+  CHECK( file_size(zWal)==szWal );
+  CHECK( page_is(pPager, 2, 4) );
+  CHECK( count_other_pages(pPager, 20, 3)==1 );
+
+  /* Change page 3 in the database file of a copy.  If any frame of the
+  ** old log were used, page 3 would read as it was before.
+  */
+  copy_file(zDb, zCopy, 0);
+  copy_file(zWal, zCopyWal, 0);
+  file_fill(zCopy, 2L*szPage, szPage, 9);
+  CHECK( mndbpager_open(&pCopy, zCopy, 10, 0)==MNDB_OK );
+  CHECK( page_is(pCopy, 2, 4) );
+  CHECK( page_is(pCopy, 3, 9) );
+  CHECK( mndbpager_close(pCopy)==MNDB_OK );
+
+  CHECK( mndbpager_close(pPager)==MNDB_OK );
+  CHECK( file_size(zWal)<0 );
+  unlink(zDb);
+  unlink(zCopy);
+}
+
+#if defined(THREADSAFE) && THREADSAFE
+/*
+** Each thread of test_group_commit() commits N_GROUP_COMMIT transactions
+** through a connection of its own.  Transaction i fills page pArg with
+** the byte i.  Return the number of transactions that failed.
+*/
+#define N_GROUP_COMMIT 100
+static void *group_commit_thread(void *pArg){
+  Pgno pgno = (Pgno)(size_t)pArg;
   Pager *pPager;
-  printf("ss");
-   mndbpager_open(&pPager, "test.db", 6);
-   void *ppPage1, *ppPage2, *ppPage3,*ppPage31, *ppPage4,*ppPage5,*ppPage6,*ppPage7;
-   void *test;
- unsigned char a = 1;
-   test = malloc(1);
-   memcpy(test,&a ,1);
-   mndbpager_get(pPager, 1, &ppPage1);
-   mndbpager_get(pPager, 2, &ppPage2);
-  mndbpager_get(pPager, 3, &ppPage3);
-  mndbpager_get(pPager, 3, &ppPage31);
-  mndbpager_get(pPager, 4, &ppPage4);
-  mndbpager_get(pPager, 5, &ppPage5);
-  mndbpager_get(pPager, 6, &ppPage6);
-
-  mndbpager_unref(ppPage2);
-  mndbpager_get(pPager, 7,&ppPage7);
-
-  printf("%p \t %p \t %p\n", ppPage1, ppPage2, ppPage3,ppPage4);
-
- 
-  mndbpager_begin(ppPage3);
-  memcpy(ppPage3,&a,1024);
-  mndbpager_write(ppPage3);
-  mndbpager_commit(pPager);
-
-  mndbpager_begin(ppPage2);
-  memcpy(ppPage2,&a,1024);
-  mndbpager_write(ppPage2);
-  mndbpager_commit(pPager);
-
-  mndbpager_begin(ppPage1); 
-  memset(ppPage1,&a,1024);
-  mndbpager_write(ppPage1);
-  mndbpager_commit(pPager); 
+  void *pPage1, *pData;
+  size_t nBad = 0;
+  int i, rc;
+
+  if( mndbpager_open(&pPager, "testgc.db", 20, 0)!=MNDB_OK ) return (void*)1;
+  if( mndbpager_set_wal(pPager, 1)!=MNDB_OK ) nBad++;
+  for(i=1; nBad==0 && i<=N_GROUP_COMMIT; i++){
+    if( mndbpager_get(pPager, 1, &pPage1)!=MNDB_OK ){
+      nBad++;
+      break;
+    }
+    rc = mndbpager_begin(pPage1);
+    if( rc==MNDB_BUSY ){
+      /* The other thread is in the middle of a transaction */
+      mndbpager_unref(pPage1);
+      sched_yield();
+      i--;
+      continue;
+    }
+    if( rc==MNDB_OK ) rc = mndbpager_get(pPager, pgno, &pData);
+    if( rc==MNDB_OK ){
+      rc = mndbpager_write(pData);
+      if( rc==MNDB_OK ) memset(pData, i, mndbpager_pagesize(pPager));
+      mndbpager_unref(pData);
+    }
+    if( rc==MNDB_OK ) rc = mndbpager_commit(pPager);
+    mndbpager_unref(pPage1);
+    if( rc!=MNDB_OK ) nBad++;
+  }
   mndbpager_close(pPager);
-   return 0;
+  return (void*)nBad;
+}
+
+/*
+** Two connections in WAL mode commit at the same time, each from a
+** thread of its own.  Every commit makes it to the database, and some
+** of them share a sync of the log.
+*/
+static void test_group_commit(void){
+  pthread_t aThread[2];
+  Pager *pPager;
+  void *pRet;
+  int i;
+
+  unlink("testgc.db");
+  unlink("testgc.db-wal");
+  CHECK( mndbpager_open(&pPager, "testgc.db", 20, 0)==MNDB_OK );
+  CHECK( mndbpager_set_wal(pPager, 1)==MNDB_OK );
+  CHECK( write_pages(pPager, 3, 0)==MNDB_OK );
+  for(i=0; i<2; i++){
+    CHECK( pthread_create(&aThread[i], 0, group_commit_thread,
+                          (void*)(size_t)(i+2))==0 );
+  }
+  for(i=0; i<2; i++){
+    pthread_join(aThread[i], &pRet);
+    CHECK( pRet==0 );
+  }
+  CHECK( stat_wal_commits(pPager)==2*N_GROUP_COMMIT+1 );
+  CHECK( stat_wal_syncs(pPager)<stat_wal_commits(pPager) );
+  CHECK( page_is(pPager, 2, N_GROUP_COMMIT) );
+  CHECK( page_is(pPager, 3, N_GROUP_COMMIT) );
+  CHECK( mndbpager_close(pPager)==MNDB_OK );
+  unlink("testgc.db");
+}
+#endif
+
+/*
+** Many more pages than the background writer has slots for are changed
+** in a small cache, twice over, and the commits leave all of them as
+** they were changed.  Without THREADSAFE there is no background writer.
+*/
+static void test_bgwriter(void){
+  Pager *pPager;
+
+  unlink("testbgw.db");
+  CHECK( mndbpager_open(&pPager, "testbgw.db", 40, 0)==MNDB_OK );
+#if defined(THREADSAFE) && THREADSAFE
+  CHECK( mndbpager_set_bgwriter(pPager, 50)==MNDB_OK );
+#else
+  CHECK( mndbpager_set_bgwriter(pPager, 50)==MNDB_ERROR );
+#endif
+  CHECK( write_pages(pPager, 200, 5)==MNDB_OK );
+  CHECK( write_pages(pPager, 200, 6)==MNDB_OK );
+  CHECK( mndbpager_close(pPager)==MNDB_OK );
+
+  CHECK( mndbpager_open(&pPager, "testbgw.db", 40, 0)==MNDB_OK );
+  CHECK( count_other_pages(pPager, 200, 6)==0 );
+  CHECK( mndbpager_close(pPager)==MNDB_OK );
+  unlink("testbgw.db");
+}
+
+/*
+** Every page asked for is counted as a hit or as a miss.  Resetting the
+** counters reports them as they were and starts them again from zero,
+** but leaves the figures that describe the cache as it is now.
+*/
+static void test_stats(void){
+  PagerStats s;
+  Pager *pPager;
+  void *pPage1;
+  int i, nGet;
+
+  unlink("teststats.db");
+  CHECK( mndbpager_open(&pPager, "teststats.db", 50, 0)==MNDB_OK );
+  CHECK( write_pages(pPager, 30, 1)==MNDB_OK );
+  CHECK( mndbpager_close(pPager)==MNDB_OK );
+
+  CHECK( mndbpager_open(&pPager, "teststats.db", 50, 0)==MNDB_OK );
+  mndbpager_stats(pPager, &s, 1);
+  CHECK( mndbpager_get(pPager, 1, &pPage1)==MNDB_OK );
+  nGet = 1;
+  for(i=0; i<3; i++){
+    read_pages(pPager, 2, 30);
+    nGet += 29;
+  }
+  mndbpager_stats(pPager, &s, 0);
+  CHECK( s.nHit+s.nMiss==(PagerCounter)nGet );
+  CHECK( s.nMiss==30 );
+  CHECK( s.read.nCall>0 );
+  CHECK( s.nRef==1 && s.nPage==30 && s.mxPage==50 );
+
+  mndbpager_stats(pPager, &s, 1);
+  CHECK( s.nHit+s.nMiss==(PagerCounter)nGet );
+  mndbpager_stats(pPager, &s, 0);
+  CHECK( s.nHit==0 && s.nMiss==0 && s.read.nCall==0 );
+  CHECK( s.nRef==1 && s.nPage==30 && s.mxPage==50 );
+  mndbpager_unref(pPage1);
+  CHECK( mndbpager_close(pPager)==MNDB_OK );
+  unlink("teststats.db");
+}
+
+/*
+** Commits of more pages than go in one batch write them all, and a batch
+** of prefetched pages, some of them past the end of the file, reads the
+** same as pages got one at a time.
+*/
+static void test_batch_io(void){
+  static Pgno aPgno[300];
+  Pager *pPager;
+  void *pPage1;
+  int i;
+
+  unlink("testbatch.db");
+  CHECK( mndbpager_open(&pPager, "testbatch.db", 700, 0)==MNDB_OK );
+  CHECK( write_pages(pPager, 600, 1)==MNDB_OK );
+  CHECK( write_pages(pPager, 600, 2)==MNDB_OK );
+  CHECK( mndbpager_close(pPager)==MNDB_OK );
+
+  CHECK( mndbpager_open(&pPager, "testbatch.db", 700, 0)==MNDB_OK );
+  CHECK( mndbpager_get(pPager, 1, &pPage1)==MNDB_OK );
+  for(i=0; i<300; i++){
+    aPgno[i] = 2 + i*3;
+  }
+  mndbpager_prefetch_pages(pPager, 300, aPgno);
+  CHECK( mndbpager_lookup(pPager, 602)==0 );
+  CHECK( count_other_pages(pPager, 600, 2)==0 );
+  mndbpager_unref(pPage1);
+  CHECK( mndbpager_close(pPager)==MNDB_OK );
+  unlink("testbatch.db");
+}
+
+/*
+** A database written with direct I/O reads back the same.  Where the
+** file system cannot do direct I/O the pager says so and goes on
+** without it.  It cannot be turned on while a page is referenced.
+*/
+static void test_direct(void){
+  Pager *pPager;
+  void *pPage1;
+  int rc;
+
+  unlink("testdio.db");
+  CHECK( mndbpager_open(&pPager, "testdio.db", 20, 0)==MNDB_OK );
+  CHECK( mndbpager_set_pagesize(pPager, 4096, 0)==MNDB_OK );
+  rc = mndbpager_set_direct(pPager, 1);
+  CHECK( rc==MNDB_OK || rc==MNDB_ERROR );
+  CHECK( write_pages(pPager, 50, 1)==MNDB_OK );
+  CHECK( write_pages(pPager, 50, 2)==MNDB_OK );
+  CHECK( mndbpager_close(pPager)==MNDB_OK );
+
+  CHECK( mndbpager_open(&pPager, "testdio.db", 20, 0)==MNDB_OK );
+  CHECK( mndbpager_set_pagesize(pPager, 4096, 0)==MNDB_OK );
+  CHECK( mndbpager_set_direct(pPager, 1)==rc );
+  CHECK( count_other_pages(pPager, 50, 2)==0 );
+  CHECK( mndbpager_get(pPager, 1, &pPage1)==MNDB_OK );
+  CHECK( mndbpager_set_direct(pPager, 0)==MNDB_MISUSE );
+  mndbpager_unref(pPage1);
+  CHECK( mndbpager_close(pPager)==MNDB_OK );
+  unlink("testdio.db");
+}
+
+/*
+** Fill a buffer with n bytes that are text like in parts, runs of one
+** byte in others and random in the rest, as record data tends to be.
+*/
+static void fill_mixed(unsigned char *a, int n, unsigned int iSeed){
+  int i;
+  for(i=0; i<n; i++){
+    iSeed = iSeed*1103515245 + 12345;
+    switch( (i/256)%3 ){
+      case 0:  a[i] = "the quick brown fox "[i%20];  break;
+      case 1:  a[i] = (unsigned char)(i/512);  break;
+      default: a[i] = (unsigned char)(iSeed>>16);  break;
+    }
+  }
+}
+
+/*
+** The LZ compressor round-trips what it is given, says when the result
+** does not fit, and the decompressor rejects input that it did not make
+** or that would overflow the output, rather than writing out of bounds.
+*/
+static void test_lz(void){
+  static unsigned char aIn[16384], aOut[16384+256], aBack[16384];
+  static const unsigned char aBadOffset[] = { 0x10, 'x', 0x05, 0x00 };
+  unsigned int iSeed = 1;
+  int n, nOut, i;
+
+  /* Compressible data shrinks and comes back the same */
+  fill_mixed(aIn, sizeof(aIn), 7);
+  nOut = mndbLzCompress(aIn, sizeof(aIn), aOut, sizeof(aIn));
+  CHECK( nOut>0 && nOut<(int)sizeof(aIn)*3/4 );
+  CHECK( mndbLzDecompress(aOut, nOut, aBack, sizeof(aBack))==sizeof(aIn) );
+  CHECK( memcmp(aIn, aBack, sizeof(aIn))==0 );
+
+  /* It does not fit in less room than it needs, or in less than the
+  ** input if that is random, but does with room to spare */
+  CHECK( mndbLzCompress(aIn, sizeof(aIn), aOut, nOut-1)==0 );
+  for(i=0; i<(int)sizeof(aIn); i++){
+    iSeed = iSeed*1103515245 + 12345;
+    aIn[i] = (unsigned char)(iSeed>>16);
+  }
+  CHECK( mndbLzCompress(aIn, sizeof(aIn), aOut, sizeof(aIn))==0 );
+  nOut = mndbLzCompress(aIn, sizeof(aIn), aOut, sizeof(aOut));
+  CHECK( nOut>0 );
+  CHECK( mndbLzDecompress(aOut, nOut, aBack, sizeof(aBack))==sizeof(aIn) );
+  CHECK( memcmp(aIn, aBack, sizeof(aIn))==0 );
+
+  /* Input that is cut short, that would overflow the output or that
+  ** refers back past the start of the output is rejected.  The last
+  ** byte may be the token of a final sequence with nothing in it, so
+  ** input is cut by at least two bytes. */
+  fill_mixed(aIn, sizeof(aIn), 7);
+  nOut = mndbLzCompress(aIn, sizeof(aIn), aOut, sizeof(aIn));
+  for(n=nOut-2; n>nOut-40; n--){
+    CHECK( mndbLzDecompress(aOut, n, aBack, sizeof(aBack))!=sizeof(aIn) );
+  }
+  CHECK( mndbLzDecompress(aOut, nOut, aBack, sizeof(aBack)-1)<0 );
+  CHECK( mndbLzDecompress(aBadOffset, 4, aBack, sizeof(aBack))<0 );
+
+  /* Random garbage never claims more output than there is room for */
+  for(n=0; n<2000; n++){
+    int nGarbage = 1 + n%64;
+    for(i=0; i<nGarbage; i++){
+      iSeed = iSeed*1103515245 + 12345;
+      aOut[i] = (unsigned char)(iSeed>>16);
+    }
+    CHECK( mndbLzDecompress(aOut, nGarbage, aBack, 100)<=100 );
+  }
+}
+
+/*
+** Pages of a compressed database read back as they were written, after
+** the pager is opened again and finds the layout recorded in the file.
+*/
+static void test_compress(void){
+  static unsigned char aPage[MNDB_MAX_PAGE_SIZE];
+  const char *zDb = "testlz.db";
+  Pager *pPager;
+  void *pPage1, *pData;
+  int i, szPage, nBad;
+
+  unlink(zDb);
+  CHECK( mndbpager_open(&pPager, zDb, 10, 0)==MNDB_OK );
+  CHECK( mndbpager_set_compress(pPager, 1)==MNDB_OK );
+  szPage = mndbpager_pagesize(pPager);
+  CHECK( mndbpager_get(pPager, 1, &pPage1)==MNDB_OK );
+  CHECK( mndbpager_begin(pPage1)==MNDB_OK );
+  for(i=2; i<=40; i++){
+    CHECK( mndbpager_get(pPager, i, &pData)==MNDB_OK );
+    CHECK( mndbpager_write(pData)==MNDB_OK );
+    fill_mixed(pData, szPage, i);
+    if( i%5==0 ) memset(pData, 0, szPage);
+    mndbpager_unref(pData);
+  }
+  CHECK( mndbpager_commit(pPager)==MNDB_OK );
+  mndbpager_unref(pPage1);
+  CHECK( mndbpager_close(pPager)==MNDB_OK );
+
+  CHECK( mndbpager_open(&pPager, zDb, 10, 0)==MNDB_OK );
+  CHECK( mndbpager_set_compress(pPager, 0)==MNDB_ERROR );
+  nBad = 0;
+  for(i=2; i<=40; i++){
+    fill_mixed(aPage, szPage, i);
+    if( i%5==0 ) memset(aPage, 0, szPage);
+    if( mndbpager_get(pPager, i, &pData)!=MNDB_OK ){
+      nBad++;
+      continue;
+    }
+    if( memcmp(pData, aPage, szPage)!=0 ) nBad++;
+    mndbpager_unref(pData);
+  }
+  CHECK( nBad==0 );
+  CHECK( mndbpager_close(pPager)==MNDB_OK );
+  unlink(zDb);
+}
+
+#if defined(THREADSAFE) && THREADSAFE
+/*
+** The pager the threads of test_shared_pager() share, and the number of
+** pages each of them gets.
+*/
+static Pager *pShared;
+#define N_SHARED_GET 20000
+
+/*
+** Get pages of pShared at random and check that each holds its own
+** number.  Now and then look a page up again while it is referenced.
+** Return the number of pages that were wrong.
+*/
+static void *shared_reader_thread(void *pArg){
+  unsigned int iSeed = (unsigned int)(size_t)pArg;
+  void *pData, *pAgain;
+  size_t nBad = 0;
+  Pgno pgno;
+  int i;
+
+  for(i=0; i<N_SHARED_GET; i++){
+    iSeed = iSeed*1103515245 + 12345;
+    pgno = 2 + (iSeed>>8)%200;
+    if( mndbpager_get(pShared, pgno, &pData)!=MNDB_OK ){
+      nBad++;
+      continue;
+    }
+    if( ((unsigned char*)pData)[100]!=(unsigned char)pgno ) nBad++;
+    if( i%16==0 ){
+      pAgain = mndbpager_lookup(pShared, pgno);
+      if( pAgain!=pData ) nBad++;
+      if( pAgain ) mndbpager_unref(pAgain);
+    }
+    mndbpager_unref(pData);
+  }
+  return (void*)nBad;
+}
+
+/*
+** Threads read pages of one pager at random, five times as many pages
+** as fit in its cache, so that pages are loaded and recycled under them
+** all the time.  Each must get the page it asked for, and when they are
+** done every page they got has been counted and released.
+*/
+static void test_shared_pager(void){
+  pthread_t aThread[4];
+  PagerStats s;
+  void *pPage1, *pData, *pRet;
+  int i;
+
+  unlink("testmt.db");
+  CHECK( mndbpager_open(&pShared, "testmt.db", 40, 0)==MNDB_OK );
+  CHECK( mndbpager_get(pShared, 1, &pPage1)==MNDB_OK );
+  CHECK( mndbpager_begin(pPage1)==MNDB_OK );
+  for(i=2; i<=201; i++){
+    CHECK( mndbpager_get(pShared, i, &pData)==MNDB_OK );
+    CHECK( mndbpager_write(pData)==MNDB_OK );
+    memset(pData, i, mndbpager_pagesize(pShared));
+    mndbpager_unref(pData);
+  }
+  CHECK( mndbpager_commit(pShared)==MNDB_OK );
+  mndbpager_unref(pPage1);
+
+  CHECK( mndbpager_get(pShared, 2, &pData)==MNDB_OK );
+  mndbpager_stats(pShared, &s, 1);
+  for(i=0; i<4; i++){
+    CHECK( pthread_create(&aThread[i], 0, shared_reader_thread,
+                          (void*)(size_t)(i+1))==0 );
+  }
+  for(i=0; i<4; i++){
+    pthread_join(aThread[i], &pRet);
+    CHECK( pRet==0 );
+  }
+  mndbpager_stats(pShared, &s, 0);
+  CHECK( s.nRef==1 );
+  CHECK( s.nHit+s.nMiss>=4*N_SHARED_GET );
+  CHECK( s.nMiss>0 );
+  mndbpager_unref(pData);
+  CHECK( mndbpager_close(pShared)==MNDB_OK );
+  unlink("testmt.db");
+}
+#endif
+
+/*
+** With a chunk size, space is reserved in the file ahead of the pages a
+** commit adds, but the file is no longer than its pages, and they read
+** back as they were written.
+*/
+static void test_chunks(void){
+  Pager *pPager;
+  long szPage;
+
+  unlink("testchunk.db");
+  CHECK( mndbpager_open(&pPager, "testchunk.db", 20, 0)==MNDB_OK );
+  CHECK( mndbpager_set_chunksize(pPager, 64)==MNDB_OK );
+  szPage = mndbpager_pagesize(pPager);
+  CHECK( write_pages(pPager, 10, 1)==MNDB_OK );
+  CHECK( file_size("testchunk.db")==10*szPage );
+  CHECK( write_pages(pPager, 100, 2)==MNDB_OK );
+  CHECK( file_size("testchunk.db")==100*szPage );
+  CHECK( mndbpager_close(pPager)==MNDB_OK );
+
+  CHECK( mndbpager_open(&pPager, "testchunk.db", 20, 0)==MNDB_OK );
+  CHECK( mndbpager_pagecount(pPager)==100 );
+  CHECK( count_other_pages(pPager, 100, 2)==0 );
+  CHECK( mndbpager_close(pPager)==MNDB_OK );
+  unlink("testchunk.db");
+}
+
+/*
+** Mark pages as interior pages of a B-tree.
+*/
+static void set_interior(Pager *pPager, int first, int last){
+  void *pData;
+  int i;
+  for(i=first; i<=last; i++){
+    if( mndbpager_get(pPager, i, &pData)!=MNDB_OK ) continue;
+    mndbpager_set_priority(pData, MNDB_PAGE_INTERIOR);
+    mndbpager_unref(pData);
+  }
+}
+
+/*
+** Free interior pages are held in the cache up to their budget, which
+** is split between the shards, so a scan of other pages does not push
+** them out.  A budget of 0 lets them go.  Leaf and overflow pages have
+** no budget to set.  Held pages that are changed are written like any
+** other.
+*/
+static void test_priority(void){
+  PagerStats s;
+  Pager *pPager;
+  void *pPage1, *pData;
+  int i;
+
+  unlink("testprio.db");
+  CHECK( mndbpager_open(&pPager, "testprio.db", 40, 0)==MNDB_OK );
+  CHECK( write_pages(pPager, 200, 1)==MNDB_OK );
+  CHECK( mndbpager_close(pPager)==MNDB_OK );
+
+  CHECK( mndbpager_open(&pPager, "testprio.db", 40, 0)==MNDB_OK );
+  CHECK( mndbpager_get(pPager, 1, &pPage1)==MNDB_OK );
+  set_interior(pPager, 2, 6);
+  read_pages(pPager, 7, 200);
+  mndbpager_stats(pPager, &s, 0);
+  CHECK( s.nHold==5 );
+  for(i=2; i<=6; i++){
+    pData = mndbpager_lookup(pPager, i);
+    CHECK( pData!=0 );
+    if( pData ) mndbpager_unref(pData);
+  }
+
+  CHECK( mndbpager_set_budget(pPager, MNDB_PAGE_INTERIOR, 0)==MNDB_OK );
+  mndbpager_stats(pPager, &s, 0);
+  CHECK( s.nHold==0 );
+  CHECK( mndbpager_set_budget(pPager, MNDB_PAGE_LEAF, 10)==MNDB_ERROR );
+  CHECK( mndbpager_set_budget(pPager, MNDB_PAGE_OVERFLOW, 10)==MNDB_ERROR );
+
+  CHECK( mndbpager_set_budget(pPager, MNDB_PAGE_INTERIOR, 10)==MNDB_OK );
+  set_interior(pPager, 2, 6);
+  CHECK( write_pages(pPager, 200, 2)==MNDB_OK );
+  mndbpager_unref(pPage1);
+  CHECK( mndbpager_close(pPager)==MNDB_OK );
+
+  CHECK( mndbpager_open(&pPager, "testprio.db", 40, 0)==MNDB_OK );
+  CHECK( count_other_pages(pPager, 200, 2)==0 );
+  CHECK( mndbpager_close(pPager)==MNDB_OK );
+  unlink("testprio.db");
+}
+
+/*
+** A pager with warm restarts saves the pages of its cache when it
+** closes, and the next one loads them, so that reading them again takes
+** no miss.  The side file only names pages.  When the database has
+** changed since it was saved, the pages it names are read as they are
+** now, and a change made after they were loaded is not missed either.
+** A side file that was cut short, or that names a page past the end of
+** the database, loads nothing wrong.
+*/
+static void test_warm_file(void){
+  const char *zDb = "testwarm.db";
+  const char *zWarm = "testwarm.db-warm";
+  const char *zSave = "testwarm.sav";
+  Pager *pPager, *pOther;
+  PagerStats s;
+
+  unlink(zDb);
+  unlink(zWarm);
+  CHECK( mndbpager_open(&pPager, zDb, 50, 0)==MNDB_OK );
+  CHECK( mndbpager_set_warm(pPager, 1)==MNDB_OK );
+  CHECK( write_pages(pPager, 30, 1)==MNDB_OK );
+  CHECK( count_other_pages(pPager, 30, 1)==0 );
+  CHECK( mndbpager_close(pPager)==MNDB_OK );
+  CHECK( file_size(zWarm)>12 );
+  copy_file(zWarm, zSave, 0);
+
+  /* The pages come back without a miss */
+  CHECK( mndbpager_open(&pPager, zDb, 50, 0)==MNDB_OK );
+  CHECK( mndbpager_set_warm(pPager, 1)==MNDB_OK );
+  mndbpager_stats(pPager, &s, 1);
+  CHECK( s.nPage==30 );
+  CHECK( count_other_pages(pPager, 30, 1)==0 );
+  mndbpager_stats(pPager, &s, 0);
+  CHECK( s.nMiss==0 );
+  CHECK( mndbpager_close(pPager)==MNDB_OK );
+
+  /* The database changes after the side file is saved, and again after
+  ** the pages are loaded */
+  CHECK( mndbpager_open(&pOther, zDb, 50, 0)==MNDB_OK );
+  CHECK( write_pages(pOther, 30, 2)==MNDB_OK );
+  copy_file(zSave, zWarm, 0);
+  CHECK( mndbpager_open(&pPager, zDb, 50, 0)==MNDB_OK );
+  CHECK( mndbpager_set_warm(pPager, 1)==MNDB_OK );
+  CHECK( count_other_pages(pPager, 30, 2)==0 );
+  CHECK( write_pages(pOther, 30, 3)==MNDB_OK );
+  CHECK( count_other_pages(pPager, 30, 3)==0 );
+  CHECK( mndbpager_close(pPager)==MNDB_OK );
+
+  /* A side file cut short is not used at all */
+  copy_file(zSave, zWarm, 8);
+  CHECK( mndbpager_open(&pPager, zDb, 50, 0)==MNDB_OK );
+  CHECK( mndbpager_set_warm(pPager, 1)==MNDB_OK );
+  mndbpager_stats(pPager, &s, 0);
+  CHECK( s.nPage==0 );
+  CHECK( count_other_pages(pPager, 30, 3)==0 );
+  CHECK( mndbpager_close(pPager)==MNDB_OK );
+
+  /* The first page named is past the end of the database */
+  copy_file(zSave, zWarm, 0);
+  file_put32(zWarm, 12, 1000);
+  CHECK( mndbpager_open(&pPager, zDb, 50, 0)==MNDB_OK );
+  CHECK( mndbpager_set_warm(pPager, 1)==MNDB_OK );
+  CHECK( mndbpager_lookup(pPager, 1000)==0 );
+  CHECK( count_other_pages(pPager, 30, 3)==0 );
+  CHECK( mndbpager_pagecount(pPager)==30 );
+  CHECK( mndbpager_close(pPager)==MNDB_OK );
+
+  CHECK( mndbpager_close(pOther)==MNDB_OK );
+  unlink(zDb);
+  unlink(zWarm);
+  unlink(zSave);
+}
+
+/*
+** Change pages first through last to hold the byte v, in the
+** transaction of pPager.
+*/
+static void change_pages(Pager *pPager, int first, int last, int v){
+  void *pData;
+  int i;
+  for(i=first; i<=last; i++){
+    CHECK( mndbpager_get(pPager, i, &pData)==MNDB_OK );
+    CHECK( mndbpager_write(pData)==MNDB_OK );
+    memset(pData, v, mndbpager_pagesize(pPager));
+    mndbpager_unref(pData);
+  }
+}
+
+/*
+** A miss recycles a clean free page rather than write a dirty one, for
+** as long as a clean one is free.  Only when every free page is dirty is
+** one written out ahead of the commit.  Either way the commit leaves
+** every page as it was changed.
+*/
+static void test_clean_dirty(void){
+  PagerStats s;
+  Pager *pPager;
+  void *pPage1, *pData;
+  int i, nBad;
+
+  unlink("testevict.db");
+  CHECK( mndbpager_open(&pPager, "testevict.db", 40, 0)==MNDB_OK );
+  CHECK( write_pages(pPager, 100, 1)==MNDB_OK );
+  CHECK( mndbpager_close(pPager)==MNDB_OK );
+
+  CHECK( mndbpager_open(&pPager, "testevict.db", 40, 0)==MNDB_OK );
+  CHECK( mndbpager_get(pPager, 1, &pPage1)==MNDB_OK );
+  CHECK( mndbpager_begin(pPage1)==MNDB_OK );
+  change_pages(pPager, 2, 11, 2);
+  mndbpager_stats(pPager, &s, 1);
+  read_pages(pPager, 20, 100);
+  mndbpager_stats(pPager, &s, 0);
+  CHECK( s.nEvictClean>0 );
+  CHECK( s.nEvictDirty==0 );
+  for(i=2; i<=11; i++){
+    pData = mndbpager_lookup(pPager, i);
+    CHECK( pData!=0 );
+    if( pData ) mndbpager_unref(pData);
+  }
+
+  change_pages(pPager, 20, 70, 2);
+  mndbpager_stats(pPager, &s, 0);
+  CHECK( s.nEvictDirty>0 );
+  CHECK( mndbpager_commit(pPager)==MNDB_OK );
+  mndbpager_unref(pPage1);
+  CHECK( mndbpager_close(pPager)==MNDB_OK );
+
+  CHECK( mndbpager_open(&pPager, "testevict.db", 40, 0)==MNDB_OK );
+  nBad = 0;
+  for(i=2; i<=100; i++){
+    if( !page_is(pPager, i, i<=11 || (i>=20 && i<=70) ? 2 : 1) ) nBad++;
+  }
+  CHECK( nBad==0 );
+  CHECK( mndbpager_close(pPager)==MNDB_OK );
+  unlink("testevict.db");
+}
+
+/*
+** Return true if page pgno, as snapshot pSnap sees it, holds nothing but
+** the byte v.
+*/
+static int snapshot_page_is(PagerSnap *pSnap, Pager *pPager, Pgno pgno,
+                            int v){
+  unsigned char *a;
+  void *pData;
+  int i, n;
+
+  if( mndbpager_snapshot_get(pSnap, pgno, &pData)!=MNDB_OK ) return 0;
+  a = (unsigned char*)pData;
+  n = mndbpager_pagesize(pPager);
+  for(i=0; i<n && a[i]==(unsigned char)v; i++){}
+  mndbpager_unref(pData);
+  return i==n;
+}
+
+/*
+** A snapshot reads the database as it was when the snapshot began,
+** after later commits have changed pages it had not read yet.  Old page
+** images are kept only for as long as a snapshot that can read them,
+** and none are left once the last snapshot has ended.
+*/
+static void test_snapshot(void){
+  PagerSnap *pOld, *pNew;
+  PagerStats s;
+  Pager *pPager;
+  int i, nBad;
+
+  unlink("testsnap.db");
+  CHECK( mndbpager_open(&pPager, "testsnap.db", 50, 0)==MNDB_OK );
+  CHECK( write_pages(pPager, 20, 1)==MNDB_OK );
+  CHECK( mndbpager_snapshot_begin(pPager, &pOld)==MNDB_OK );
+  if( pOld==0 ) return;
+  CHECK( write_pages(pPager, 20, 2)==MNDB_OK );
+  mndbpager_stats(pPager, &s, 0);
+  CHECK( s.nVersion>0 );
+  CHECK( mndbpager_snapshot_begin(pPager, &pNew)==MNDB_OK );
+  if( pNew==0 ) return;
+  CHECK( write_pages(pPager, 20, 3)==MNDB_OK );
+
+  nBad = 0;
+  for(i=2; i<=20; i++){
+    if( !snapshot_page_is(pOld, pPager, i, 1) ) nBad++;
+    if( !snapshot_page_is(pNew, pPager, i, 2) ) nBad++;
+  }
+  CHECK( nBad==0 );
+  CHECK( count_other_pages(pPager, 20, 3)==0 );
+
+  mndbpager_snapshot_end(pOld);
+  mndbpager_stats(pPager, &s, 0);
+  CHECK( s.nVersion>0 );
+  CHECK( snapshot_page_is(pNew, pPager, 5, 2) );
+  mndbpager_snapshot_end(pNew);
+  mndbpager_stats(pPager, &s, 0);
+  CHECK( s.nVersion==0 );
+  CHECK( mndbpager_close(pPager)==MNDB_OK );
+  unlink("testsnap.db");
+}
+
+int main(){
+  test_basic();
+  test_dirty_list();
+  test_positional();
+  test_2q();
+  test_hash_remove();
+  test_arena();
+  test_warm_cache();
+  test_prefetch();
+  test_wal();
+#if defined(THREADSAFE) && THREADSAFE
+  test_group_commit();
+#endif
+  test_bgwriter();
+  test_stats();
+  test_batch_io();
+  test_direct();
+  test_lz();
+  test_compress();
+#if defined(THREADSAFE) && THREADSAFE
+  test_shared_pager();
+#endif
+  test_chunks();
+  test_priority();
+  test_warm_file();
+  test_clean_dirty();
+  test_snapshot();
+  if( nFail ) printf("%d checks failed\n", nFail);
+  return nFail;
 }
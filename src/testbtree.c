@@ -1,5 +1,17 @@
+/*
+** Tests of the B-tree layer.  Build them with "make -f mfbtree btreetest"
+** and run ./btreetest.  Each check that fails is printed, and the exit
+** status is the number of failures.  The tests that need threads are
+** only built by "make -f mfbtree btreetest-threadsafe".
+*/
+#define MNDB_TEST 1
+#include"mndbInt.h"
 #include"btree.h"
-#include<assert.h>
+#include"pager.h"
+#include<unistd.h>
+#if defined(THREADSAFE) && THREADSAFE
+# include<pthread.h>
+#endif
 //stdno:int stdname:char[20] stdage:int stdgpa:float
 typedef struct std{
   int stdNo;
@@ -7,55 +19,391 @@ typedef struct std{
   int age;
   float gpa;
 } Std;
-int  main(){
-  Btree ** ppBtree;
-  BtCursor * btc;
-  mndbBtreeOpen("testbtree.db", 1024, ppBtree);
-  int firstt;
-
-  mndbBtreeBeginTrans(*ppBtree);
-  mndbBtreeCreateTable(*ppBtree, &firstt);
-  
-  Std std1;
+
+static int nFail = 0;
+
+/*
+** Report a check that failed and count it.
+*/
+#define CHECK(X) do{ \
+  if( !(X) ){ printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #X); \
+              nFail++; } \
+}while(0)
+
+/*
+** Record number k of the tables the tests fill.  Every eleventh record
+** is large enough to need overflow pages.
+*/
+static int record_size(int k){
+  return k%11==0 ? 2500 + k%700 : 40 + k%90;
+}
+static void record_key(char *zKey, int k){
+  sprintf(zKey, "k%06d", k);
+}
+
+/*
+** Insert records iFirst through iFirst+n-1 into table iTable, in an
+** order that splits pages all over the tree.  Return an error code.
+*/
+static int insert_records(Btree *pBt, int iTable, int iFirst, int n){
+  static char zData[4000];
+  BtCursor *pCur;
+  char zKey[20];
+  int i, k, rc;
+
+  rc = mndbBtreeCursor(pBt, iTable, &pCur);
+  for(i=0; rc==MNDB_OK && i<n; i++){
+    k = iFirst + (i*7919)%n;
+    record_key(zKey, k);
+    memset(zData, 'a'+k%26, record_size(k));
+    rc = mndbBtreeInsert(pCur, zKey, strlen(zKey), zData, record_size(k));
+  }
+  if( pCur ) mndbBtreeCloseCursor(pCur);
+  return rc;
+}
+
+/*
+** Return the number of records in table iTable, or -1 if one of them
+** is not what insert_records() put there.
+*/
+static int count_records(Btree *pBt, int iTable){
+  static char zData[4000];
+  BtCursor *pCur;
+  char zKey[20];
+  int nKey, nData, res, k, i;
+  int n = 0;
+
+  if( mndbBtreeCursor(pBt, iTable, &pCur)!=MNDB_OK ) return -1;
+  if( mndbBtreeFirst(pCur, &res)!=MNDB_OK ){
+    mndbBtreeCloseCursor(pCur);
+    return -1;
+  }
+  while( !res ){
+    mndbBtreeKeySize(pCur, &nKey);
+    if( nKey<=0 || nKey>=(int)sizeof(zKey) ){ n = -1; break; }
+    mndbBtreeKey(pCur, 0, nKey, zKey);
+    zKey[nKey] = 0;
+    k = atoi(&zKey[1]);
+    mndbBtreeDataSize(pCur, &nData);
+    if( nData!=record_size(k) ){ n = -1; break; }
+    mndbBtreeData(pCur, 0, nData, zData);
+    for(i=0; i<nData && zData[i]==(char)('a'+k%26); i++){}
+    if( i<nData ){ n = -1; break; }
+    n++;
+    if( mndbBtreeNext(pCur, &res)!=MNDB_OK ){ n = -1; break; }
+  }
+  mndbBtreeCloseCursor(pCur);
+  return n;
+}
+
+/*
+** Return the largest number of a page of table iTable, other than its
+** root, that holds records, or 0 if the root holds them all.  Overflow
+** pages are not looked at.
+*/
+static int last_tree_page(Btree *pBt, int iTable){
+  BtCursor *pCur;
+  int aResult[8];
+  int res, mx = 0;
+
+  if( mndbBtreeCursor(pBt, iTable, &pCur)!=MNDB_OK ) return -1;
+  if( mndbBtreeFirst(pCur, &res)!=MNDB_OK ) res = 1;
+  while( !res ){
+    mndbBtreeCursorDump(pCur, aResult);
+    if( aResult[0]!=iTable && aResult[0]>mx ) mx = aResult[0];
+    if( mndbBtreeNext(pCur, &res)!=MNDB_OK ) break;
+  }
+  mndbBtreeCloseCursor(pCur);
+  return mx;
+}
+
+/*
+** Insert a few student records keyed by number and look one up.
+*/
+static void test_students(void){
+  Btree *pBt;
+  BtCursor *btc;
+  Std std1, std2;
+  char a[9]="xiaoming";
+  int firstt, rec, i;
+
+  CHECK( mndbBtreeOpen("testbtree.db", 1024, &pBt)==MNDB_OK );
+  if( pBt==0 ) return;
+  CHECK( mndbBtreeBeginTrans(pBt)==MNDB_OK );
+  CHECK( mndbBtreeCreateTable(pBt, &firstt)==MNDB_OK );
+
   std1.gpa = 1.4;
   std1.age = 23;
   std1.stdNo = 1;
-  char a[9]="xiaoming";
   memcpy(std1.stdName, &a, 9) ;
-  mndbBtreeCursor(*ppBtree, firstt, &btc);
-  int i = 0;
+  CHECK( mndbBtreeCursor(pBt, firstt, &btc)==MNDB_OK );
   for(i = 0; i < 20 ; ++i){
     std1.stdNo += i;
     std1.age += i;
     mndbBtreeInsert(btc, (void*)&std1.stdNo, sizeof(int), (void*)&std1, sizeof(std1));
   }
+  CHECK( mndbBtreeCloseCursor(btc)==MNDB_OK );
+  CHECK( mndbBtreeCommit(pBt)==MNDB_OK );
 
-  mndbBtreeCommit(*ppBtree);
-  
-  Std std2;
   std2.stdNo = 4;
-  int rec;
+  CHECK( mndbBtreeCursor(pBt, firstt, &btc)==MNDB_OK );
   mndbBtreeMoveto(btc,(void*) &std2.stdNo, sizeof(int), &rec);
-  assert(rec == 0);
+  CHECK( rec==0 );
   mndbBtreeData(btc,0 ,sizeof(Std), (char*)&std2);
+  CHECK( std2.stdNo==4 && strcmp(std2.stdName, "xiaoming")==0 );
+  mndbBtreeCloseCursor(btc);
+  mndbBtreeClose(pBt);
 }
 
+/*
+** A database keeps the page size it was created with.  Opening it
+** again adopts the size recorded in page one, whatever the default,
+** and the size cannot be changed once the database exists.
+*/
+static void test_pagesize(void){
+  static const int aSize[] = { 512, 4096, 16384 };
+  const char *zFile = "testpgsz.db";
+  int aRoot[2];
+  Btree *pBt;
+  int i;
 
+  for(i=0; i<(int)(sizeof(aSize)/sizeof(aSize[0])); i++){
+    unlink(zFile);
+    CHECK( mndbBtreeOpen(zFile, 100, &pBt)==MNDB_OK );
+    if( pBt==0 ) return;
+    CHECK( mndbBtreeSetPageSize(pBt, 1000)!=MNDB_OK );
+    CHECK( mndbBtreeSetPageSize(pBt, aSize[i])==MNDB_OK );
+    CHECK( mndbBtreeGetPageSize(pBt)==aSize[i] );
+    CHECK( mndbBtreeBeginTrans(pBt)==MNDB_OK );
+    CHECK( mndbBtreeCreateTable(pBt, &aRoot[1])==MNDB_OK );
+    CHECK( insert_records(pBt, aRoot[1], 0, 500)==MNDB_OK );
+    CHECK( mndbBtreeCommit(pBt)==MNDB_OK );
+    mndbBtreeClose(pBt);
 
+    CHECK( mndbBtreeOpen(zFile, 100, &pBt)==MNDB_OK );
+    if( pBt==0 ) return;
+    CHECK( mndbBtreeGetPageSize(pBt)==aSize[i] );
+    CHECK( mndbBtreeSetPageSize(pBt, 1024)==MNDB_MISUSE );
+    CHECK( mndbBtreeGetPageSize(pBt)==aSize[i] );
+    CHECK( count_records(pBt, aRoot[1])==500 );
+    aRoot[0] = 2;
+    CHECK( mndbBtreeSanityCheck(pBt, aRoot, 2)==0 );
+    mndbBtreeClose(pBt);
+  }
+  unlink(zFile);
+}
 
+/*
+** A ":memory:" database works like one in a file for as long as it is
+** open, and nothing of it is left once it is closed.  There is no
+** rollback journal, so a transaction that is not committed is not undone
+** either: what it changed is kept, and the next commit includes it.
+*/
+static void test_memory(void){
+  int aRoot[3];
+  Btree *pBt;
 
+  CHECK( mndbBtreeOpen(":memory:", 100, &pBt)==MNDB_OK );
+  if( pBt==0 ) return;
+  aRoot[0] = 2;
+  CHECK( mndbBtreeBeginTrans(pBt)==MNDB_OK );
+  CHECK( mndbBtreeCreateTable(pBt, &aRoot[1])==MNDB_OK );
+  CHECK( insert_records(pBt, aRoot[1], 0, 1000)==MNDB_OK );
+  CHECK( mndbBtreeCommit(pBt)==MNDB_OK );
+  CHECK( count_records(pBt, aRoot[1])==1000 );
+  CHECK( mndbBtreeSanityCheck(pBt, aRoot, 2)==0 );
 
+  CHECK( mndbBtreeBeginTrans(pBt)==MNDB_OK );
+  CHECK( mndbBtreeCreateTable(pBt, &aRoot[2])==MNDB_OK );
+  CHECK( insert_records(pBt, aRoot[2], 0, 300)==MNDB_OK );
+  CHECK( count_records(pBt, aRoot[2])==300 );
+  CHECK( insert_records(pBt, aRoot[1], 1000, 500)==MNDB_OK );
+  CHECK( mndbBtreeCommit(pBt)==MNDB_OK );
+  CHECK( count_records(pBt, aRoot[1])==1500 );
+  CHECK( count_records(pBt, aRoot[2])==300 );
+  CHECK( mndbBtreeSanityCheck(pBt, aRoot, 3)==0 );
+  CHECK( access(":memory:", F_OK)!=0 );
+  mndbBtreeClose(pBt);
 
+  CHECK( mndbBtreeOpen(":memory:", 100, &pBt)==MNDB_OK );
+  if( pBt==0 ) return;
+  CHECK( mndbpager_pagecount(mndbBtreePager(pBt))<=2 );
+  mndbBtreeClose(pBt);
+}
 
+#if defined(THREADSAFE) && THREADSAFE
+/*
+** The Btree the threads of test_threads() share, the table they read,
+** and whether the writer is done.
+*/
+static Btree *pShared;
+static int iSharedTable;
+static volatile int bDone;
 
+/*
+** Look up records 0 through 1999 of the shared table at random, and step
+** to the next record from some of them, until the writer is done.
+** Return the number of records that were missing, of the wrong size or
+** out of order.
+*/
+static void *reader_thread(void *pArg){
+  unsigned int iSeed = (unsigned int)(size_t)pArg;
+  BtCursor *pCur;
+  char zKey[20];
+  size_t nBad = 0;
+  int i, k, res, nKey, nData;
 
+  if( mndbBtreeCursor(pShared, iSharedTable, &pCur)!=MNDB_OK ){
+    return (void*)1;
+  }
+  for(i=0; i<500 || !bDone; i++){
+    iSeed = iSeed*1103515245 + 12345;
+    k = (iSeed>>8)%2000;
+    record_key(zKey, k);
+    if( mndbBtreeMoveto(pCur, zKey, strlen(zKey), &res)!=MNDB_OK || res!=0 ){
+      nBad++;
+      continue;
+    }
+    mndbBtreeDataSize(pCur, &nData);
+    if( nData!=record_size(k) ) nBad++;
+    if( i%8==0 && mndbBtreeNext(pCur, &res)==MNDB_OK && !res ){
+      mndbBtreeKeySize(pCur, &nKey);
+      if( nKey<=0 || nKey>=(int)sizeof(zKey) ){
+        nBad++;
+        continue;
+      }
+      mndbBtreeKey(pCur, 0, nKey, zKey);
+      zKey[nKey] = 0;
+      if( atoi(&zKey[1])<=k ) nBad++;
+    }
+  }
+  mndbBtreeCloseCursor(pCur);
+  return (void*)nBad;
+}
 
+/*
+** Threads share one Btree.  While the main thread inserts records that
+** split pages all over the tree, readers look up the records that were
+** there before and step through them.  None may be missed or seen out
+** of order, and the tree must be sane and whole afterwards.
+*/
+static void test_threads(void){
+  const char *zFile = "testbtmt.db";
+  pthread_t aThread[4];
+  int aRoot[2];
+  void *pRet;
+  int i;
 
+  unlink(zFile);
+  CHECK( mndbBtreeOpen(zFile, 100, &pShared)==MNDB_OK );
+  if( pShared==0 ) return;
+  aRoot[0] = 2;
+  CHECK( mndbBtreeBeginTrans(pShared)==MNDB_OK );
+  CHECK( mndbBtreeCreateTable(pShared, &aRoot[1])==MNDB_OK );
+  CHECK( insert_records(pShared, aRoot[1], 0, 2000)==MNDB_OK );
+  CHECK( mndbBtreeCommit(pShared)==MNDB_OK );
 
+  iSharedTable = aRoot[1];
+  bDone = 0;
+  CHECK( mndbBtreeBeginTrans(pShared)==MNDB_OK );
+  for(i=0; i<4; i++){
+    CHECK( pthread_create(&aThread[i], 0, reader_thread,
+                          (void*)(size_t)(i+1))==0 );
+  }
+  CHECK( insert_records(pShared, aRoot[1], 2000, 2000)==MNDB_OK );
+  bDone = 1;
+  for(i=0; i<4; i++){
+    pthread_join(aThread[i], &pRet);
+    CHECK( pRet==0 );
+  }
+  CHECK( mndbBtreeCommit(pShared)==MNDB_OK );
+  CHECK( mndbBtreeSanityCheck(pShared, aRoot, 2)==0 );
+  CHECK( count_records(pShared, aRoot[1])==4000 );
+  mndbBtreeClose(pShared);
 
+  CHECK( mndbBtreeOpen(zFile, 100, &pShared)==MNDB_OK );
+  if( pShared==0 ) return;
+  CHECK( count_records(pShared, aRoot[1])==4000 );
+  mndbBtreeClose(pShared);
+  unlink(zFile);
+}
+#endif
 
+/*
+** Fill one table, then fill a second table whose pages all come after
+** the first one's, and clear the first.  Vacuuming a few pages at a time
+** must move every page of the second table except its root, interior
+** and overflow pages included, back into the space the first one freed.
+** Before the vacuum some of its pages lie past that space, after it
+** none do.
+** The trees must still be sane and whole afterwards, and after reopening.
+*/
+static void test_vacuum(void){
+  const char *zFile = "testvac.db";
+  int aRoot[3];
+  Btree *pBt;
+  BtCursor *pCur;
+  int nBefore, nPage, nFree, i;
 
+  unlink(zFile);
+  CHECK( mndbBtreeOpen(zFile, 100, &pBt)==MNDB_OK );
+  if( pBt==0 ) return;
+  aRoot[0] = 2;
+  CHECK( mndbBtreeBeginTrans(pBt)==MNDB_OK );
+  CHECK( mndbBtreeCreateTable(pBt, &aRoot[1])==MNDB_OK );
+  CHECK( mndbBtreeCreateTable(pBt, &aRoot[2])==MNDB_OK );
+  CHECK( insert_records(pBt, aRoot[1], 0, 3000)==MNDB_OK );
+  CHECK( mndbBtreeCommit(pBt)==MNDB_OK );
+  nBefore = mndbpager_pagecount(mndbBtreePager(pBt));
 
+  CHECK( mndbBtreeBeginTrans(pBt)==MNDB_OK );
+  CHECK( insert_records(pBt, aRoot[2], 0, 1500)==MNDB_OK );
+  CHECK( mndbBtreeCommit(pBt)==MNDB_OK );
+  CHECK( mndbBtreeBeginTrans(pBt)==MNDB_OK );
+  CHECK( mndbBtreeClearTable(pBt, aRoot[1])==MNDB_OK );
+  CHECK( mndbBtreeCommit(pBt)==MNDB_OK );
+  CHECK( last_tree_page(pBt, aRoot[2])>=nBefore );
 
+  /* A vacuum is refused while a cursor could be left on a moved page */
+  CHECK( mndbBtreeBeginTrans(pBt)==MNDB_OK );
+  CHECK( mndbBtreeCursor(pBt, aRoot[2], &pCur)==MNDB_OK );
+  CHECK( mndbBtreeIncrVacuum(pBt, aRoot, 3, 7, &nFree)==MNDB_LOCKED );
+  mndbBtreeCloseCursor(pCur);
+  CHECK( mndbBtreeCommit(pBt)==MNDB_OK );
 
+  nPage = 0;
+  for(i=0; i<10000 && nPage!=mndbpager_pagecount(mndbBtreePager(pBt)); i++){
+    nPage = mndbpager_pagecount(mndbBtreePager(pBt));
+    CHECK( mndbBtreeBeginTrans(pBt)==MNDB_OK );
+    CHECK( mndbBtreeIncrVacuum(pBt, aRoot, 3, 7, &nFree)==MNDB_OK );
+    CHECK( mndbBtreeCommit(pBt)==MNDB_OK );
+  }
+  nPage = mndbpager_pagecount(mndbBtreePager(pBt));
+  CHECK( nPage<nBefore );
+  i = last_tree_page(pBt, aRoot[2]);
+  CHECK( i>0 && i<nBefore );
+  CHECK( mndbBtreeSanityCheck(pBt, aRoot, 3)==0 );
+  CHECK( count_records(pBt, aRoot[1])==0 );
+  CHECK( count_records(pBt, aRoot[2])==1500 );
+  mndbBtreeClose(pBt);
 
+  CHECK( mndbBtreeOpen(zFile, 100, &pBt)==MNDB_OK );
+  if( pBt==0 ) return;
+  CHECK( mndbpager_pagecount(mndbBtreePager(pBt))==nPage );
+  CHECK( mndbBtreeSanityCheck(pBt, aRoot, 3)==0 );
+  CHECK( count_records(pBt, aRoot[2])==1500 );
+  mndbBtreeClose(pBt);
+  unlink(zFile);
+}
+
+int  main(){
+  test_students();
+  test_pagesize();
+  test_memory();
+#if defined(THREADSAFE) && THREADSAFE
+  test_threads();
+#endif
+  test_vacuum();
+  if( nFail ) printf("%d checks failed\n", nFail);
+  return nFail;
+}
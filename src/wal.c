@@ -0,0 +1,870 @@
+/*
+** 2016 Jan
+** This file implements the write-ahead log ("WAL") that the pager uses
+** in WAL mode instead of writing changed pages straight into the
+** database file.
+**
+** A commit appends an image of every page it changed to the end of the
+** log file, which has the name of the database file with "-wal" added.
+** The database file is only written by a checkpoint, which copies the
+** newest committed image of each page back into it.  A reader looks
+** for a page in the log first and only goes to the database file if
+** the log holds no image of the page that it is allowed to see.
+**
+** The log file begins with a 32-byte header:
+**
+**     0   Magic number, WAL_MAGIC
+**     4   Format version, currently 1
+**     8   Page size
+**    12   Checkpoint sequence number, incremented at each restart
+**    16   Salt-1, incremented at each restart
+**    20   Salt-2, a new random number at each restart
+**    24   Checksum of bytes 0 through 23 (two 32-bit words)
+**
+** The header is followed by frames.  A frame is a 24-byte header and
+** then the image of one page:
+**
+**     0   Page number
+**     4   For a commit frame, the size of the database in pages after
+**         the commit.  Zero for all other frames.
+**     8   Salt-1 and salt-2, copied from the log header
+**    16   Checksum (two 32-bit words)
+**
+** The checksum of a frame covers its first 8 bytes and the page image
+** and is seeded with the checksum of the frame before it, or of the log
+** header for the first frame.  Recovery reads frames until it finds one
+** with the wrong salt or checksum and ignores everything after the last
+** commit frame before that point.  As everywhere else in the file
+** format, integers are stored in native byte order.
+**
+** Locking.  While any connection of a process has the database in WAL
+** mode, the process holds a write lock on the whole database file, so
+** connections of other processes, and connections of this process that
+** are not in WAL mode, get MNDB_BUSY.  Connections in WAL mode share a
+** WalIndex that tracks which frame holds which page.  It is found by
+** file name in a process wide hash table, like the lockInfo structures
+** of os.c, and is protected by mndbOsEnterMutex().  No file I/O is done
+** while the mutex is held.
+**
+** A read transaction takes a snapshot, which is the last frame committed
+** when it began, and never looks at frames past it.  There is a single
+** writer, which only appends to the log, so readers and the writer never
+** wait for each other.  A checkpoint never copies a frame newer than the
+** oldest snapshot in use, and the log only starts again at the beginning
+** after every frame has been copied back and no read transaction is open.
+**
+** Group commit.  A commit appends its frames and gives up the write
+** transaction before it waits for the log to reach the disk, so the
+** next writer can append while the log is being synced.  Only one thread
+** syncs the log at a time.  It syncs everything committed so far, and
+** commits that arrive in the meantime wait for it and then share the
+** next sync between them.
+*/
+#include "os.h"
+#include "mndbInt.h"
+#include "pager.h"
+#include "wal.h"
+
+#define WAL_MAGIC         0x4d4e4457      /* "MNDW" */
+#define WAL_VERSION       1
+#define WAL_HDRSIZE       32              /* Bytes in the log header */
+#define WAL_FRAME_HDRSIZE 24              /* Bytes in a frame header */
+
+/*
+** Up to this many frames are gathered up in memory and written to the
+** log with a single write.
+*/
+#define WAL_MAX_BATCH 16
+
+/*
+** Offset of frame I, counting from 1, in the log.
+*/
+#define walFrameOffset(P,I) \
+   (WAL_HDRSIZE + ((I)-1)*(off_t)((P)->pageSize + WAL_FRAME_HDRSIZE))
+
+typedef struct WalIndex WalIndex;
+typedef struct WalCkptPage WalCkptPage;
+
+/*
+** There is one instance of this structure per log per process.  It is
+** shared by all Wal handles on the same database.
+*/
+struct WalIndex {
+  char *zWal;                 /* Name of the log file and the hash key */
+  int nRef;                   /* Number of Wal handles using this index */
+  OsFile fd;                  /* The log file */
+  OsFile lockFd;              /* Holds the write lock on the database */
+  int pageSize;               /* Size of the page images in the log */
+  u32 iSeq;                   /* Checkpoint sequence number */
+  u32 aSalt[2];               /* Salt values of the log */
+  u32 aCksum[2];              /* Checksum of frame nFrame */
+  u32 aCommitCksum[2];        /* Checksum of frame mxFrame */
+  int nFrame;                 /* Number of frames, committed or not */
+  int mxFrame;                /* Last committed frame */
+  int nBackfill;              /* Frames already copied into the database */
+  int nDbPage;                /* Database size after the last commit, or 0 */
+  int nAlloc;                 /* Slots allocated in aPgno[] and aPrev[] */
+  Pgno *aPgno;                /* aPgno[i] is the page held in frame i */
+  int *aPrev;                 /* Earlier frame holding the same page, or 0 */
+  Hash pgHash;                /* Maps a page number to its newest frame */
+  Wal *pReader;               /* Handles that have a read transaction open */
+  Wal *pWriter;               /* Handle that has the write transaction */
+  u8 ckptBusy;                /* A checkpoint is running */
+  u8 syncBusy;                /* A thread is syncing the log */
+  int nReading;               /* Reads of frames in progress */
+  int nSynced;                /* Frames known to be on disk */
+  u64 nCommit;                /* Transactions committed to the log */
+  u64 nSync;                  /* Syncs done to make commits durable */
+};
+
+/*
+** Each pager in WAL mode has one of these.
+*/
+struct Wal {
+  WalIndex *pIdx;             /* Index shared with other connections */
+  OsFile *pDbFd;              /* Database file of the connection */
+  int pageSize;               /* Page size used by the connection */
+  u32 iSeq;                   /* pIdx->iSeq when the snapshot was taken */
+  int iSnapshot;              /* Last frame visible to this connection */
+  int nDbPage;                /* Database size as of iSnapshot, or 0 */
+  u32 iCommitSeq;             /* pIdx->iSeq when iCommit was written */
+  int iCommit;                /* Commit frame not yet synced, or 0 */
+  u8 inRead;                  /* True if a read transaction is open */
+  Wal *pNextReader;           /* Next handle on WalIndex.pReader */
+  char *aBuf;                 /* Frames are assembled here */
+  int nBuf;                   /* Bytes allocated for aBuf */
+};
+
+/*
+** A page that a checkpoint copies into the database.
+*/
+struct WalCkptPage {
+  Pgno pgno;                  /* The page */
+  int iFrame;                 /* Frame that holds its image */
+};
+
+/*
+** Maps the name of a log file into its WalIndex.  Access is protected
+** by mndbOsEnterMutex().
+*/
+static Hash walHash = { MNDB_HASH_STRING, 0, 0, 0, 0, 0 };
+
+/*
+** Add the checksum of nByte bytes at a to the checksum aIn[] and write
+** the result into aOut[].  nByte must be a multiple of 8 and a must be
+** aligned to 4 bytes.
+*/
+static void walChecksum(const void *a, int nByte, const u32 *aIn, u32 *aOut){
+  const u32 *p = (const u32*)a;
+  const u32 *pEnd = &p[nByte/4];
+  u32 s1 = aIn[0];
+  u32 s2 = aIn[1];
+  assert( nByte>=8 && (nByte & 7)==0 );
+  do{
+    s1 += *p++ + s2;
+    s2 += *p++ + s1;
+  }while( p<pEnd );
+  aOut[0] = s1;
+  aOut[1] = s2;
+}
+
+/*
+** Return the newest frame, not later than iLast, that holds page pgno.
+** Return 0 if there is none.  The caller holds the mutex.
+*/
+static int walFindFrame(WalIndex *p, Pgno pgno, int iLast){
+  int i = (int)(size_t)mndbHashFind(&p->pgHash, 0, pgno);
+  while( i>iLast ){
+    i = p->aPrev[i];
+  }
+  return i;
+}
+
+/*
+** Record that the next frame holds page pgno.
+*/
+static int walIndexAppend(WalIndex *p, Pgno pgno){
+  int iFrame = p->nFrame + 1;
+  if( iFrame>=p->nAlloc ){
+    int nNew = p->nAlloc ? p->nAlloc*2 : 256;
+    Pgno *aPgno;
+    int *aPrev;
+    aPgno = mndbRealloc(p->aPgno, nNew*sizeof(Pgno));
+    if( aPgno==0 ) return MNDB_NOMEM;
+    p->aPgno = aPgno;
+    aPrev = mndbRealloc(p->aPrev, nNew*sizeof(int));
+    if( aPrev==0 ) return MNDB_NOMEM;
+    p->aPrev = aPrev;
+    p->nAlloc = nNew;
+  }
+  p->aPgno[iFrame] = pgno;
+  p->aPrev[iFrame] = (int)(size_t)mndbHashFind(&p->pgHash, 0, pgno);
+  if( mndbHashInsert(&p->pgHash, 0, pgno, (void*)(size_t)iFrame)
+        ==(void*)(size_t)iFrame ){
+    return MNDB_NOMEM;
+  }
+  p->nFrame = iFrame;
+  return MNDB_OK;
+}
+
+/*
+** Forget every frame after frame nFrame.
+*/
+static void walIndexTruncate(WalIndex *p, int nFrame){
+  while( p->nFrame>nFrame ){
+    int i = p->nFrame--;
+    mndbHashInsert(&p->pgHash, 0, p->aPgno[i], (void*)(size_t)p->aPrev[i]);
+  }
+}
+
+/*
+** Rebuild the index from the log file left behind by an earlier
+** process.  A log that is missing, damaged or empty is ignored.
+*/
+static int walIndexRecover(WalIndex *p){
+  u32 aHdr[WAL_HDRSIZE/4];
+  u32 aCksum[2];
+  u32 *aFrame;
+  off_t szWal;
+  int szFrame;
+  int iFrame;
+  int rc;
+
+  rc = mndbOsFileSize(&p->fd, &szWal);
+  if( rc!=MNDB_OK ) return rc;
+  if( szWal<WAL_HDRSIZE ) return MNDB_OK;
+  rc = mndbOsReadAt(&p->fd, aHdr, WAL_HDRSIZE, 0);
+  if( rc!=MNDB_OK ) return rc;
+  if( aHdr[0]!=WAL_MAGIC || aHdr[1]!=WAL_VERSION
+        || aHdr[2]<MNDB_MIN_PAGE_SIZE || aHdr[2]>MNDB_MAX_PAGE_SIZE
+        || (aHdr[2] & (aHdr[2]-1))!=0 ){
+    return MNDB_OK;
+  }
+  aCksum[0] = aCksum[1] = 0;
+  walChecksum(aHdr, 24, aCksum, aCksum);
+  if( aCksum[0]!=aHdr[6] || aCksum[1]!=aHdr[7] ){
+    return MNDB_OK;
+  }
+  p->pageSize = aHdr[2];
+  p->iSeq = aHdr[3];
+  p->aSalt[0] = aHdr[4];
+  p->aSalt[1] = aHdr[5];
+  p->aCksum[0] = p->aCommitCksum[0] = aCksum[0];
+  p->aCksum[1] = p->aCommitCksum[1] = aCksum[1];
+
+  szFrame = p->pageSize + WAL_FRAME_HDRSIZE;
+  aFrame = mndbMalloc( szFrame );
+  if( aFrame==0 ) return MNDB_NOMEM;
+  for(iFrame=1; walFrameOffset(p, iFrame)+szFrame<=szWal; iFrame++){
+    if( mndbOsReadAt(&p->fd, aFrame, szFrame,
+                     walFrameOffset(p, iFrame))!=MNDB_OK ){
+      break;
+    }
+    if( aFrame[0]==0 || aFrame[2]!=p->aSalt[0] || aFrame[3]!=p->aSalt[1] ){
+      break;
+    }
+    walChecksum(aFrame, 8, p->aCksum, aCksum);
+    walChecksum(&aFrame[WAL_FRAME_HDRSIZE/4], p->pageSize, aCksum, aCksum);
+    if( aCksum[0]!=aFrame[4] || aCksum[1]!=aFrame[5] ){
+      break;
+    }
+    rc = walIndexAppend(p, aFrame[0]);
+    if( rc!=MNDB_OK ) break;
+    p->aCksum[0] = aCksum[0];
+    p->aCksum[1] = aCksum[1];
+    if( aFrame[1] ){
+      p->mxFrame = p->nFrame;
+      p->nDbPage = aFrame[1];
+      p->aCommitCksum[0] = aCksum[0];
+      p->aCommitCksum[1] = aCksum[1];
+    }
+  }
+  mndbFree(aFrame);
+  walIndexTruncate(p, p->mxFrame);
+  p->aCksum[0] = p->aCommitCksum[0];
+  p->aCksum[1] = p->aCommitCksum[1];
+  return rc;
+}
+
+/*
+** Close the files of an index that nobody uses any more and free it.
+** The log file is deleted if everything in it is in the database.
+*/
+static void walIndexDestroy(WalIndex *p){
+  mndbOsClose(&p->fd);
+  if( p->nBackfill==p->mxFrame ){
+    mndbOsDelete(p->zWal);
+  }
+  mndbOsUnlock(&p->lockFd);
+  mndbOsClose(&p->lockFd);
+  mndbHashClear(&p->pgHash);
+  mndbFree(p->aPgno);
+  mndbFree(p->aPrev);
+  mndbFree(p->zWal);
+  mndbFree(p);
+}
+
+/*
+** Create the index for the log zWal of database zDbName, lock the
+** database, run recovery and make the index known to other handles.
+** zWal becomes the property of the index if it is created.  If two
+** threads race to create the same index, the loser finds the database
+** locked and gets MNDB_BUSY.
+*/
+static int walIndexCreate(const char *zDbName, char *zWal, WalIndex **ppIdx){
+  WalIndex *p;
+  int readOnly = 0;
+  int rc;
+
+  *ppIdx = 0;
+  p = mndbMalloc( sizeof(*p) );
+  if( p==0 ) return MNDB_NOMEM;
+  rc = mndbOsOpenReadWrite(zDbName, &p->lockFd, &readOnly);
+  if( rc!=MNDB_OK ){
+    mndbFree(p);
+    return MNDB_CANTOPEN;
+  }
+  if( readOnly ){
+    rc = MNDB_READONLY;
+  }else{
+    rc = mndbOsWriteLock(&p->lockFd);
+  }
+  if( rc==MNDB_OK ){
+    rc = mndbOsOpenReadWrite(zWal, &p->fd, &readOnly);
+    if( rc!=MNDB_OK ){
+      rc = MNDB_CANTOPEN;
+    }else if( readOnly ){
+      mndbOsClose(&p->fd);
+      rc = MNDB_READONLY;
+    }
+  }
+  if( rc!=MNDB_OK ){
+    mndbOsUnlock(&p->lockFd);
+    mndbOsClose(&p->lockFd);
+    mndbFree(p);
+    return rc;
+  }
+  p->zWal = zWal;
+  p->nRef = 1;
+  mndbHashInit(&p->pgHash, MNDB_HASH_INT, 0);
+  mndbRandomness(sizeof(p->aSalt), p->aSalt);
+  rc = walIndexRecover(p);
+  if( rc==MNDB_OK ){
+    mndbOsEnterMutex();
+    if( mndbHashInsert(&walHash, p->zWal, strlen(p->zWal), p)!=0 ){
+      rc = MNDB_NOMEM;
+    }
+    mndbOsLeaveMutex();
+  }
+  if( rc!=MNDB_OK ){
+    p->zWal = 0;
+    p->nBackfill = -1;      /* Keep the log file */
+    walIndexDestroy(p);
+    return rc;
+  }
+  *ppIdx = p;
+  return MNDB_OK;
+}
+
+/*
+** Open a handle on the log of database zDbName.  pDbFd is the open
+** database file of the caller, which checkpoints write into.  The log
+** file is created if it does not exist, and recovered if it was left
+** behind by a process that did not shut down cleanly.
+*/
+int mndbWalOpen(OsFile *pDbFd, const char *zDbName, Wal **ppWal){
+  WalIndex *pIdx;
+  Wal *pWal;
+  char *zWal;
+  int rc = MNDB_OK;
+
+  *ppWal = 0;
+  zWal = mndbMalloc( strlen(zDbName)+5 );
+  pWal = mndbMalloc( sizeof(*pWal) );
+  if( zWal==0 || pWal==0 ){
+    mndbFree(zWal);
+    mndbFree(pWal);
+    return MNDB_NOMEM;
+  }
+  strcpy(zWal, zDbName);
+  strcat(zWal, "-wal");
+  mndbOsEnterMutex();
+  pIdx = mndbHashFind(&walHash, zWal, strlen(zWal));
+  if( pIdx ) pIdx->nRef++;
+  mndbOsLeaveMutex();
+  if( pIdx ){
+    mndbFree(zWal);
+  }else{
+    rc = walIndexCreate(zDbName, zWal, &pIdx);
+    if( rc!=MNDB_OK ) mndbFree(zWal);
+  }
+  if( rc!=MNDB_OK ){
+    mndbFree(pWal);
+    return rc;
+  }
+  pWal->pIdx = pIdx;
+  pWal->pDbFd = pDbFd;
+  pWal->iSnapshot = -1;
+  *ppWal = pWal;
+  return MNDB_OK;
+}
+
+/*
+** Copy frames from the log into the database file.  Each page gets the
+** newest image not later than the oldest snapshot in use, and the
+** database file is synced before the frames are counted as done.
+**
+** If the database was shorter as of that snapshot than the file is,
+** the file is cut down to size.  No snapshot still in use can see a
+** page past that point in the file: a later commit that grew the
+** database again put the new pages in the log.
+*/
+static int walCheckpoint(WalIndex *p, OsFile *pDbFd){
+  WalCkptPage *a;
+  WalCkptPage t;
+  Wal *pReader;
+  char *aData;
+  int iFirst, iLast;
+  int nDbPage;
+  off_t szDb;
+  int i, j, n;
+  int rc;
+
+  mndbOsEnterMutex();
+  if( p->ckptBusy ){
+    mndbOsLeaveMutex();
+    return MNDB_BUSY;
+  }
+  iFirst = p->nBackfill;
+  iLast = p->mxFrame;
+  nDbPage = p->nDbPage;
+  for(pReader=p->pReader; pReader; pReader=pReader->pNextReader){
+    if( pReader->iSnapshot<iLast ){
+      iLast = pReader->iSnapshot;
+      nDbPage = pReader->nDbPage;
+    }
+  }
+  if( iLast<=iFirst ){
+    mndbOsLeaveMutex();
+    return MNDB_OK;
+  }
+  a = mndbMalloc( (iLast-iFirst)*sizeof(*a) );
+  aData = mndbOsAllocArena(p->pageSize, 0);  /* Aligned, for O_DIRECT */
+  if( a==0 || aData==0 ){
+    mndbOsLeaveMutex();
+    mndbFree(a);
+    mndbOsFreeArena(aData, p->pageSize);
+    return MNDB_NOMEM;
+  }
+  n = 0;
+  for(i=iFirst+1; i<=iLast; i++){
+    if( walFindFrame(p, p->aPgno[i], iLast)==i ){
+      a[n].pgno = p->aPgno[i];
+      a[n].iFrame = i;
+      n++;
+    }
+  }
+  p->ckptBusy = 1;
+  mndbOsLeaveMutex();
+
+  /* Write the pages in file order.  There are few enough of them that
+  ** an insertion sort will do.
+  */
+  for(i=1; i<n; i++){
+    t = a[i];
+    for(j=i; j>0 && a[j-1].pgno>t.pgno; j--) a[j] = a[j-1];
+    a[j] = t;
+  }
+  rc = mndbOsSync(&p->fd);
+  for(i=0; rc==MNDB_OK && i<n; i++){
+    rc = mndbOsReadAt(&p->fd, aData, p->pageSize,
+                      walFrameOffset(p, a[i].iFrame) + WAL_FRAME_HDRSIZE);
+    if( rc==MNDB_OK ){
+      rc = mndbOsWriteAt(pDbFd, aData, p->pageSize,
+                         (a[i].pgno-1)*(off_t)p->pageSize);
+    }
+  }
+  if( rc==MNDB_OK && nDbPage>0 ){
+    rc = mndbOsFileSize(pDbFd, &szDb);
+    if( rc==MNDB_OK && szDb>nDbPage*(off_t)p->pageSize ){
+      rc = mndbOsTruncate(pDbFd, nDbPage*(off_t)p->pageSize);
+    }
+  }
+  if( rc==MNDB_OK ){
+    rc = mndbOsSync(pDbFd);
+  }
+  mndbFree(a);
+  mndbOsFreeArena(aData, p->pageSize);
+
+  mndbOsEnterMutex();
+  if( rc==MNDB_OK ){
+    p->nBackfill = iLast;
+    if( p->nSynced<iLast ) p->nSynced = iLast;
+  }
+  p->ckptBusy = 0;
+  mndbOsLeaveMutex();
+  return rc;
+}
+
+/*
+** Close a handle.  When the last handle on a log is closed, the log is
+** copied into the database and deleted, and the lock on the database
+** file is released.
+*/
+void mndbWalClose(Wal *pWal){
+  WalIndex *p = pWal->pIdx;
+  int isLast;
+  mndbWalEndWrite(pWal);
+  mndbWalEndRead(pWal);
+  mndbOsEnterMutex();
+  isLast = --p->nRef==0;
+  if( isLast ){
+    mndbHashInsert(&walHash, p->zWal, strlen(p->zWal), 0);
+  }
+  mndbOsLeaveMutex();
+  if( isLast ){
+    walCheckpoint(p, pWal->pDbFd);
+    walIndexDestroy(p);
+  }
+  mndbFree(pWal->aBuf);
+  mndbFree(pWal);
+}
+
+/*
+** Start a read transaction.  pageSize is the page size used by the
+** caller, which must agree with the log unless the log is empty.
+** *pChanged is set if another connection has committed since the last
+** read transaction of this handle, in which case pages cached by the
+** caller may be out of date.
+*/
+int mndbWalBeginRead(Wal *pWal, int pageSize, int *pChanged){
+  WalIndex *p = pWal->pIdx;
+  int rc = MNDB_OK;
+  assert( !pWal->inRead );
+  mndbOsEnterMutex();
+  if( p->nFrame>0 && p->pageSize!=pageSize ){
+    rc = MNDB_CORRUPT;
+  }else{
+    *pChanged = pWal->iSeq!=p->iSeq || pWal->iSnapshot!=p->mxFrame;
+    pWal->pageSize = pageSize;
+    pWal->iSeq = p->iSeq;
+    pWal->iSnapshot = p->mxFrame;
+    pWal->nDbPage = p->nDbPage;
+    pWal->inRead = 1;
+    pWal->pNextReader = p->pReader;
+    p->pReader = pWal;
+  }
+  mndbOsLeaveMutex();
+  return rc;
+}
+
+/*
+** End a read transaction.  This is a no-op if none is open.
+*/
+void mndbWalEndRead(Wal *pWal){
+  WalIndex *p = pWal->pIdx;
+  Wal **pp;
+  if( !pWal->inRead ) return;
+  mndbOsEnterMutex();
+  for(pp=&p->pReader; *pp!=pWal; pp=&(*pp)->pNextReader){}
+  *pp = pWal->pNextReader;
+  pWal->pNextReader = 0;
+  pWal->inRead = 0;
+  mndbOsLeaveMutex();
+}
+
+/*
+** Read the first nByte bytes of page pgno, as of the snapshot of the
+** caller, from the log into pBuf.  *pFound is cleared if the log has
+** no such image, in which case the page must be read from the database
+** file.  The writer also sees the frames it has not yet committed.
+** Without a read transaction the latest committed image is read.
+*/
+int mndbWalRead(Wal *pWal, Pgno pgno, int nByte, void *pBuf, int *pFound){
+  WalIndex *p = pWal->pIdx;
+  off_t offset;
+  int iLast;
+  int iFrame;
+  int rc;
+
+  mndbOsEnterMutex();
+  if( p->pWriter==pWal ){
+    iLast = p->nFrame;
+  }else if( pWal->inRead ){
+    iLast = pWal->iSnapshot;
+  }else{
+    iLast = p->mxFrame;
+  }
+  iFrame = walFindFrame(p, pgno, iLast);
+  offset = walFrameOffset(p, iFrame) + WAL_FRAME_HDRSIZE;
+  if( nByte>p->pageSize ) nByte = p->pageSize;
+  if( iFrame>0 ) p->nReading++;
+  mndbOsLeaveMutex();
+  *pFound = iFrame>0;
+  if( iFrame==0 ) return MNDB_OK;
+
+  /* The pager reads without holding its latch, so another thread of
+  ** the same connection may begin to write meanwhile.  The log is not
+  ** started again while a frame is being read.
+  */
+  rc = mndbOsReadAt(&p->fd, pBuf, nByte, offset);
+  mndbOsEnterMutex();
+  p->nReading--;
+  mndbOsLeaveMutex();
+  return rc;
+}
+
+/*
+** Return the size of the database in pages as of the snapshot of the
+** caller, or 0 if the log does not know it.  In that case the size of
+** the database file is the size of the database.
+*/
+int mndbWalDbSize(Wal *pWal){
+  return pWal->nDbPage;
+}
+
+/*
+** Start a write transaction.  The caller must have a read transaction
+** open.  MNDB_BUSY is returned if another connection is writing, or if
+** the snapshot of the caller is no longer the latest one, in which case
+** it has to start a new read transaction before it can write.
+**
+** If every frame is in the database, nobody else is reading and no frame
+** is being read, the log is started again from the beginning.
+*/
+int mndbWalBeginWrite(Wal *pWal){
+  WalIndex *p = pWal->pIdx;
+  int rc = MNDB_OK;
+  u32 iSalt;
+  assert( pWal->inRead );
+  /* mndbRandomness() takes the mutex itself */
+  mndbRandomness(sizeof(iSalt), &iSalt);
+  mndbOsEnterMutex();
+  if( p->pWriter!=0 ){
+    rc = MNDB_BUSY;
+  }else if( pWal->iSeq!=p->iSeq || pWal->iSnapshot!=p->mxFrame ){
+    rc = MNDB_BUSY;
+  }else{
+    p->pWriter = pWal;
+    if( p->mxFrame>0 && p->nBackfill==p->mxFrame && !p->ckptBusy
+          && p->pReader==pWal && pWal->pNextReader==0 && p->nReading==0 ){
+      walIndexTruncate(p, 0);
+      p->mxFrame = 0;
+      p->nBackfill = 0;
+      p->nSynced = 0;
+      p->iSeq++;
+      p->aSalt[0]++;
+      p->aSalt[1] = iSalt;
+      pWal->iSeq = p->iSeq;
+      pWal->iSnapshot = 0;
+    }
+  }
+  mndbOsLeaveMutex();
+  return rc;
+}
+
+/*
+** Write the log header.  This is done before the first frame is added
+** to an empty log.
+*/
+static int walWriteHeader(Wal *pWal){
+  WalIndex *p = pWal->pIdx;
+  u32 aHdr[WAL_HDRSIZE/4];
+  aHdr[0] = WAL_MAGIC;
+  aHdr[1] = WAL_VERSION;
+  aHdr[2] = pWal->pageSize;
+  aHdr[3] = p->iSeq;
+  aHdr[4] = p->aSalt[0];
+  aHdr[5] = p->aSalt[1];
+  aHdr[6] = aHdr[7] = 0;
+  walChecksum(aHdr, 24, &aHdr[6], &aHdr[6]);
+  mndbOsEnterMutex();
+  p->pageSize = pWal->pageSize;
+  p->aCksum[0] = p->aCommitCksum[0] = aHdr[6];
+  p->aCksum[1] = p->aCommitCksum[1] = aHdr[7];
+  mndbOsLeaveMutex();
+  return mndbOsWriteAt(&p->fd, aHdr, WAL_HDRSIZE, 0);
+}
+
+/*
+** Append nFrame pages to the log.  aPgno[] holds their page numbers and
+** apData[] their content.  If nTruncate is not zero, the last frame is
+** a commit frame and nTruncate is the size of the database after the
+** commit.  Frames are only seen by other connections once committed.
+*/
+int mndbWalWriteFrames(
+  Wal *pWal,                  /* Handle with the write transaction */
+  int nFrame,                 /* Number of pages to write */
+  const Pgno *aPgno,          /* Page numbers */
+  void *const*apData,         /* Page content */
+  int nTruncate               /* Database size for a commit, else 0 */
+){
+  WalIndex *p = pWal->pIdx;
+  int szFrame = pWal->pageSize + WAL_FRAME_HDRSIZE;
+  u32 aCksum[2], aSaved[2];
+  int nSaved;
+  int i, j, n;
+  int rc;
+
+  assert( p->pWriter==pWal );
+  if( p->nFrame==0 ){
+    rc = walWriteHeader(pWal);
+    if( rc!=MNDB_OK ) return rc;
+  }
+  if( pWal->nBuf<WAL_MAX_BATCH*szFrame ){
+    mndbFree(pWal->aBuf);
+    pWal->aBuf = mndbMallocRaw( WAL_MAX_BATCH*szFrame );
+    pWal->nBuf = pWal->aBuf ? WAL_MAX_BATCH*szFrame : 0;
+    if( pWal->aBuf==0 ) return MNDB_NOMEM;
+  }
+  aCksum[0] = p->aCksum[0];
+  aCksum[1] = p->aCksum[1];
+  for(i=0; i<nFrame; i+=n){
+    n = nFrame - i;
+    if( n>WAL_MAX_BATCH ) n = WAL_MAX_BATCH;
+    for(j=0; j<n; j++){
+      u32 *aHdr = (u32*)&pWal->aBuf[j*szFrame];
+      aHdr[0] = aPgno[i+j];
+      aHdr[1] = (nTruncate && i+j==nFrame-1) ? nTruncate : 0;
+      aHdr[2] = p->aSalt[0];
+      aHdr[3] = p->aSalt[1];
+      memcpy(&aHdr[WAL_FRAME_HDRSIZE/4], apData[i+j], pWal->pageSize);
+      walChecksum(aHdr, 8, aCksum, aCksum);
+      walChecksum(&aHdr[WAL_FRAME_HDRSIZE/4], pWal->pageSize, aCksum, aCksum);
+      aHdr[4] = aCksum[0];
+      aHdr[5] = aCksum[1];
+    }
+    rc = mndbOsWriteAt(&p->fd, pWal->aBuf, n*szFrame,
+                       walFrameOffset(p, p->nFrame+1));
+    if( rc!=MNDB_OK ) return rc;
+
+    mndbOsEnterMutex();
+    nSaved = p->nFrame;
+    aSaved[0] = p->aCksum[0];
+    aSaved[1] = p->aCksum[1];
+    for(j=0; j<n && rc==MNDB_OK; j++){
+      rc = walIndexAppend(p, aPgno[i+j]);
+    }
+    if( rc==MNDB_OK ){
+      p->aCksum[0] = aCksum[0];
+      p->aCksum[1] = aCksum[1];
+    }else{
+      walIndexTruncate(p, nSaved);
+      p->aCksum[0] = aSaved[0];
+      p->aCksum[1] = aSaved[1];
+    }
+    mndbOsLeaveMutex();
+    if( rc!=MNDB_OK ) return rc;
+  }
+  if( nTruncate ){
+    mndbOsEnterMutex();
+    p->mxFrame = p->nFrame;
+    p->nDbPage = nTruncate;
+    p->aCommitCksum[0] = p->aCksum[0];
+    p->aCommitCksum[1] = p->aCksum[1];
+    p->nCommit++;
+    pWal->iSnapshot = p->mxFrame;
+    pWal->nDbPage = nTruncate;
+    pWal->iCommitSeq = p->iSeq;
+    pWal->iCommit = p->mxFrame;
+    mndbOsLeaveMutex();
+  }
+  return MNDB_OK;
+}
+
+/*
+** End the write transaction, if the handle has one.  Frames that were
+** written but not committed are forgotten and will be overwritten by
+** the next writer.
+*/
+void mndbWalEndWrite(Wal *pWal){
+  WalIndex *p = pWal->pIdx;
+  mndbOsEnterMutex();
+  if( p->pWriter==pWal ){
+    walIndexTruncate(p, p->mxFrame);
+    p->aCksum[0] = p->aCommitCksum[0];
+    p->aCksum[1] = p->aCommitCksum[1];
+    p->pWriter = 0;
+  }
+  mndbOsLeaveMutex();
+}
+
+/*
+** Wait until the last transaction committed through this handle is on
+** disk.  If no other thread is syncing the log, this one syncs it,
+** taking along every transaction committed up to that point.  Otherwise
+** it waits for that sync to finish, which may have covered it already.
+**
+** This is called after mndbWalEndWrite() so that other connections can
+** commit while the log is being synced.
+*/
+int mndbWalSync(Wal *pWal){
+  WalIndex *p = pWal->pIdx;
+  u32 iSeq;
+  int iLast;
+  int rc = MNDB_OK;
+
+  mndbOsEnterMutex();
+  while( pWal->iCommit>0 ){
+    if( pWal->iCommitSeq!=p->iSeq || p->nSynced>=pWal->iCommit ){
+      /* Synced by someone else.  A log that was started again is in the
+      ** database file already.
+      */
+      pWal->iCommit = 0;
+    }else if( p->syncBusy ){
+      mndbOsWait();
+    }else{
+      p->syncBusy = 1;
+      iSeq = p->iSeq;
+      iLast = p->mxFrame;
+      mndbOsLeaveMutex();
+      rc = mndbOsSync(&p->fd);
+      mndbOsEnterMutex();
+      p->syncBusy = 0;
+      if( rc==MNDB_OK ){
+        p->nSync++;
+        if( p->iSeq==iSeq && p->nSynced<iLast ) p->nSynced = iLast;
+      }else{
+        pWal->iCommit = 0;
+      }
+      mndbOsBroadcast();
+    }
+  }
+  mndbOsLeaveMutex();
+  return rc;
+}
+
+/*
+** Write into *pnCommit the number of transactions committed to the log
+** and into *pnSync the number of syncs it took to make them durable.
+** The ratio of the two is how many commits share a sync.
+*/
+void mndbWalSyncStats(Wal *pWal, u64 *pnCommit, u64 *pnSync){
+  WalIndex *p = pWal->pIdx;
+  mndbOsEnterMutex();
+  *pnCommit = p->nCommit;
+  *pnSync = p->nSync;
+  mndbOsLeaveMutex();
+}
+
+/*
+** Return the number of committed frames that are not in the database
+** file yet.
+*/
+int mndbWalFrameCount(Wal *pWal){
+  WalIndex *p = pWal->pIdx;
+  int n;
+  mndbOsEnterMutex();
+  n = p->mxFrame - p->nBackfill;
+  mndbOsLeaveMutex();
+  return n;
+}
+
+/*
+** Copy as much of the log into the database file as the read
+** transactions of other connections allow.  MNDB_BUSY is returned if
+** another checkpoint is running.
+*/
+int mndbWalCheckpoint(Wal *pWal){
+  return walCheckpoint(pWal->pIdx, pWal->pDbFd);
+}
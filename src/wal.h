@@ -0,0 +1,37 @@
+/*
+** 2016 Jan
+** This header file defines the interface to the write-ahead log used
+** by the pager when it runs in WAL mode.  See the comments at the top
+** of wal.c for the file format and how connections share a log.
+**
+** Include os.h, mndbInt.h and pager.h before this file.
+*/
+#ifndef _WAL_H_
+#define _WAL_H_
+
+/*
+** Once this many frames have accumulated in the log, the connection
+** that commits tries to copy them back into the database file.
+*/
+#ifndef MNDB_WAL_AUTOCHECKPOINT
+# define MNDB_WAL_AUTOCHECKPOINT 1000
+#endif
+
+typedef struct Wal Wal;
+
+int mndbWalOpen(OsFile *pDbFd, const char *zDbName, Wal **ppWal);
+void mndbWalClose(Wal *pWal);
+int mndbWalBeginRead(Wal *pWal, int pageSize, int *pChanged);
+void mndbWalEndRead(Wal *pWal);
+int mndbWalRead(Wal *pWal, Pgno pgno, int nByte, void *pBuf, int *pFound);
+int mndbWalDbSize(Wal *pWal);
+int mndbWalBeginWrite(Wal *pWal);
+int mndbWalWriteFrames(Wal *pWal, int nFrame, const Pgno *aPgno,
+                       void *const*apData, int nTruncate);
+void mndbWalEndWrite(Wal *pWal);
+int mndbWalSync(Wal *pWal);
+void mndbWalSyncStats(Wal *pWal, u64 *pnCommit, u64 *pnSync);
+int mndbWalFrameCount(Wal *pWal);
+int mndbWalCheckpoint(Wal *pWal);
+
+#endif /* _WAL_H_ */